@@ -0,0 +1,608 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Checks that the pairs of files listed by ktx2mtp64 are really duplicates.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+struct file_s
+{
+   char *name;
+   uint64_t size;
+   XXH128_hash_t hash;
+   /* Set if the file could not be read. */
+   unsigned char missing;
+   /* Set if the file is in a pair with a file of the same size. */
+   unsigned char need_hash;
+   /* Set once the contents are known to equal those of rep. */
+   unsigned char same;
+   size_t rep;
+};
+
+struct pair_s
+{
+   size_t a;
+   size_t b;
+};
+
+struct check_s
+{
+   struct file_s *files;
+   size_t n_files;
+   size_t files_alloc;
+
+   /* Open addressing table of indices into files, by name. */
+   size_t *table;
+   size_t table_sz;
+
+   struct pair_s *pairs;
+   size_t n_pairs;
+   size_t pairs_alloc;
+
+   /* Files for the threads to hash or compare. */
+   size_t *work;
+   size_t n_work;
+   size_t next;
+   int compare;
+   uint64_t bytes;
+};
+
+uint64_t now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Maps the whole of a file. A file of zero bytes is mapped to an empty
+ * string. Returns NULL if it cannot be read. */
+const uint8_t *map_file(const char *filename, uint64_t size)
+{
+   void *map;
+   int fd;
+
+   if (size == 0)
+      return (const uint8_t *)"";
+
+   fd = open(filename, O_RDONLY);
+
+   if (fd < 0)
+      return NULL;
+
+   map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+      return NULL;
+
+   madvise(map, size, MADV_SEQUENTIAL);
+   return map;
+}
+
+void unmap_file(const uint8_t *map, uint64_t size)
+{
+   if (size != 0)
+      munmap((void *)map, size);
+}
+
+int grow_table(struct check_s *c)
+{
+   size_t sz = c->table_sz ? c->table_sz * 2 : 4096;
+   size_t *table = malloc(sz * sizeof(*table));
+
+   if (table == NULL)
+      return -1;
+
+   for (size_t i = 0; i < sz; i++)
+      table[i] = SIZE_MAX;
+
+   for (size_t f = 0; f < c->n_files; f++)
+   {
+      const char *name = c->files[f].name;
+      size_t i = XXH3_64bits(name, strlen(name)) & (sz - 1);
+
+      while (table[i] != SIZE_MAX)
+         i = (i + 1) & (sz - 1);
+
+      table[i] = f;
+   }
+
+   free(c->table);
+   c->table = table;
+   c->table_sz = sz;
+   return 0;
+}
+
+/* Returns the index of the file with this name, adding it if it is new. */
+size_t intern_file(struct check_s *c, const char *name)
+{
+   size_t i;
+
+   /* Keep the table at most half full. */
+   if ((c->n_files + 1) * 2 > c->table_sz && grow_table(c) != 0)
+      return SIZE_MAX;
+
+   i = XXH3_64bits(name, strlen(name)) & (c->table_sz - 1);
+
+   while (c->table[i] != SIZE_MAX)
+   {
+      if (strcmp(c->files[c->table[i]].name, name) == 0)
+         return c->table[i];
+
+      i = (i + 1) & (c->table_sz - 1);
+   }
+
+   if (c->n_files == c->files_alloc)
+   {
+      size_t alloc = c->files_alloc ? c->files_alloc * 2 : 1024;
+      struct file_s *files = realloc(c->files, alloc * sizeof(*files));
+
+      if (files == NULL)
+         return SIZE_MAX;
+
+      c->files = files;
+      c->files_alloc = alloc;
+   }
+
+   memset(&c->files[c->n_files], 0, sizeof(*c->files));
+   c->files[c->n_files].name = strdup(name);
+
+   if (c->files[c->n_files].name == NULL)
+      return SIZE_MAX;
+
+   c->table[i] = c->n_files;
+   return c->n_files++;
+}
+
+/**
+ * Splits a line into two file names. ktx2mtp64 writes each name in double
+ * quotes. Unquoted names are split at the first space.
+ */
+int split_line(char *line, char **a, char **b)
+{
+   char *p = line;
+
+   for (int k = 0; k < 2; k++)
+   {
+      char **name = k == 0 ? a : b;
+
+      while (*p == ' ' || *p == '\t')
+         p++;
+
+      if (*p == '"')
+      {
+         char *end = strchr(++p, '"');
+
+         if (end == NULL)
+            return -1;
+
+         *name = p;
+         *end = '\0';
+         p = end + 1;
+      }
+      else
+      {
+         *name = p;
+
+         if (k == 0)
+         {
+            p = strchr(p, ' ');
+
+            if (p == NULL)
+               return -1;
+
+            *p++ = '\0';
+         }
+      }
+
+      if (**name == '\0')
+         return -1;
+   }
+
+   return 0;
+}
+
+int read_pairs(struct check_s *c, const char *filename)
+{
+   FILE *f = fopen(filename, "r");
+   char *line = NULL;
+   size_t line_sz = 0;
+   size_t line_no = 0;
+   ssize_t len;
+   int ret = 0;
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to open %s\n", filename);
+      return -1;
+   }
+
+   while ((len = getline(&line, &line_sz, f)) >= 0)
+   {
+      char *a, *b;
+      struct pair_s *pair;
+
+      line_no++;
+
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+         line[--len] = '\0';
+
+      if (len == 0)
+         continue;
+
+      if (split_line(line, &a, &b) != 0)
+      {
+         fprintf(stderr, "Line %lu of %s is not a pair of files\n", line_no,
+                 filename);
+         continue;
+      }
+
+      if (c->n_pairs == c->pairs_alloc)
+      {
+         size_t alloc = c->pairs_alloc ? c->pairs_alloc * 2 : 1024;
+         struct pair_s *pairs = realloc(c->pairs, alloc * sizeof(*pairs));
+
+         if (pairs == NULL)
+         {
+            ret = -1;
+            break;
+         }
+
+         c->pairs = pairs;
+         c->pairs_alloc = alloc;
+      }
+
+      pair = &c->pairs[c->n_pairs];
+      pair->a = intern_file(c, a);
+      pair->b = intern_file(c, b);
+
+      if (pair->a == SIZE_MAX || pair->b == SIZE_MAX)
+      {
+         ret = -1;
+         break;
+      }
+
+      c->n_pairs++;
+   }
+
+   if (ret != 0)
+      fprintf(stderr, "Unable to allocate memory.\n");
+
+   free(line);
+   fclose(f);
+   return ret;
+}
+
+/* Hashes each file of the work list, or compares it with its representative
+ * once hashes are known. */
+void *check_worker(void *arg)
+{
+   struct check_s *c = arg;
+   uint64_t bytes = 0;
+
+   for (;;)
+   {
+      size_t w = __atomic_fetch_add(&c->next, 1, __ATOMIC_RELAXED);
+      struct file_s *file;
+      const uint8_t *data;
+
+      if (w >= c->n_work)
+         break;
+
+      file = &c->files[c->work[w]];
+      data = map_file(file->name, file->size);
+
+      if (data == NULL)
+      {
+         file->missing = 1;
+         continue;
+      }
+
+      if (!c->compare)
+         file->hash = XXH3_128bits(data, file->size);
+      else
+      {
+         const struct file_s *rep = &c->files[file->rep];
+         const uint8_t *rep_data = map_file(rep->name, rep->size);
+
+         if (rep_data != NULL)
+         {
+            file->same = memcmp(data, rep_data, file->size) == 0;
+            unmap_file(rep_data, rep->size);
+         }
+      }
+
+      bytes += file->size;
+      unmap_file(data, file->size);
+   }
+
+   __atomic_add_fetch(&c->bytes, bytes, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+int run_workers(struct check_s *c, unsigned n_threads)
+{
+   pthread_t *threads = calloc(n_threads, sizeof(*threads));
+   unsigned n_started = 0;
+
+   if (threads == NULL)
+      return -1;
+
+   c->next = 0;
+
+   for (; n_started < n_threads; n_started++)
+   {
+      if (pthread_create(&threads[n_started], NULL, check_worker, c) != 0)
+         break;
+   }
+
+   /* Work on this thread if none could be started. */
+   if (n_started == 0)
+      check_worker(c);
+
+   for (unsigned t = 0; t < n_started; t++)
+      pthread_join(threads[t], NULL);
+
+   free(threads);
+   return 0;
+}
+
+/* Returns 1 if both files have the same contents, 0 if they do not, and -1
+ * if either could not be read. */
+int files_equal(const struct file_s *a, const struct file_s *b)
+{
+   const uint8_t *da = map_file(a->name, a->size);
+   const uint8_t *db = map_file(b->name, b->size);
+   int ret = -1;
+
+   if (da != NULL && db != NULL)
+      ret = memcmp(da, db, a->size) == 0;
+
+   if (da != NULL)
+      unmap_file(da, a->size);
+
+   if (db != NULL)
+      unmap_file(db, b->size);
+
+   return ret;
+}
+
+struct check_s *sort_ctx;
+
+/* Orders files by size and then by hash, so that equal files are
+ * adjacent. */
+int compare_content(const void *in1, const void *in2)
+{
+   const struct file_s *a = &sort_ctx->files[*(const size_t *)in1];
+   const struct file_s *b = &sort_ctx->files[*(const size_t *)in2];
+
+   if (a->size != b->size)
+      return a->size < b->size ? -1 : 1;
+
+   return XXH128_cmp(&a->hash, &b->hash);
+}
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: checkdups [OPTION...] [FILE]\n"
+      "Checks that each pair of files listed in FILE, 'duplicates.txt' by "
+      "default, has the same contents.\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -threads N \tNumber of threads to hash with (default: number of "
+      "CPUs)\n"
+      "\n"
+      "Each line lists two files, in double quotes as written by ktx2mtp64, "
+      "or separated by a space. Pairs of files of different sizes are "
+      "reported without being read. Every other file is hashed with XXH3 "
+      "once, however many pairs it is in, and files with the same hash are "
+      "compared byte for byte.\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int main(int argc, char *argv[])
+{
+   struct check_s c = { 0 };
+   const char *filename = "duplicates.txt";
+   unsigned n_threads = 0;
+   uint64_t start_time = now_ms(), elapsed;
+   size_t n_hashed = 0;
+   size_t bad_size = 0, bad_content = 0, missing = 0;
+   char **arg;
+
+   (void)argc;
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-threads") == 0 && arg[1] != NULL)
+         n_threads = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'checkdups -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (*arg != NULL)
+      filename = *arg++;
+
+   if (*arg != NULL)
+   {
+      fprintf(stderr, "Only one list of duplicates may be given.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (n_threads == 0)
+   {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      n_threads = n > 0 ? n : 1;
+   }
+
+   if (read_pairs(&c, filename) != 0)
+      return EXIT_FAILURE;
+
+   for (size_t f = 0; f < c.n_files; f++)
+   {
+      struct stat st;
+
+      if (stat(c.files[f].name, &st) != 0 || !S_ISREG(st.st_mode))
+         c.files[f].missing = 1;
+      else
+         c.files[f].size = st.st_size;
+   }
+
+   /* Only files in a pair of equal sizes need to be read. */
+   for (size_t p = 0; p < c.n_pairs; p++)
+   {
+      struct file_s *a = &c.files[c.pairs[p].a];
+      struct file_s *b = &c.files[c.pairs[p].b];
+
+      if (!a->missing && !b->missing && a->size == b->size)
+         a->need_hash = b->need_hash = 1;
+   }
+
+   c.work = malloc((c.n_files + 1) * sizeof(*c.work));
+
+   if (c.work == NULL)
+   {
+      fprintf(stderr, "Unable to allocate memory.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (size_t f = 0; f < c.n_files; f++)
+   {
+      if (c.files[f].need_hash)
+         c.work[c.n_work++] = f;
+   }
+
+   n_hashed = c.n_work;
+   run_workers(&c, n_threads);
+
+   /* Group files by contents, and compare each with the first of its
+    * group. */
+   sort_ctx = &c;
+   qsort(c.work, c.n_work, sizeof(*c.work), compare_content);
+
+   for (size_t w = 0, rep = 0; w < n_hashed; w++)
+   {
+      struct file_s *file = &c.files[c.work[w]];
+
+      if (file->missing)
+         continue;
+
+      if (w == 0 || compare_content(&c.work[rep], &c.work[w]) != 0 ||
+            c.files[c.work[rep]].missing)
+      {
+         rep = w;
+         file->same = 1;
+      }
+
+      file->rep = c.work[rep];
+   }
+
+   c.n_work = 0;
+
+   for (size_t w = 0; w < n_hashed; w++)
+   {
+      struct file_s *file = &c.files[c.work[w]];
+
+      if (!file->missing && !file->same)
+         c.work[c.n_work++] = c.work[w];
+   }
+
+   c.compare = 1;
+   run_workers(&c, n_threads);
+
+   for (size_t p = 0; p < c.n_pairs; p++)
+   {
+      struct file_s *a = &c.files[c.pairs[p].a];
+      struct file_s *b = &c.files[c.pairs[p].b];
+      const char *reason;
+
+      if (a->missing || b->missing)
+      {
+         reason = "could not be read";
+         missing++;
+      }
+      else if (a->size != b->size)
+      {
+         reason = "sizes differ";
+         bad_size++;
+      }
+      else if (a->rep == b->rep && a->same && b->same)
+         continue;
+      else if (a->rep != b->rep)
+      {
+         reason = "contents differ";
+         bad_content++;
+      }
+      else
+      {
+         /* The hashes of both files matched, but one of them did not match
+          * the first file with that hash. */
+         int eq = files_equal(a, b);
+
+         if (eq == 1)
+            continue;
+
+         reason = eq < 0 ? "could not be read" : "contents differ";
+         *(eq < 0 ? &missing : &bad_content) += 1;
+      }
+
+      fprintf(stdout, "Files \"%s\" and \"%s\" were not duplicates: %s\n",
+              a->name, b->name, reason);
+   }
+
+   elapsed = now_ms() - start_time;
+   fprintf(stdout, "Checked %lu pairs of %lu files in %.2f s, hashing %lu "
+           "files (%.2f MiB) with %u threads\n", c.n_pairs, c.n_files,
+           elapsed / 1000.0, n_hashed, c.bytes / (1024.0 * 1024.0),
+           n_threads);
+   fprintf(stdout, "%lu pairs were not duplicates: %lu of different sizes, "
+           "%lu with different contents, %lu that could not be read\n",
+           bad_size + bad_content + missing, bad_size, bad_content, missing);
+
+   for (size_t f = 0; f < c.n_files; f++)
+      free(c.files[f].name);
+
+   free(c.files);
+   free(c.table);
+   free(c.pairs);
+   free(c.work);
+   return bad_size + bad_content + missing == 0 ? EXIT_SUCCESS :
+          EXIT_FAILURE;
+}
@@ -0,0 +1,272 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * ETC1 texture compression.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <limits.h>
+#include <string.h>
+
+#include "etc1.h"
+
+/* Intensity modifiers of each table, as given by the ETC1 specification. */
+static const int etc1_modifiers[8][2] =
+{
+   {  2,   8 }, {  5,  17 }, {  9,  29 }, { 13,  42 },
+   { 18,  60 }, { 24,  80 }, { 33, 106 }, { 47, 183 }
+};
+
+/* The eight pixels of each sub-block, as (x, y), for each flip mode. */
+static const uint8_t etc1_subblock[2][2][8][2] =
+{
+   /* 2x4 sub-blocks side by side. */
+   {
+      { {0,0}, {0,1}, {0,2}, {0,3}, {1,0}, {1,1}, {1,2}, {1,3} },
+      { {2,0}, {2,1}, {2,2}, {2,3}, {3,0}, {3,1}, {3,2}, {3,3} }
+   },
+   /* 4x2 sub-blocks one above the other. */
+   {
+      { {0,0}, {1,0}, {2,0}, {3,0}, {0,1}, {1,1}, {2,1}, {3,1} },
+      { {0,2}, {1,2}, {2,2}, {3,2}, {0,3}, {1,3}, {2,3}, {3,3} }
+   }
+};
+
+struct etc1_subblock_s
+{
+   /* Index into etc1_modifiers. */
+   unsigned table;
+   /* Index of the modifier of each pixel, in etc1_subblock order. */
+   uint8_t idx[8];
+   unsigned err;
+};
+
+size_t etc1_image_size(size_t w, size_t h)
+{
+   return ((w + 3) / 4) * ((h + 3) / 4) * 8;
+}
+
+int etc1_is_opaque(const uint8_t *rgba, size_t n_px)
+{
+   uint8_t a = 0xFF;
+
+   for (size_t i = 0; i < n_px; i++)
+      a &= rgba[i * 4 + 3];
+
+   return a == 0xFF;
+}
+
+static inline int clamp255(int v)
+{
+   return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/**
+ * Finds the table and per pixel modifiers that best fit eight pixels to the
+ * base colour.
+ */
+static void fit_subblock(const uint8_t px[8][3], const int base[3],
+                         struct etc1_subblock_s *sb)
+{
+   sb->err = UINT_MAX;
+
+   for (unsigned t = 0; t < 8; t++)
+   {
+      /* Modifier indices 0 to 3 are +a, +b, -a and -b. */
+      const int mod[4] = {
+         etc1_modifiers[t][0], etc1_modifiers[t][1],
+         -etc1_modifiers[t][0], -etc1_modifiers[t][1]
+      };
+      uint8_t idx[8];
+      unsigned err = 0;
+
+      for (unsigned p = 0; p < 8; p++)
+      {
+         unsigned best = UINT_MAX;
+
+         for (unsigned m = 0; m < 4; m++)
+         {
+            unsigned e = 0;
+
+            for (unsigned c = 0; c < 3; c++)
+            {
+               int d = clamp255(base[c] + mod[m]) - px[p][c];
+               e += d * d;
+            }
+
+            if (e < best)
+            {
+               best = e;
+               idx[p] = m;
+            }
+         }
+
+         err += best;
+      }
+
+      if (err < sb->err)
+      {
+         sb->err = err;
+         sb->table = t;
+         memcpy(sb->idx, idx, sizeof(idx));
+      }
+   }
+}
+
+static uint64_t encode_block(const uint8_t block[4][4][3])
+{
+   uint64_t best_bits = 0;
+   unsigned best_err = UINT_MAX;
+
+   for (unsigned flip = 0; flip < 2; flip++)
+   {
+      uint8_t px[2][8][3];
+      int avg[2][3];
+
+      for (unsigned s = 0; s < 2; s++)
+      {
+         int sum[3] = { 0, 0, 0 };
+
+         for (unsigned p = 0; p < 8; p++)
+         {
+            const uint8_t *xy = etc1_subblock[flip][s][p];
+
+            for (unsigned c = 0; c < 3; c++)
+            {
+               px[s][p][c] = block[xy[1]][xy[0]][c];
+               sum[c] += px[s][p][c];
+            }
+         }
+
+         for (unsigned c = 0; c < 3; c++)
+            avg[s][c] = (sum[c] + 4) / 8;
+      }
+
+      /* Try both the differential mode, where the second base colour is
+       * stored as a small offset from the first, and the individual mode. */
+      for (unsigned diff = 0; diff < 2; diff++)
+      {
+         struct etc1_subblock_s sb[2];
+         int q[2][3], base[2][3];
+         uint64_t bits;
+         int ok = 1;
+
+         for (unsigned s = 0; s < 2; s++)
+         {
+            for (unsigned c = 0; c < 3; c++)
+            {
+               if (diff)
+               {
+                  q[s][c] = (avg[s][c] * 31 + 127) / 255;
+                  base[s][c] = (q[s][c] << 3) | (q[s][c] >> 2);
+               }
+               else
+               {
+                  q[s][c] = (avg[s][c] * 15 + 127) / 255;
+                  base[s][c] = (q[s][c] << 4) | q[s][c];
+               }
+            }
+         }
+
+         if (diff)
+         {
+            for (unsigned c = 0; c < 3; c++)
+            {
+               int d = q[1][c] - q[0][c];
+
+               if (d < -4 || d > 3)
+                  ok = 0;
+            }
+         }
+
+         if (!ok)
+            continue;
+
+         fit_subblock(px[0], base[0], &sb[0]);
+         fit_subblock(px[1], base[1], &sb[1]);
+
+         if (sb[0].err + sb[1].err >= best_err)
+            continue;
+
+         best_err = sb[0].err + sb[1].err;
+
+         if (diff)
+         {
+            bits = (uint64_t)q[0][0] << 59 |
+                   (uint64_t)((q[1][0] - q[0][0]) & 7) << 56 |
+                   (uint64_t)q[0][1] << 51 |
+                   (uint64_t)((q[1][1] - q[0][1]) & 7) << 48 |
+                   (uint64_t)q[0][2] << 43 |
+                   (uint64_t)((q[1][2] - q[0][2]) & 7) << 40;
+         }
+         else
+         {
+            bits = (uint64_t)q[0][0] << 60 | (uint64_t)q[1][0] << 56 |
+                   (uint64_t)q[0][1] << 52 | (uint64_t)q[1][1] << 48 |
+                   (uint64_t)q[0][2] << 44 | (uint64_t)q[1][2] << 40;
+         }
+
+         bits |= (uint64_t)sb[0].table << 37 | (uint64_t)sb[1].table << 34 |
+                 (uint64_t)diff << 33 | (uint64_t)flip << 32;
+
+         /* Pixel indices are stored in column order, with the most
+          * significant bits of every index before the least significant. */
+         for (unsigned s = 0; s < 2; s++)
+         {
+            for (unsigned p = 0; p < 8; p++)
+            {
+               const uint8_t *xy = etc1_subblock[flip][s][p];
+               unsigned n = xy[0] * 4 + xy[1];
+               unsigned m = sb[s].idx[p];
+
+               bits |= (uint64_t)(m >> 1) << (16 + n);
+               bits |= (uint64_t)(m & 1) << n;
+            }
+         }
+
+         best_bits = bits;
+      }
+   }
+
+   return best_bits;
+}
+
+void etc1_encode_image(uint8_t *dst, const uint8_t *rgba, size_t w, size_t h)
+{
+   for (size_t by = 0; by < h; by += 4)
+   {
+      for (size_t bx = 0; bx < w; bx += 4)
+      {
+         uint8_t block[4][4][3];
+         uint64_t bits;
+
+         for (unsigned y = 0; y < 4; y++)
+         {
+            size_t sy = by + y < h ? by + y : h - 1;
+
+            for (unsigned x = 0; x < 4; x++)
+            {
+               size_t sx = bx + x < w ? bx + x : w - 1;
+               const uint8_t *p = rgba + (sy * w + sx) * 4;
+
+               memcpy(block[y][x], p, 3);
+            }
+         }
+
+         bits = encode_block(block);
+
+         for (unsigned i = 0; i < 8; i++)
+            *dst++ = bits >> (56 - i * 8);
+      }
+   }
+}
@@ -0,0 +1,43 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * ETC1 texture compression.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ETC1_H
+#define ETC1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Size in bytes of an ETC1 image of the given dimensions. Each 4x4 block of
+ * pixels is stored in 8 bytes.
+ */
+size_t etc1_image_size(size_t w, size_t h);
+
+/**
+ * Returns non-zero if every pixel of the 8-bit RGBA image is opaque, so that
+ * it may be stored as ETC1 without loss of alpha.
+ */
+int etc1_is_opaque(const uint8_t *rgba, size_t n_px);
+
+/**
+ * Encodes an 8-bit RGBA image to ETC1, ignoring alpha. Blocks are written in
+ * row order to dst, which must hold etc1_image_size(w, h) bytes. Blocks at
+ * the right and bottom edges repeat the last column and row of the image.
+ */
+void etc1_encode_image(uint8_t *dst, const uint8_t *rgba, size_t w, size_t h);
+
+#endif
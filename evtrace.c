@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Event traces of the stages of work done on each texture.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "evtrace.h"
+#include "tracebuf.h"
+
+struct event_s
+{
+   uint64_t start;
+   uint64_t dur;
+   uint64_t texture;
+   enum evtrace_stage_e stage;
+};
+
+static const char *const stage_names[] =
+{
+   "open", "parse", "hash", "compress", "write", "inflate", "decode"
+};
+
+static void write_events(FILE *f, const void *recs, unsigned n,
+                         unsigned thread);
+
+static struct tracebuf_s trace = TRACEBUF_INIT(sizeof(struct event_s),
+                                               write_events);
+static _Thread_local struct tracebuf_thread_s *tls_trace;
+
+/* Events written to the current trace, only changed with its lock held. */
+static unsigned trace_events;
+
+/* Called with the trace's lock held. Times are written in microseconds. */
+static void write_events(FILE *f, const void *recs, unsigned n,
+                         unsigned thread)
+{
+   const struct event_s *ev = recs;
+   int pid = getpid();
+
+   for (unsigned i = 0; i < n; i++)
+   {
+      const struct event_s *e = &ev[i];
+
+      fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lu.%03lu,"
+              "\"dur\":%lu.%03lu,\"pid\":%d,\"tid\":%u,"
+              "\"args\":{\"texture\":\"%016lX\"}}",
+              trace_events++ == 0 ? "" : ",\n", stage_names[e->stage],
+              e->start / 1000, e->start % 1000, e->dur / 1000,
+              e->dur % 1000, pid, thread, e->texture);
+   }
+}
+
+uint64_t evtrace_begin(void)
+{
+   return tracebuf_begin(&trace);
+}
+
+void evtrace_end(enum evtrace_stage_e stage, uint64_t texture,
+                 uint64_t start)
+{
+   struct event_s *e;
+   unsigned thread;
+   uint64_t now;
+
+   if (start == 0)
+      return;
+
+   now = tracebuf_now();
+   e = tracebuf_append(&trace, &tls_trace, &thread);
+
+   if (e == NULL)
+      return;
+
+   e->start = start - trace.epoch;
+   e->dur = now - start;
+   e->texture = texture;
+   e->stage = stage;
+}
+
+int evtrace_start(const char *filename)
+{
+   static int registered = 0;
+   FILE *f = fopen(filename, "w");
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to create trace file %s\n", filename);
+      return -1;
+   }
+
+   fputs("[\n", f);
+   trace_events = 0;
+   tracebuf_start(&trace, f);
+
+   if (!registered)
+      registered = atexit(evtrace_stop) == 0;
+
+   return 0;
+}
+
+void evtrace_stop(void)
+{
+   FILE *f = tracebuf_stop(&trace);
+
+   if (f == NULL)
+      return;
+
+   fputs("\n]\n", f);
+   fclose(f);
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Event traces of the stages of work done on each texture.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EVTRACE_H
+#define EVTRACE_H
+
+#include <stdint.h>
+
+/* Stages of work recorded in an event trace. */
+enum evtrace_stage_e
+{
+   EVTRACE_OPEN = 0,
+   EVTRACE_PARSE,
+   EVTRACE_HASH,
+   EVTRACE_COMPRESS,
+   EVTRACE_WRITE,
+   EVTRACE_INFLATE,
+   EVTRACE_DECODE
+};
+
+/**
+ * Starts writing an event trace in the JSON format read by chrome://tracing
+ * and Perfetto. Each thread buffers its own events, which are written out
+ * when its buffer fills or the trace is stopped. The trace is also stopped
+ * when the process exits, so every thread that records events must have been
+ * joined before returning from main() or calling exit(). Returns 0 on
+ * success.
+ */
+int evtrace_start(const char *filename);
+
+/**
+ * Writes every buffered event and closes the trace file. Threads must not
+ * record events whilst the trace is being stopped.
+ */
+void evtrace_stop(void);
+
+/**
+ * Returns the start time of a stage, or 0 if no trace is being written.
+ */
+uint64_t evtrace_begin(void);
+
+/**
+ * Records a stage that began at start, which was returned by
+ * evtrace_begin(). The texture is identified by its CRC where that is known,
+ * or otherwise by its offset, and is 0 if the stage is not for one texture.
+ */
+void evtrace_end(enum evtrace_stage_e stage, uint64_t texture,
+                 uint64_t start);
+
+#endif
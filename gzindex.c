@@ -0,0 +1,638 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Random access index for gzip compressed texture packs.
+ *
+ * Based on the approach of zran.c from the zlib examples: the whole stream is
+ * inflated once, and at the end of a deflate block every span bytes the
+ * position within the compressed and uncompressed data is stored along with
+ * the preceding 32 KiB of output. Inflation may then restart at any of these
+ * checkpoints by priming a raw inflate stream with that window.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "gzindex.h"
+
+#define WINSIZE      32768
+#define CHUNK        (64 * 1024)
+
+#define GZINDEX_MAGIC   "HTGZIDX1"
+
+struct point_s
+{
+   /* Offset within the uncompressed data. */
+   uint64_t out;
+   /* Offset within the compressed file of the first full byte. */
+   uint64_t in;
+   /* Number of bits of the preceding byte that belong to the next block. */
+   uint8_t bits;
+   /* The window before this point, compressed with zlib. */
+   uint32_t window_sz;
+   uint8_t *window;
+};
+
+struct gzindex_s
+{
+   uint64_t span;
+   uint64_t pack_size;
+   int64_t pack_mtime;
+
+   struct point_s *points;
+   size_t n_points;
+   size_t points_alloc;
+
+   struct gzindex_entry_s *entries;
+   size_t n_entries;
+   size_t entries_alloc;
+};
+
+struct gzindex_reader_s
+{
+   const struct gzindex_s *idx;
+   FILE *in;
+   z_stream strm;
+   /* Uncompressed position of the next byte inflate will output. */
+   uint64_t pos;
+   int active;
+   int eof;
+   uint8_t inbuf[CHUNK];
+   uint8_t discard[WINSIZE];
+};
+
+struct file_header_s
+{
+   char magic[8];
+   uint64_t span;
+   uint64_t pack_size;
+   int64_t pack_mtime;
+   uint64_t n_points;
+   uint64_t n_entries;
+};
+
+struct file_point_s
+{
+   uint64_t out;
+   uint64_t in;
+   uint32_t window_sz;
+   uint8_t bits;
+   uint8_t unused[3];
+};
+
+static int pack_stat(const char *filename, uint64_t *size, int64_t *mtime)
+{
+   struct stat st;
+
+   if (stat(filename, &st) != 0)
+      return -1;
+
+   *size = st.st_size;
+   *mtime = st.st_mtime;
+   return 0;
+}
+
+int gzindex_is_gzip(const char *filename)
+{
+   uint8_t magic[2] = { 0 };
+   FILE *f = fopen(filename, "rb");
+
+   if (f == NULL)
+      return 0;
+
+   if (fread(magic, 1, sizeof(magic), f) != sizeof(magic))
+      magic[0] = 0;
+
+   fclose(f);
+   return magic[0] == 0x1F && magic[1] == 0x8B;
+}
+
+static int add_point(struct gzindex_s *idx, uint8_t bits, uint64_t in,
+                     uint64_t out, const uint8_t *window, size_t left)
+{
+   struct point_s *p;
+   uint8_t last[WINSIZE];
+   size_t have = out < WINSIZE ? out : WINSIZE;
+   uLongf comp_sz;
+
+   if (idx->n_points == idx->points_alloc)
+   {
+      size_t alloc = idx->points_alloc ? idx->points_alloc << 1 : 64;
+      struct point_s *points = realloc(idx->points, alloc * sizeof(*points));
+
+      if (points == NULL)
+         return -1;
+
+      idx->points = points;
+      idx->points_alloc = alloc;
+   }
+
+   p = &idx->points[idx->n_points];
+   p->out = out;
+   p->in = in;
+   p->bits = bits;
+   p->window = NULL;
+   p->window_sz = 0;
+
+   /* The window is circular, with the oldest byte at window[WINSIZE - left]. */
+   if (left)
+      memcpy(last, window + WINSIZE - left, left);
+
+   if (left < WINSIZE)
+      memcpy(last + left, window, WINSIZE - left);
+
+   if (have != 0)
+   {
+      comp_sz = compressBound(have);
+      p->window = malloc(comp_sz);
+
+      if (p->window == NULL)
+         return -1;
+
+      if (compress(p->window, &comp_sz, last + WINSIZE - have, have) != Z_OK)
+      {
+         free(p->window);
+         return -1;
+      }
+
+      p->window_sz = comp_sz;
+   }
+
+   idx->n_points++;
+   return 0;
+}
+
+struct gzindex_s *gzindex_build(const char *filename, uint64_t span,
+                                gzindex_scan_fn scan, void *scan_ctx)
+{
+   struct gzindex_s *idx;
+   z_stream strm = { 0 };
+   uint8_t *input = NULL;
+   uint8_t *window = NULL;
+   uint64_t totin = 0, totout = 0, last = 0;
+   int ret = Z_OK;
+   FILE *in = fopen(filename, "rb");
+
+   if (in == NULL)
+      return NULL;
+
+   idx = calloc(1, sizeof(*idx));
+   input = malloc(CHUNK);
+   window = malloc(WINSIZE);
+
+   if (idx == NULL || input == NULL || window == NULL)
+      goto err;
+
+   idx->span = span;
+
+   if (pack_stat(filename, &idx->pack_size, &idx->pack_mtime) != 0)
+      goto err;
+
+   /* Decode the gzip header as well as the deflate stream. */
+   if (inflateInit2(&strm, 15 + 16) != Z_OK)
+      goto err;
+
+   strm.avail_out = 0;
+
+   do
+   {
+      strm.avail_in = fread(input, 1, CHUNK, in);
+
+      if (ferror(in) || strm.avail_in == 0)
+      {
+         ret = Z_DATA_ERROR;
+         break;
+      }
+
+      strm.next_in = input;
+
+      do
+      {
+         uint64_t out_before;
+         unsigned avail_before;
+
+         if (strm.avail_out == 0)
+         {
+            strm.avail_out = WINSIZE;
+            strm.next_out = window;
+         }
+
+         avail_before = strm.avail_out;
+         out_before = totout;
+         totin += strm.avail_in;
+         totout += strm.avail_out;
+         ret = inflate(&strm, Z_BLOCK);
+         totin -= strm.avail_in;
+         totout -= strm.avail_out;
+
+         if (ret == Z_NEED_DICT || ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+            break;
+
+         if (scan != NULL && totout != out_before)
+            scan(scan_ctx, idx, out_before,
+                 window + WINSIZE - avail_before, totout - out_before);
+
+         if (ret == Z_STREAM_END)
+            break;
+
+         /* At the end of a block that is not the last, add a checkpoint if
+          * one is due. */
+         if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+               (totout == 0 || totout - last > span))
+         {
+            if (add_point(idx, strm.data_type & 7, totin, totout, window,
+                          strm.avail_out) != 0)
+            {
+               ret = Z_MEM_ERROR;
+               break;
+            }
+
+            last = totout;
+         }
+      }
+      while (strm.avail_in != 0);
+   }
+   while (ret != Z_STREAM_END && ret != Z_NEED_DICT && ret != Z_MEM_ERROR &&
+          ret != Z_DATA_ERROR);
+
+   inflateEnd(&strm);
+
+   if (ret != Z_STREAM_END)
+      goto err;
+
+   fclose(in);
+   free(input);
+   free(window);
+   return idx;
+
+err:
+   fclose(in);
+   free(input);
+   free(window);
+   gzindex_free(idx);
+   return NULL;
+}
+
+int gzindex_add_entry(struct gzindex_s *idx, uint64_t key, uint64_t offset)
+{
+   if (idx->n_entries == idx->entries_alloc)
+   {
+      size_t alloc = idx->entries_alloc ? idx->entries_alloc << 1 : 1024;
+      struct gzindex_entry_s *entries =
+         realloc(idx->entries, alloc * sizeof(*entries));
+
+      if (entries == NULL)
+         return -1;
+
+      idx->entries = entries;
+      idx->entries_alloc = alloc;
+   }
+
+   idx->entries[idx->n_entries].key = key;
+   idx->entries[idx->n_entries].offset = offset;
+   idx->n_entries++;
+   return 0;
+}
+
+const struct gzindex_entry_s *gzindex_entries(const struct gzindex_s *idx,
+      size_t *n)
+{
+   *n = idx->n_entries;
+   return idx->entries;
+}
+
+size_t gzindex_n_points(const struct gzindex_s *idx)
+{
+   return idx->n_points;
+}
+
+static char *sidecar_name(const char *pack_filename)
+{
+   size_t len = strlen(pack_filename);
+   char *name = malloc(len + sizeof(GZINDEX_EXT));
+
+   if (name == NULL)
+      return NULL;
+
+   memcpy(name, pack_filename, len);
+   memcpy(name + len, GZINDEX_EXT, sizeof(GZINDEX_EXT));
+   return name;
+}
+
+int gzindex_save(const struct gzindex_s *idx, const char *pack_filename)
+{
+   struct file_header_s hdr = { GZINDEX_MAGIC, idx->span, idx->pack_size,
+             idx->pack_mtime, idx->n_points, idx->n_entries
+   };
+   char *name = sidecar_name(pack_filename);
+   FILE *f;
+   int ret = 0;
+
+   if (name == NULL)
+      return -1;
+
+   f = fopen(name, "wb");
+   free(name);
+
+   if (f == NULL)
+      return -1;
+
+   fwrite(&hdr, sizeof(hdr), 1, f);
+
+   for (size_t i = 0; i < idx->n_points; i++)
+   {
+      const struct point_s *p = &idx->points[i];
+      struct file_point_s fp = {
+         .out = p->out, .in = p->in, .window_sz = p->window_sz,
+         .bits = p->bits
+      };
+
+      fwrite(&fp, sizeof(fp), 1, f);
+      fwrite(p->window, 1, p->window_sz, f);
+   }
+
+   fwrite(idx->entries, sizeof(*idx->entries), idx->n_entries, f);
+
+   if (ferror(f))
+      ret = -1;
+
+   if (fclose(f) != 0)
+      ret = -1;
+
+   return ret;
+}
+
+struct gzindex_s *gzindex_load(const char *pack_filename)
+{
+   struct file_header_s hdr;
+   struct gzindex_s *idx = NULL;
+   uint64_t pack_size;
+   int64_t pack_mtime;
+   char *name = sidecar_name(pack_filename);
+   FILE *f;
+
+   if (name == NULL)
+      return NULL;
+
+   f = fopen(name, "rb");
+   free(name);
+
+   if (f == NULL)
+      return NULL;
+
+   if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+         memcmp(hdr.magic, GZINDEX_MAGIC, sizeof(hdr.magic)) != 0)
+      goto err;
+
+   if (pack_stat(pack_filename, &pack_size, &pack_mtime) != 0 ||
+         pack_size != hdr.pack_size || pack_mtime != hdr.pack_mtime)
+   {
+      fprintf(stderr, "Ignoring index for %s as the pack has changed\n",
+              pack_filename);
+      goto err;
+   }
+
+   idx = calloc(1, sizeof(*idx));
+
+   if (idx == NULL)
+      goto err;
+
+   idx->span = hdr.span;
+   idx->pack_size = hdr.pack_size;
+   idx->pack_mtime = hdr.pack_mtime;
+   idx->points = calloc(hdr.n_points + 1, sizeof(*idx->points));
+   idx->entries = malloc((hdr.n_entries + 1) * sizeof(*idx->entries));
+
+   if (idx->points == NULL || idx->entries == NULL)
+      goto err;
+
+   idx->points_alloc = hdr.n_points + 1;
+   idx->entries_alloc = hdr.n_entries + 1;
+
+   for (; idx->n_points < hdr.n_points; idx->n_points++)
+   {
+      struct point_s *p = &idx->points[idx->n_points];
+      struct file_point_s fp;
+
+      if (fread(&fp, sizeof(fp), 1, f) != 1 || fp.window_sz > 2 * WINSIZE)
+         goto err;
+
+      p->out = fp.out;
+      p->in = fp.in;
+      p->bits = fp.bits;
+      p->window_sz = fp.window_sz;
+      p->window = malloc(fp.window_sz + 1);
+
+      if (p->window == NULL ||
+            fread(p->window, 1, fp.window_sz, f) != fp.window_sz)
+         goto err;
+   }
+
+   if (fread(idx->entries, sizeof(*idx->entries), hdr.n_entries, f) !=
+         hdr.n_entries)
+      goto err;
+
+   idx->n_entries = hdr.n_entries;
+   fclose(f);
+   return idx;
+
+err:
+   fclose(f);
+   gzindex_free(idx);
+   return NULL;
+}
+
+void gzindex_free(struct gzindex_s *idx)
+{
+   if (idx == NULL)
+      return;
+
+   for (size_t i = 0; i < idx->n_points; i++)
+      free(idx->points[i].window);
+
+   free(idx->points);
+   free(idx->entries);
+   free(idx);
+}
+
+struct gzindex_reader_s *gzindex_reader_open(const struct gzindex_s *idx,
+      const char *pack_filename)
+{
+   struct gzindex_reader_s *r;
+
+   if (idx->n_points == 0)
+      return NULL;
+
+   r = calloc(1, sizeof(*r));
+
+   if (r == NULL)
+      return NULL;
+
+   r->idx = idx;
+   r->in = fopen(pack_filename, "rb");
+
+   if (r->in == NULL || inflateInit2(&r->strm, -15) != Z_OK)
+   {
+      if (r->in != NULL)
+         fclose(r->in);
+
+      free(r);
+      return NULL;
+   }
+
+   return r;
+}
+
+void gzindex_reader_close(struct gzindex_reader_s *r)
+{
+   if (r == NULL)
+      return;
+
+   inflateEnd(&r->strm);
+   fclose(r->in);
+   free(r);
+}
+
+/* Returns the last checkpoint at or before the offset. */
+static const struct point_s *find_point(const struct gzindex_s *idx,
+                                        uint64_t offset)
+{
+   size_t lo = 0;
+   size_t hi = idx->n_points;
+
+   while (hi - lo > 1)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (idx->points[mid].out <= offset)
+         lo = mid;
+      else
+         hi = mid;
+   }
+
+   return &idx->points[lo];
+}
+
+static int restart_at(struct gzindex_reader_s *r, const struct point_s *p)
+{
+   uint8_t window[WINSIZE];
+   uLongf window_sz = WINSIZE;
+
+   if (fseeko(r->in, p->in - (p->bits ? 1 : 0), SEEK_SET) != 0)
+      return -1;
+
+   inflateReset(&r->strm);
+   r->strm.avail_in = 0;
+
+   if (p->bits)
+   {
+      int ch = getc(r->in);
+
+      if (ch == EOF)
+         return -1;
+
+      inflatePrime(&r->strm, p->bits, ch >> (8 - p->bits));
+   }
+
+   if (p->window_sz != 0)
+   {
+      if (uncompress(window, &window_sz, p->window, p->window_sz) != Z_OK)
+         return -1;
+
+      inflateSetDictionary(&r->strm, window, window_sz);
+   }
+
+   r->pos = p->out;
+   r->active = 1;
+   r->eof = 0;
+   return 0;
+}
+
+/* Inflates up to len bytes to buf. Returns the number of bytes produced. */
+static long inflate_to(struct gzindex_reader_s *r, uint8_t *buf, size_t len)
+{
+   size_t done = 0;
+
+   while (done < len && !r->eof)
+   {
+      int ret;
+      size_t chunk = len - done;
+
+      if (chunk > UINT32_MAX)
+         chunk = UINT32_MAX;
+
+      if (r->strm.avail_in == 0)
+      {
+         r->strm.avail_in = fread(r->inbuf, 1, sizeof(r->inbuf), r->in);
+         r->strm.next_in = r->inbuf;
+
+         if (r->strm.avail_in == 0)
+            return -1;
+      }
+
+      r->strm.next_out = buf + done;
+      r->strm.avail_out = chunk;
+      ret = inflate(&r->strm, Z_NO_FLUSH);
+      done += chunk - r->strm.avail_out;
+
+      if (ret == Z_STREAM_END)
+         r->eof = 1;
+      else if (ret != Z_OK && ret != Z_BUF_ERROR)
+      {
+         r->active = 0;
+         return -1;
+      }
+   }
+
+   r->pos += done;
+   return done;
+}
+
+long gzindex_read(struct gzindex_reader_s *r, uint64_t offset, void *buf,
+                  size_t len)
+{
+   const struct point_s *p = find_point(r->idx, offset);
+
+   /* Continue from the current position unless a checkpoint is closer. */
+   if (!r->active || offset < r->pos || p->out > r->pos)
+   {
+      if (restart_at(r, p) != 0)
+      {
+         r->active = 0;
+         return -1;
+      }
+   }
+
+   while (r->pos < offset)
+   {
+      uint64_t skip = offset - r->pos;
+      long got;
+
+      if (skip > sizeof(r->discard))
+         skip = sizeof(r->discard);
+
+      got = inflate_to(r, r->discard, skip);
+
+      if (got <= 0)
+         return got;
+   }
+
+   return inflate_to(r, buf, len);
+}
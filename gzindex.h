@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Random access index for gzip compressed texture packs.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef GZINDEX_H
+#define GZINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Extension appended to the pack file name to name its index. */
+#define GZINDEX_EXT           ".gzi"
+
+/* Default distance between checkpoints in uncompressed bytes. */
+#define GZINDEX_DEFAULT_SPAN  (4 * 1024 * 1024)
+
+struct gzindex_s;
+struct gzindex_reader_s;
+
+/**
+ * Key and uncompressed offset of a record within the pack. Used for packs that
+ * have no key map of their own, such as HTC.
+ */
+struct gzindex_entry_s
+{
+   uint64_t key;
+   uint64_t offset;
+};
+
+/**
+ * Called with each run of uncompressed data whilst an index is being built.
+ * offset is the position of data within the uncompressed stream.
+ */
+typedef void (*gzindex_scan_fn)(void *ctx, struct gzindex_s *idx,
+                                uint64_t offset, const uint8_t *data,
+                                size_t len);
+
+/**
+ * Returns non-zero if the file starts with a gzip header.
+ */
+int gzindex_is_gzip(const char *filename);
+
+/**
+ * Inflates the whole of a gzip file once, storing a checkpoint with the
+ * preceding 32 KiB of output every span bytes. scan may be NULL.
+ */
+struct gzindex_s *gzindex_build(const char *filename, uint64_t span,
+                                gzindex_scan_fn scan, void *scan_ctx);
+
+int gzindex_add_entry(struct gzindex_s *idx, uint64_t key, uint64_t offset);
+const struct gzindex_entry_s *gzindex_entries(const struct gzindex_s *idx,
+      size_t *n);
+size_t gzindex_n_points(const struct gzindex_s *idx);
+
+/**
+ * Saves the index to, or loads it from, the sidecar file of the given pack.
+ * A loaded index is rejected if the pack has changed since it was built.
+ */
+int gzindex_save(const struct gzindex_s *idx, const char *pack_filename);
+struct gzindex_s *gzindex_load(const char *pack_filename);
+void gzindex_free(struct gzindex_s *idx);
+
+/**
+ * A reader keeps an inflate stream open so that reads at increasing offsets
+ * continue from the current position. A read that is behind the current
+ * position, or past the next checkpoint, restarts from the nearest checkpoint.
+ * Each reader must only be used by one thread at a time.
+ */
+struct gzindex_reader_s *gzindex_reader_open(const struct gzindex_s *idx,
+      const char *pack_filename);
+void gzindex_reader_close(struct gzindex_reader_s *r);
+
+/**
+ * Reads len bytes from the uncompressed offset. Returns the number of bytes
+ * read, which is less than len at the end of the stream, or -1 on error.
+ */
+long gzindex_read(struct gzindex_reader_s *r, uint64_t offset, void *buf,
+                  size_t len);
+
+#endif
@@ -0,0 +1,437 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Reading of GLideNHQ HTS and HTC texture packs.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gzindex.h"
+#include "hts.h"
+
+void hts_parse_record(struct hts_record_s *rec, const uint8_t *hdr)
+{
+   memcpy(&rec->w, hdr + 0, 4);
+   memcpy(&rec->h, hdr + 4, 4);
+   memcpy(&rec->fmt, hdr + 8, 4);
+   memcpy(&rec->texfmt, hdr + 12, 2);
+   memcpy(&rec->pixtype, hdr + 14, 2);
+   rec->hires = hdr[16];
+   memcpy(&rec->data_sz, hdr + 17, 4);
+   rec->pf = pixfmt_from_gl(rec->fmt, rec->texfmt, rec->pixtype);
+}
+
+const uint8_t *pack_map(const char *filename, size_t *size)
+{
+   struct stat st;
+   void *map;
+   int fd;
+
+   if (gzindex_is_gzip(filename))
+      return NULL;
+
+   fd = open(filename, O_RDONLY);
+
+   if (fd < 0)
+      return NULL;
+
+   if (fstat(fd, &st) != 0 || st.st_size == 0)
+   {
+      close(fd);
+      return NULL;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+      return NULL;
+
+   /* Records are mostly read in order. */
+   madvise(map, st.st_size, MADV_SEQUENTIAL);
+   *size = st.st_size;
+   return map;
+}
+
+void pack_unmap(const uint8_t *map, size_t size)
+{
+   munmap((void *)map, size);
+}
+
+int pack_open(struct pack_in_s *in, const char *filename)
+{
+   memset(in, 0, sizeof(*in));
+   in->map = pack_map(filename, &in->map_sz);
+
+   if (in->map != NULL)
+      return 0;
+
+   if (gzindex_is_gzip(filename))
+      in->idx = gzindex_load(filename);
+
+   if (in->idx != NULL)
+   {
+      in->reader = gzindex_reader_open(in->idx, filename);
+
+      if (in->reader != NULL)
+         return 0;
+
+      gzindex_free(in->idx);
+      in->idx = NULL;
+   }
+
+   in->gzfp = gzopen(filename, "rb");
+
+   if (in->gzfp == NULL)
+   {
+      fprintf(stderr, "gzip was unable to open the input file.\n");
+      return -1;
+   }
+
+   return 0;
+}
+
+long pack_pread(struct pack_in_s *in, uint64_t offset, void *buf, size_t len)
+{
+   if (in->map != NULL)
+   {
+      if (offset >= in->map_sz)
+         return 0;
+
+      if (len > in->map_sz - offset)
+         len = in->map_sz - offset;
+
+      memcpy(buf, in->map + offset, len);
+      return len;
+   }
+
+   if (in->reader != NULL)
+      return gzindex_read(in->reader, offset, buf, len);
+
+   if ((uint64_t)gztell(in->gzfp) != offset &&
+         gzseek(in->gzfp, offset, SEEK_SET) < 0)
+      return -1;
+
+   return gzread(in->gzfp, buf, len);
+}
+
+const uint8_t *pack_get(struct pack_in_s *in, uint64_t offset, void *buf,
+                        size_t len)
+{
+   if (in->map != NULL)
+   {
+      if (offset > in->map_sz || len > in->map_sz - offset)
+         return NULL;
+
+      return in->map + offset;
+   }
+
+   if (pack_pread(in, offset, buf, len) != (long)len)
+      return NULL;
+
+   return buf;
+}
+
+uint64_t hts_keymap_offset(struct pack_in_s *in)
+{
+   uint64_t keymap_off = 0;
+
+   /* Skip reading config. The key map offset is relative to the end of
+    * itself. */
+   pack_pread(in, 4, &keymap_off, 8);
+   return keymap_off + 12;
+}
+
+void pack_close(struct pack_in_s *in)
+{
+   if (in->map != NULL)
+      pack_unmap(in->map, in->map_sz);
+
+   if (in->reader != NULL)
+      gzindex_reader_close(in->reader);
+
+   if (in->gzfp != NULL)
+      gzclose(in->gzfp);
+
+   gzindex_free(in->idx);
+   memset(in, 0, sizeof(*in));
+}
+
+uint64_t pack_size_hint(const char *filename, uint64_t min_size)
+{
+   uint64_t size = 0;
+   FILE *f = fopen(filename, "rb");
+
+   if (f == NULL)
+      return min_size;
+
+   fseek(f, 0, SEEK_END);
+   size = ftell(f);
+
+   if (gzindex_is_gzip(filename) && size >= 4)
+   {
+      uint8_t isize[4];
+
+      fseek(f, -4, SEEK_END);
+
+      if (fread(isize, 1, sizeof(isize), f) == sizeof(isize))
+         size = (uint64_t)isize[0] | (uint64_t)isize[1] << 8 |
+                (uint64_t)isize[2] << 16 | (uint64_t)isize[3] << 24;
+
+      while (size < min_size)
+         size += (uint64_t)1 << 32;
+   }
+
+   fclose(f);
+   return size < min_size ? min_size : size;
+}
+
+int read_keymap(struct pack_in_s *in, const char *filename, uint64_t off,
+                struct keymap_s *km)
+{
+   const size_t chunk_entries = 4096;
+   uint64_t (*chunk)[2];
+   size_t alloc;
+
+   alloc = (pack_size_hint(filename, off) - off) / sizeof(*chunk) + 1;
+   chunk = malloc(chunk_entries * sizeof(*chunk));
+   km->offset = malloc(alloc * sizeof(*km->offset));
+   km->crc = malloc(alloc * sizeof(*km->crc));
+   km->n = 0;
+
+   if (chunk == NULL || km->offset == NULL || km->crc == NULL)
+      goto err;
+
+   for (;;)
+   {
+      uint64_t pos = off + km->n * sizeof(*chunk);
+      const uint8_t *src = (const uint8_t *)chunk;
+      long got;
+      size_t n;
+
+      /* The key map of a mapped pack is read in place, all at once. */
+      if (in->map != NULL)
+      {
+         got = pos < in->map_sz ? (long)(in->map_sz - pos) : 0;
+         src = in->map + pos;
+      }
+      else
+         got = pack_pread(in, pos, chunk, chunk_entries * sizeof(*chunk));
+
+      if (got <= 0)
+         break;
+
+      n = got / sizeof(*chunk);
+
+      /* Only grows if the size hint was wrong. */
+      if (km->n + n > alloc)
+      {
+         uint64_t *o, *c;
+
+         while (km->n + n > alloc)
+            alloc <<= 1;
+
+         o = realloc(km->offset, alloc * sizeof(*km->offset));
+         c = realloc(km->crc, alloc * sizeof(*km->crc));
+
+         if (o != NULL)
+            km->offset = o;
+
+         if (c != NULL)
+            km->crc = c;
+
+         if (o == NULL || c == NULL)
+            goto err;
+      }
+
+      for (size_t i = 0; i < n; i++)
+      {
+         memcpy(&km->offset[km->n + i], src + i * sizeof(*chunk), 8);
+         memcpy(&km->crc[km->n + i], src + i * sizeof(*chunk) + 8, 8);
+      }
+
+      km->n += n;
+
+      if (in->map != NULL || (size_t)got < chunk_entries * sizeof(*chunk))
+         break;
+   }
+
+   free(chunk);
+   return 0;
+
+err:
+   free(chunk);
+   free(km->offset);
+   free(km->crc);
+   memset(km, 0, sizeof(*km));
+   return -1;
+}
+
+int sort_keymap(struct keymap_s *km)
+{
+   uint64_t *off = km->offset;
+   uint64_t *crc = km->crc;
+   uint64_t *tmp_off = malloc(km->n * sizeof(*tmp_off) + 1);
+   uint64_t *tmp_crc = malloc(km->n * sizeof(*tmp_crc) + 1);
+
+   if (tmp_off == NULL || tmp_crc == NULL)
+   {
+      free(tmp_off);
+      free(tmp_crc);
+      return -1;
+   }
+
+   for (unsigned shift = 0; shift < 64; shift += 8)
+   {
+      size_t count[256] = { 0 };
+      size_t pos = 0;
+      uint64_t *swap;
+
+      for (size_t i = 0; i < km->n; i++)
+         count[(off[i] >> shift) & 0xFF]++;
+
+      if (km->n == 0 || count[(off[0] >> shift) & 0xFF] == km->n)
+         continue;
+
+      for (unsigned d = 0; d < 256; d++)
+      {
+         size_t c = count[d];
+         count[d] = pos;
+         pos += c;
+      }
+
+      for (size_t i = 0; i < km->n; i++)
+      {
+         size_t dst = count[(off[i] >> shift) & 0xFF]++;
+         tmp_off[dst] = off[i];
+         tmp_crc[dst] = crc[i];
+      }
+
+      swap = off;
+      off = tmp_off;
+      tmp_off = swap;
+      swap = crc;
+      crc = tmp_crc;
+      tmp_crc = swap;
+   }
+
+   km->offset = off;
+   km->crc = crc;
+   free(tmp_off);
+   free(tmp_crc);
+   return 0;
+}
+
+void free_keymap(struct keymap_s *km)
+{
+   free(km->offset);
+   free(km->crc);
+   memset(km, 0, sizeof(*km));
+}
+
+int reserve_buf(uint8_t **buf, size_t *buf_sz, size_t len)
+{
+   if (len <= *buf_sz)
+      return 0;
+
+   free(*buf);
+   *buf_sz = len;
+   *buf = malloc(len);
+
+   return *buf == NULL ? -1 : 0;
+}
+
+int tex_inflate_init(struct tex_inflate_s *ti)
+{
+#ifdef USE_LIBDEFLATE
+   ti->d = libdeflate_alloc_decompressor();
+   return ti->d == NULL ? -1 : 0;
+#else
+   memset(&ti->strm, 0, sizeof(ti->strm));
+   return inflateInit(&ti->strm) == Z_OK ? 0 : -1;
+#endif
+}
+
+void tex_inflate_end(struct tex_inflate_s *ti)
+{
+#ifdef USE_LIBDEFLATE
+   libdeflate_free_decompressor(ti->d);
+#else
+   inflateEnd(&ti->strm);
+#endif
+}
+
+int tex_inflate(struct tex_inflate_s *ti, uint8_t *dst, size_t dst_cap,
+                size_t *dst_len, const uint8_t *src, size_t src_len)
+{
+#ifdef USE_LIBDEFLATE
+   return libdeflate_zlib_decompress(ti->d, src, src_len, dst, dst_cap,
+                                     dst_len) == LIBDEFLATE_SUCCESS ? 0 : -1;
+#else
+   inflateReset(&ti->strm);
+   ti->strm.next_in = (Bytef *)src;
+   ti->strm.avail_in = src_len;
+   ti->strm.next_out = dst;
+   ti->strm.avail_out = dst_cap;
+
+   if (inflate(&ti->strm, Z_FINISH) != Z_STREAM_END)
+      return -1;
+
+   *dst_len = ti->strm.total_out;
+   return 0;
+#endif
+}
+
+const uint8_t *texture_rgba8(enum pixfmt_e fmt, const uint8_t *tex,
+                             size_t *tex_sz, size_t n_px, uint8_t **rgba,
+                             size_t *rgba_sz)
+{
+   if (*tex_sz != n_px * pixfmt_bpp(fmt))
+      return NULL;
+
+   if (fmt == PIXFMT_RGBA8888)
+      return tex;
+
+   if (reserve_buf(rgba, rgba_sz, n_px * 4) != 0)
+      return NULL;
+
+   pixfmt_to_rgba8(fmt, *rgba, tex, n_px);
+   *tex_sz = n_px * 4;
+   return *rgba;
+}
+
+size_t hts_record_size(const struct hts_record_s *rec)
+{
+   size_t bpp = rec->pf == PIXFMT_UNKNOWN ? 4 : pixfmt_bpp(rec->pf);
+   size_t n_px, tex_len, max_sz;
+
+   if (rec->w <= 0 || rec->h <= 0 || rec->data_sz < 0)
+      return 0;
+
+   n_px = (size_t)rec->w * (size_t)rec->h;
+
+   if (n_px > SIZE_MAX / 4)
+      return 0;
+
+   tex_len = n_px * bpp;
+   max_sz = (rec->fmt & GL_TEXFMT_GZ) ? compressBound(tex_len) : tex_len;
+
+   return (size_t)rec->data_sz > max_sz ? 0 : tex_len;
+}
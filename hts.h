@@ -0,0 +1,179 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Reading of GLideNHQ HTS and HTC texture packs.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HTS_H
+#define HTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "pixfmt.h"
+
+/* Set in the internal format of textures that are zlib compressed. */
+#define GL_TEXFMT_GZ       0x80000000
+
+/* Size of the record header preceding the texture data in HTS files. */
+#define HTS_RECORD_HDR_SZ  21
+
+/* Size of the record header, including the CRC, in HTC files. */
+#define HTC_RECORD_HDR_SZ  (8 + HTS_RECORD_HDR_SZ)
+
+/* Fields of a record header. */
+struct hts_record_s
+{
+   int32_t w;
+   int32_t h;
+   uint32_t fmt;
+   uint16_t texfmt;
+   uint16_t pixtype;
+   uint8_t hires;
+   int32_t data_sz;
+   enum pixfmt_e pf;
+};
+
+/* The key map of a HTS pack, stored as separate arrays of offsets and CRCs. */
+struct keymap_s
+{
+   uint64_t *offset;
+   uint64_t *crc;
+   size_t n;
+};
+
+/**
+ * Source of uncompressed pack data. Packs that are not gzip compressed are
+ * mapped into memory. When a random access index has been built for a
+ * compressed pack, data is read through it. Otherwise data is read through
+ * zlib's gz functions.
+ */
+struct pack_in_s
+{
+   const uint8_t *map;
+   size_t map_sz;
+   gzFile gzfp;
+   struct gzindex_s *idx;
+   struct gzindex_reader_s *reader;
+};
+
+/**
+ * Decompressor for zlib compressed textures. Each thread keeps one for its
+ * lifetime, so no inflate state is created or destroyed per texture.
+ * libdeflate is used instead of zlib when built with USE_LIBDEFLATE.
+ */
+struct tex_inflate_s
+{
+#ifdef USE_LIBDEFLATE
+   struct libdeflate_decompressor *d;
+#else
+   z_stream strm;
+#endif
+};
+
+/**
+ * Parses a HTS record header. For HTC records, hdr must point past the CRC.
+ */
+void hts_parse_record(struct hts_record_s *rec, const uint8_t *hdr);
+
+/**
+ * Opens a pack, through its index if one has been built. pack_close() may be
+ * called more than once.
+ */
+int pack_open(struct pack_in_s *in, const char *filename);
+void pack_close(struct pack_in_s *in);
+
+/* Reads len bytes at the uncompressed offset, returning the number read. */
+long pack_pread(struct pack_in_s *in, uint64_t offset, void *buf, size_t len);
+
+/**
+ * Returns a pointer to len bytes at the uncompressed offset. For mapped packs
+ * this points into the mapping and nothing is copied, otherwise the bytes are
+ * read into buf. Returns NULL if fewer than len bytes could be read.
+ */
+const uint8_t *pack_get(struct pack_in_s *in, uint64_t offset, void *buf,
+                        size_t len);
+
+/**
+ * Maps the whole of a pack that is not gzip compressed into memory. Returns
+ * NULL if the pack is compressed, empty, or could not be mapped.
+ */
+const uint8_t *pack_map(const char *filename, size_t *size);
+void pack_unmap(const uint8_t *map, size_t size);
+
+/**
+ * Estimates the uncompressed size of a pack. For gzip files this is taken
+ * from the trailer, which holds the size modulo 2^32, so it is increased in
+ * steps of 4 GiB until it is at least min_size.
+ */
+uint64_t pack_size_hint(const char *filename, uint64_t min_size);
+
+/**
+ * Returns the uncompressed offset of the key map of a HTS pack.
+ */
+uint64_t hts_keymap_offset(struct pack_in_s *in);
+
+/**
+ * Reads the key map at the given offset until the end of the pack. The arrays
+ * are sized from the remaining length of the pack, and entries are read in
+ * large chunks.
+ */
+int read_keymap(struct pack_in_s *in, const char *filename, uint64_t off,
+                struct keymap_s *km);
+
+/**
+ * Sorts the key map by offset with a least significant digit radix sort.
+ * Passes over bytes that are the same for every offset are skipped, so
+ * typically only the lower four or five bytes of each offset are sorted on.
+ */
+int sort_keymap(struct keymap_s *km);
+void free_keymap(struct keymap_s *km);
+
+/* Grows a buffer to at least len bytes, discarding its contents. */
+int reserve_buf(uint8_t **buf, size_t *buf_sz, size_t len);
+
+int tex_inflate_init(struct tex_inflate_s *ti);
+void tex_inflate_end(struct tex_inflate_s *ti);
+
+/**
+ * Decompresses a zlib stream directly into dst, which is dst_cap bytes long.
+ * Returns 0 on success and sets dst_len to the decompressed size.
+ */
+int tex_inflate(struct tex_inflate_s *ti, uint8_t *dst, size_t dst_cap,
+                size_t *dst_len, const uint8_t *src, size_t src_len);
+
+/**
+ * Checks that a decoded texture holds n_px pixels of the given format, and
+ * returns it as 8-bit RGBA. 16-bit pixels are expanded into the rgba buffer,
+ * which is grown as required. Returns NULL if the texture is unusable.
+ */
+const uint8_t *texture_rgba8(enum pixfmt_e fmt, const uint8_t *tex,
+                             size_t *tex_sz, size_t n_px, uint8_t **rgba,
+                             size_t *rgba_sz);
+
+/**
+ * Checks the sizes in a record header before its data is read. Stored
+ * textures must be no larger than their pixels, and zlib compressed textures
+ * no larger than compressBound() of their pixels. Returns the size of the
+ * uncompressed texture, or 0 if the record is invalid. No texture format needs
+ * more than 32 bits per pixel, so this is an upper bound for unknown formats.
+ */
+size_t hts_record_size(const struct hts_record_s *rec);
+
+#endif
@@ -18,340 +18,2389 @@
 #define _DEFAULT_SOURCE
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <zlib.h>
 
-#define GL_TEXFMT_GZ    0x80000000
+#define XXH_INLINE_ALL
+#include "xxhash.h"
 
-struct mapping_s
+#include "evtrace.h"
+#include "gzindex.h"
+#include "hts.h"
+#include "pgzip.h"
+#include "tar.h"
+
+/* Formats that textures may be written in. */
+enum out_format_e
+{
+   FORMAT_BMP = 0,
+   FORMAT_RAW,
+   FORMAT_KTX
+};
+
+/* Conversions of alpha applied to textures before they are written. */
+enum alpha_e
+{
+   ALPHA_KEEP = 0,
+   ALPHA_PREMULTIPLY,
+   ALPHA_UNPREMULTIPLY
+};
+
+struct options_s
+{
+   unsigned threads;
+   unsigned char build_index;
+   unsigned char list;
+   unsigned char json;
+   const char *crc_list;
+   const char *tar;
+   enum out_format_e format;
+   enum alpha_e alpha;
+   unsigned char no_links;
+   unsigned char verify;
+   /* Channel order to write textures in. Textures are decoded to RGBA. */
+   enum pixfmt_order_e order;
+   const char *trace;
+};
+
+/* Size of the BMP header written before each texture. */
+#define BMP_HDR_SZ   138
+
+/* Size of the KTX header and key value data written before each texture. */
+#define KTX_HDR_SZ   96
+
+/**
+ * Open addressing hash table of the textures written so far, shared by every
+ * thread. Textures are hashed after conversion, together with their
+ * dimensions, and repeats are linked to the first file written.
+ */
+struct dedupe_s
+{
+   XXH128_hash_t *hash;
+   uint64_t *crc;
+   unsigned char *used;
+   size_t n;
+   size_t cap;
+
+   /* Links made instead of writes, and the bytes that were not written. */
+   uint64_t links;
+   uint64_t bytes_saved;
+
+   pthread_mutex_t lock;
+};
+
+/* Output settings of a thread, and the buffer that it converts textures in. */
+struct out_s
+{
+   const struct options_s *opts;
+   struct tar_s *tar;
+   struct tar_writer_s *tw;
+   struct dedupe_s *dd;
+   uint8_t *buf;
+   size_t buf_sz;
+};
+
+void dedupe_init(struct dedupe_s *dd)
+{
+   memset(dd, 0, sizeof(*dd));
+   pthread_mutex_init(&dd->lock, NULL);
+}
+
+void dedupe_free(struct dedupe_s *dd)
+{
+   pthread_mutex_destroy(&dd->lock);
+   free(dd->hash);
+   free(dd->crc);
+   free(dd->used);
+}
+
+/* Must be called with the lock held. */
+static size_t dedupe_slot(const struct dedupe_s *dd, XXH128_hash_t hash)
+{
+   size_t i;
+
+   for (i = hash.low64 & (dd->cap - 1); dd->used[i];
+         i = (i + 1) & (dd->cap - 1))
+   {
+      if (XXH128_isEqual(dd->hash[i], hash))
+         break;
+   }
+
+   return i;
+}
+
+/* Returns 1 and the CRC of the file if a texture has been written already. */
+int dedupe_find(struct dedupe_s *dd, XXH128_hash_t hash, uint64_t *crc)
+{
+   int found = 0;
+
+   pthread_mutex_lock(&dd->lock);
+
+   if (dd->cap != 0)
+   {
+      size_t i = dedupe_slot(dd, hash);
+
+      if (dd->used[i])
+      {
+         *crc = dd->crc[i];
+         found = 1;
+      }
+   }
+
+   pthread_mutex_unlock(&dd->lock);
+   return found;
+}
+
+/**
+ * Records a texture once its file has been written. If another thread wrote
+ * the same texture in the meantime, the first one recorded is kept. A table
+ * that cannot grow only stops further textures from being linked.
+ */
+void dedupe_add(struct dedupe_s *dd, XXH128_hash_t hash, uint64_t crc)
+{
+   size_t i;
+
+   pthread_mutex_lock(&dd->lock);
+
+   if ((dd->n + 1) * 2 > dd->cap)
+   {
+      struct dedupe_s grown = { .cap = dd->cap ? dd->cap * 2 : 1024 };
+
+      grown.hash = malloc(grown.cap * sizeof(*grown.hash));
+      grown.crc = malloc(grown.cap * sizeof(*grown.crc));
+      grown.used = calloc(grown.cap, sizeof(*grown.used));
+
+      if (grown.hash == NULL || grown.crc == NULL || grown.used == NULL)
+      {
+         free(grown.hash);
+         free(grown.crc);
+         free(grown.used);
+         goto out;
+      }
+
+      for (size_t j = 0; j < dd->cap; j++)
+      {
+         if (!dd->used[j])
+            continue;
+
+         i = dedupe_slot(&grown, dd->hash[j]);
+         grown.hash[i] = dd->hash[j];
+         grown.crc[i] = dd->crc[j];
+         grown.used[i] = 1;
+      }
+
+      free(dd->hash);
+      free(dd->crc);
+      free(dd->used);
+      dd->hash = grown.hash;
+      dd->crc = grown.crc;
+      dd->used = grown.used;
+      dd->cap = grown.cap;
+   }
+
+   i = dedupe_slot(dd, hash);
+
+   if (!dd->used[i])
+   {
+      dd->hash[i] = hash;
+      dd->crc[i] = crc;
+      dd->used[i] = 1;
+      dd->n++;
+   }
+
+out:
+   pthread_mutex_unlock(&dd->lock);
+}
+
+/**
+ * Writes a BMP V5 header for a 32-bit texture. The bit field masks select the
+ * red, green, blue and alpha channels of pixels stored in the given byte
+ * order, so the texture is displayed correctly after any swizzle.
+ */
+void make_bmp_header(uint8_t *argb_bmp, size_t w, size_t h,
+                     enum pixfmt_order_e order)
+{
+   /* Byte offset of red, green, blue and alpha within a pixel. */
+   static const uint8_t channel_byte[][4] =
+   {
+      [PIXFMT_ORDER_RGBA] = { 0, 1, 2, 3 },
+      [PIXFMT_ORDER_BGRA] = { 2, 1, 0, 3 },
+      [PIXFMT_ORDER_ARGB] = { 1, 2, 3, 0 }
+   };
+   static const unsigned char argb_bmp_template[BMP_HDR_SZ] =
+   {
+      0x42, 0x4d, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x8a, 0x00,
+      0x00, 0x00, 0x7c, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,
+      0x00, 0x00, 0x01, 0x00, 0x20, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04, 0x00,
+      0x00, 0x00, 0x13, 0x0b, 0x00, 0x00, 0x13, 0x0b, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0xff,
+      0x00, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0xff, 0x42, 0x47,
+      0x52, 0x73, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+   };
+   size_t size = h * (w * 4) + BMP_HDR_SZ;
+
+   memcpy(argb_bmp, argb_bmp_template, BMP_HDR_SZ);
+
+   argb_bmp[2] = size >>  0;
+   argb_bmp[3] = size >>  8;
+   argb_bmp[4] = size >> 16;
+   argb_bmp[5] = size >> 24;
+
+   argb_bmp[18] = w >>  0;
+   argb_bmp[19] = w >>  8;
+   argb_bmp[20] = w >> 16;
+   argb_bmp[21] = w >> 24;
+
+   /* A negative height stores the rows from the top down. */
+   argb_bmp[22] = -h >>  0;
+   argb_bmp[23] = -h >>  8;
+   argb_bmp[24] = -h >> 16;
+   argb_bmp[25] = -h >> 24;
+
+   /* Each mask is a little endian 32-bit value with all bits of its
+    * channel's byte set. */
+   memset(argb_bmp + 54, 0, 16);
+
+   for (unsigned c = 0; c < 4; c++)
+      argb_bmp[54 + c * 4 + channel_byte[order][c]] = 0xff;
+}
+
+/**
+ * Writes a KTX 1 header for an uncompressed RGBA8 texture, as read by
+ * ktx2mtp64. The orientation key records that rows are stored from the top
+ * down, as they are in the pack.
+ */
+void make_ktx_header(uint8_t *ktx, size_t w, size_t h, size_t data_sz)
+{
+   static const uint8_t identifier[12] =
+   {
+      0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+   };
+   static const char orientation[24] = "KTXorientation\0S=r,T=d";
+   const uint32_t fields[13] =
+   {
+      0x04030201,    /* endianness */
+      0x1401,        /* glType: GL_UNSIGNED_BYTE */
+      1,             /* glTypeSize */
+      0x1908,        /* glFormat: GL_RGBA */
+      0x8058,        /* glInternalFormat: GL_RGBA8 */
+      0x1908,        /* glBaseInternalFormat: GL_RGBA */
+      w, h,
+      0,             /* pixelDepth */
+      0,             /* numberOfArrayElements */
+      1,             /* numberOfFaces */
+      1,             /* numberOfMipmapLevels */
+      4 + sizeof(orientation)
+   };
+   const uint32_t kv_sz = sizeof(orientation) - 1;
+   const uint32_t image_sz = data_sz;
+
+   memcpy(ktx, identifier, sizeof(identifier));
+   memcpy(ktx + 12, fields, sizeof(fields));
+   memcpy(ktx + 64, &kv_sz, 4);
+   memcpy(ktx + 68, orientation, sizeof(orientation));
+   memcpy(ktx + 92, &image_sz, 4);
+}
+
+/**
+ * Writes a header followed by data to a file, or as a member of an archive
+ * if the thread is writing to one. Returns -1 on failure.
+ */
+int write_file(struct out_s *out, const char *name, uint64_t crc,
+               const void *hdr, size_t hdr_len, const void *data,
+               size_t data_len)
+{
+   uint64_t ev_start = evtrace_begin();
+   FILE *f;
+   int ret;
+
+   if (out->tw != NULL)
+   {
+      ret = tar_add(out->tw, name, crc, hdr, hdr_len, data, data_len);
+      evtrace_end(EVTRACE_WRITE, crc, ev_start);
+      return ret;
+   }
+
+   f = fopen(name, "wb");
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to create %s\n", name);
+      return -1;
+   }
+
+   fwrite(hdr, 1, hdr_len, f);
+   fwrite(data, 1, data_len, f);
+   fclose(f);
+   evtrace_end(EVTRACE_WRITE, crc, ev_start);
+   return 0;
+}
+
+/**
+ * Converts an 8-bit RGBA texture as requested by the options, and writes it
+ * in the chosen format to a file named after its CRC. Conversion is done by
+ * the calling worker into its own buffer, so tex is left unchanged.
+ * Returns -1 if the texture could not be written.
+ */
+int write_texture(struct out_s *out, const uint8_t *tex, size_t tex_sz,
+                  uint64_t crc, size_t w, size_t h)
+{
+   static const char *const ext[] = { "bmp", "raw", "ktx" };
+   const struct options_s *opts = out->opts;
+   uint8_t hdr[BMP_HDR_SZ > KTX_HDR_SZ ? BMP_HDR_SZ : KTX_HDR_SZ];
+   size_t hdr_len = 0;
+   size_t n_px = tex_sz / 4;
+   XXH128_hash_t hash = { 0, 0 };
+   char name[32];
+
+   if (opts->alpha != ALPHA_KEEP || opts->order != PIXFMT_ORDER_RGBA)
+   {
+      const uint8_t *src = tex;
+
+      if (reserve_buf(&out->buf, &out->buf_sz, tex_sz) != 0)
+      {
+         fprintf(stderr, "Unable to reallocate memory.\n");
+         return -1;
+      }
+
+      if (opts->alpha == ALPHA_PREMULTIPLY)
+         pixfmt_premultiply(out->buf, src, n_px);
+      else if (opts->alpha == ALPHA_UNPREMULTIPLY)
+         pixfmt_unpremultiply(out->buf, src, n_px);
+
+      if (opts->alpha != ALPHA_KEEP)
+         src = out->buf;
+
+      if (opts->order != PIXFMT_ORDER_RGBA)
+         pixfmt_swizzle(out->buf, src, n_px, PIXFMT_ORDER_RGBA, opts->order);
+
+      tex = out->buf;
+   }
+
+   if (opts->format == FORMAT_BMP)
+   {
+      make_bmp_header(hdr, w, h, opts->order);
+      hdr_len = BMP_HDR_SZ;
+   }
+   else if (opts->format == FORMAT_KTX)
+   {
+      make_ktx_header(hdr, w, h, tex_sz);
+      hdr_len = KTX_HDR_SZ;
+   }
+
+   snprintf(name, sizeof(name), "%016lX.%s", crc, ext[opts->format]);
+
+   if (out->dd != NULL)
+   {
+      uint64_t first_crc;
+      int linked = 0;
+      uint64_t ev_start = evtrace_begin();
+
+      hash = XXH3_128bits_withSeed(tex, tex_sz, (uint64_t)w << 32 | h);
+      evtrace_end(EVTRACE_HASH, crc, ev_start);
+
+      if (dedupe_find(out->dd, hash, &first_crc))
+      {
+         char target[32];
+
+         snprintf(target, sizeof(target), "%016lX.%s", first_crc,
+                  ext[opts->format]);
+
+         if (out->tar != NULL)
+            linked = tar_add_link(out->tar, name, crc, target) == 0;
+         else
+         {
+            /* Replace files left by earlier dumps. If the file system does
+             * not support hard links, the texture is written instead. */
+            unlink(name);
+            linked = link(target, name) == 0;
+         }
+      }
+
+      if (linked)
+      {
+         __atomic_add_fetch(&out->dd->links, 1, __ATOMIC_RELAXED);
+         __atomic_add_fetch(&out->dd->bytes_saved, hdr_len + tex_sz,
+                            __ATOMIC_RELAXED);
+         return 0;
+      }
+   }
+
+   if (write_file(out, name, crc, hdr, hdr_len, tex, tex_sz) != 0)
+      return -1;
+
+   if (out->dd != NULL)
+      dedupe_add(out->dd, hash, crc);
+
+   return 0;
+}
+
+void print_verify(uint64_t bad, uint64_t bytes, uint64_t elapsed_ms)
+{
+   fprintf(stdout, "\nVerified %.2f MiB of textures in %.2f s (%.0f MiB/s)\n"
+           "%lu bad records\n", bytes / (1024.0 * 1024.0),
+           elapsed_ms / 1000.0,
+           elapsed_ms ? bytes / (1024.0 * 1024.0) * 1000.0 / elapsed_ms : 0.0,
+           bad);
+}
+
+/* Prints how much linking identical textures saved. */
+void print_dedupe(const struct dedupe_s *dd)
+{
+   if (dd == NULL)
+      return;
+
+   fprintf(stdout, "Linked %lu identical textures instead of writing them, "
+           "saving %.2f MiB\n", dd->links,
+           dd->bytes_saved / (1024.0 * 1024.0));
+}
+
+uint64_t now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t now_us(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Opens a pack with pack_open(), recording the time taken in the trace. */
+int open_pack(struct pack_in_s *in, const char *filename)
+{
+   uint64_t ev_start = evtrace_begin();
+
+   if (pack_open(in, filename) != 0)
+      return -1;
+
+   evtrace_end(EVTRACE_OPEN, 0, ev_start);
+   return 0;
+}
+
+/* Buffers kept by a thread for decoding textures one after another. */
+struct tex_bufs_s
+{
+   /* Texture data as stored in the pack. */
+   uint8_t *data;
+   size_t data_sz;
+
+   /* Uncompressed texture data. */
+   uint8_t *dec;
+   size_t dec_sz;
+
+   /* 16-bit textures expanded to 8-bit RGBA. */
+   uint8_t *rgba;
+   size_t rgba_sz;
+};
+
+void free_tex_bufs(struct tex_bufs_s *b)
+{
+   free(b->data);
+   free(b->dec);
+   free(b->rgba);
+   memset(b, 0, sizeof(*b));
+}
+
+/**
+ * Reads the HTS record at the given offset and decodes it to 8-bit RGBA.
+ * The CRC is only used to identify the texture in event traces.
+ * Returns 0 on success, 1 if the texture was skipped after printing the
+ * reason, and -1 if memory could not be allocated.
+ */
+int read_texture(struct pack_in_s *in, uint64_t offset, uint64_t crc,
+                 struct tex_inflate_s *ti, struct tex_bufs_s *b,
+                 struct hts_record_s *rec, const uint8_t **tex,
+                 size_t *tex_sz)
+{
+   uint8_t hdr_buf[HTS_RECORD_HDR_SZ];
+   const uint8_t *hdr, *data;
+   size_t n_px, dst_len;
+   uint64_t ev_start = evtrace_begin();
+
+   hdr = pack_get(in, offset, hdr_buf, sizeof(hdr_buf));
+
+   if (hdr == NULL)
+   {
+      fprintf(stderr, "Unable to read texture at %lu\n", offset);
+      return 1;
+   }
+
+   hts_parse_record(rec, hdr);
+   n_px = (size_t)rec->h * (size_t)rec->w;
+
+   if (rec->pf == PIXFMT_UNKNOWN)
+   {
+      fprintf(stderr, "Texture format at %lu not supported.\n", offset);
+      return 1;
+   }
+
+   dst_len = hts_record_size(rec);
+
+   if (dst_len == 0)
+   {
+      fprintf(stderr, "Texture at %lu has an invalid size.\n", offset);
+      return 1;
+   }
+
+   /* Textures of mapped packs are decoded straight from the mapping. */
+   if (in->map == NULL &&
+         reserve_buf(&b->data, &b->data_sz, rec->data_sz) != 0)
+      return -1;
+
+   data = pack_get(in, offset + sizeof(hdr_buf), b->data, rec->data_sz);
+
+   if (data == NULL)
+   {
+      fprintf(stderr, "Unable to read texture at %lu\n", offset);
+      return 1;
+   }
+
+   evtrace_end(EVTRACE_PARSE, crc, ev_start);
+   *tex = data;
+   *tex_sz = rec->data_sz;
+
+   /* If texture is zlib compressed, uncompress it. */
+   if (rec->fmt & GL_TEXFMT_GZ)
+   {
+      if (reserve_buf(&b->dec, &b->dec_sz, dst_len) != 0)
+         return -1;
+
+      ev_start = evtrace_begin();
+
+      if (tex_inflate(ti, b->dec, dst_len, tex_sz, data, rec->data_sz) != 0)
+      {
+         fprintf(stderr, "zlib failure for texture at %lu\n", offset);
+         return 1;
+      }
+
+      evtrace_end(EVTRACE_INFLATE, crc, ev_start);
+
+      if (*tex_sz != dst_len)
+      {
+         fprintf(stderr, "Texture at %lu inflated to %zu bytes instead of "
+                 "%zu\n", offset, *tex_sz, dst_len);
+         return 1;
+      }
+
+      *tex = b->dec;
+   }
+
+   ev_start = evtrace_begin();
+   *tex = texture_rgba8(rec->pf, *tex, tex_sz, n_px, &b->rgba, &b->rgba_sz);
+   evtrace_end(EVTRACE_DECODE, crc, ev_start);
+
+   if (*tex == NULL)
+   {
+      fprintf(stderr, "Unable to convert %s texture at %lu\n",
+              pixfmt_name(rec->pf), offset);
+      return 1;
+   }
+
+   return 0;
+}
+
+/**
+ * Checks that the data of a record decompresses to the size of its texture.
+ * Returns as verify_record() does.
+ */
+int verify_data(const struct hts_record_s *rec, const uint8_t *data,
+                uint64_t crc, uint64_t offset, struct tex_inflate_s *ti,
+                uint8_t **dec, size_t *dec_sz, uint64_t *bytes)
+{
+   /* The size of textures in unknown formats, such as S3TC, is not known,
+    * so they are only checked against the largest size they could have. */
+   size_t tex_len = hts_record_size(rec);
+   size_t dst_len;
+
+   if (rec->w <= 0 || rec->h <= 0 || rec->data_sz < 0)
+   {
+      fprintf(stderr, "%016lX at %lu: invalid header\n", crc, offset);
+      return 1;
+   }
+
+   if (tex_len == 0)
+   {
+      fprintf(stderr, "%016lX at %lu: %d bytes is too large for %dx%d\n",
+              crc, offset, rec->data_sz, rec->w, rec->h);
+      return 1;
+   }
+
+   if (!(rec->fmt & GL_TEXFMT_GZ))
+   {
+      *bytes += rec->data_sz;
+      return 0;
+   }
+
+   if (reserve_buf(dec, dec_sz, tex_len) != 0)
+      return -1;
+
+   if (tex_inflate(ti, *dec, tex_len, &dst_len, data, rec->data_sz) != 0)
+   {
+      fprintf(stderr, "%016lX at %lu: zlib stream is corrupt\n", crc,
+              offset);
+      return 1;
+   }
+
+   if (rec->pf != PIXFMT_UNKNOWN && dst_len != tex_len)
+   {
+      fprintf(stderr, "%016lX at %lu: inflated to %zu bytes instead of %zu\n",
+              crc, offset, dst_len, tex_len);
+      return 1;
+   }
+
+   *bytes += dst_len;
+   return 0;
+}
+
+/**
+ * Checks that the record at the given offset can be read and decompressed,
+ * and discards the texture. The uncompressed size is added to bytes.
+ * Returns 0 if the record is intact, 1 if it is not after printing why, and
+ * -1 if memory could not be allocated.
+ */
+int verify_record(struct pack_in_s *in, uint64_t offset, uint64_t crc,
+                  struct tex_inflate_s *ti, struct tex_bufs_s *b,
+                  uint64_t *bytes)
+{
+   uint8_t hdr_buf[HTS_RECORD_HDR_SZ];
+   const uint8_t *hdr, *data;
+   struct hts_record_s rec;
+
+   hdr = pack_get(in, offset, hdr_buf, sizeof(hdr_buf));
+
+   if (hdr == NULL)
+   {
+      fprintf(stderr, "%016lX at %lu: header is truncated\n", crc, offset);
+      return 1;
+   }
+
+   hts_parse_record(&rec, hdr);
+
+   /* Reject bad sizes before allocating for them. */
+   if (hts_record_size(&rec) == 0)
+      return verify_data(&rec, NULL, crc, offset, ti, &b->dec, &b->dec_sz,
+                         bytes);
+
+   if (in->map == NULL &&
+         reserve_buf(&b->data, &b->data_sz, rec.data_sz) != 0)
+      return -1;
+
+   data = pack_get(in, offset + sizeof(hdr_buf), b->data, rec.data_sz);
+
+   if (data == NULL)
+   {
+      fprintf(stderr, "%016lX at %lu: data is truncated\n", crc, offset);
+      return 1;
+   }
+
+   return verify_data(&rec, data, crc, offset, ti, &b->dec, &b->dec_sz,
+                      bytes);
+}
+
+/* Completes the archive written by a dump, if one was requested. */
+int finish_archive(struct tar_s *tar, const char *filename)
+{
+   uint64_t size;
+
+   if (tar == NULL)
+      return 0;
+
+   if (tar_close(tar, &size) != 0)
+   {
+      fprintf(stderr, "Unable to write archive %s\n", filename);
+      return -1;
+   }
+
+   fprintf(stdout, "Wrote %lu bytes to %s\n", size, filename);
+   return 0;
+}
+
+/* A contiguous range of the offset sorted key map, dumped by one thread. */
+struct hts_worker_s
+{
+   const char *filename;
+   const struct keymap_s *km;
+   const struct options_s *opts;
+   struct tar_s *tar;
+   struct dedupe_s *dd;
+   size_t first;
+   size_t last;
+
+   /* Shared between all workers and updated atomically. */
+   size_t *done;
+   unsigned *finished;
+
+   /* Records found to be corrupt, and the uncompressed bytes verified. */
+   uint64_t bad;
+   uint64_t bytes;
+
+   int failed;
+};
+
+void *dump_hts_worker(void *arg)
+{
+   struct hts_worker_s *wk = arg;
+   const struct keymap_s *km = wk->km;
+   struct pack_in_s in;
+   struct tex_inflate_s ti;
+   struct tex_bufs_s bufs = { 0 };
+   struct hts_record_s rec;
+   const uint8_t *tex = NULL;
+   size_t tex_sz = 0;
+   int have_prev = 0;
+   struct out_s out = { .opts = wk->opts, .tar = wk->tar, .dd = wk->dd };
+
+   if (open_pack(&in, wk->filename) != 0)
+   {
+      wk->failed = 1;
+      goto out;
+   }
+
+   if (wk->tar != NULL && (out.tw = tar_writer_open(wk->tar)) == NULL)
+   {
+      pack_close(&in);
+      goto allocerr;
+   }
+
+   if (tex_inflate_init(&ti) != 0)
+   {
+      tar_writer_close(out.tw);
+      pack_close(&in);
+      goto allocerr;
+   }
+
+   for (size_t i = wk->first; i < wk->last; i++)
+   {
+      int ret;
+
+      __atomic_add_fetch(wk->done, 1, __ATOMIC_RELAXED);
+
+      if (wk->opts->verify)
+      {
+         /* Records shared by several CRCs are only verified once. */
+         if (i > wk->first && km->offset[i] == km->offset[i - 1])
+            continue;
+
+         ret = verify_record(&in, km->offset[i], km->crc[i], &ti, &bufs,
+                             &wk->bytes);
+
+         if (ret < 0)
+            goto allocerr_in;
+
+         wk->bad += ret;
+         continue;
+      }
+
+      /* Several CRCs may map to the same texture. Seeking back to it would
+       * restart inflation from the beginning of the pack, so reuse the
+       * texture that was just decoded instead. */
+      if (have_prev && km->offset[i] == km->offset[i - 1])
+      {
+         if (write_texture(&out, tex, tex_sz, km->crc[i], rec.w, rec.h) != 0)
+            wk->failed = 1;
+
+         continue;
+      }
+
+      ret = read_texture(&in, km->offset[i], km->crc[i], &ti, &bufs, &rec,
+                         &tex, &tex_sz);
+      have_prev = ret == 0;
+
+      if (ret < 0)
+         goto allocerr_in;
+
+      if (ret == 0 &&
+            write_texture(&out, tex, tex_sz, km->crc[i], rec.w, rec.h) != 0)
+         wk->failed = 1;
+   }
+
+   if (tar_writer_close(out.tw) != 0)
+      wk->failed = 1;
+
+   free(out.buf);
+   free_tex_bufs(&bufs);
+   tex_inflate_end(&ti);
+   pack_close(&in);
+   goto out;
+
+allocerr_in:
+   tar_writer_close(out.tw);
+   free(out.buf);
+   free_tex_bufs(&bufs);
+   tex_inflate_end(&ti);
+   pack_close(&in);
+allocerr:
+   fprintf(stderr, "Unable to reallocate memory.\n");
+   wk->failed = 1;
+
+out:
+   __atomic_add_fetch(wk->finished, 1, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+/**
+ * Dumps, or verifies, the records of an offset sorted key map in parallel.
+ * Each thread reads a contiguous range of the pack, so that reads within a
+ * thread remain sequential.
+ */
+int dump_keymap(const char *filename, const struct keymap_s *km,
+                const struct options_s *opts)
+{
+   struct hts_worker_s *workers;
+   pthread_t *threads;
+   struct tar_s *tar = NULL;
+   struct dedupe_s dd;
+   unsigned n_threads = opts->threads;
+   size_t done = 0;
+   unsigned finished = 0;
+   uint64_t start_time;
+   uint64_t progress_time;
+   uint64_t elapsed;
+   uint64_t bad = 0, bytes = 0;
+   int ret = EXIT_SUCCESS;
+
+   if (n_threads > km->n)
+      n_threads = km->n ? km->n : 1;
+
+   workers = calloc(n_threads, sizeof(*workers));
+   threads = calloc(n_threads, sizeof(*threads));
+
+   if (workers == NULL || threads == NULL)
+   {
+      fprintf(stderr, "Unable to reallocate memory.\n");
+      free(workers);
+      free(threads);
+      return EXIT_FAILURE;
+   }
+
+   if (opts->tar != NULL && !opts->verify &&
+         (tar = tar_create(opts->tar)) == NULL)
+   {
+      free(workers);
+      free(threads);
+      return EXIT_FAILURE;
+   }
+
+   fprintf(stdout, "%s %lu textures with %u threads\n",
+           opts->verify ? "Verifying" : "Dumping", km->n, n_threads);
+   fflush(stdout);
+   start_time = progress_time = now_ms();
+   dedupe_init(&dd);
+
+   for (unsigned t = 0; t < n_threads; t++)
+   {
+      workers[t].filename = filename;
+      workers[t].km = km;
+      workers[t].opts = opts;
+      workers[t].tar = tar;
+      workers[t].dd = opts->no_links || opts->verify ? NULL : &dd;
+      workers[t].first = km->n * t / n_threads;
+      workers[t].last = km->n * (t + 1) / n_threads;
+      workers[t].done = &done;
+      workers[t].finished = &finished;
+
+      if (pthread_create(&threads[t], NULL, dump_hts_worker,
+                         &workers[t]) != 0)
+      {
+         fprintf(stderr, "Unable to create thread.\n");
+         workers[t].failed = 1;
+         __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+         threads[t] = pthread_self();
+      }
+   }
+
+   /* Check for completion every 10 ms, and update progress every 200 ms. */
+   while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < n_threads)
+   {
+      const struct timespec delay = { 0, 10 * 1000 * 1000 };
+
+      nanosleep(&delay, NULL);
+
+      if (now_ms() - progress_time >= 200)
+      {
+         progress_time = now_ms();
+         fprintf(stdout, "%8lu\r", __atomic_load_n(&done, __ATOMIC_RELAXED));
+         fflush(stdout);
+      }
+   }
+
+   for (unsigned t = 0; t < n_threads; t++)
+   {
+      if (!pthread_equal(threads[t], pthread_self()))
+         pthread_join(threads[t], NULL);
+
+      if (workers[t].failed)
+         ret = EXIT_FAILURE;
+
+      bad += workers[t].bad;
+      bytes += workers[t].bytes;
+   }
+
+   elapsed = now_ms() - start_time;
+
+   if (opts->verify)
+   {
+      print_verify(bad, bytes, elapsed);
+
+      if (bad != 0)
+         ret = EXIT_FAILURE;
+   }
+   else
+   {
+      fprintf(stdout, "\nCompleted %lu textures in %.2f s "
+              "(%.0f textures/s)\n", km->n, elapsed / 1000.0,
+              elapsed ? km->n * 1000.0 / elapsed : 0.0);
+      print_dedupe(opts->no_links ? NULL : &dd);
+   }
+
+   dedupe_free(&dd);
+
+   if (finish_archive(tar, opts->tar) != 0)
+      ret = EXIT_FAILURE;
+
+   free(workers);
+   free(threads);
+   return ret;
+}
+
+int dump_hts(const char *hts_filename, const struct options_s *opts)
+{
+   struct pack_in_s in;
+   uint64_t keymap_off;
+   struct keymap_s km = { 0 };
+   unsigned n_threads = opts->threads;
+   uint64_t start_time;
+   int ret;
+
+   if (open_pack(&in, hts_filename) != 0)
+      return EXIT_FAILURE;
+
+   if (in.map != NULL)
+      fprintf(stdout, "Pack is not compressed, so it is read from memory\n");
+   else if (in.idx != NULL)
+      fprintf(stdout, "Using index with %zu checkpoints\n",
+              gzindex_n_points(in.idx));
+   else if (n_threads > 1 && gzindex_is_gzip(hts_filename))
+      fprintf(stdout, "No index found, so each thread must inflate the pack "
+              "up to its first texture. Use '-index' to build one.\n");
+
+   keymap_off = hts_keymap_offset(&in);
+
+   fprintf(stdout, "Reading key mappings\n");
+   fflush(stdout);
+   start_time = now_ms();
+
+   if (read_keymap(&in, hts_filename, keymap_off, &km) != 0)
+      goto allocerr;
+
+   pack_close(&in);
+
+   /* Sort by offset so that we can sequentially read the file later. */
+   if (sort_keymap(&km) != 0)
+      goto allocerr;
+
+   fprintf(stdout, "Read and sorted %lu key mappings in %lu ms\n", km.n,
+           now_ms() - start_time);
+
+   if (km.n == 0)
+   {
+      fprintf(stderr, "No key mappings could be read from %s\n",
+              hts_filename);
+      free_keymap(&km);
+      return EXIT_FAILURE;
+   }
+
+   ret = dump_keymap(hts_filename, &km, opts);
+   free_keymap(&km);
+   return ret;
+
+allocerr:
+   fprintf(stderr, "Unable to reallocate memory.\n");
+   free_keymap(&km);
+   pack_close(&in);
+   return EXIT_FAILURE;
+}
+
+/* A texture record sliced from a HTC pack, waiting to be decoded. */
+struct htc_slot_s
 {
-   uint64_t offset;
    uint64_t crc;
+   uint64_t offset;
+   int32_t w;
+   int32_t h;
+   uint32_t fmt;
+   enum pixfmt_e pf;
+   int32_t tex_sz;
+
+   /* Texture data as stored in the pack. This is either buf, or points into
+    * the mapping of a pack that is not compressed. */
+   const uint8_t *data;
+
+   uint8_t *buf;
+   size_t buf_sz;
+
+   /* Uncompressed texture data. */
+   uint8_t *dst;
+   size_t dst_sz;
+};
+
+/**
+ * Slots cycle between the free list and the queue of records waiting to be
+ * decoded. The reading thread fills free slots, and the decoding threads
+ * return them to the free list once the texture is written.
+ */
+struct htc_pipe_s
+{
+   struct htc_slot_s *slots;
+   unsigned n_slots;
+
+   unsigned *free_list;
+   unsigned n_free;
+
+   unsigned *queue;
+   unsigned queue_head;
+   unsigned queue_len;
+
+   const struct options_s *opts;
+
+   /* Archive that textures are written to instead of separate files. */
+   struct tar_s *tar;
+   struct dedupe_s *dd;
+
+   /* Records found to be corrupt, and the uncompressed bytes verified. */
+   uint64_t bad;
+   uint64_t bytes;
+
+   int eof;
+   int failed;
+
+   pthread_mutex_t lock;
+   pthread_cond_t free_cond;
+   pthread_cond_t queue_cond;
+};
+
+void *dump_htc_worker(void *arg)
+{
+   struct htc_pipe_s *p = arg;
+   struct tex_inflate_s ti;
+   /* 16-bit textures are expanded into rgba_buf. */
+   uint8_t *rgba_buf = NULL;
+   size_t rgba_buf_sz = 0;
+   int have_ti = tex_inflate_init(&ti) == 0;
+   struct out_s out = { .opts = p->opts, .tar = p->tar, .dd = p->dd };
+   /* A worker that could not be set up still consumes slots, so that the
+    * producer is never left waiting for a free one. */
+   int ready = have_ti;
+
+   if (p->tar != NULL && (out.tw = tar_writer_open(p->tar)) == NULL)
+      ready = 0;
+
+   if (!ready)
+   {
+      fprintf(stderr, "Unable to allocate memory.\n");
+      __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+   }
+
+   for (;;)
+   {
+      struct htc_slot_s *slot;
+      const uint8_t *tex;
+      size_t tex_sz;
+      uint64_t ev_start;
+      unsigned s;
+
+      pthread_mutex_lock(&p->lock);
+
+      while (p->queue_len == 0 && !p->eof)
+         pthread_cond_wait(&p->queue_cond, &p->lock);
+
+      if (p->queue_len == 0)
+      {
+         pthread_mutex_unlock(&p->lock);
+         break;
+      }
+
+      s = p->queue[p->queue_head];
+      p->queue_head = (p->queue_head + 1) % p->n_slots;
+      p->queue_len--;
+      pthread_mutex_unlock(&p->lock);
+
+      slot = &p->slots[s];
+
+      if (!ready)
+         goto release;
+
+      if (p->opts->verify)
+      {
+         struct hts_record_s rec = {
+            .w = slot->w, .h = slot->h, .fmt = slot->fmt, .pf = slot->pf,
+            .data_sz = slot->tex_sz
+         };
+         uint64_t bytes = 0;
+         int ret = verify_data(&rec, slot->data, slot->crc, slot->offset,
+                               &ti, &slot->dst, &slot->dst_sz, &bytes);
+
+         if (ret < 0)
+         {
+            fprintf(stderr, "Unable to reallocate memory.\n");
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+         }
+         else
+            __atomic_add_fetch(&p->bad, ret, __ATOMIC_RELAXED);
+
+         __atomic_add_fetch(&p->bytes, bytes, __ATOMIC_RELAXED);
+         goto release;
+      }
+
+      tex = slot->data;
+      tex_sz = slot->tex_sz;
+
+      /* If texture is zlib compressed, uncompress it. The producer has
+       * checked that the record has a valid size. */
+      if (slot->fmt & GL_TEXFMT_GZ)
+      {
+         size_t dst_len = (size_t)slot->w * (size_t)slot->h *
+                          pixfmt_bpp(slot->pf);
+
+         if (reserve_buf(&slot->dst, &slot->dst_sz, dst_len) != 0)
+         {
+            fprintf(stderr, "Unable to reallocate memory.\n");
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+            goto release;
+         }
+
+         ev_start = evtrace_begin();
+
+         if (tex_inflate(&ti, slot->dst, dst_len, &tex_sz, slot->data,
+                         slot->tex_sz) != 0)
+         {
+            fprintf(stderr, "zlib failure for texture at %lu\n",
+                    slot->offset);
+            goto release;
+         }
+
+         evtrace_end(EVTRACE_INFLATE, slot->crc, ev_start);
+
+         if (tex_sz != dst_len)
+         {
+            fprintf(stderr, "Texture at %lu inflated to %zu bytes instead of "
+                    "%zu\n", slot->offset, tex_sz, dst_len);
+            goto release;
+         }
+
+         tex = slot->dst;
+      }
+
+      ev_start = evtrace_begin();
+      tex = texture_rgba8(slot->pf, tex, &tex_sz,
+                          (size_t)slot->w * (size_t)slot->h, &rgba_buf,
+                          &rgba_buf_sz);
+      evtrace_end(EVTRACE_DECODE, slot->crc, ev_start);
+
+      if (tex != NULL)
+      {
+         if (write_texture(&out, tex, tex_sz, slot->crc, slot->w,
+                           slot->h) != 0)
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+      }
+      else
+         fprintf(stderr, "Unable to convert %s texture at %lu\n",
+                 pixfmt_name(slot->pf), slot->offset);
+
+release:
+      pthread_mutex_lock(&p->lock);
+      p->free_list[p->n_free++] = s;
+      pthread_cond_signal(&p->free_cond);
+      pthread_mutex_unlock(&p->lock);
+   }
+
+   if (have_ti)
+      tex_inflate_end(&ti);
+
+   if (tar_writer_close(out.tw) != 0)
+      __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+
+   free(out.buf);
+   free(rgba_buf);
+
+   return NULL;
+}
+
+/**
+ * Records are sliced from the mapping of a HTC pack that is not compressed.
+ * Compressed packs are inflated in parallel when more than one thread is
+ * used, and are otherwise read from a gzip stream.
+ */
+struct htc_src_s
+{
+   const uint8_t *map;
+   size_t map_sz;
+   size_t pos;
+   struct pgz_s *pgz;
+   gzFile gzfp;
 };
 
-void write_bmp(const uint8_t *bmp, size_t bmp_sz, uint64_t crc, size_t w,
-               size_t h)
+/**
+ * Returns a pointer to the next len bytes of the pack. They are only copied
+ * into buf if the pack is not mapped. Returns NULL at the end of the pack.
+ */
+const uint8_t *htc_next(struct htc_src_s *src, uint8_t *buf, size_t len)
+{
+   if (src->map != NULL)
+   {
+      if (len > src->map_sz - src->pos)
+         return NULL;
+
+      src->pos += len;
+      return src->map + src->pos - len;
+   }
+
+   if (src->pgz != NULL)
+   {
+      if (pgz_read(src->pgz, buf, len) != (long)len)
+         return NULL;
+   }
+   else if (gzread(src->gzfp, buf, len) != (int)len)
+      return NULL;
+
+   return buf;
+}
+
+/* Position within the uncompressed pack, and within the file. */
+uint64_t htc_tell(const struct htc_src_s *src)
+{
+   if (src->map != NULL)
+      return src->pos;
+
+   if (src->pgz != NULL)
+      return pgz_tell(src->pgz);
+
+   return gztell(src->gzfp);
+}
+
+uint64_t htc_offset(const struct htc_src_s *src)
+{
+   if (src->map != NULL)
+      return src->pos;
+
+   if (src->pgz != NULL)
+      return pgz_offset(src->pgz);
+
+   return gzoffset(src->gzfp);
+}
+
+void htc_src_close(struct htc_src_s *src)
+{
+   if (src->map != NULL)
+      pack_unmap(src->map, src->map_sz);
+   else if (src->pgz != NULL)
+      pgz_close(src->pgz);
+   else
+      gzclose(src->gzfp);
+}
+
+int dump_htc(const char *htc_filename, const struct options_s *opts)
+{
+   struct htc_src_s src = { 0 };
+   struct htc_pipe_s p = { .opts = opts };
+   struct dedupe_s dd;
+   pthread_t *threads;
+   unsigned n_threads = opts->threads;
+   unsigned n_started = 0;
+   size_t file_size;
+   size_t n_textures = 0;
+   uint64_t progress_time = now_ms();
+   uint64_t start_time = progress_time;
+   uint64_t elapsed;
+   int ret = EXIT_SUCCESS;
+   uint64_t ev_start = evtrace_begin();
+
+   src.map = pack_map(htc_filename, &src.map_sz);
+   file_size = src.map_sz;
+
+   if (src.map == NULL)
+   {
+      FILE *f = fopen(htc_filename, "rb");
+
+      if (f == NULL)
+      {
+         fprintf(stderr, "Unable to open input file.\n");
+         return EXIT_FAILURE;
+      }
+
+      fseek(f, 0, SEEK_END);
+      file_size = ftell(f);
+      fclose(f);
+
+      if (n_threads > 1)
+         src.pgz = pgz_open(htc_filename, n_threads);
+
+      if (src.pgz == NULL)
+         src.gzfp = gzopen(htc_filename, "rb");
+
+      if (src.pgz == NULL && src.gzfp == NULL)
+      {
+         fprintf(stderr, "gzip was unable to open the input file.\n");
+         return EXIT_FAILURE;
+      }
+   }
+
+   evtrace_end(EVTRACE_OPEN, 0, ev_start);
+
+   /* Enough slots to keep every decoding thread busy whilst the next
+    * records are read. */
+   p.n_slots = n_threads * 2 + 2;
+   p.slots = calloc(p.n_slots, sizeof(*p.slots));
+   p.free_list = calloc(p.n_slots, sizeof(*p.free_list));
+   p.queue = calloc(p.n_slots, sizeof(*p.queue));
+   threads = calloc(n_threads, sizeof(*threads));
+
+   if (p.slots == NULL || p.free_list == NULL || p.queue == NULL ||
+         threads == NULL)
+      goto allocerr;
+
+   if (opts->tar != NULL && !opts->verify &&
+         (p.tar = tar_create(opts->tar)) == NULL)
+   {
+      free(p.slots);
+      free(p.free_list);
+      free(p.queue);
+      free(threads);
+      htc_src_close(&src);
+      return EXIT_FAILURE;
+   }
+
+   for (unsigned i = 0; i < p.n_slots; i++)
+      p.free_list[p.n_free++] = i;
+
+   pthread_mutex_init(&p.lock, NULL);
+   pthread_cond_init(&p.free_cond, NULL);
+   pthread_cond_init(&p.queue_cond, NULL);
+   dedupe_init(&dd);
+   p.dd = opts->no_links || opts->verify ? NULL : &dd;
+
+   for (; n_started < n_threads; n_started++)
+   {
+      if (pthread_create(&threads[n_started], NULL, dump_htc_worker, &p) != 0)
+         break;
+   }
+
+   if (n_started == 0)
+   {
+      fprintf(stderr, "Unable to create thread.\n");
+      ret = EXIT_FAILURE;
+      p.eof = 1;
+   }
+
+   fprintf(stdout, "%s textures with %u threads\n",
+           opts->verify ? "Verifying" : "Dumping", n_started);
+   fflush(stdout);
+
+   if (src.map != NULL)
+      fprintf(stdout, "Pack is not compressed, so it is read from memory\n");
+   else if (src.pgz != NULL)
+      fprintf(stdout, "Inflating the pack with %u threads\n", n_threads);
+
+   /* Skip reading config. */
+   if (src.map != NULL)
+      src.pos = 4;
+   else if (src.pgz != NULL)
+      pgz_skip(src.pgz, 4);
+   else
+      gzseek(src.gzfp, 4, SEEK_CUR);
+
+   /* This thread only inflates the pack and slices it into records. */
+   while (!p.eof)
+   {
+      uint8_t hdr_buf[HTC_RECORD_HDR_SZ];
+      const uint8_t *hdr;
+      struct htc_slot_s *slot;
+      uint64_t offset = htc_tell(&src);
+      struct hts_record_s rec;
+      uint64_t ev_start;
+      unsigned s;
+
+      hdr = htc_next(&src, hdr_buf, sizeof(hdr_buf));
+
+      if (hdr == NULL)
+         break;
+
+      ev_start = evtrace_begin();
+      hts_parse_record(&rec, hdr + 8);
+
+      /* The size of the record is checked before anything is allocated for
+       * it. A record with an invalid size cannot be skipped, as the start of
+       * the next record is unknown. */
+      if (hts_record_size(&rec) == 0)
+      {
+         fprintf(stderr, "Texture at %lu has an invalid size.\n", offset);
+         __atomic_add_fetch(&p.bad, 1, __ATOMIC_RELAXED);
+         break;
+      }
+
+      pthread_mutex_lock(&p.lock);
+
+      while (p.n_free == 0)
+         pthread_cond_wait(&p.free_cond, &p.lock);
+
+      s = p.free_list[--p.n_free];
+      pthread_mutex_unlock(&p.lock);
+
+      slot = &p.slots[s];
+      slot->offset = offset;
+      memcpy(&slot->crc, hdr + 0, 8);
+      slot->w = rec.w;
+      slot->h = rec.h;
+      slot->fmt = rec.fmt;
+      slot->pf = rec.pf;
+      slot->tex_sz = rec.data_sz;
+
+      if (src.map == NULL &&
+            reserve_buf(&slot->buf, &slot->buf_sz, slot->tex_sz) != 0)
+      {
+         fprintf(stderr, "Unable to reallocate memory.\n");
+         ret = EXIT_FAILURE;
+         break;
+      }
+
+      slot->data = htc_next(&src, slot->buf, slot->tex_sz);
+
+      if (slot->data == NULL)
+      {
+         fprintf(stderr, "Texture at %lu is truncated.\n", offset);
+         __atomic_add_fetch(&p.bad, 1, __ATOMIC_RELAXED);
+
+         pthread_mutex_lock(&p.lock);
+         p.free_list[p.n_free++] = s;
+         pthread_mutex_unlock(&p.lock);
+         break;
+      }
+
+      evtrace_end(EVTRACE_PARSE, slot->crc, ev_start);
+
+      /* Verification checks the records of every format. */
+      if (!opts->verify && rec.pf == PIXFMT_UNKNOWN)
+      {
+         fprintf(stderr, "Texture format at %lu not supported.\n", offset);
+
+         pthread_mutex_lock(&p.lock);
+         p.free_list[p.n_free++] = s;
+         pthread_mutex_unlock(&p.lock);
+         continue;
+      }
+
+      pthread_mutex_lock(&p.lock);
+      p.queue[(p.queue_head + p.queue_len) % p.n_slots] = s;
+      p.queue_len++;
+      pthread_cond_signal(&p.queue_cond);
+      pthread_mutex_unlock(&p.lock);
+      n_textures++;
+
+      /* Update progress every 200 ms. */
+      if (now_ms() - progress_time >= 200)
+      {
+         uint64_t read = htc_offset(&src);
+
+         progress_time = now_ms();
+         fprintf(stdout, "%4.2f\r", ((float)read / file_size) * 100.0f);
+         fflush(stdout);
+      }
+   }
+
+   if (src.pgz != NULL)
+   {
+      const char *msg = pgz_error(src.pgz);
+
+      if (msg != NULL)
+      {
+         fprintf(stderr, "gzip stream is corrupt after %lu bytes: %s\n",
+                 htc_tell(&src), msg);
+         __atomic_add_fetch(&p.bad, 1, __ATOMIC_RELAXED);
+      }
+   }
+   else if (src.map == NULL)
+   {
+      int err;
+      const char *msg = gzerror(src.gzfp, &err);
+
+      if (err != Z_OK)
+      {
+         fprintf(stderr, "gzip stream is corrupt after %lu bytes: %s\n",
+                 (size_t)gztell(src.gzfp), msg);
+         __atomic_add_fetch(&p.bad, 1, __ATOMIC_RELAXED);
+      }
+   }
+
+   pthread_mutex_lock(&p.lock);
+   p.eof = 1;
+   pthread_cond_broadcast(&p.queue_cond);
+   pthread_mutex_unlock(&p.lock);
+
+   for (unsigned t = 0; t < n_started; t++)
+      pthread_join(threads[t], NULL);
+
+   if (p.failed)
+      ret = EXIT_FAILURE;
+
+   elapsed = now_ms() - start_time;
+
+   if (opts->verify)
+   {
+      print_verify(p.bad, p.bytes, elapsed);
+
+      if (p.bad != 0)
+         ret = EXIT_FAILURE;
+   }
+   else
+   {
+      fprintf(stdout, "\nCompleted %lu textures in %.2f s "
+              "(%.0f textures/s)\n", n_textures, elapsed / 1000.0,
+              elapsed ? n_textures * 1000.0 / elapsed : 0.0);
+      print_dedupe(p.dd);
+   }
+
+   if (src.pgz != NULL)
+   {
+      size_t n_chunks, n_serial;
+
+      pgz_stats(src.pgz, &n_chunks, &n_serial);
+      fprintf(stdout, "Inflated %lu chunks in parallel, %lu of which were "
+              "inflated again\n", n_chunks - n_serial, n_serial);
+   }
+
+   if (finish_archive(p.tar, opts->tar) != 0)
+      ret = EXIT_FAILURE;
+
+   for (unsigned i = 0; i < p.n_slots; i++)
+   {
+      free(p.slots[i].buf);
+      free(p.slots[i].dst);
+   }
+
+   pthread_mutex_destroy(&p.lock);
+   pthread_cond_destroy(&p.free_cond);
+   pthread_cond_destroy(&p.queue_cond);
+   dedupe_free(&dd);
+   free(p.slots);
+   free(p.free_list);
+   free(p.queue);
+   free(threads);
+   htc_src_close(&src);
+   return ret;
+
+allocerr:
+   fprintf(stderr, "Unable to allocate memory.\n");
+   free(p.slots);
+   free(p.free_list);
+   free(p.queue);
+   free(threads);
+   htc_src_close(&src);
+   return EXIT_FAILURE;
+}
+
+/**
+ * Builds a key map of the records of a HTC pack, in the order of the pack,
+ * from its index or by walking the records of a pack that is not compressed.
+ */
+int htc_keymap(struct pack_in_s *in, struct keymap_s *km)
+{
+   const struct gzindex_entry_s *e = NULL;
+   size_t n = 0;
+
+   if (in->idx != NULL)
+      e = gzindex_entries(in->idx, &n);
+   else
+   {
+      /* Count the records first, as walking a mapping is cheap. */
+      for (uint64_t off = 4; off + HTC_RECORD_HDR_SZ <= in->map_sz; n++)
+      {
+         int32_t tex_sz;
+
+         memcpy(&tex_sz, in->map + off + 25, 4);
+         off += HTC_RECORD_HDR_SZ + (uint32_t)tex_sz;
+      }
+   }
+
+   km->n = n;
+   km->offset = malloc(n * sizeof(*km->offset) + 1);
+   km->crc = malloc(n * sizeof(*km->crc) + 1);
+
+   if (km->offset == NULL || km->crc == NULL)
+   {
+      free_keymap(km);
+      return -1;
+   }
+
+   if (e != NULL)
+   {
+      for (size_t i = 0; i < n; i++)
+      {
+         km->offset[i] = e[i].offset + 8;
+         km->crc[i] = e[i].key;
+      }
+
+      return 0;
+   }
+
+   /* Skip reading config. */
+   for (size_t i = 0, off = 4; i < n; i++)
+   {
+      int32_t tex_sz;
+
+      memcpy(&km->crc[i], in->map + off, 8);
+      memcpy(&tex_sz, in->map + off + 25, 4);
+      km->offset[i] = off + 8;
+      off += HTC_RECORD_HDR_SZ + (uint32_t)tex_sz;
+   }
+
+   return 0;
+}
+
+/**
+ * Verifies every record of a pack in parallel. HTS packs, and HTC packs that
+ * are indexed or not compressed, are split between threads by offset. Other
+ * HTC packs are inflated by one thread, which hands records to the others.
+ */
+int verify_pack(const char *filename, int is_htc, const struct options_s *opts)
 {
-   static unsigned char argb_bmp[] =
+   struct pack_in_s in;
+   struct keymap_s km = { 0 };
+   int ret;
+
+   if (!is_htc)
+      return dump_hts(filename, opts);
+
+   if (open_pack(&in, filename) != 0)
+      return EXIT_FAILURE;
+
+   if (in.idx == NULL && in.map == NULL)
    {
-      0x42, 0x4d, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x8a, 0x00,
-      0x00, 0x00, 0x7c, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00,
-      0x00, 0x00, 0x01, 0x00, 0x20, 0x00, 0x03, 0x00, 0x00, 0x00, 0x04, 0x00,
-      0x00, 0x00, 0x13, 0x0b, 0x00, 0x00, 0x13, 0x0b, 0x00, 0x00, 0x00, 0x00,
-      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0xff,
-      0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x42, 0x47,
-      0x52, 0x73, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-      0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-      0x00, 0x00, 0x00, 0x00, 0x00, 0x00
-   };
-   FILE *f;
-   char out[32];
-   snprintf(out, sizeof(out), "%016lX.bmp", crc);
+      pack_close(&in);
+      return dump_htc(filename, opts);
+   }
 
-   size_t size = h * (w * 4) + sizeof(argb_bmp);
-   argb_bmp[2] = size >>  0;
-   argb_bmp[3] = size >>  8;
-   argb_bmp[4] = size >> 16;
-   argb_bmp[5] = size >> 24;
+   if (in.idx != NULL)
+      fprintf(stdout, "Using index with %zu checkpoints\n",
+              gzindex_n_points(in.idx));
 
-   argb_bmp[18] = w >>  0;
-   argb_bmp[19] = w >>  8;
-   argb_bmp[20] = w >> 16;
-   argb_bmp[21] = w >> 24;
+   if (htc_keymap(&in, &km) != 0)
+   {
+      fprintf(stderr, "Unable to reallocate memory.\n");
+      pack_close(&in);
+      return EXIT_FAILURE;
+   }
 
-   argb_bmp[22] = -h >>  0;
-   argb_bmp[23] = -h >>  8;
-   argb_bmp[24] = -h >> 16;
-   argb_bmp[25] = -h >> 24;
+   pack_close(&in);
+   ret = dump_keymap(filename, &km, opts);
+   free_keymap(&km);
+   return ret;
+}
 
-   f = fopen(out, "wb");
-   fwrite(argb_bmp, 1, sizeof(argb_bmp), f);
-   fwrite(bmp, 1, bmp_sz, f);
-   fclose(f);
+/* A requested key and the offset of its record within the pack. */
+struct extract_s
+{
+   uint64_t crc;
+   uint64_t offset;
+};
+
+int compare_u64(const void *in1, const void *in2)
+{
+   const uint64_t *a = in1;
+   const uint64_t *b = in2;
+
+   return (*a > *b) - (*a < *b);
 }
 
-int compare_offset(const void *in1, const void *in2)
+int compare_extract_offset(const void *in1, const void *in2)
 {
-   const struct mapping_s *m1 = in1;
-   const struct mapping_s *m2 = in2;
+   const struct extract_s *a = in1;
+   const struct extract_s *b = in2;
 
-   return m1->offset - m2->offset;
+   return (a->offset > b->offset) - (a->offset < b->offset);
 }
 
-int dump_hts(const char *hts_filename)
+/**
+ * Parses a comma separated list of hexadecimal CRCs into a sorted array
+ * without duplicates. Returns NULL if the list is not valid.
+ */
+uint64_t *parse_crc_list(const char *list, size_t *n)
 {
-   gzFile gzfp = gzopen(hts_filename, "rb");
-   uint64_t keymap_off;
-   struct mapping_s *map = NULL;
-   size_t map_nmemb = 0;
-   size_t map_sz = 1024;
-   uint8_t *texture_buf = NULL;
-   size_t texture_buf_sz = 1 * 1024 * 1024;
-   clock_t start_time = clock();
+   size_t alloc = 1;
+   uint64_t *crcs;
+   size_t out = 0;
+
+   for (const char *c = list; *c != '\0'; c++)
+      alloc += *c == ',';
+
+   crcs = malloc(alloc * sizeof(*crcs));
+
+   if (crcs == NULL)
+      return NULL;
+
+   *n = 0;
 
-   if (gzfp == NULL)
+   for (const char *c = list; ; c++)
    {
-      fprintf(stderr, "gzip was unable to open the input file.\n");
-      return EXIT_FAILURE;
+      char *end;
+
+      if (!isxdigit((unsigned char)*c))
+         goto err;
+
+      crcs[(*n)++] = strtoull(c, &end, 16);
+
+      if (*end == '\0')
+         break;
+
+      if (*end != ',')
+         goto err;
+
+      c = end;
    }
 
-   map = calloc(map_sz, sizeof(*map));
-   texture_buf = malloc(texture_buf_sz);
+   qsort(crcs, *n, sizeof(*crcs), compare_u64);
 
-   if (map == NULL || texture_buf == NULL)
+   for (size_t i = 0; i < *n; i++)
    {
-      fprintf(stderr, "Unable to allocate memory.\n");
-      return EXIT_FAILURE;
+      if (out == 0 || crcs[out - 1] != crcs[i])
+         crcs[out++] = crcs[i];
    }
 
-   /* Skip reading config. */
-   gzseek(gzfp, 4, SEEK_CUR);
+   *n = out;
+   return crcs;
 
-   gzread(gzfp, &keymap_off, 8);
-   gzseek(gzfp, keymap_off, SEEK_CUR);
+err:
+   fprintf(stderr, "'%s' is not a comma separated list of hexadecimal "
+           "CRCs.\n", list);
+   free(crcs);
+   return NULL;
+}
 
-   fprintf(stdout, "Reading key mappings\n");
-   fflush(stdout);
+/**
+ * Records the offset of crc if it is within the sorted list and has not
+ * already been found. Returns 1 if it was recorded.
+ */
+int crc_found(const uint64_t *crcs, size_t n, uint64_t *offsets,
+              uint64_t crc, uint64_t offset)
+{
+   const uint64_t *c = bsearch(&crc, crcs, n, sizeof(*crcs), compare_u64);
+
+   if (c == NULL || offsets[c - crcs] != UINT64_MAX)
+      return 0;
 
-   while (gzeof(gzfp) != 1)
+   offsets[c - crcs] = offset;
+   return 1;
+}
+
+/**
+ * Finds the records of the requested keys, setting the offset of the HTS
+ * part of each record found and UINT64_MAX otherwise. HTS packs are searched
+ * through their key map, and HTC packs through the texture offsets of their
+ * index. HTC packs without an index have their record headers read in turn
+ * until every key has been found. Returns the number of keys found, or -1 if
+ * memory could not be allocated.
+ */
+long find_records(struct pack_in_s *in, const char *filename, int is_htc,
+                  const uint64_t *crcs, size_t n_crcs, uint64_t *offsets)
+{
+   size_t n_found = 0;
+
+   for (size_t i = 0; i < n_crcs; i++)
+      offsets[i] = UINT64_MAX;
+
+   if (!is_htc)
+   {
+      struct keymap_s km = { 0 };
+
+      if (read_keymap(in, filename, hts_keymap_offset(in), &km) != 0)
+         return -1;
+
+      for (size_t i = 0; i < km.n && n_found < n_crcs; i++)
+         n_found += crc_found(crcs, n_crcs, offsets, km.crc[i], km.offset[i]);
+
+      free_keymap(&km);
+   }
+   else if (in->idx != NULL)
    {
-      gzread(gzfp, &map[map_nmemb].offset, sizeof(map[map_nmemb].offset));
-      gzread(gzfp, &map[map_nmemb].crc, sizeof(map[map_nmemb].crc));
+      size_t n;
+      const struct gzindex_entry_s *e = gzindex_entries(in->idx, &n);
 
-      map_nmemb++;
+      for (size_t i = 0; i < n && n_found < n_crcs; i++)
+         n_found += crc_found(crcs, n_crcs, offsets, e[i].key,
+                              e[i].offset + 8);
+   }
+   else
+   {
+      uint8_t hdr[HTC_RECORD_HDR_SZ];
 
-      if (map_nmemb >= map_sz)
+      /* Skip reading config. */
+      for (uint64_t off = 4; n_found < n_crcs &&
+            pack_pread(in, off, hdr, sizeof(hdr)) == sizeof(hdr); )
       {
-         map_sz <<= 1;
-         map = realloc(map, map_sz * sizeof(*map));
+         uint64_t crc;
+         int32_t tex_sz;
 
-         if (map == NULL)
-            goto allocerr;
+         memcpy(&crc, hdr, 8);
+         memcpy(&tex_sz, hdr + 25, 4);
+         n_found += crc_found(crcs, n_crcs, offsets, crc, off + 8);
+         off += HTC_RECORD_HDR_SZ + (uint32_t)tex_sz;
       }
    }
 
-   /* Sort by offset so that we can sequentially read the file later. */
-   qsort(map, map_nmemb, sizeof(*map), compare_offset);
+   return n_found;
+}
 
-   fprintf(stdout, "Dumping %lu textures\n", map_nmemb);
+/**
+ * Writes only the textures mapped to the requested keys, reading the pack at
+ * their offsets.
+ */
+int extract_crcs(const char *filename, int is_htc,
+                 const struct options_s *opts)
+{
+   struct out_s out = { .opts = opts };
+   struct pack_in_s in;
+   struct tex_inflate_s ti;
+   struct tex_bufs_s bufs = { 0 };
+   struct extract_s *found;
+   uint64_t *crcs, *offsets;
+   size_t n_crcs, n_found = 0, n_written = 0;
+   uint64_t start_time, elapsed;
+   long n;
+   int ret = EXIT_SUCCESS;
+
+   crcs = parse_crc_list(opts->crc_list, &n_crcs);
+
+   if (crcs == NULL)
+      return EXIT_FAILURE;
 
-   for (uint64_t i = 0; i < map_nmemb; i++)
+   offsets = malloc(n_crcs * sizeof(*offsets));
+   found = malloc(n_crcs * sizeof(*found));
+
+   if (offsets == NULL || found == NULL || tex_inflate_init(&ti) != 0)
    {
-      int32_t w, h;
-      uint32_t fmt;
-      const uint8_t fmt_len = 5;
-      size_t dst_len;
-      int32_t tex_sz;
+      fprintf(stderr, "Unable to reallocate memory.\n");
+      free(offsets);
+      free(found);
+      free(crcs);
+      return EXIT_FAILURE;
+   }
 
-      gzseek(gzfp, map[i].offset, SEEK_SET);
-      gzread(gzfp, &w, 4);
-      gzread(gzfp, &h, 4);
-      gzread(gzfp, &fmt, 4);
-      gzseek(gzfp, fmt_len, SEEK_CUR);
-      gzread(gzfp, &tex_sz, 4);
-      dst_len = (size_t)h * (size_t)w * sizeof(uint32_t);
+   if (open_pack(&in, filename) != 0)
+   {
+      ret = EXIT_FAILURE;
+      goto out;
+   }
 
-      if (dst_len > texture_buf_sz)
-      {
-         while (dst_len > texture_buf_sz)
-            texture_buf_sz <<= 1;
+   if (opts->tar != NULL && (out.tar = tar_create(opts->tar)) == NULL)
+   {
+      ret = EXIT_FAILURE;
+      goto out_pack;
+   }
 
-         texture_buf = realloc(texture_buf, texture_buf_sz);
+   if (out.tar != NULL && (out.tw = tar_writer_open(out.tar)) == NULL)
+   {
+      fprintf(stderr, "Unable to reallocate memory.\n");
+      ret = EXIT_FAILURE;
+      goto out_tar;
+   }
 
-         if (texture_buf == NULL)
-         {
-            free(map);
-            goto allocerr;
-         }
-      }
+   if (in.idx != NULL)
+      fprintf(stdout, "Using index with %zu checkpoints\n",
+              gzindex_n_points(in.idx));
+
+   start_time = now_us();
+   n = find_records(&in, filename, is_htc, crcs, n_crcs, offsets);
+
+   if (n < 0)
+   {
+      fprintf(stderr, "Unable to reallocate memory.\n");
+      ret = EXIT_FAILURE;
+      goto out_tar;
+   }
 
-      gzread(gzfp, texture_buf, tex_sz);
+   fprintf(stdout, "Found %ld of %lu textures in %.3f ms\n", n, n_crcs,
+           (now_us() - start_time) / 1000.0);
 
-      if ((size_t)tex_sz > w * h * sizeof(uint32_t))
+   for (size_t i = 0; i < n_crcs; i++)
+   {
+      if (offsets[i] == UINT64_MAX)
       {
-         fprintf(stderr, "Texture format at %lu not supported.\n",
-                 map[i].offset);
+         fprintf(stderr, "%016lX not found\n", crcs[i]);
+         ret = EXIT_FAILURE;
          continue;
       }
 
-      /* If texture is zlib compressed, uncompress it. */
-      if (fmt & GL_TEXFMT_GZ)
-      {
-         uint8_t *dst = malloc(dst_len);
-
-         if (dst == NULL)
-         {
-            free(map);
-            goto allocerr;
-         }
+      found[n_found].crc = crcs[i];
+      found[n_found].offset = offsets[i];
+      n_found++;
+   }
 
-         if (uncompress(dst, &dst_len, texture_buf, tex_sz) != Z_OK)
-            fprintf(stderr, "zlib failure for texture at %lu\n", map[i].offset);
-         else
-            memcpy(texture_buf, dst, dst_len);
+   /* Read in the order of the pack, so that inflation only moves forward
+    * between textures that share a checkpoint. */
+   qsort(found, n_found, sizeof(*found), compare_extract_offset);
+   start_time = now_us();
 
-         tex_sz = dst_len;
-         free(dst);
+   for (size_t f = 0; f < n_found; f++)
+   {
+      struct hts_record_s rec;
+      const uint8_t *tex;
+      size_t tex_sz;
+      uint64_t t0 = now_us();
+      int r = read_texture(&in, found[f].offset, found[f].crc, &ti, &bufs,
+                           &rec, &tex, &tex_sz);
+
+      if (r < 0)
+      {
+         fprintf(stderr, "Unable to reallocate memory.\n");
+         ret = EXIT_FAILURE;
+         break;
       }
 
-      write_bmp(texture_buf, tex_sz, map[i].crc, w, h);
+      if (r != 0)
+      {
+         ret = EXIT_FAILURE;
+         continue;
+      }
 
-      /* Update progress every 200 ms. */
-      if ((clock() - start_time) / (CLOCKS_PER_SEC / 1000) >= 200)
+      if (write_texture(&out, tex, tex_sz, found[f].crc, rec.w, rec.h) != 0)
       {
-         start_time = clock();
-         fprintf(stdout, "%8lu\r", i);
-         fflush(stdout);
+         ret = EXIT_FAILURE;
+         continue;
       }
+
+      n_written++;
+      fprintf(stdout, "%016lX  %5dx%-5d %-8s %8.3f ms\n", found[f].crc,
+              rec.w, rec.h, pixfmt_name(rec.pf), (now_us() - t0) / 1000.0);
    }
 
-   fprintf(stdout, "\nCompleted\n");
-   free(texture_buf);
-   free(map);
-   gzclose(gzfp);
-   return EXIT_SUCCESS;
+   elapsed = now_us() - start_time;
+   fprintf(stdout, "Extracted %lu textures in %.3f ms\n", n_written,
+           elapsed / 1000.0);
 
-allocerr:
-   fprintf(stderr, "Unable to reallocate memory.\n");
-   gzclose(gzfp);
-   return EXIT_FAILURE;
+out_tar:
+   if (tar_writer_close(out.tw) != 0)
+      ret = EXIT_FAILURE;
+
+   if (finish_archive(out.tar, opts->tar) != 0)
+      ret = EXIT_FAILURE;
+
+out_pack:
+   pack_close(&in);
+
+out:
+   free(out.buf);
+   free_tex_bufs(&bufs);
+   tex_inflate_end(&ti);
+   free(offsets);
+   free(found);
+   free(crcs);
+   return ret;
 }
 
-int dump_htc(const char *htc_filename)
+/* Totals over every texture listed by list_pack(). */
+struct list_totals_s
 {
-   gzFile gzfp;
-   uint8_t *texture_buf = NULL;
-   size_t texture_buf_sz = 1 * 1024 * 1024;
-   size_t file_size;
-   clock_t start_time = clock();
+   size_t n;
+   size_t n_compressed;
+   size_t n_fmt[PIXFMT_RGBA4444 + 1];
+   uint64_t stored_bytes;
+   uint64_t decoded_bytes;
+};
+
+void list_record(FILE *f, int json, uint64_t crc, uint64_t offset,
+                 const struct hts_record_s *rec, struct list_totals_s *t)
+{
+   int gz = (rec->fmt & GL_TEXFMT_GZ) != 0;
+   uint64_t decoded = (uint64_t)rec->w * rec->h * pixfmt_bpp(rec->pf);
+
+   if (json)
+      fprintf(f, "%s\n{\"crc\":\"%016lX\",\"offset\":%lu,\"width\":%d,"
+              "\"height\":%d,\"format\":\"%s\",\"gl_format\":\"0x%04X\","
+              "\"gl_type\":\"0x%04X\",\"compressed\":%s,\"stored\":%d,"
+              "\"decoded\":%lu}", t->n ? "," : "", crc, offset, rec->w, rec->h,
+              pixfmt_name(rec->pf), rec->fmt & ~GL_TEXFMT_GZ, rec->pixtype,
+              gz ? "true" : "false", rec->data_sz, decoded);
+   else
+      fprintf(f, "%016lX,%lu,%d,%d,%s,0x%04X,0x%04X,%d,%d,%lu\n", crc, offset,
+              rec->w, rec->h, pixfmt_name(rec->pf), rec->fmt & ~GL_TEXFMT_GZ,
+              rec->pixtype, gz, rec->data_sz, decoded);
+
+   t->n++;
+   t->n_compressed += gz;
+   t->n_fmt[rec->pf]++;
+   t->stored_bytes += (uint32_t)rec->data_sz;
+   t->decoded_bytes += decoded;
+}
+
+/**
+ * Lists the record header of every texture without reading the texture data.
+ * HTS records are read in the order of the offset sorted key map, and HTC
+ * records in the order of the pack.
+ */
+int list_pack(const char *filename, int is_htc, int json)
+{
+   struct pack_in_s in;
+   struct list_totals_s t = { 0 };
+   uint64_t start_time = now_ms();
+   int ret = EXIT_SUCCESS;
 
+   if (open_pack(&in, filename) != 0)
+      return EXIT_FAILURE;
+
+   if (json)
+      fputs("{\"textures\":[", stdout);
+   else
+      fputs("crc,offset,width,height,format,gl_format,gl_type,compressed,"
+            "stored,decoded\n", stdout);
+
+   if (!is_htc)
    {
-      FILE *f = fopen(htc_filename, "rb");
+      struct keymap_s km = { 0 };
+      struct hts_record_s rec;
+      int have_rec = 0;
 
-      if (f == NULL)
+      if (read_keymap(&in, filename, hts_keymap_offset(&in), &km) != 0 ||
+            sort_keymap(&km) != 0)
       {
-         fprintf(stderr, "Unable to open input file.\n");
+         fprintf(stderr, "Unable to reallocate memory.\n");
+         free_keymap(&km);
+         pack_close(&in);
          return EXIT_FAILURE;
       }
 
-      fseek(f, 0, SEEK_END);
-      file_size = ftell(f);
-      fclose(f);
+      for (size_t i = 0; i < km.n; i++)
+      {
+         uint8_t hdr[HTS_RECORD_HDR_SZ];
+
+         /* Keys that map to the same record share its header. */
+         if (i == 0 || km.offset[i] != km.offset[i - 1])
+         {
+            have_rec = pack_pread(&in, km.offset[i], hdr, sizeof(hdr)) ==
+                       sizeof(hdr);
+
+            if (have_rec)
+               hts_parse_record(&rec, hdr);
+            else
+            {
+               fprintf(stderr, "Unable to read texture at %lu\n",
+                       km.offset[i]);
+               ret = EXIT_FAILURE;
+            }
+         }
+
+         if (!have_rec)
+            continue;
+
+         list_record(stdout, json, km.crc[i], km.offset[i], &rec, &t);
+      }
+
+      free_keymap(&km);
+   }
+   else
+   {
+      uint8_t hdr[HTC_RECORD_HDR_SZ];
+
+      /* Skip reading config. */
+      for (uint64_t off = 4;
+            pack_pread(&in, off, hdr, sizeof(hdr)) == sizeof(hdr); )
+      {
+         struct hts_record_s rec;
+         uint64_t crc;
+
+         memcpy(&crc, hdr, 8);
+         hts_parse_record(&rec, hdr + 8);
+         list_record(stdout, json, crc, off + 8, &rec, &t);
+         off += HTC_RECORD_HDR_SZ + (uint32_t)rec.data_sz;
+      }
    }
 
-   gzfp = gzopen(htc_filename, "rb");
+   pack_close(&in);
 
-   if (gzfp == NULL)
+   if (json)
    {
-      fprintf(stderr, "gzip was unable to open the input file.\n");
-      return EXIT_FAILURE;
+      fprintf(stdout, "\n],\"summary\":{\"textures\":%lu,\"compressed\":%lu,"
+              "\"stored_bytes\":%lu,\"decoded_bytes\":%lu,\"formats\":{",
+              t.n, t.n_compressed, t.stored_bytes, t.decoded_bytes);
+
+      for (unsigned f = 0, first = 1; f <= PIXFMT_RGBA4444; f++)
+      {
+         if (t.n_fmt[f] == 0)
+            continue;
+
+         fprintf(stdout, "%s\"%s\":%lu", first ? "" : ",",
+                 pixfmt_name(f), t.n_fmt[f]);
+         first = 0;
+      }
+
+      fputs("}}}\n", stdout);
    }
 
-   texture_buf = malloc(texture_buf_sz);
+   /* The summary goes to stderr, so that stdout may be parsed as is. */
+   fprintf(stderr, "%lu textures (%lu compressed), %.1f MiB stored, %.1f MiB "
+           "decoded, listed in %lu ms\n", t.n, t.n_compressed,
+           t.stored_bytes / (1024.0 * 1024.0),
+           t.decoded_bytes / (1024.0 * 1024.0), now_ms() - start_time);
 
-   if (texture_buf == NULL)
-      goto allocerr;
+   return ret;
+}
 
-   /* Skip reading config. */
-   gzseek(gzfp, 4, SEEK_CUR);
+/* State for finding HTC records whilst the index is being built. */
+struct htc_scan_s
+{
+   uint64_t next;
+   uint8_t hdr[HTC_RECORD_HDR_SZ];
+   size_t hdr_have;
+   int failed;
+};
+
+void htc_scan(void *ctx, struct gzindex_s *idx, uint64_t offset,
+              const uint8_t *data, size_t len)
+{
+   struct htc_scan_s *s = ctx;
+   uint64_t end = offset + len;
 
-   while (gzeof(gzfp) != 1)
+   /* Record headers may be split between runs of data. */
+   while (s->next + s->hdr_have < end)
    {
-      int32_t w, h;
-      uint32_t fmt;
+      uint64_t pos = s->next + s->hdr_have;
+      size_t take = HTC_RECORD_HDR_SZ - s->hdr_have;
       uint64_t crc;
-      const uint8_t fmt_len = 5;
       int32_t tex_sz;
-      size_t dst_len;
 
-      gzread(gzfp, &crc, 8);
-      gzread(gzfp, &w, 4);
-      gzread(gzfp, &h, 4);
-      gzread(gzfp, &fmt, 4);
-      gzseek(gzfp, fmt_len, SEEK_CUR);
-      gzread(gzfp, &tex_sz, 4);
+      if (take > end - pos)
+         take = end - pos;
 
-      dst_len = (size_t)w * (size_t)h * sizeof(uint32_t);
+      memcpy(s->hdr + s->hdr_have, data + (pos - offset), take);
+      s->hdr_have += take;
 
-      while (dst_len > texture_buf_sz)
-      {
-         texture_buf_sz <<= 1;
-         texture_buf = realloc(texture_buf, texture_buf_sz);
+      if (s->hdr_have < HTC_RECORD_HDR_SZ)
+         break;
 
-         if (texture_buf == NULL)
-            goto allocerr;
-      }
+      memcpy(&crc, s->hdr, 8);
+      memcpy(&tex_sz, s->hdr + 25, 4);
 
-      gzread(gzfp, texture_buf, tex_sz);
+      if (gzindex_add_entry(idx, crc, s->next) != 0)
+         s->failed = 1;
 
-      if ((size_t)tex_sz > (size_t)w * (size_t)h * sizeof(uint32_t))
-      {
-         fprintf(stderr, "Texture format at %lu not supported.\n",
-                 gztell(gzfp));
-         continue;
-      }
+      s->next += HTC_RECORD_HDR_SZ + (uint32_t)tex_sz;
+      s->hdr_have = 0;
+   }
+}
 
-      /* If texture is zlib compressed, uncompress it. */
-      if (fmt & GL_TEXFMT_GZ)
-      {
-         uint8_t *dst = malloc(dst_len);
+int build_index(const char *filename, int is_htc)
+{
+   struct gzindex_s *idx;
+   struct htc_scan_s scan = { .next = 4 };
+   clock_t start_time = clock();
 
-         if (dst == NULL)
-            goto allocerr;
+   if (!gzindex_is_gzip(filename))
+   {
+      fprintf(stderr, "%s is not gzip compressed, so no index is required.\n",
+              filename);
+      return EXIT_FAILURE;
+   }
 
-         if (uncompress(dst, &dst_len, texture_buf, tex_sz) != Z_OK)
-            fprintf(stderr, "zlib failure for texture at %lu\n", gztell(gzfp));
-         else
-            memcpy(texture_buf, dst, dst_len);
+   fprintf(stdout, "Building index\n");
+   fflush(stdout);
 
-         tex_sz = dst_len;
-         free(dst);
-      }
+   idx = gzindex_build(filename, GZINDEX_DEFAULT_SPAN,
+                       is_htc ? htc_scan : NULL, &scan);
 
-      write_bmp(texture_buf, tex_sz, crc, w, h);
+   if (idx == NULL || scan.failed)
+   {
+      fprintf(stderr, "Unable to build index for %s\n", filename);
+      gzindex_free(idx);
+      return EXIT_FAILURE;
+   }
 
-      /* Update progress every 200 ms. */
-      if ((clock() - start_time) / (CLOCKS_PER_SEC / 1000) >= 200)
-      {
-         start_time = clock();
-         fprintf(stdout, "%4.2f\r", ((float)gzoffset(gzfp) / file_size) * 100.0f);
-         fflush(stdout);
-      }
+   if (gzindex_save(idx, filename) != 0)
+   {
+      fprintf(stderr, "Unable to write index %s%s\n", filename, GZINDEX_EXT);
+      gzindex_free(idx);
+      return EXIT_FAILURE;
+   }
+
+   {
+      size_t n;
+      gzindex_entries(idx, &n);
+      fprintf(stdout, "Wrote %zu checkpoints", gzindex_n_points(idx));
+
+      if (is_htc)
+         fprintf(stdout, " and %zu texture offsets", n);
+
+      fprintf(stdout, " to %s%s in %.2f s\n", filename, GZINDEX_EXT,
+              (double)(clock() - start_time) / CLOCKS_PER_SEC);
    }
 
-   fprintf(stdout, "\nCompleted\n");
-   free(texture_buf);
-   gzclose(gzfp);
+   gzindex_free(idx);
    return EXIT_SUCCESS;
+}
 
-allocerr:
-   fprintf(stderr, "Unable to reallocate memory.\n");
-   gzclose(gzfp);
-   return EXIT_FAILURE;
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: hts2bmp [OPTION...] in_file\n"
+      "Dumps the contents of a HTS or HTC texture pack \"in_file\" to the "
+      "current folder\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -index     \tBuild a random access index for in_file and exit\n"
+      "  -verify    \tCheck that every texture decompresses, writing nothing\n"
+      "  -crc LIST  \tOnly write the textures of the comma separated CRCs\n"
+      "  -list      \tList the textures within the pack as CSV instead of "
+      "dumping them\n"
+      "  -json      \tList the textures as JSON instead of CSV\n"
+      "  -tar FILE  \tWrite the textures to the tar archive FILE instead of "
+      "separate files\n"
+      "  -format F  \tWrite textures as 'bmp' (default), 'raw' or 'ktx'\n"
+      "  -swizzle O \tReorder channels to 'rgba' (default), 'bgra' or "
+      "'argb'\n"
+      "  -premultiply\tMultiply colours by alpha\n"
+      "  -unpremultiply\tDivide colours by alpha\n"
+      "  -nolink    \tWrite every texture, even if it is a duplicate\n"
+      "  -threads N \tNumber of threads to dump with (default: number of "
+      "CPUs)\n"
+      "  -trace FILE\tWrite the time taken by each stage of each texture "
+      "to FILE, as a Chrome trace\n"
+      "\n"
+      "The index is saved beside in_file with the extension '" GZINDEX_EXT
+      "', and is used automatically by later runs for as long as in_file is "
+      "unchanged. It is only useful for gzip compressed texture packs.\n"
+      "HTS packs are dumped in parallel, with each thread reading its own "
+      "range of the pack. Building an index first lets each thread start "
+      "inflating at the nearest checkpoint.\n"
+      "HTC packs are a single gzip stream, so one thread inflates the pack "
+      "whilst the other threads decompress and write each texture.\n"
+      "With '-crc', such as '-crc 0123456789ABCDEF,00000000DEADBEEF', only the "
+      "records of the given CRCs are read, and the time taken to extract each "
+      "texture is printed. An index makes this much faster for gzip "
+      "compressed packs.\n"
+      "'-list' only reads the header of each texture, and prints a summary "
+      "of the pack to stderr.\n"
+      "With '-tar', each thread gathers textures into large writes, and the "
+      "last member of the archive, '" TAR_INDEX_NAME "', lists the CRC, "
+      "offset, size and name of every texture within the archive.\n"
+      "Textures are decoded to RGBA with 8 bits per channel, which is the "
+      "byte order written unless '-swizzle' is given, and colours are "
+      "unchanged unless an alpha option is given. Each thread converts its "
+      "own textures. BMP headers describe the chosen channel order, so "
+      "swizzled BMP files still display correctly. 'raw' writes only the "
+      "pixels. 'ktx' writes KTX 1 RGBA8 files that ktx2mtp64 accepts "
+      "directly.\n"
+      "When dumping a whole pack, textures identical to one already written "
+      "are hard linked to its file, or added to the archive as hard links, "
+      "unless '-nolink' is given.\n";
+
+   fprintf(stdout, "%s", help_str);
 }
 
 int main(int argc, char *argv[])
 {
    const char *filename;
-   int (*dump_func)(const char *);
+   int (*dump_func)(const char *, const struct options_s *);
+   int is_htc;
+   char **arg;
+   struct options_s options = { 0 };
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "Usage: hts2bmp [OPTION...] in_file\n"
+              "Try 'hts2bmp -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-index") == 0)
+         options.build_index = 1;
+      else if (strcmp(*arg, "-threads") == 0 && arg[1] != NULL)
+         options.threads = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-list") == 0)
+         options.list = 1;
+      else if (strcmp(*arg, "-json") == 0)
+         options.list = options.json = 1;
+      else if (strcmp(*arg, "-crc") == 0 && arg[1] != NULL)
+         options.crc_list = *(++arg);
+      else if (strcmp(*arg, "-tar") == 0 && arg[1] != NULL)
+         options.tar = *(++arg);
+      else if (strcmp(*arg, "-format") == 0 && arg[1] != NULL)
+      {
+         arg++;
+
+         if (strcmp(*arg, "bmp") == 0)
+            options.format = FORMAT_BMP;
+         else if (strcmp(*arg, "raw") == 0)
+            options.format = FORMAT_RAW;
+         else if (strcmp(*arg, "ktx") == 0)
+            options.format = FORMAT_KTX;
+         else
+         {
+            fprintf(stderr, "Unrecognised format '%s'\n", *arg);
+            return EXIT_FAILURE;
+         }
+      }
+      else if (strcmp(*arg, "-swizzle") == 0 && arg[1] != NULL)
+      {
+         arg++;
+
+         if (strcmp(*arg, "rgba") == 0)
+            options.order = PIXFMT_ORDER_RGBA;
+         else if (strcmp(*arg, "bgra") == 0)
+            options.order = PIXFMT_ORDER_BGRA;
+         else if (strcmp(*arg, "argb") == 0)
+            options.order = PIXFMT_ORDER_ARGB;
+         else
+         {
+            fprintf(stderr, "Unrecognised channel order '%s'\n", *arg);
+            return EXIT_FAILURE;
+         }
+      }
+      else if (strcmp(*arg, "-verify") == 0)
+         options.verify = 1;
+      else if (strcmp(*arg, "-nolink") == 0)
+         options.no_links = 1;
+      else if (strcmp(*arg, "-premultiply") == 0)
+         options.alpha = ALPHA_PREMULTIPLY;
+      else if (strcmp(*arg, "-unpremultiply") == 0)
+         options.alpha = ALPHA_UNPREMULTIPLY;
+      else if (strcmp(*arg, "-trace") == 0 && arg[1] != NULL)
+         options.trace = *(++arg);
+      else if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'hts2bmp -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
 
-   if (argc != 2)
+   if (*arg == NULL || arg[1] != NULL)
    {
-      fprintf(stderr, "Usage: hts2bmp in_file\n"
-              "Dumps the contents of a HTS or HTC texture pack \"in_file\" to "
-              "the current folder\n");
+      fprintf(stderr, "A single texture pack must be specified.\n"
+              "Try 'hts2bmp -help' for more information.\n");
       return EXIT_FAILURE;
    }
 
-   filename = argv[1];
+   filename = *arg;
    /* Get file type from file extension. */
    {
       const char *ext = strrchr(filename, '.');
@@ -385,9 +2434,33 @@ int main(int argc, char *argv[])
          dump_func = dump_htc;
       else
          goto incompatible;
+
+      is_htc = dump_func == dump_htc;
+   }
+
+   if (options.threads == 0)
+   {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      options.threads = n > 0 ? n : 1;
    }
 
-   return dump_func(filename);
+   /* The trace is written out when the process exits. */
+   if (options.trace != NULL && evtrace_start(options.trace) != 0)
+      return EXIT_FAILURE;
+
+   if (options.build_index)
+      return build_index(filename, is_htc);
+
+   if (options.list)
+      return list_pack(filename, is_htc, options.json);
+
+   if (options.verify)
+      return verify_pack(filename, is_htc, &options);
+
+   if (options.crc_list != NULL)
+      return extract_crcs(filename, is_htc, &options);
+
+   return dump_func(filename, &options);
 
 incompatible:
    fprintf(stderr, "File extension not hts or htc.");
@@ -0,0 +1,1168 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Convert HTS and HTC texture packs directly to mTP64 texture packs.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define LZ4F_STATIC_LINKING_ONLY 1
+#include <lz4frame.h>
+#include <lz4hc.h>
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+#include "etc1.h"
+#include "gzindex.h"
+#include "hts.h"
+#include "mtp64.h"
+#include "pgzip.h"
+
+/* Textures are read and converted in batches of at most this many textures
+ * or bytes of pack data. */
+#define BATCH_TEXTURES        256
+#define BATCH_BYTES           (64 * 1024 * 1024)
+
+struct options_s
+{
+   const char *out;
+   const char *dictionary_file;
+   unsigned threads;
+   int level;
+   unsigned char etc1;
+   unsigned char decspeed;
+};
+
+/**
+ * A texture read from the pack, and the keys that map to it. In HTS packs
+ * several keys may map to the same record.
+ */
+struct job_s
+{
+   const uint64_t *keys;
+   size_t n_keys;
+   uint64_t key;
+   uint64_t offset;
+   struct hts_record_s rec;
+
+   /* Texture data as stored in the pack. */
+   uint8_t *in;
+   size_t in_sz;
+
+   /* LZ4 frame of the converted texture. */
+   uint8_t *out;
+   size_t out_sz;
+   size_t out_len;
+   uint8_t data_format;
+   uint64_t hash;
+   int failed;
+};
+
+struct batch_s
+{
+   struct job_s *jobs;
+   size_t n;
+
+   /* Index of the next job to be converted, and number of jobs converted. */
+   size_t next;
+   size_t done;
+
+   /* Number of workers converting jobs of the batch, which is only changed
+    * with the pool's lock held. The batch is not refilled until it is 0. */
+   unsigned workers;
+};
+
+/**
+ * Batches are converted by the worker threads whilst the main thread reads
+ * the next batch from the pack, and then writes the converted batch.
+ */
+struct pool_s
+{
+   const struct options_s *opts;
+   LZ4F_CDict *cdict;
+
+   struct batch_s *batch;
+   unsigned generation;
+   int quit;
+   int failed;
+
+   pthread_mutex_t lock;
+   pthread_cond_t work_cond;
+   pthread_cond_t done_cond;
+};
+
+/* The pack being read, which is either a HTS pack or a HTC pack. */
+struct source_s
+{
+   int is_htc;
+
+   /* HTS packs are read in the order of the offset sorted key map. */
+   struct pack_in_s in;
+   struct keymap_s km;
+   size_t km_pos;
+
+   /* HTC packs are read sequentially, and inflated in parallel when more
+    * than one thread is used. */
+   struct pgz_s *pgz;
+   gzFile gzfp;
+};
+
+/* A key and the offset of its texture in the output divided by eight. */
+struct mapping_s
+{
+   uint64_t key;
+   uint32_t offset;
+};
+
+/* Open addressing hash table of the textures written so far. */
+struct written_s
+{
+   uint64_t *hash;
+   uint32_t *offset;
+   size_t n;
+   size_t cap;
+};
+
+uint64_t now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Converts a texture to RGBA8888, or to ETC1 if requested and the texture is
+ * opaque, and compresses it with LZ4.
+ */
+void convert_texture(struct pool_s *pool, struct job_s *job,
+                     struct tex_inflate_s *ti, LZ4F_cctx *cctx,
+                     uint8_t **dec, size_t *dec_sz, uint8_t **rgba,
+                     size_t *rgba_sz, uint8_t **etc, size_t *etc_sz)
+{
+   const struct hts_record_s *rec = &job->rec;
+   LZ4F_preferences_t lz4pref = LZ4F_INIT_PREFERENCES;
+   size_t n_px = (size_t)rec->w * (size_t)rec->h;
+   const uint8_t *tex = job->in;
+   size_t tex_sz = rec->data_sz;
+   size_t tex_len, bound;
+
+   job->failed = 1;
+
+   /* Records with invalid sizes are marked as unknown by source_read(). */
+   if (rec->pf == PIXFMT_UNKNOWN || rec->w > UINT16_MAX ||
+         rec->h > UINT16_MAX)
+   {
+      fprintf(stderr, "Texture format at %lu not supported.\n", job->offset);
+      return;
+   }
+
+   if (rec->fmt & GL_TEXFMT_GZ)
+   {
+      tex_len = hts_record_size(rec);
+
+      if (reserve_buf(dec, dec_sz, tex_len) != 0)
+         goto allocerr;
+
+      if (tex_inflate(ti, *dec, tex_len, &tex_sz, job->in,
+                      rec->data_sz) != 0)
+      {
+         fprintf(stderr, "zlib failure for texture at %lu\n", job->offset);
+         return;
+      }
+
+      if (tex_sz != tex_len)
+      {
+         fprintf(stderr, "Texture at %lu inflated to %zu bytes instead of "
+                 "%zu\n", job->offset, tex_sz, tex_len);
+         return;
+      }
+
+      tex = *dec;
+   }
+
+   tex = texture_rgba8(rec->pf, tex, &tex_sz, n_px, rgba, rgba_sz);
+
+   if (tex == NULL)
+   {
+      fprintf(stderr, "Unable to convert %s texture at %lu\n",
+              pixfmt_name(rec->pf), job->offset);
+      return;
+   }
+
+   job->data_format = MTP64_FORMAT_RGBA8888;
+
+   if (pool->opts->etc1 && etc1_is_opaque(tex, n_px))
+   {
+      size_t sz = etc1_image_size(rec->w, rec->h);
+
+      if (reserve_buf(etc, etc_sz, sz) != 0)
+         goto allocerr;
+
+      etc1_encode_image(*etc, tex, rec->w, rec->h);
+      tex = *etc;
+      tex_sz = sz;
+      job->data_format = MTP64_FORMAT_ETC1;
+   }
+
+   /* Identical textures are only written once. The format and dimensions
+    * are part of the seed so that only textures that decode identically
+    * match. */
+   job->hash = XXH64(tex, tex_sz, (uint64_t)job->data_format << 32 |
+                     (uint64_t)rec->w << 16 | (uint64_t)rec->h);
+
+   lz4pref.compressionLevel = pool->opts->level;
+   lz4pref.favorDecSpeed = pool->opts->decspeed;
+   bound = LZ4F_compressFrameBound(tex_sz, &lz4pref);
+
+   if (job->out_sz < bound)
+   {
+      free(job->out);
+      job->out = malloc(bound);
+      job->out_sz = job->out == NULL ? 0 : bound;
+
+      if (job->out == NULL)
+         goto allocerr;
+   }
+
+   job->out_len = LZ4F_compressFrame_usingCDict(cctx, job->out, job->out_sz,
+                                                tex, tex_sz, pool->cdict,
+                                                &lz4pref);
+
+   if (LZ4F_isError(job->out_len))
+   {
+      fprintf(stderr, "Error compressing texture with LZ4: %s\n",
+              LZ4F_getErrorName(job->out_len));
+      __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   job->data_format |= MTP64_FORMAT_LZ4_COMPRESSED;
+   job->failed = 0;
+   return;
+
+allocerr:
+   fprintf(stderr, "Unable to reallocate memory.\n");
+   __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+}
+
+void *convert_worker(void *arg)
+{
+   struct pool_s *pool = arg;
+   struct tex_inflate_s ti;
+   LZ4F_cctx *cctx = NULL;
+   uint8_t *dec = NULL, *rgba = NULL, *etc = NULL;
+   size_t dec_sz = 0, rgba_sz = 0, etc_sz = 0;
+   unsigned generation = 0;
+   int ready;
+
+   ready = tex_inflate_init(&ti) == 0;
+
+   if (!ready || LZ4F_isError(LZ4F_createCompressionContext(&cctx,
+                              LZ4F_VERSION)))
+   {
+      fprintf(stderr, "Unable to allocate memory.\n");
+      __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+   }
+
+   for (;;)
+   {
+      struct batch_s *batch;
+      size_t i, n;
+
+      pthread_mutex_lock(&pool->lock);
+
+      while (pool->generation == generation && !pool->quit)
+         pthread_cond_wait(&pool->work_cond, &pool->lock);
+
+      if (pool->quit)
+      {
+         pthread_mutex_unlock(&pool->lock);
+         break;
+      }
+
+      /* The number of jobs is read with the generation, as the main thread
+       * refills the batch once it has been converted. */
+      generation = pool->generation;
+      batch = pool->batch;
+      n = batch->n;
+      batch->workers++;
+      pthread_mutex_unlock(&pool->lock);
+
+      while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < n)
+      {
+         if (cctx != NULL)
+            convert_texture(pool, &batch->jobs[i], &ti, cctx, &dec, &dec_sz,
+                            &rgba, &rgba_sz, &etc, &etc_sz);
+         else
+            batch->jobs[i].failed = 1;
+
+         if (__atomic_add_fetch(&batch->done, 1, __ATOMIC_ACQ_REL) == n)
+         {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->done_cond);
+            pthread_mutex_unlock(&pool->lock);
+         }
+      }
+
+      pthread_mutex_lock(&pool->lock);
+
+      if (--batch->workers == 0)
+         pthread_cond_signal(&pool->done_cond);
+
+      pthread_mutex_unlock(&pool->lock);
+   }
+
+   if (ready)
+      tex_inflate_end(&ti);
+
+   LZ4F_freeCompressionContext(cctx);
+   free(dec);
+   free(rgba);
+   free(etc);
+   return NULL;
+}
+
+void post_batch(struct pool_s *pool, struct batch_s *batch)
+{
+   batch->next = 0;
+   batch->done = 0;
+
+   pthread_mutex_lock(&pool->lock);
+   pool->batch = batch;
+   pool->generation++;
+   pthread_cond_broadcast(&pool->work_cond);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+void wait_batch(struct pool_s *pool, struct batch_s *batch)
+{
+   pthread_mutex_lock(&pool->lock);
+
+   /* Workers that took the batch must also have left it, so that none of
+    * them claims a job whilst the batch is refilled. */
+   while (__atomic_load_n(&batch->done, __ATOMIC_ACQUIRE) != batch->n ||
+          batch->workers != 0)
+      pthread_cond_wait(&pool->done_cond, &pool->lock);
+
+   pthread_mutex_unlock(&pool->lock);
+}
+
+int source_open(struct source_s *src, const char *filename, int is_htc,
+                unsigned threads)
+{
+   memset(src, 0, sizeof(*src));
+   src->is_htc = is_htc;
+
+   if (is_htc && threads > 1)
+      src->pgz = pgz_open(filename, threads);
+
+   if (src->pgz != NULL)
+   {
+      /* Skip reading config. */
+      pgz_skip(src->pgz, 4);
+      return 0;
+   }
+
+   if (is_htc)
+   {
+      src->gzfp = gzopen(filename, "rb");
+
+      if (src->gzfp == NULL)
+      {
+         fprintf(stderr, "gzip was unable to open the input file.\n");
+         return -1;
+      }
+
+      gzbuffer(src->gzfp, 256 * 1024);
+
+      /* Skip reading config. */
+      gzseek(src->gzfp, 4, SEEK_CUR);
+      return 0;
+   }
+
+   if (pack_open(&src->in, filename) != 0)
+      return -1;
+
+   if (read_keymap(&src->in, filename, hts_keymap_offset(&src->in),
+                   &src->km) != 0 || sort_keymap(&src->km) != 0)
+   {
+      fprintf(stderr, "Unable to reallocate memory.\n");
+      pack_close(&src->in);
+      free_keymap(&src->km);
+      return -1;
+   }
+
+   return 0;
+}
+
+/**
+ * Reads the next len bytes of a HTC pack, or skips them if buf is NULL.
+ * Returns 0 on success, 1 if the pack ended before any byte was read, and -1
+ * if it ended part way through or is corrupt.
+ */
+int htc_read(struct source_s *src, void *buf, size_t len)
+{
+   long got = 0;
+
+   if (src->pgz != NULL)
+      got = buf != NULL ? pgz_read(src->pgz, buf, len) :
+            pgz_skip(src->pgz, len);
+   else if (buf != NULL)
+      got = gzread(src->gzfp, buf, len);
+   else
+   {
+      /* gzseek() does not report skipping past the end of the pack. */
+      uint8_t skip[16 * 1024];
+
+      while ((size_t)got < len)
+      {
+         size_t chunk = len - got < sizeof(skip) ? len - got : sizeof(skip);
+         int n = gzread(src->gzfp, skip, chunk);
+
+         if (n <= 0)
+            break;
+
+         got += n;
+      }
+   }
+
+   if (got == (long)len)
+      return 0;
+
+   return got == 0 ? 1 : -1;
+}
+
+void source_close(struct source_s *src)
+{
+   if (src->pgz != NULL)
+      pgz_close(src->pgz);
+   else if (src->is_htc)
+      gzclose(src->gzfp);
+   else
+   {
+      pack_close(&src->in);
+      free_keymap(&src->km);
+   }
+}
+
+/**
+ * Reads the next texture of the pack into job. Returns 1 if a texture was
+ * read, 0 at the end of the pack, and -1 on error.
+ */
+int source_read(struct source_s *src, struct job_s *job)
+{
+   uint8_t hdr[HTC_RECORD_HDR_SZ];
+   int ret;
+
+   if (src->is_htc)
+   {
+      job->offset = src->pgz != NULL ? pgz_tell(src->pgz) :
+                    (uint64_t)gztell(src->gzfp);
+
+      ret = htc_read(src, hdr, sizeof(hdr));
+
+      /* The pack may only end between records. */
+      if (ret > 0)
+         return 0;
+      else if (ret < 0)
+      {
+         fprintf(stderr, "Texture at %lu is truncated.\n", job->offset);
+         return -1;
+      }
+
+      memcpy(&job->key, hdr, 8);
+      job->keys = &job->key;
+      job->n_keys = 1;
+      hts_parse_record(&job->rec, hdr + 8);
+   }
+   else
+   {
+      const struct keymap_s *km = &src->km;
+      size_t first = src->km_pos;
+
+      if (first == km->n)
+         return 0;
+
+      /* Every key that maps to this record is converted with it. */
+      while (src->km_pos < km->n &&
+             km->offset[src->km_pos] == km->offset[first])
+         src->km_pos++;
+
+      job->offset = km->offset[first];
+      job->keys = km->crc + first;
+      job->n_keys = src->km_pos - first;
+
+      if (pack_pread(&src->in, job->offset, hdr, HTS_RECORD_HDR_SZ) !=
+            HTS_RECORD_HDR_SZ)
+      {
+         fprintf(stderr, "Unable to read texture at %lu\n", job->offset);
+         return -1;
+      }
+
+      hts_parse_record(&job->rec, hdr);
+   }
+
+   if (hts_record_size(&job->rec) == 0)
+   {
+      /* The texture is skipped by the worker, but in HTC packs its data must
+       * still be skipped over to reach the next record. */
+      job->rec.pf = PIXFMT_UNKNOWN;
+
+      if (src->is_htc && job->rec.data_sz > 0 &&
+            htc_read(src, NULL, job->rec.data_sz) != 0)
+      {
+         fprintf(stderr, "Texture at %lu is truncated.\n", job->offset);
+         return -1;
+      }
+
+      return 1;
+   }
+
+   if (reserve_buf(&job->in, &job->in_sz, job->rec.data_sz) != 0)
+   {
+      fprintf(stderr, "Unable to reallocate memory.\n");
+      return -1;
+   }
+
+   if (src->is_htc)
+   {
+      if (htc_read(src, job->in, job->rec.data_sz) != 0)
+      {
+         fprintf(stderr, "Texture at %lu is truncated.\n", job->offset);
+         return -1;
+      }
+   }
+   else if (pack_pread(&src->in, job->offset + HTS_RECORD_HDR_SZ, job->in,
+                       job->rec.data_sz) != job->rec.data_sz)
+   {
+      fprintf(stderr, "Unable to read texture at %lu\n", job->offset);
+      return -1;
+   }
+
+   return 1;
+}
+
+/* Fills a batch from the pack. Returns -1 on error. */
+int fill_batch(struct source_s *src, struct batch_s *batch)
+{
+   size_t bytes = 0;
+   int ret = 0;
+
+   batch->n = 0;
+
+   while (batch->n < BATCH_TEXTURES && bytes < BATCH_BYTES)
+   {
+      struct job_s *job = &batch->jobs[batch->n];
+
+      ret = source_read(src, job);
+
+      if (ret <= 0)
+         break;
+
+      bytes += job->rec.data_sz > 0 ? job->rec.data_sz : 0;
+      batch->n++;
+   }
+
+   return ret < 0 ? -1 : 0;
+}
+
+/* Returns the offset of a texture already written with the given hash. */
+int written_find(const struct written_s *w, uint64_t hash, uint32_t *offset)
+{
+   if (w->cap == 0)
+      return 0;
+
+   for (size_t i = hash & (w->cap - 1); w->offset[i] != 0;
+         i = (i + 1) & (w->cap - 1))
+   {
+      if (w->hash[i] == hash)
+      {
+         *offset = w->offset[i];
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/* Offsets are never zero, as the header precedes every texture. */
+int written_add(struct written_s *w, uint64_t hash, uint32_t offset)
+{
+   size_t i;
+
+   if ((w->n + 1) * 2 > w->cap)
+   {
+      struct written_s grown = { .n = w->n, .cap = w->cap ? w->cap * 2 : 1024 };
+
+      grown.hash = malloc(grown.cap * sizeof(*grown.hash));
+      grown.offset = calloc(grown.cap, sizeof(*grown.offset));
+
+      if (grown.hash == NULL || grown.offset == NULL)
+      {
+         free(grown.hash);
+         free(grown.offset);
+         return -1;
+      }
+
+      for (size_t j = 0; j < w->cap; j++)
+      {
+         if (w->offset[j] == 0)
+            continue;
+
+         for (i = w->hash[j] & (grown.cap - 1); grown.offset[i] != 0;
+               i = (i + 1) & (grown.cap - 1))
+            ;
+
+         grown.hash[i] = w->hash[j];
+         grown.offset[i] = w->offset[j];
+      }
+
+      free(w->hash);
+      free(w->offset);
+      *w = grown;
+   }
+
+   for (i = hash & (w->cap - 1); w->offset[i] != 0; i = (i + 1) & (w->cap - 1))
+      ;
+
+   w->hash[i] = hash;
+   w->offset[i] = offset;
+   w->n++;
+   return 0;
+}
+
+int compare_mapping(const void *in1, const void *in2)
+{
+   const struct mapping_s *a = in1;
+   const struct mapping_s *b = in2;
+   uint32_t crc_a = a->key, crc_b = b->key;
+
+   if (crc_a != crc_b)
+      return crc_a < crc_b ? -1 : 1;
+
+   return (a->key > b->key) - (a->key < b->key);
+}
+
+/**
+ * Moves the len bytes at offset from forward by shift bytes, starting from
+ * the end so that the data is not overwritten before it is moved.
+ */
+int shift_data(FILE *f, uint64_t from, uint64_t len, uint64_t shift)
+{
+   static uint8_t buf[1 << 20];
+   int fd = fileno(f);
+
+   fflush(f);
+
+   while (len > 0)
+   {
+      size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+      uint64_t pos = from + len - chunk;
+
+      if (pread(fd, buf, chunk, pos) != (ssize_t)chunk ||
+            pwrite(fd, buf, chunk, pos + shift) != (ssize_t)chunk)
+         return -1;
+
+      len -= chunk;
+   }
+
+   return 0;
+}
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: hts2mtp64 [OPTION...] -out FILE in_file\n"
+      "Converts the HTS or HTC texture pack \"in_file\" to an mTP64 texture "
+      "pack in a single pass, without writing any intermediate files.\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -out FILE  \tSet output mtp64 texture pack file\n"
+      "  -etc1      \tEncode opaque textures as ETC1\n"
+      "  -dictionary FILE\n"
+      "             \tUse a dictionary when compressing with LZ4\n"
+      "  -threads N \tNumber of threads to convert with (default: number of "
+      "CPUs)\n"
+      "  -level N   \tLZ4 compression level (default 9)\n"
+      "  -decspeed  \tFavour decompression speed over size at levels of 10 "
+      "and above\n"
+      "\n"
+      "Textures are stored as RGBA8888 unless '-etc1' is given, in which case "
+      "textures without any transparent pixels are stored as ETC1. Every "
+      "texture is compressed with LZ4.\n"
+      "mTP64 maps textures by a 32-bit CRC, so the lower 32 bits of each "
+      "64-bit key of the pack are used. Where several keys share the same "
+      "lower 32 bits but map to different textures, only the smallest key is "
+      "kept, and the others are listed.\n"
+      "The dictionary file is used as with ktx2mtp64.\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int convert(const char *filename, int is_htc, const struct options_s *opts)
+{
+   struct source_s src;
+   struct pool_s pool = { .opts = opts };
+   struct batch_s batches[2] = { { 0 } };
+   struct batch_s *cur, *next;
+   struct written_s written = { 0 };
+   struct mapping_s *mappings = NULL;
+   size_t n_mappings = 0, alloc_mappings = 0;
+   struct mtp64_map_s *map = NULL;
+   size_t n_map = 0, n_dropped = 0, n_failed = 0, n_read = 0;
+   pthread_t *threads;
+   unsigned n_threads = 0;
+   struct mtp64_header_s mtp64_hdr = MTP64_HEADER_INIT;
+   uint8_t *dictionary = NULL;
+   size_t dictionary_sz = 0;
+   uint64_t map_off, data_start, data_end, pos, first_texture;
+   uint64_t start_time, progress_time;
+   FILE *f_out = NULL;
+   int ret = EXIT_FAILURE;
+
+   if (opts->dictionary_file != NULL)
+   {
+      FILE *fdic = fopen(opts->dictionary_file, "rb");
+
+      if (fdic == NULL)
+      {
+         fprintf(stderr, "Unable to open %s\n", opts->dictionary_file);
+         return EXIT_FAILURE;
+      }
+
+      fseek(fdic, 0, SEEK_END);
+      dictionary_sz = ftell(fdic);
+      rewind(fdic);
+
+      if (dictionary_sz % 1024 != 0 || dictionary_sz / 1024 > UINT8_MAX)
+      {
+         fprintf(stderr, "Dictionary file size is not a multiple of 1024, "
+                 "or is larger than 255 KiB\n");
+         fclose(fdic);
+         return EXIT_FAILURE;
+      }
+
+      dictionary = malloc(dictionary_sz + 1);
+
+      if (dictionary == NULL ||
+            fread(dictionary, 1, dictionary_sz, fdic) != dictionary_sz)
+      {
+         fprintf(stderr, "Unable to read %s\n", opts->dictionary_file);
+         fclose(fdic);
+         free(dictionary);
+         return EXIT_FAILURE;
+      }
+
+      fclose(fdic);
+      mtp64_hdr.dictionary_size = dictionary_sz / 1024;
+      pool.cdict = LZ4F_createCDict(dictionary, dictionary_sz);
+
+      if (pool.cdict == NULL)
+      {
+         fprintf(stderr, "Unable to create the LZ4 dictionary.\n");
+         goto out_dict;
+      }
+   }
+
+   start_time = now_ms();
+
+   if (source_open(&src, filename, is_htc, opts->threads) != 0)
+      goto out_dict;
+
+   if (!is_htc)
+      fprintf(stdout, "Read and sorted %lu key mappings in %lu ms\n",
+              src.km.n, now_ms() - start_time);
+
+   f_out = fopen(opts->out, "w+b");
+
+   if (f_out == NULL)
+   {
+      fprintf(stderr, "Unable to create %s\n", opts->out);
+      goto out_src;
+   }
+
+   /* Space for the map is reserved before the texture data. Every key of a
+    * HTS pack is known up front, but a HTC pack must be read to the end to
+    * count its keys, so the texture data is moved forward afterwards if
+    * needed. */
+   map_off = sizeof(mtp64_hdr) + dictionary_sz + 4;
+   data_start = map_off + (is_htc ? 0 : src.km.n * sizeof(struct mtp64_map_s));
+   data_start = (data_start + 7) & ~(uint64_t)7;
+   pos = data_start;
+
+   batches[0].jobs = calloc(BATCH_TEXTURES, sizeof(struct job_s));
+   batches[1].jobs = calloc(BATCH_TEXTURES, sizeof(struct job_s));
+   threads = calloc(opts->threads, sizeof(*threads));
+
+   if (batches[0].jobs == NULL || batches[1].jobs == NULL || threads == NULL)
+   {
+      fprintf(stderr, "Unable to allocate memory.\n");
+      goto out_batches;
+   }
+
+   pthread_mutex_init(&pool.lock, NULL);
+   pthread_cond_init(&pool.work_cond, NULL);
+   pthread_cond_init(&pool.done_cond, NULL);
+
+   for (; n_threads < opts->threads; n_threads++)
+   {
+      if (pthread_create(&threads[n_threads], NULL, convert_worker,
+                         &pool) != 0)
+         break;
+   }
+
+   if (n_threads == 0)
+   {
+      fprintf(stderr, "Unable to create thread.\n");
+      goto out_pool;
+   }
+
+   fprintf(stdout, "Converting textures with %u threads\n", n_threads);
+   fflush(stdout);
+   start_time = progress_time = now_ms();
+
+   cur = &batches[0];
+   next = &batches[1];
+
+   if (fill_batch(&src, cur) != 0)
+      goto out_threads;
+
+   while (cur->n != 0)
+   {
+      struct batch_s *swap;
+      int fill_ret;
+
+      post_batch(&pool, cur);
+
+      /* Read the next batch whilst this one is converted. */
+      fill_ret = fill_batch(&src, next);
+      wait_batch(&pool, cur);
+
+      if (pool.failed || fill_ret != 0)
+         goto out_threads;
+
+      for (size_t j = 0; j < cur->n; j++)
+      {
+         struct job_s *job = &cur->jobs[j];
+         uint32_t offset;
+
+         n_read++;
+
+         if (job->failed)
+         {
+            n_failed++;
+            continue;
+         }
+
+         if (!written_find(&written, job->hash, &offset))
+         {
+            struct mtp64_texture_header_s tex_hdr;
+            const uint8_t padding[7] = { 0 };
+
+            if (pos / 8 > UINT32_MAX)
+            {
+               fprintf(stderr, "The mTP64 pack would be larger than 32 "
+                       "GiB\n");
+               goto out_threads;
+            }
+
+            offset = pos / 8;
+            tex_hdr.data_format = job->data_format;
+            tex_hdr.data_size = job->out_len;
+            tex_hdr.tex_width = job->rec.w;
+            tex_hdr.tex_height = job->rec.h;
+
+            fseeko(f_out, pos, SEEK_SET);
+            fwrite(&tex_hdr, 1, sizeof(tex_hdr), f_out);
+            fwrite(job->out, 1, job->out_len, f_out);
+            pos += sizeof(tex_hdr) + job->out_len;
+
+            if (pos % 8 != 0)
+            {
+               fwrite(padding, 1, 8 - pos % 8, f_out);
+               pos += 8 - pos % 8;
+            }
+
+            if (written_add(&written, job->hash, offset) != 0)
+            {
+               fprintf(stderr, "Unable to allocate memory.\n");
+               goto out_threads;
+            }
+         }
+
+         if (n_mappings + job->n_keys > alloc_mappings)
+         {
+            struct mapping_s *m;
+
+            alloc_mappings = (n_mappings + job->n_keys) * 2;
+            m = realloc(mappings, alloc_mappings * sizeof(*mappings));
+
+            if (m == NULL)
+            {
+               fprintf(stderr, "Unable to allocate memory.\n");
+               goto out_threads;
+            }
+
+            mappings = m;
+         }
+
+         for (size_t k = 0; k < job->n_keys; k++)
+         {
+            mappings[n_mappings].key = job->keys[k];
+            mappings[n_mappings].offset = offset;
+            n_mappings++;
+         }
+      }
+
+      /* Update progress every 200 ms. */
+      if (now_ms() - progress_time >= 200)
+      {
+         progress_time = now_ms();
+         fprintf(stdout, "%8lu\r", n_read);
+         fflush(stdout);
+      }
+
+      swap = cur;
+      cur = next;
+      next = swap;
+   }
+
+   data_end = pos;
+
+   /* Build the map from the lower 32 bits of each key. */
+   qsort(mappings, n_mappings, sizeof(*mappings), compare_mapping);
+   map = malloc(n_mappings * sizeof(*map) + 1);
+
+   if (map == NULL)
+   {
+      fprintf(stderr, "Unable to allocate memory.\n");
+      goto out_threads;
+   }
+
+   for (size_t i = 0; i < n_mappings; i++)
+   {
+      uint32_t crc = mappings[i].key;
+
+      if (n_map != 0 && map[n_map - 1].crc == crc)
+      {
+         if (map[n_map - 1].offset != mappings[i].offset)
+         {
+            fprintf(stderr, "Key %016lX dropped, as CRC %08X is already "
+                    "mapped to a different texture\n", mappings[i].key, crc);
+            n_dropped++;
+         }
+
+         continue;
+      }
+
+      map[n_map].crc = crc;
+      map[n_map].offset = mappings[i].offset;
+      n_map++;
+   }
+
+   first_texture = (map_off + n_map * sizeof(*map) + 7) & ~(uint64_t)7;
+
+   if (first_texture > data_start)
+   {
+      uint64_t shift = first_texture - data_start;
+
+      if (shift_data(f_out, data_start, data_end - data_start, shift) != 0)
+      {
+         fprintf(stderr, "Unable to write %s\n", opts->out);
+         goto out_threads;
+      }
+
+      for (size_t i = 0; i < n_map; i++)
+         map[i].offset += shift / 8;
+
+      data_start = first_texture;
+   }
+
+   mtp64_hdr.n_textures = written.n;
+   mtp64_hdr.n_mappings = n_map;
+   mtp64_hdr.first_texture_offset = data_start;
+
+   /* Any space reserved for the map but not used is left as padding. */
+   {
+      const uint8_t unused[4] = { 0, 0, 0, 0 };
+
+      fseeko(f_out, 0, SEEK_SET);
+      fwrite(&mtp64_hdr, 1, sizeof(mtp64_hdr), f_out);
+      fwrite(dictionary, 1, dictionary_sz, f_out);
+      fwrite(unused, 1, sizeof(unused), f_out);
+      fwrite(map, 1, n_map * sizeof(*map), f_out);
+
+      for (uint64_t p = map_off + n_map * sizeof(*map); p < data_start; p++)
+         fputc(0, f_out);
+   }
+
+   if (fflush(f_out) != 0)
+   {
+      fprintf(stderr, "Unable to write %s\n", opts->out);
+      goto out_threads;
+   }
+
+   fprintf(stdout, "\nConverted %lu textures in %.2f s\n"
+           "Wrote %u CRC entries and %u textures (%lu duplicates) to %s\n",
+           n_read, (now_ms() - start_time) / 1000.0, mtp64_hdr.n_mappings,
+           mtp64_hdr.n_textures, n_read - n_failed - written.n, opts->out);
+
+   if (n_failed != 0)
+      fprintf(stdout, "%lu textures could not be converted\n", n_failed);
+
+   if (n_dropped != 0)
+      fprintf(stdout, "%lu keys were dropped, as their lower 32 bits were "
+              "already mapped\n", n_dropped);
+
+   ret = EXIT_SUCCESS;
+
+out_threads:
+   pthread_mutex_lock(&pool.lock);
+   pool.quit = 1;
+   pthread_cond_broadcast(&pool.work_cond);
+   pthread_mutex_unlock(&pool.lock);
+
+   for (unsigned t = 0; t < n_threads; t++)
+      pthread_join(threads[t], NULL);
+
+out_pool:
+   pthread_mutex_destroy(&pool.lock);
+   pthread_cond_destroy(&pool.work_cond);
+   pthread_cond_destroy(&pool.done_cond);
+
+out_batches:
+   for (unsigned b = 0; b < 2; b++)
+   {
+      for (size_t j = 0; batches[b].jobs != NULL && j < BATCH_TEXTURES; j++)
+      {
+         free(batches[b].jobs[j].in);
+         free(batches[b].jobs[j].out);
+      }
+
+      free(batches[b].jobs);
+   }
+
+   free(threads);
+   free(mappings);
+   free(map);
+   free(written.hash);
+   free(written.offset);
+   fclose(f_out);
+
+   if (ret != EXIT_SUCCESS)
+      remove(opts->out);
+
+out_src:
+   source_close(&src);
+
+out_dict:
+   LZ4F_freeCDict(pool.cdict);
+   free(dictionary);
+   return ret;
+}
+
+int main(int argc, char *argv[])
+{
+   const char *filename;
+   int is_htc;
+   char **arg;
+   struct options_s options = { .level = LZ4HC_CLEVEL_DEFAULT };
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "Usage: hts2mtp64 [OPTION...] -out FILE in_file\n"
+              "Try 'hts2mtp64 -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-out") == 0 && arg[1] != NULL)
+         options.out = *(++arg);
+      else if (strcmp(*arg, "-dictionary") == 0 && arg[1] != NULL)
+         options.dictionary_file = *(++arg);
+      else if (strcmp(*arg, "-etc1") == 0)
+         options.etc1 = 1;
+      else if (strcmp(*arg, "-level") == 0 && arg[1] != NULL)
+         options.level = strtol(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-decspeed") == 0)
+         options.decspeed = 1;
+      else if (strcmp(*arg, "-threads") == 0 && arg[1] != NULL)
+         options.threads = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'hts2mtp64 -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (*arg == NULL || arg[1] != NULL)
+   {
+      fprintf(stderr, "A single texture pack must be specified.\n"
+              "Try 'hts2mtp64 -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (options.out == NULL)
+   {
+      fprintf(stderr, "No output file was specified.\n");
+      return EXIT_FAILURE;
+   }
+
+   filename = *arg;
+   /* Get file type from file extension. */
+   {
+      const char *ext = strrchr(filename, '.');
+
+      if (ext == NULL || strlen(ext) != 4)
+      {
+         fprintf(stderr, "File extension not hts or htc.\n");
+         return EXIT_FAILURE;
+      }
+
+      if (tolower(ext[1]) != 'h' || tolower(ext[2]) != 't' ||
+            (tolower(ext[3]) != 's' && tolower(ext[3]) != 'c'))
+      {
+         fprintf(stderr, "File extension not hts or htc.\n");
+         return EXIT_FAILURE;
+      }
+
+      is_htc = tolower(ext[3]) == 'c';
+   }
+
+   if (options.threads == 0)
+   {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      options.threads = n > 0 ? n : 1;
+   }
+
+   return convert(filename, is_htc, &options);
+}
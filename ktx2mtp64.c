@@ -29,10 +29,12 @@
 #define XXH_INLINE_ALL
 #include "xxhash.h"
 
+#include "evtrace.h"
+#include "mtp64.h"
+
 #define CRC32_STR_LEN      8
 #define GL_ETC1_RGB8_OES   0x8D64
 #define GL_RGBA8_EXT       0x8058
-#define DATA_LZ4_COMPRESSED 0x80
 
 /**
  * Used for rare system errors, such as ENOMEM, which make continuing difficult.
@@ -52,41 +54,6 @@ struct textures_s
    char *filename;
 };
 
-struct map_s
-{
-   uint32_t crc;
-   uint32_t offset;
-} __attribute__((packed));
-
-struct texture_header_s
-{
-   uint8_t data_format;
-   uint32_t data_size;
-   uint16_t tex_width;
-   uint16_t tex_height;
-} __attribute__((packed));
-
-struct mtp64_header_s
-{
-   uint8_t magic[10];
-   uint8_t version;
-   uint8_t tp_version[3];
-   char rom_target[20];
-   char pack_name[32];
-   char pack_author[32];
-   uint32_t pack_size;
-   uint32_t n_textures;
-   uint32_t n_mappings;
-   uint32_t first_texture_offset;
-   uint8_t dictionary_size;
-} __attribute__((packed));
-
-#define MTP64_HEADER_INIT {   \
-      .magic = { 0xAB, 'm', 'T', 'P', '@', 0xBB, 0x0D, 0x0A, 0x1A, 0x0A }, \
-      .version = 1, .tp_version = { 0, 1, 0 }, .rom_target = { 0 },        \
-      .pack_name = { 0 }, .pack_author = { 0 }, .pack_size = 0             \
-   }
-
 void fatal_error(int line)
 {
    char buf[128];
@@ -99,7 +66,7 @@ int compare_crc(const void *in1, const void *in2)
 {
    const struct textures_s *tex1 = in1;
    const struct textures_s *tex2 = in2;
-   int64_t diff = tex1->crc - tex2->crc;
+   int64_t diff = (int64_t)tex1->crc - tex2->crc;
 
    if (diff < 0)
       return -1;
@@ -141,6 +108,7 @@ struct textures_s *add_textures(char **filenames, uint_fast32_t *entries)
       char *dot;
       size_t len;
       char crcstr[CRC32_STR_LEN + 1];
+      uint64_t ev_start = evtrace_begin();
 
       /* Is the file name correct? */
       dot = strrchr(*filename, '.');
@@ -232,6 +200,7 @@ struct textures_s *add_textures(char **filenames, uint_fast32_t *entries)
       }
 
       ktxTexture_Destroy(tex);
+      evtrace_end(EVTRACE_OPEN, textures[*entries].crc, ev_start);
       (*entries)++;
 
       if (*entries >= alloc_nmemb)
@@ -275,6 +244,11 @@ const char *const help_str = "Usage: ktx2mtp64 [OPTION...] [FILE...]\n"
          "  -out       \tSet output mtp64 texture pack file\n"
          "  -dump      \tDump raw texture data within the current folder\n"
          "  -dictionary\tUse a dictionary when compressing with LZ4\n"
+         "  -level     \tLZ4 compression level (default 9)\n"
+         "  -decspeed  \tFavour decompression speed over size at levels of "
+         "10 and above\n"
+         "  -trace     \tWrite the time taken by each stage of each texture "
+         "to the given file, as a Chrome trace\n"
          "\n"
          "'-dump' and '-out' may not be used at the same time. '-dump' "
          "can be used to create a dictionary before creating the mTP64 texture "
@@ -314,8 +288,11 @@ int main(int argc, char *argv[])
    {
       unsigned char dump_textures;
       unsigned char show_help;
+      unsigned char decspeed;
       char *mtp64_out;
       char *dictionary_file;
+      char *level;
+      char *trace;
    } options = { 0 };
 
    if(argc < 2)
@@ -340,7 +317,10 @@ int main(int argc, char *argv[])
          { "out",       REQUIRED, { .valp = (void**)&options.mtp64_out } },
          { "dump",      NONE,     { .valc = &options.dump_textures     } },
          { "help",      NONE,     { .valc = &options.show_help         } },
-         { "dictionary",REQUIRED, { .valp = (void**)&options.dictionary_file } }
+         { "dictionary",REQUIRED, { .valp = (void**)&options.dictionary_file } },
+         { "level",     REQUIRED, { .valp = (void**)&options.level     } },
+         { "decspeed",  NONE,     { .valc = &options.decspeed          } },
+         { "trace",     REQUIRED, { .valp = (void**)&options.trace     } }
       };
       uint8_t valid_option = 0;
 
@@ -417,6 +397,9 @@ int main(int argc, char *argv[])
       return EXIT_FAILURE;
    }
 
+   if (options.trace != NULL && evtrace_start(options.trace) != 0)
+      return EXIT_FAILURE;
+
    textures = add_textures(filenames, &entries);
    if (textures == NULL)
    {
@@ -435,6 +418,7 @@ int main(int argc, char *argv[])
          KTX_error_code kret;
          uint8_t *tex;
          char dump_name[8 + 1 + 4 + 1]; /* Example: "0A0B0C0D.ETC1" */
+         uint64_t ev_start = evtrace_begin();
 
          kret = ktxTexture_CreateFromNamedFile(textures[i].filename,
                                                KTX_TEXTURE_CREATE_LOAD_IMAGE_DATA_BIT,
@@ -448,6 +432,8 @@ int main(int argc, char *argv[])
          }
 
          tex = ktxTexture_GetData(ktex);
+         evtrace_end(EVTRACE_PARSE, textures[i].crc, ev_start);
+         ev_start = evtrace_begin();
          snprintf(dump_name, sizeof(dump_name), "%08X.%s",
                   textures[i].crc,
                   textures[i].type == TYPE_ETC1 ? "ETC1" : "RGB8");
@@ -457,6 +443,7 @@ int main(int argc, char *argv[])
 
          fwrite(tex, 1, textures[i].data_sz, f_dmp);
          fclose(f_dmp);
+         evtrace_end(EVTRACE_WRITE, textures[i].crc, ev_start);
          ktxTexture_Destroy(ktex);
 
          if (i % (128 * sizeof(intptr_t)) == 0)
@@ -486,8 +473,8 @@ int main(int argc, char *argv[])
    uint8_t *dictionary = NULL;
    LZ4F_CDict *cdict = NULL;
    struct mtp64_header_s mtp64_hdr = MTP64_HEADER_INIT;
-   const size_t map_sz = entries * sizeof(struct map_s);
-   struct map_s *map = malloc(map_sz);
+   const size_t map_sz = entries * sizeof(struct mtp64_map_s);
+   struct mtp64_map_s *map = malloc(map_sz);
 
    ASSERT(map != NULL);
 
@@ -543,6 +530,17 @@ int main(int argc, char *argv[])
    }
 
    fwrite(map, 1, map_sz, f_out);
+
+   /* Texture offsets are stored divided by eight, so the first texture must
+    * also be aligned. */
+   {
+      const uint8_t padding[7] = { 0 };
+      long offset = ftell(f_out);
+
+      if (offset % 8 != 0)
+         fwrite(padding, 1, 8 - (offset % 8), f_out);
+   }
+
    mtp64_hdr.first_texture_offset = ftell(f_out);
 
    puts("Writing texture data");
@@ -550,6 +548,7 @@ int main(int argc, char *argv[])
    struct tex_hash_list_s {
       uint64_t hash;
       char *filename;
+      uint32_t offset;
    };
    struct tex_hash_list_s *tex_hash_list =
          malloc(entries * sizeof(struct tex_hash_list_s));
@@ -557,12 +556,13 @@ int main(int argc, char *argv[])
 
    for(struct textures_s *tex = textures; tex < textures + entries; tex++)
    {
-      uint8_t data_format = tex->type;
+      uint8_t data_format = tex->type | MTP64_FORMAT_LZ4_COMPRESSED;
       size_t data_size;
       uint64_t data_hash;
       uint8_t *data_tex;
       ktxTexture *ktex;
       KTX_error_code kret;
+      uint64_t ev_start = evtrace_begin();
 
       kret = ktxTexture_CreateFromNamedFile(tex->filename,
                                             KTX_TEXTURE_CREATE_LOAD_IMAGE_DATA_BIT,
@@ -577,8 +577,11 @@ int main(int argc, char *argv[])
 
       data_size = ktxTexture_GetDataSize(ktex);
       data_tex = ktxTexture_GetData(ktex);
+      evtrace_end(EVTRACE_PARSE, tex->crc, ev_start);
 
+      ev_start = evtrace_begin();
       data_hash = XXH64(data_tex, data_size, 0xDEADBEEF);
+      evtrace_end(EVTRACE_HASH, tex->crc, ev_start);
 
       /* Check for duplicates. */
       for (size_t d = 0; d < mtp64_hdr.n_textures; d++)
@@ -594,23 +597,23 @@ int main(int argc, char *argv[])
 
          fprintf(f_dupes, "\"%s\" \"%s\"\n",
                  tex_hash_list[d].filename, tex->filename);
+
+         /* Map this CRC to the texture that was already written. */
+         map[tex - textures].offset = tex_hash_list[d].offset;
          goto duplicate;
       }
 
-      tex_hash_list[mtp64_hdr.n_textures].hash = data_hash;
-      tex_hash_list[mtp64_hdr.n_textures].filename = tex->filename;
-
-      for(size_t i = 0; i < mtp64_hdr.n_textures; i++)
+      /* The map was built from the CRC sorted list of textures, so the
+       * mapping for this texture shares its index. */
       {
-         if(map[i].crc == tex->crc)
-         {
-            long offset = ftell(f_out);
-            assert(offset % 8 == 0);
-            map[i].offset = (unsigned long)offset / 8;
-            break;
-         }
+         long offset = ftell(f_out);
+         assert(offset % 8 == 0);
+         map[tex - textures].offset = (unsigned long)offset / 8;
       }
 
+      tex_hash_list[mtp64_hdr.n_textures].hash = data_hash;
+      tex_hash_list[mtp64_hdr.n_textures].filename = tex->filename;
+      tex_hash_list[mtp64_hdr.n_textures].offset = map[tex - textures].offset;
       mtp64_hdr.n_textures++;
 
       /* Compress texture with LZ4. */
@@ -621,9 +624,11 @@ int main(int argc, char *argv[])
          size_t lz4sz_max;
          size_t lz4sz;
          char *lz4tex;
-         struct texture_header_s tex_hdr;
+         struct mtp64_texture_header_s tex_hdr;
 
-         lz4pref.compressionLevel = LZ4HC_CLEVEL_DEFAULT;
+         lz4pref.compressionLevel = options.level != NULL ?
+                                    atoi(options.level) : LZ4HC_CLEVEL_DEFAULT;
+         lz4pref.favorDecSpeed = options.decspeed;
 
          lz4sz_max = LZ4F_compressFrameBound(data_size, &lz4pref);
          lz4tex = malloc(lz4sz_max);
@@ -638,14 +643,17 @@ int main(int argc, char *argv[])
             abort();
          }
 
+         ev_start = evtrace_begin();
          lz4sz = LZ4F_compressFrame_usingCDict(cctxPtr, lz4tex, lz4sz_max,
                                                data_tex, data_size, cdict,
                                                &lz4pref);
+         evtrace_end(EVTRACE_COMPRESS, tex->crc, ev_start);
 
          tex_hdr.data_format = data_format;
          tex_hdr.data_size = lz4sz;
          tex_hdr.tex_width = ktex->baseWidth;
          tex_hdr.tex_height = ktex->baseHeight;
+         ev_start = evtrace_begin();
          fwv(tex_hdr);
          fwrite(lz4tex, 1, lz4sz, f_out);
 
@@ -665,6 +673,8 @@ int main(int argc, char *argv[])
                fwrite(padding, 1, add_pad, f_out);
             }
          }
+
+         evtrace_end(EVTRACE_WRITE, tex->crc, ev_start);
       }
 
 duplicate:
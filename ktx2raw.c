@@ -15,22 +15,485 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _DEFAULT_SOURCE
+
 #include <ktx.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #define DIE()  do{fprintf(stderr, "Error on line %d\n", __LINE__); abort();}while(0)
 #define ASSERT(x) if(!(x))DIE()
 
+/* Buffer of the concatenated output file. */
+#define CAT_BUF_SIZE    (8 * 1024 * 1024)
+
+struct batch_s
+{
+   char **inputs;
+   size_t n_inputs;
+   const char *out_dir;
+
+   /* Textures of the concatenated output, written in the order of the
+    * inputs. Each is held in one of n_slots slots until written. */
+   FILE *cat;
+   ktxTexture **slots;
+   unsigned char *ready;
+   size_t n_slots;
+   size_t written;
+   int flushing;
+
+   size_t next;
+   uint64_t failed;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+};
+
+uint64_t now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Reads the whole file in one go, reusing buf between files. */
+int read_file(const char *filename, uint8_t **buf, size_t *buf_sz,
+              size_t *len)
+{
+   FILE *f = fopen(filename, "rb");
+   long sz;
+
+   if (f == NULL)
+      return -1;
+
+   fseek(f, 0, SEEK_END);
+   sz = ftell(f);
+   fseek(f, 0, SEEK_SET);
+
+   if (sz < 0)
+   {
+      fclose(f);
+      return -1;
+   }
+
+   if ((size_t)sz > *buf_sz)
+   {
+      uint8_t *b = realloc(*buf, sz);
+
+      if (b == NULL)
+      {
+         fclose(f);
+         return -1;
+      }
+
+      *buf = b;
+      *buf_sz = sz;
+   }
+
+   *len = fread(*buf, 1, sz, f);
+   fclose(f);
+   return *len == (size_t)sz ? 0 : -1;
+}
+
+/* Writes the texture to the output folder, named after the input with its
+ * extension replaced by ".raw". */
+int write_raw(const char *out_dir, const char *in_file, ktxTexture *ktex)
+{
+   const char *base = strrchr(in_file, '/');
+   const char *ext;
+   char *name;
+   size_t base_len;
+   FILE *f;
+   int ret = 0;
+
+   base = base != NULL ? base + 1 : in_file;
+   ext = strrchr(base, '.');
+   base_len = ext != NULL ? (size_t)(ext - base) : strlen(base);
+   name = malloc(strlen(out_dir) + base_len + 6);
+
+   if (name == NULL)
+      return -1;
+
+   sprintf(name, "%s/%.*s.raw", out_dir, (int)base_len, base);
+   f = fopen(name, "wb");
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to create %s\n", name);
+      free(name);
+      return -1;
+   }
+
+   if (fwrite(ktxTexture_GetData(ktex), 1, ktxTexture_GetDataSize(ktex), f) !=
+         ktxTexture_GetDataSize(ktex))
+      ret = -1;
+
+   if (fclose(f) != 0)
+      ret = -1;
+
+   free(name);
+   return ret;
+}
+
+/* Writes every texture that is ready to the concatenated output, in order.
+ * Called with the lock held, which is released whilst writing. Only one
+ * thread writes at a time, and it also writes any textures that become ready
+ * meanwhile. */
+void flush_ready(struct batch_s *b)
+{
+   if (b->flushing)
+      return;
+
+   b->flushing = 1;
+
+   while (b->written < b->n_inputs && b->ready[b->written % b->n_slots])
+   {
+      size_t s = b->written % b->n_slots;
+      ktxTexture *ktex = b->slots[s];
+      int ok = 1;
+
+      pthread_mutex_unlock(&b->lock);
+
+      if (ktex != NULL)
+      {
+         ok = fwrite(ktxTexture_GetData(ktex), 1,
+                     ktxTexture_GetDataSize(ktex), b->cat) ==
+              ktxTexture_GetDataSize(ktex);
+         ktxTexture_Destroy(ktex);
+      }
+
+      pthread_mutex_lock(&b->lock);
+
+      if (!ok)
+      {
+         fprintf(stderr, "Unable to write %s\n", b->inputs[b->written]);
+         b->failed++;
+      }
+
+      b->slots[s] = NULL;
+      b->ready[s] = 0;
+      b->written++;
+      pthread_cond_broadcast(&b->cond);
+   }
+
+   b->flushing = 0;
+}
+
+void *batch_worker(void *arg)
+{
+   struct batch_s *b = arg;
+   uint8_t *buf = NULL;
+   size_t buf_sz = 0;
+
+   for (;;)
+   {
+      ktxTexture *ktex = NULL;
+      KTX_error_code kres;
+      size_t i, len;
+      int ok;
+
+      pthread_mutex_lock(&b->lock);
+
+      /* Textures for the concatenated output must wait for a free slot. */
+      while (b->cat != NULL && b->next < b->n_inputs &&
+             b->next >= b->written + b->n_slots)
+         pthread_cond_wait(&b->cond, &b->lock);
+
+      i = b->next;
+
+      if (i < b->n_inputs)
+         b->next++;
+
+      pthread_mutex_unlock(&b->lock);
+
+      if (i >= b->n_inputs)
+         break;
+
+      ok = read_file(b->inputs[i], &buf, &buf_sz, &len) == 0;
+
+      if (!ok)
+         fprintf(stderr, "Unable to read %s\n", b->inputs[i]);
+      else
+      {
+         kres = ktxTexture_CreateFromMemory(buf, len,
+               KTX_TEXTURE_CREATE_LOAD_IMAGE_DATA_BIT, &ktex);
+
+         if (kres != KTX_SUCCESS)
+         {
+            fprintf(stderr, "Failed to open %s: %s\n", b->inputs[i],
+                    ktxErrorString(kres));
+            ok = 0;
+            ktex = NULL;
+         }
+      }
+
+      if (ok && b->cat == NULL)
+      {
+         if (write_raw(b->out_dir, b->inputs[i], ktex) != 0)
+            ok = 0;
+
+         ktxTexture_Destroy(ktex);
+      }
+
+      pthread_mutex_lock(&b->lock);
+
+      if (!ok)
+         b->failed++;
+
+      if (b->cat != NULL)
+      {
+         b->slots[i % b->n_slots] = ktex;
+         b->ready[i % b->n_slots] = 1;
+         flush_ready(b);
+      }
+
+      pthread_mutex_unlock(&b->lock);
+   }
+
+   free(buf);
+   return NULL;
+}
+
+/* Appends each non-empty line of the manifest to the list of inputs. */
+int read_manifest(const char *filename, char ***inputs, size_t *n)
+{
+   FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+   char *line = NULL;
+   size_t line_sz = 0, alloc = *n;
+   ssize_t len;
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to open manifest %s\n", filename);
+      return -1;
+   }
+
+   while ((len = getline(&line, &line_sz, f)) >= 0)
+   {
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+         line[--len] = '\0';
+
+      if (len == 0)
+         continue;
+
+      if (*n == alloc)
+      {
+         char **in;
+
+         alloc = alloc ? alloc * 2 : 1024;
+         in = realloc(*inputs, alloc * sizeof(*in));
+
+         if (in == NULL)
+            goto err;
+
+         *inputs = in;
+      }
+
+      if (((*inputs)[*n] = strdup(line)) == NULL)
+         goto err;
+
+      (*n)++;
+   }
+
+   free(line);
+
+   if (f != stdin)
+      fclose(f);
+
+   return 0;
+
+err:
+   fprintf(stderr, "Unable to allocate memory.\n");
+   free(line);
+
+   if (f != stdin)
+      fclose(f);
+
+   return -1;
+}
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: ktx2raw in_file out_file\n"
+      "       ktx2raw -batch [OPTION...] [in_file...]\n"
+      "Dumps KTX file to raw data.\n"
+      "Batch options:\n"
+      "  -manifest FILE \tAlso read input files from FILE, one per line, "
+      "or from stdin if FILE is '-'\n"
+      "  -outdir DIR    \tWrite each texture to DIR, named after its input "
+      "with the extension '.raw'\n"
+      "  -cat FILE      \tWrite every texture to FILE, one after the other "
+      "in the order of the inputs\n"
+      "  -threads N     \tNumber of threads (default: number of CPUs)\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int batch(char *argv[])
+{
+   struct batch_s b = { 0 };
+   const char *cat_file = NULL;
+   pthread_t *threads;
+   unsigned n_threads = 0, n_started = 0;
+   size_t alloc = 0;
+   uint64_t start_time, elapsed;
+   int ret = EXIT_SUCCESS;
+   char **arg;
+
+   for (arg = argv + 2; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-manifest") == 0 && arg[1] != NULL)
+      {
+         if (read_manifest(*(++arg), &b.inputs, &b.n_inputs) != 0)
+            return EXIT_FAILURE;
+
+         alloc = b.n_inputs;
+      }
+      else if (strcmp(*arg, "-outdir") == 0 && arg[1] != NULL)
+         b.out_dir = *(++arg);
+      else if (strcmp(*arg, "-cat") == 0 && arg[1] != NULL)
+         cat_file = *(++arg);
+      else if (strcmp(*arg, "-threads") == 0 && arg[1] != NULL)
+         n_threads = strtoul(*(++arg), NULL, 10);
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'ktx2raw -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   for (; *arg != NULL; arg++)
+   {
+      if (b.n_inputs == alloc)
+      {
+         char **in;
+
+         alloc = alloc ? alloc * 2 : 1024;
+         in = realloc(b.inputs, alloc * sizeof(*in));
+
+         if (in == NULL)
+         {
+            fprintf(stderr, "Unable to allocate memory.\n");
+            return EXIT_FAILURE;
+         }
+
+         b.inputs = in;
+      }
+
+      if ((b.inputs[b.n_inputs++] = strdup(*arg)) == NULL)
+      {
+         fprintf(stderr, "Unable to allocate memory.\n");
+         return EXIT_FAILURE;
+      }
+   }
+
+   if ((b.out_dir == NULL) == (cat_file == NULL))
+   {
+      fprintf(stderr, "Either '-outdir' or '-cat' must be given.\n"
+              "Try 'ktx2raw -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (n_threads == 0)
+   {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      n_threads = n > 0 ? n : 1;
+   }
+
+   if (cat_file != NULL)
+   {
+      b.cat = fopen(cat_file, "wb");
+
+      if (b.cat == NULL)
+      {
+         fprintf(stderr, "Unable to create %s\n", cat_file);
+         return EXIT_FAILURE;
+      }
+
+      setvbuf(b.cat, NULL, _IOFBF, CAT_BUF_SIZE);
+   }
+
+   b.n_slots = n_threads * 4;
+   b.slots = calloc(b.n_slots, sizeof(*b.slots));
+   b.ready = calloc(b.n_slots, sizeof(*b.ready));
+   threads = calloc(n_threads, sizeof(*threads));
+
+   if (b.slots == NULL || b.ready == NULL || threads == NULL)
+   {
+      fprintf(stderr, "Unable to allocate memory.\n");
+      return EXIT_FAILURE;
+   }
+
+   pthread_mutex_init(&b.lock, NULL);
+   pthread_cond_init(&b.cond, NULL);
+   start_time = now_ms();
+
+   for (; n_started < n_threads; n_started++)
+   {
+      if (pthread_create(&threads[n_started], NULL, batch_worker, &b) != 0)
+         break;
+   }
+
+   if (n_started == 0)
+   {
+      fprintf(stderr, "Unable to create thread.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (unsigned t = 0; t < n_started; t++)
+      pthread_join(threads[t], NULL);
+
+   if (b.cat != NULL && fclose(b.cat) != 0)
+   {
+      fprintf(stderr, "Unable to write %s\n", cat_file);
+      ret = EXIT_FAILURE;
+   }
+
+   elapsed = now_ms() - start_time;
+   fprintf(stdout, "Converted %lu of %lu files with %u threads in %.2f s "
+           "(%.0f files/s)\n", b.n_inputs - b.failed, b.n_inputs, n_started,
+           elapsed / 1000.0, elapsed ? b.n_inputs * 1000.0 / elapsed : 0.0);
+
+   if (b.failed != 0)
+      ret = EXIT_FAILURE;
+
+   for (size_t i = 0; i < b.n_inputs; i++)
+      free(b.inputs[i]);
+
+   pthread_mutex_destroy(&b.lock);
+   pthread_cond_destroy(&b.cond);
+   free(b.inputs);
+   free(b.slots);
+   free(b.ready);
+   free(threads);
+   return ret;
+}
+
 int main(int argc, char *argv[])
 {
    const char *in_file;
    const char *out_file;
 
+   if (argc >= 2 && strcmp(argv[1], "-help") == 0)
+   {
+      print_help();
+      return EXIT_SUCCESS;
+   }
+
+   if (argc >= 2 && strcmp(argv[1], "-batch") == 0)
+      return batch(argv);
+
    if (argc != 3)
    {
       fprintf(stderr, "Usage: ktx2raw in_file out_file\n"
-              "Dumps KTX file to raw data.\n");
+              "Dumps KTX file to raw data.\n"
+              "Try 'ktx2raw -help' for more information.\n");
       return EXIT_FAILURE;
    }
 
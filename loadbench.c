@@ -0,0 +1,577 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Compare the load performance of the same textures in HTS and mTP64 packs.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hts.h"
+#include "mtp64.h"
+
+enum format_e
+{
+   FORMAT_HTS = 0,
+   FORMAT_MTP64
+};
+
+struct options_s
+{
+   const char *hts;
+   const char *mtp64;
+   unsigned runs;
+   unsigned samples;
+   uint64_t seed;
+   unsigned char warm;
+   unsigned char cold;
+};
+
+/* Results of one run, printed as a row of the CSV. */
+struct result_s
+{
+   uint64_t mappings;
+   uint64_t open_ns;
+   uint64_t load_ns;
+   uint64_t load_bytes;
+   /* Latency of each random texture in nanoseconds. */
+   uint64_t *latency;
+   unsigned n_latency;
+   unsigned failures;
+};
+
+/* An entry of the key map of a HTS pack, sorted by CRC for lookups. */
+struct hts_key_s
+{
+   uint64_t crc;
+   uint64_t offset;
+};
+
+/* State of a HTS pack as an emulator would keep it once opened. */
+struct hts_pack_s
+{
+   struct pack_in_s in;
+   struct keymap_s km;
+   struct hts_key_s *keys;
+   struct tex_inflate_s ti;
+   uint8_t *data;
+   size_t data_sz;
+};
+
+static uint64_t mono_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* SplitMix64, so that every run samples the same textures. */
+static uint64_t rng_next(uint64_t *s)
+{
+   uint64_t z = (*s += 0x9E3779B97F4A7C15);
+
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+   return z ^ (z >> 31);
+}
+
+/**
+ * Evicts a file from the page cache, or reads it all into the cache. All
+ * caches are dropped when running as root, as posix_fadvise() only evicts
+ * pages that no process has mapped.
+ */
+static int prepare_cache(const char *filename, int cold)
+{
+   int fd = open(filename, O_RDONLY);
+
+   if (fd < 0)
+   {
+      fprintf(stderr, "Unable to open %s\n", filename);
+      return -1;
+   }
+
+   if (cold)
+   {
+      FILE *drop;
+
+      sync();
+      drop = fopen("/proc/sys/vm/drop_caches", "w");
+
+      if (drop != NULL)
+      {
+         fputs("3\n", drop);
+         fclose(drop);
+      }
+
+      if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+         fprintf(stderr, "Unable to drop %s from the page cache\n", filename);
+   }
+   else
+   {
+      static uint8_t buf[1 << 16];
+
+      while (read(fd, buf, sizeof(buf)) > 0)
+         ;
+   }
+
+   close(fd);
+   return 0;
+}
+
+static int compare_key(const void *in1, const void *in2)
+{
+   const struct hts_key_s *a = in1;
+   const struct hts_key_s *b = in2;
+
+   return (a->crc > b->crc) - (a->crc < b->crc);
+}
+
+static int compare_u64(const void *in1, const void *in2)
+{
+   uint64_t a = *(const uint64_t *)in1;
+   uint64_t b = *(const uint64_t *)in2;
+
+   return (a > b) - (a < b);
+}
+
+/* Opens a HTS pack and reads its key map into a table sorted by CRC. */
+static int hts_open(struct hts_pack_s *p, const char *filename)
+{
+   memset(p, 0, sizeof(*p));
+
+   if (pack_open(&p->in, filename) != 0)
+      return -1;
+
+   if (read_keymap(&p->in, filename, hts_keymap_offset(&p->in), &p->km) != 0 ||
+         tex_inflate_init(&p->ti) != 0)
+      return -1;
+
+   p->keys = malloc((p->km.n + 1) * sizeof(*p->keys));
+
+   if (p->keys == NULL)
+      return -1;
+
+   for (size_t i = 0; i < p->km.n; i++)
+   {
+      p->keys[i].crc = p->km.crc[i];
+      p->keys[i].offset = p->km.offset[i];
+   }
+
+   qsort(p->keys, p->km.n, sizeof(*p->keys), compare_key);
+   return 0;
+}
+
+static void hts_close(struct hts_pack_s *p)
+{
+   tex_inflate_end(&p->ti);
+   pack_close(&p->in);
+   free_keymap(&p->km);
+   free(p->keys);
+   free(p->data);
+   memset(p, 0, sizeof(*p));
+}
+
+/**
+ * Reads and decompresses the texture at the given offset. Returns the size of
+ * the texture, or 0 on failure.
+ */
+static size_t hts_load(struct hts_pack_s *p, uint64_t offset, uint8_t **out,
+                       size_t *out_sz)
+{
+   uint8_t hdr_buf[HTS_RECORD_HDR_SZ];
+   struct hts_record_s rec;
+   const uint8_t *hdr, *data;
+   size_t max_len, len;
+
+   hdr = pack_get(&p->in, offset, hdr_buf, sizeof(hdr_buf));
+
+   if (hdr == NULL)
+      return 0;
+
+   hts_parse_record(&rec, hdr);
+
+   if (rec.w <= 0 || rec.h <= 0 || rec.data_sz < 0)
+      return 0;
+
+   max_len = (size_t)rec.w * (size_t)rec.h * sizeof(uint32_t);
+
+   if (p->in.map == NULL &&
+         reserve_buf(&p->data, &p->data_sz, rec.data_sz) != 0)
+      return 0;
+
+   data = pack_get(&p->in, offset + sizeof(hdr_buf), p->data, rec.data_sz);
+
+   if (data == NULL || reserve_buf(out, out_sz, max_len) != 0)
+      return 0;
+
+   if (!(rec.fmt & GL_TEXFMT_GZ))
+   {
+      if ((size_t)rec.data_sz > max_len)
+         return 0;
+
+      /* Copied as an emulator copies it to its texture cache. */
+      memcpy(*out, data, rec.data_sz);
+      return rec.data_sz;
+   }
+
+   if (tex_inflate(&p->ti, *out, max_len, &len, data, rec.data_sz) != 0)
+      return 0;
+
+   return len;
+}
+
+static size_t mtp64_load(struct mtp64_s *pack, uint32_t crc, uint8_t **out,
+                         size_t *out_sz)
+{
+   struct mtp64_texture_s tex;
+   const uint8_t *data;
+   size_t len;
+
+   if (mtp64_lookup(pack, crc, &tex) != 0)
+      return 0;
+
+   data = mtp64_decode(pack, &tex, &len);
+
+   if (data == NULL || reserve_buf(out, out_sz, len) != 0)
+      return 0;
+
+   memcpy(*out, data, len);
+   return len;
+}
+
+/**
+ * Opens a pack, loads random textures one at a time and then loads every
+ * texture of the pack, as an emulator would when preloading a pack.
+ */
+static int run_hts(const struct options_s *opts, int cold, struct result_s *r)
+{
+   struct hts_pack_s p;
+   uint8_t *out = NULL;
+   size_t out_sz = 0;
+   uint64_t s = opts->seed;
+   uint64_t start;
+   int ret = -1;
+
+   if (prepare_cache(opts->hts, cold) != 0)
+      return -1;
+
+   start = mono_ns();
+
+   if (hts_open(&p, opts->hts) != 0)
+   {
+      fprintf(stderr, "Unable to open %s\n", opts->hts);
+      goto out;
+   }
+
+   r->open_ns = mono_ns() - start;
+   r->mappings = p.km.n;
+
+   for (unsigned i = 0; i < opts->samples && p.km.n != 0; i++)
+   {
+      uint64_t crc = p.km.crc[rng_next(&s) % p.km.n];
+      const struct hts_key_s key = { crc, 0 }, *found;
+
+      start = mono_ns();
+      found = bsearch(&key, p.keys, p.km.n, sizeof(key), compare_key);
+
+      if (found == NULL || hts_load(&p, found->offset, &out, &out_sz) == 0)
+         r->failures++;
+
+      r->latency[r->n_latency++] = mono_ns() - start;
+   }
+
+   /* A pack that is not compressed is mapped, so its pages are only evicted
+    * once it is closed. */
+   if (cold)
+   {
+      hts_close(&p);
+
+      if (prepare_cache(opts->hts, cold) != 0 || hts_open(&p, opts->hts) != 0)
+         goto out;
+   }
+
+   /* Records are read in the order of the pack. */
+   start = mono_ns();
+
+   if (sort_keymap(&p.km) != 0)
+      goto out;
+
+   for (size_t i = 0; i < p.km.n; i++)
+   {
+      size_t len = hts_load(&p, p.km.offset[i], &out, &out_sz);
+
+      if (len == 0)
+         r->failures++;
+
+      r->load_bytes += len;
+   }
+
+   r->load_ns = mono_ns() - start;
+   ret = 0;
+
+out:
+   hts_close(&p);
+   free(out);
+   return ret;
+}
+
+static int run_mtp64(const struct options_s *opts, int cold,
+                     struct result_s *r)
+{
+   struct mtp64_s *pack;
+   uint8_t *out = NULL;
+   size_t out_sz = 0;
+   uint64_t s = opts->seed;
+   uint64_t start;
+   uint32_t n;
+
+   if (prepare_cache(opts->mtp64, cold) != 0)
+      return -1;
+
+   start = mono_ns();
+   pack = mtp64_open(opts->mtp64);
+
+   if (pack == NULL)
+      return -1;
+
+   r->open_ns = mono_ns() - start;
+   n = mtp64_n_mappings(pack);
+   r->mappings = n;
+
+   for (unsigned i = 0; i < opts->samples && n != 0; i++)
+   {
+      uint32_t crc = mtp64_mapping_crc(pack, rng_next(&s) % n);
+
+      start = mono_ns();
+
+      if (mtp64_load(pack, crc, &out, &out_sz) == 0)
+         r->failures++;
+
+      r->latency[r->n_latency++] = mono_ns() - start;
+   }
+
+   if (cold)
+   {
+      mtp64_close(pack);
+
+      if (prepare_cache(opts->mtp64, cold) != 0)
+         return -1;
+
+      pack = mtp64_open(opts->mtp64);
+
+      if (pack == NULL)
+         return -1;
+   }
+
+   start = mono_ns();
+
+   for (uint32_t i = 0; i < n; i++)
+   {
+      size_t len = mtp64_load(pack, mtp64_mapping_crc(pack, i), &out,
+                              &out_sz);
+
+      if (len == 0)
+         r->failures++;
+
+      r->load_bytes += len;
+   }
+
+   r->load_ns = mono_ns() - start;
+
+   mtp64_close(pack);
+   free(out);
+   return 0;
+}
+
+/**
+ * Runs one benchmark in a child process, so that its peak RSS is not
+ * affected by earlier runs, and prints its results as a CSV row.
+ */
+static int run_child(const struct options_s *opts, enum format_e fmt,
+                     int cold, unsigned run)
+{
+   const char *filename = fmt == FORMAT_HTS ? opts->hts : opts->mtp64;
+   struct result_s r = { 0 };
+   struct rusage ru;
+   struct stat st;
+   double p50 = 0, p99 = 0, mean = 0;
+   int ret;
+
+   r.latency = calloc(opts->samples + 1, sizeof(*r.latency));
+
+   if (r.latency == NULL)
+      return -1;
+
+   if (fmt == FORMAT_HTS)
+      ret = run_hts(opts, cold, &r);
+   else
+      ret = run_mtp64(opts, cold, &r);
+
+   if (ret != 0)
+   {
+      free(r.latency);
+      return -1;
+   }
+
+   if (r.n_latency != 0)
+   {
+      for (unsigned i = 0; i < r.n_latency; i++)
+         mean += r.latency[i];
+
+      mean /= r.n_latency;
+      qsort(r.latency, r.n_latency, sizeof(*r.latency), compare_u64);
+      p50 = r.latency[r.n_latency / 2];
+      p99 = r.latency[(size_t)(r.n_latency * 0.99)];
+   }
+
+   getrusage(RUSAGE_SELF, &ru);
+
+   if (stat(filename, &st) != 0)
+      st.st_size = 0;
+
+   fprintf(stdout, "%s,%s,%u,%lu,%ld,%.3f,%.3f,%.1f,%u,%.2f,%.2f,%.2f,%ld,%u\n",
+           fmt == FORMAT_HTS ? "hts" : "mtp64", cold ? "cold" : "warm", run,
+           r.mappings, (long)st.st_size, r.open_ns / 1e6, r.load_ns / 1e6,
+           r.load_ns ? r.load_bytes / (r.load_ns / 1e9) / (1024 * 1024) : 0,
+           r.n_latency, mean / 1e3, p50 / 1e3, p99 / 1e3, ru.ru_maxrss,
+           r.failures);
+   fflush(stdout);
+
+   free(r.latency);
+   return r.failures != 0 ? -1 : 0;
+}
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: loadbench [OPTION...] HTS MTP64\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -runs N    \tNumber of runs of each benchmark (default 3)\n"
+      "  -samples N \tNumber of random textures to load (default 1000)\n"
+      "  -seed N    \tSeed used to choose random textures (default 1)\n"
+      "  -warm      \tOnly run with the packs in the page cache\n"
+      "  -cold      \tOnly run with the packs evicted from the page cache\n"
+      "\n"
+      "HTS and MTP64 should hold the same textures, such as packs written "
+      "by 'packgen', or a HTS pack and the output of 'hts2mtp64'.\n"
+      "Each run opens the pack, loads random textures one at a time, and "
+      "then loads every texture mapped by the pack. Each run is a separate "
+      "process, so that its peak RSS can be measured.\n"
+      "Cold runs evict the pack from the page cache before opening it and "
+      "again before loading every texture. All caches are dropped when run "
+      "as root.\n"
+      "\n"
+      "Results are written as CSV to stdout, with the columns:\n"
+      "  format, cache, run, mappings, file_bytes, open_ms, load_ms, "
+      "load_mib_s, samples, random_mean_us, random_p50_us, random_p99_us, "
+      "peak_rss_kib, failures\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int main(int argc, char *argv[])
+{
+   struct options_s opts = { .runs = 3, .samples = 1000, .seed = 1 };
+   int failed = 0;
+   char **arg;
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "A command must be specified.\n"
+              "Try 'loadbench -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-runs") == 0 && arg[1] != NULL)
+         opts.runs = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-samples") == 0 && arg[1] != NULL)
+         opts.samples = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-seed") == 0 && arg[1] != NULL)
+         opts.seed = strtoull(*(++arg), NULL, 0);
+      else if (strcmp(*arg, "-warm") == 0)
+         opts.warm = 1;
+      else if (strcmp(*arg, "-cold") == 0)
+         opts.cold = 1;
+      else if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'loadbench -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (arg[0] == NULL || arg[1] == NULL || arg[2] != NULL)
+   {
+      fprintf(stderr, "A HTS and an mTP64 texture pack must be specified.\n"
+              "Try 'loadbench -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   opts.hts = arg[0];
+   opts.mtp64 = arg[1];
+
+   if (!opts.warm && !opts.cold)
+      opts.warm = opts.cold = 1;
+
+   fprintf(stdout, "format,cache,run,mappings,file_bytes,open_ms,load_ms,"
+           "load_mib_s,samples,random_mean_us,random_p50_us,random_p99_us,"
+           "peak_rss_kib,failures\n");
+   fflush(stdout);
+
+   for (int cold = 0; cold <= 1; cold++)
+   {
+      if ((cold && !opts.cold) || (!cold && !opts.warm))
+         continue;
+
+      for (unsigned run = 0; run < opts.runs; run++)
+      {
+         for (enum format_e fmt = FORMAT_HTS; fmt <= FORMAT_MTP64; fmt++)
+         {
+            pid_t pid = fork();
+            int status;
+
+            if (pid == 0)
+               _exit(run_child(&opts, fmt, cold, run) == 0 ? 0 : 1);
+
+            if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+                  !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+               fprintf(stderr, "%s run %u failed\n",
+                       fmt == FORMAT_HTS ? opts.hts : opts.mtp64, run);
+               failed = 1;
+            }
+         }
+      }
+   }
+
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
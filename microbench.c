@@ -0,0 +1,720 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Microbenchmarks of the kernels used to build and read texture packs.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define LZ4F_STATIC_LINKING_ONLY 1
+#include <lz4.h>
+#include <lz4frame.h>
+#include <lz4hc.h>
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+#include "etc1.h"
+#include "hts.h"
+#include "mtp64.h"
+
+#define CRC32_STR_LEN      8
+
+/* Number of file names, keys and CRCs that kernels cycle through. */
+#define N_ITEMS            4096
+
+/* Entries sorted by each sort kernel. */
+#define N_SORT             (1 << 16)
+
+/* Each texture is 256x256 RGBA8888. */
+#define TEX_W              256
+#define TEX_H              256
+#define TEX_SZ             (TEX_W * TEX_H * 4)
+
+/* Same size as the BMP header written by hts2bmp. */
+#define BMP_HDR_SZ         138
+
+/* Files that the BMP kernel writes in turn. */
+#define N_BMP              64
+
+struct kernel_s
+{
+   const char *name;
+   void (*run)(void);
+   /* Bytes processed by each operation, or 0 if throughput is meaningless. */
+   size_t bytes;
+};
+
+struct sort_entry_s
+{
+   uint64_t key;
+   uint64_t value;
+};
+
+/* Inputs shared by the kernels, made once before any are timed. */
+static struct
+{
+   char names[N_ITEMS][32];
+   uint32_t crcs[N_ITEMS];
+   size_t cursor;
+
+   struct sort_entry_s *unsorted;
+   struct sort_entry_s *sorted;
+   struct keymap_s km;
+
+   uint8_t *tex;
+   uint8_t *dict;
+   size_t dict_sz;
+   uint8_t *out;
+   size_t out_cap;
+   uint8_t *frame;
+   size_t frame_sz;
+   uint8_t *frame_dict;
+   size_t frame_dict_sz;
+   uint8_t *block;
+   size_t block_sz;
+   uint8_t *block_dict;
+   size_t block_dict_sz;
+   LZ4F_cctx *cctx;
+   LZ4F_dctx *dctx;
+   LZ4F_CDict *cdict;
+   LZ4_streamHC_t *hc;
+
+   /* The texture compressed with zlib, as in a HTS record. */
+   uint8_t *gz;
+   uLongf gz_sz;
+   struct tex_inflate_s ti;
+   int have_ti;
+
+   struct mtp64_s *pack;
+   char pack_name[64];
+
+   uint8_t *etc1;
+   char dir[64];
+} b;
+
+/* Results are written here so that kernels are not optimised away. */
+static volatile uint64_t sink;
+
+static uint64_t mono_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* SplitMix64, so that every run uses the same inputs. */
+static uint64_t rng_next(uint64_t *s)
+{
+   uint64_t z = (*s += 0x9E3779B97F4A7C15);
+
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+   return z ^ (z >> 31);
+}
+
+static size_t next_item(void)
+{
+   return b.cursor++ % N_ITEMS;
+}
+
+/* Takes the CRC from the last eight characters before the extension, as
+ * ktx2mtp64 does for each KTX file. */
+static void bench_crc_parse(void)
+{
+   const char *name = b.names[next_item()];
+   const char *dot = strrchr(name, '.');
+   char crcstr[CRC32_STR_LEN + 1];
+
+   strncpy(crcstr, dot - CRC32_STR_LEN, CRC32_STR_LEN);
+   crcstr[CRC32_STR_LEN] = '\0';
+   sink = strtol(crcstr, NULL, 16);
+}
+
+static int compare_key(const void *in1, const void *in2)
+{
+   const struct sort_entry_s *e1 = in1;
+   const struct sort_entry_s *e2 = in2;
+
+   if (e1->key < e2->key)
+      return -1;
+   else if (e1->key > e2->key)
+      return 1;
+
+   return 0;
+}
+
+static void bench_sort_qsort(void)
+{
+   memcpy(b.sorted, b.unsorted, N_SORT * sizeof(*b.sorted));
+   qsort(b.sorted, N_SORT, sizeof(*b.sorted), compare_key);
+   sink = b.sorted[0].key;
+}
+
+static void bench_sort_radix(void)
+{
+   for (size_t i = 0; i < N_SORT; i++)
+   {
+      b.km.offset[i] = b.unsorted[i].key;
+      b.km.crc[i] = b.unsorted[i].value;
+   }
+
+   sort_keymap(&b.km);
+   sink = b.km.offset[0];
+}
+
+static void bench_xxh64(void)
+{
+   sink = XXH64(b.tex, TEX_SZ, 0);
+}
+
+static void bench_xxh3(void)
+{
+   sink = XXH3_64bits(b.tex, TEX_SZ);
+}
+
+static void bench_lz4f_compress(void)
+{
+   LZ4F_preferences_t prefs = LZ4F_INIT_PREFERENCES;
+
+   prefs.compressionLevel = LZ4HC_CLEVEL_DEFAULT;
+   sink = LZ4F_compressFrame(b.out, b.out_cap, b.tex, TEX_SZ, &prefs);
+}
+
+static void bench_lz4f_compress_cdict(void)
+{
+   LZ4F_preferences_t prefs = LZ4F_INIT_PREFERENCES;
+
+   prefs.compressionLevel = LZ4HC_CLEVEL_DEFAULT;
+   sink = LZ4F_compressFrame_usingCDict(b.cctx, b.out, b.out_cap, b.tex,
+                                        TEX_SZ, b.cdict, &prefs);
+}
+
+static void bench_lz4_block_compress(void)
+{
+   sink = LZ4_compress_HC((const char *)b.tex, (char *)b.out, TEX_SZ,
+                          b.out_cap, LZ4HC_CLEVEL_DEFAULT);
+}
+
+static void bench_lz4_block_compress_dict(void)
+{
+   LZ4_resetStreamHC_fast(b.hc, LZ4HC_CLEVEL_DEFAULT);
+   LZ4_loadDictHC(b.hc, (const char *)b.dict, b.dict_sz);
+   sink = LZ4_compress_HC_continue(b.hc, (const char *)b.tex, (char *)b.out,
+                                   TEX_SZ, b.out_cap);
+}
+
+static void lz4f_decompress(const uint8_t *src, size_t src_sz,
+                            const uint8_t *dict, size_t dict_sz)
+{
+   size_t dst_sz = b.out_cap;
+
+   LZ4F_resetDecompressionContext(b.dctx);
+   sink = LZ4F_decompress_usingDict(b.dctx, b.out, &dst_sz, src, &src_sz,
+                                    dict, dict_sz, NULL);
+}
+
+static void bench_lz4f_decompress(void)
+{
+   lz4f_decompress(b.frame, b.frame_sz, NULL, 0);
+}
+
+static void bench_lz4f_decompress_dict(void)
+{
+   lz4f_decompress(b.frame_dict, b.frame_dict_sz, b.dict, b.dict_sz);
+}
+
+static void bench_lz4_block_decompress(void)
+{
+   sink = LZ4_decompress_safe((const char *)b.block, (char *)b.out,
+                              b.block_sz, b.out_cap);
+}
+
+static void bench_lz4_block_decompress_dict(void)
+{
+   sink = LZ4_decompress_safe_usingDict((const char *)b.block_dict,
+                                        (char *)b.out, b.block_dict_sz,
+                                        b.out_cap, (const char *)b.dict,
+                                        b.dict_sz);
+}
+
+/* Decodes a HTS record as hts2bmp did before keeping an inflate stream for
+ * each thread: into a new buffer, which is then copied and freed. */
+static void bench_zlib_uncompress(void)
+{
+   uLongf dst_len = TEX_SZ;
+   uint8_t *dst = malloc(dst_len);
+
+   if (dst == NULL)
+      return;
+
+   sink = uncompress(dst, &dst_len, b.gz, b.gz_sz);
+   memcpy(b.out, dst, dst_len);
+   free(dst);
+}
+
+/* Decodes a HTS record as hts2bmp does now. */
+static void bench_zlib_tex_inflate(void)
+{
+   size_t dst_len;
+
+   sink = tex_inflate(&b.ti, b.out, TEX_SZ, &dst_len, b.gz, b.gz_sz);
+}
+
+static void bench_map_lookup(void)
+{
+   struct mtp64_texture_s tex;
+
+   sink = mtp64_lookup(b.pack, b.crcs[next_item()], &tex);
+}
+
+static void bench_etc1_encode(void)
+{
+   etc1_encode_image(b.etc1, b.tex, TEX_W, TEX_H);
+   sink = b.etc1[0];
+}
+
+/* Writes a BMP file the way hts2bmp does, replacing an earlier file. */
+static void bench_bmp_write(void)
+{
+   static const uint8_t hdr[BMP_HDR_SZ] = { 'B', 'M' };
+   char name[96];
+   FILE *f;
+
+   snprintf(name, sizeof(name), "%s/%02zu.bmp", b.dir,
+            next_item() % N_BMP);
+   f = fopen(name, "wb");
+
+   if (f == NULL)
+      return;
+
+   fwrite(hdr, 1, sizeof(hdr), f);
+   fwrite(b.tex, 1, TEX_SZ, f);
+   fclose(f);
+}
+
+static const struct kernel_s kernels[] =
+{
+   { "crc_parse",                bench_crc_parse,                 0 },
+   { "sort_qsort",               bench_sort_qsort,
+     N_SORT * sizeof(struct sort_entry_s) },
+   { "sort_radix",               bench_sort_radix,
+     N_SORT * sizeof(struct sort_entry_s) },
+   { "xxh64",                    bench_xxh64,                     TEX_SZ },
+   { "xxh3",                     bench_xxh3,                      TEX_SZ },
+   { "lz4f_compress",            bench_lz4f_compress,             TEX_SZ },
+   { "lz4f_compress_cdict",      bench_lz4f_compress_cdict,       TEX_SZ },
+   { "lz4_block_compress",       bench_lz4_block_compress,        TEX_SZ },
+   { "lz4_block_compress_dict",  bench_lz4_block_compress_dict,   TEX_SZ },
+   { "lz4f_decompress",          bench_lz4f_decompress,           TEX_SZ },
+   { "lz4f_decompress_dict",     bench_lz4f_decompress_dict,      TEX_SZ },
+   { "lz4_block_decompress",     bench_lz4_block_decompress,      TEX_SZ },
+   { "lz4_block_decompress_dict", bench_lz4_block_decompress_dict, TEX_SZ },
+   { "zlib_uncompress",          bench_zlib_uncompress,           TEX_SZ },
+   { "zlib_tex_inflate",         bench_zlib_tex_inflate,          TEX_SZ },
+   { "map_lookup",               bench_map_lookup,                0 },
+   { "etc1_encode",              bench_etc1_encode,               TEX_SZ },
+   { "bmp_write",                bench_bmp_write,
+     BMP_HDR_SZ + TEX_SZ }
+};
+
+/**
+ * Fills an RGBA8888 texture with a noisy gradient, which compresses about as
+ * well as a typical upscaled texture.
+ */
+static void make_texture(uint8_t *tex, uint64_t seed)
+{
+   for (size_t y = 0; y < TEX_H; y++)
+   {
+      for (size_t x = 0; x < TEX_W; x++)
+      {
+         uint8_t *px = tex + (y * TEX_W + x) * 4;
+         uint64_t r = rng_next(&seed);
+
+         px[0] = x + (r & 3);
+         px[1] = y + ((r >> 8) & 3);
+         px[2] = (x + y) / 2;
+         px[3] = 0xFF;
+      }
+   }
+}
+
+static int compare_crc32(const void *in1, const void *in2)
+{
+   uint32_t crc1 = *(const uint32_t *)in1;
+   uint32_t crc2 = *(const uint32_t *)in2;
+
+   return (crc1 > crc2) - (crc1 < crc2);
+}
+
+/**
+ * Writes an mTP64 pack of N_ITEMS mappings to one texture, so that lookups
+ * are timed through the reader itself.
+ */
+static int make_pack(void)
+{
+   struct mtp64_header_s hdr = MTP64_HEADER_INIT;
+   static const uint8_t entry[16] =
+   {
+      /* RGBA8888, 4 bytes, 1x1, and padding to a multiple of eight. */
+      1, 4, 0, 0, 0, 1, 0, 1, 0, 0xFF, 0xFF, 0xFF, 0xFF
+   };
+   uint32_t sorted[N_ITEMS];
+   size_t map_off = sizeof(hdr) + 4;
+   size_t first = (map_off + N_ITEMS * 8 + 7) & ~(size_t)7;
+   uint8_t zero[8] = { 0 };
+   FILE *f;
+   int fd;
+
+   memcpy(sorted, b.crcs, sizeof(sorted));
+   qsort(sorted, N_ITEMS, sizeof(*sorted), compare_crc32);
+
+   hdr.n_textures = 1;
+   hdr.n_mappings = N_ITEMS;
+   hdr.first_texture_offset = first;
+   hdr.pack_size = (first + sizeof(entry)) / 8;
+
+   strcpy(b.pack_name, "/tmp/microbench-XXXXXX");
+   fd = mkstemp(b.pack_name);
+
+   if (fd < 0 || (f = fdopen(fd, "wb")) == NULL)
+      return -1;
+
+   fwrite(&hdr, 1, sizeof(hdr), f);
+   fwrite(zero, 1, 4, f);
+
+   for (size_t i = 0; i < N_ITEMS; i++)
+   {
+      uint32_t map[2] = { sorted[i], first / 8 };
+      fwrite(map, 1, sizeof(map), f);
+   }
+
+   fwrite(zero, 1, first - map_off - N_ITEMS * 8, f);
+   fwrite(entry, 1, sizeof(entry), f);
+
+   if (fclose(f) != 0)
+      return -1;
+
+   b.pack = mtp64_open(b.pack_name);
+   return b.pack != NULL ? 0 : -1;
+}
+
+/* Makes the inputs of every kernel. Returns 0 on success. */
+static int setup(void)
+{
+   uint64_t seed = 1;
+   LZ4F_preferences_t prefs = LZ4F_INIT_PREFERENCES;
+
+   /* Multiplying by an odd constant gives N_ITEMS distinct CRCs. */
+   for (size_t i = 0; i < N_ITEMS; i++)
+   {
+      b.crcs[i] = (uint32_t)i * 0x9E3779B1;
+      snprintf(b.names[i], sizeof(b.names[i]), "textures/%08X.ktx",
+               b.crcs[i]);
+   }
+
+   b.unsorted = malloc(N_SORT * sizeof(*b.unsorted));
+   b.sorted = malloc(N_SORT * sizeof(*b.sorted));
+   b.km.offset = malloc(N_SORT * sizeof(*b.km.offset));
+   b.km.crc = malloc(N_SORT * sizeof(*b.km.crc));
+   b.km.n = N_SORT;
+
+   if (b.unsorted == NULL || b.sorted == NULL || b.km.offset == NULL ||
+         b.km.crc == NULL)
+      return -1;
+
+   /* Keys are offsets into a pack of up to 4 GiB, as in a HTS key map. */
+   for (size_t i = 0; i < N_SORT; i++)
+   {
+      b.unsorted[i].key = rng_next(&seed) & 0xFFFFFFFF;
+      b.unsorted[i].value = rng_next(&seed);
+   }
+
+   /* A dictionary taken from a similar texture, as a trained one would be. */
+   b.dict_sz = 64 * 1024;
+   b.out_cap = LZ4_compressBound(TEX_SZ);
+   prefs.compressionLevel = LZ4HC_CLEVEL_DEFAULT;
+
+   if (LZ4F_compressFrameBound(TEX_SZ, &prefs) > b.out_cap)
+      b.out_cap = LZ4F_compressFrameBound(TEX_SZ, &prefs);
+
+   b.tex = malloc(TEX_SZ);
+   b.dict = malloc(TEX_SZ);
+   b.out = malloc(b.out_cap);
+   b.frame = malloc(b.out_cap);
+   b.frame_dict = malloc(b.out_cap);
+   b.block = malloc(b.out_cap);
+   b.block_dict = malloc(b.out_cap);
+   b.etc1 = malloc(etc1_image_size(TEX_W, TEX_H));
+   b.hc = LZ4_createStreamHC();
+   b.gz_sz = compressBound(TEX_SZ);
+   b.gz = malloc(b.gz_sz);
+   b.have_ti = tex_inflate_init(&b.ti) == 0;
+
+   if (b.tex == NULL || b.dict == NULL || b.out == NULL || b.frame == NULL ||
+         b.frame_dict == NULL || b.block == NULL || b.block_dict == NULL ||
+         b.etc1 == NULL || b.hc == NULL || b.gz == NULL || !b.have_ti)
+      return -1;
+
+   make_texture(b.tex, 1);
+   make_texture(b.dict, 2);
+
+   if (LZ4F_isError(LZ4F_createCompressionContext(&b.cctx, LZ4F_VERSION)) ||
+         LZ4F_isError(LZ4F_createDecompressionContext(&b.dctx,
+                      LZ4F_VERSION)))
+      return -1;
+
+   b.cdict = LZ4F_createCDict(b.dict, b.dict_sz);
+
+   if (b.cdict == NULL)
+      return -1;
+
+   /* Compressed inputs for the decompression kernels. */
+   b.frame_sz = LZ4F_compressFrame(b.frame, b.out_cap, b.tex, TEX_SZ, &prefs);
+   b.frame_dict_sz = LZ4F_compressFrame_usingCDict(b.cctx, b.frame_dict,
+                     b.out_cap, b.tex, TEX_SZ, b.cdict, &prefs);
+   b.block_sz = LZ4_compress_HC((const char *)b.tex, (char *)b.block,
+                                TEX_SZ, b.out_cap, LZ4HC_CLEVEL_DEFAULT);
+   bench_lz4_block_compress_dict();
+   b.block_dict_sz = sink;
+   memcpy(b.block_dict, b.out, b.block_dict_sz);
+
+   if (LZ4F_isError(b.frame_sz) || LZ4F_isError(b.frame_dict_sz) ||
+         b.block_sz == 0 || b.block_dict_sz == 0 ||
+         compress(b.gz, &b.gz_sz, b.tex, TEX_SZ) != Z_OK)
+      return -1;
+
+   strcpy(b.dir, "/tmp/microbench-XXXXXX");
+
+   if (mkdtemp(b.dir) == NULL)
+      return -1;
+
+   return make_pack();
+}
+
+static void cleanup(void)
+{
+   char name[96];
+
+   for (unsigned i = 0; i < N_BMP; i++)
+   {
+      snprintf(name, sizeof(name), "%s/%02u.bmp", b.dir, i);
+      unlink(name);
+   }
+
+   if (b.dir[0] != '\0')
+      rmdir(b.dir);
+
+   if (b.pack_name[0] != '\0')
+      unlink(b.pack_name);
+
+   mtp64_close(b.pack);
+   LZ4F_freeCDict(b.cdict);
+   LZ4F_freeCompressionContext(b.cctx);
+   LZ4F_freeDecompressionContext(b.dctx);
+   LZ4_freeStreamHC(b.hc);
+
+   if (b.have_ti)
+      tex_inflate_end(&b.ti);
+
+   free(b.unsorted);
+   free(b.sorted);
+   free_keymap(&b.km);
+   free(b.tex);
+   free(b.dict);
+   free(b.out);
+   free(b.frame);
+   free(b.frame_dict);
+   free(b.block);
+   free(b.block_dict);
+   free(b.etc1);
+   free(b.gz);
+}
+
+/**
+ * Times a kernel. The number of operations per batch is doubled until a
+ * batch takes a fifth of min_ns, which also warms the caches and branch
+ * predictors. The fastest of five batches is kept.
+ * Returns the time of one operation in nanoseconds.
+ */
+static double time_kernel(const struct kernel_s *k, uint64_t min_ns,
+                          uint64_t *ops)
+{
+   uint64_t iters = 1, best = UINT64_MAX;
+
+   for (;;)
+   {
+      uint64_t start = mono_ns();
+
+      for (uint64_t i = 0; i < iters; i++)
+         k->run();
+
+      if (mono_ns() - start >= min_ns / 5)
+         break;
+
+      iters *= 2;
+   }
+
+   for (unsigned batch = 0; batch < 5; batch++)
+   {
+      uint64_t start = mono_ns();
+      uint64_t elapsed;
+
+      for (uint64_t i = 0; i < iters; i++)
+         k->run();
+
+      elapsed = mono_ns() - start;
+
+      if (elapsed < best)
+         best = elapsed;
+   }
+
+   *ops = iters * 5;
+   return (double)best / iters;
+}
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: microbench [OPTION...] [KERNEL...]\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -list      \tLists the kernels\n"
+      "  -time MS   \tMinimum time to spend timing each kernel (default "
+      "500)\n"
+      "  -cpu N     \tCPU to run on (default: the current CPU)\n"
+      "\n"
+      "Runs every kernel, or only those named, pinned to one CPU. Each "
+      "kernel is warmed up before it is timed, and the fastest of five "
+      "batches is kept. The time of each operation and the throughput are "
+      "written as CSV to stdout, with the columns:\n"
+      "  kernel, ops, ns_op, gb_s\n"
+      "Throughput is left empty for kernels that do not process a buffer.\n"
+      "Build with 'make MTP64_STATS=0' to time map lookups without the "
+      "reader statistics.\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int main(int argc, char *argv[])
+{
+   const size_t n_kernels = sizeof(kernels) / sizeof(*kernels);
+   uint64_t min_ns = 500 * 1000000ULL;
+   int cpu = sched_getcpu();
+   int ret = EXIT_FAILURE;
+   cpu_set_t set;
+   char **arg;
+
+   (void)argc;
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-time") == 0 && arg[1] != NULL)
+         min_ns = strtoull(*(++arg), NULL, 10) * 1000000;
+      else if (strcmp(*arg, "-cpu") == 0 && arg[1] != NULL)
+         cpu = atoi(*(++arg));
+      else if (strcmp(*arg, "-list") == 0)
+      {
+         for (size_t i = 0; i < n_kernels; i++)
+            puts(kernels[i].name);
+
+         return EXIT_SUCCESS;
+      }
+      else if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'microbench -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   for (char **name = arg; *name != NULL; name++)
+   {
+      size_t i;
+
+      for (i = 0; i < n_kernels; i++)
+         if (strcmp(*name, kernels[i].name) == 0)
+            break;
+
+      if (i == n_kernels)
+      {
+         fprintf(stderr, "Unknown kernel '%s'\n"
+                 "Try 'microbench -list' for the kernels.\n", *name);
+         return EXIT_FAILURE;
+      }
+   }
+
+   /* Moving between CPUs would disturb the caches that are warmed. */
+   CPU_ZERO(&set);
+   CPU_SET(cpu < 0 ? 0 : cpu, &set);
+
+   if (sched_setaffinity(0, sizeof(set), &set) != 0)
+      fprintf(stderr, "Unable to pin to CPU %d\n", cpu);
+
+   if (setup() != 0)
+   {
+      fprintf(stderr, "Unable to prepare the kernels.\n");
+      goto out;
+   }
+
+   fprintf(stdout, "kernel,ops,ns_op,gb_s\n");
+
+   for (size_t i = 0; i < n_kernels; i++)
+   {
+      const struct kernel_s *k = &kernels[i];
+      uint64_t ops;
+      double ns;
+
+      if (*arg != NULL)
+      {
+         char **name;
+
+         for (name = arg; *name != NULL; name++)
+            if (strcmp(*name, k->name) == 0)
+               break;
+
+         if (*name == NULL)
+            continue;
+      }
+
+      ns = time_kernel(k, min_ns, &ops);
+      fprintf(stdout, "%s,%lu,%.1f,", k->name, ops, ns);
+
+      if (k->bytes != 0)
+         fprintf(stdout, "%.3f", k->bytes / ns);
+
+      fputc('\n', stdout);
+      fflush(stdout);
+   }
+
+   ret = EXIT_SUCCESS;
+
+out:
+   cleanup();
+   return ret;
+}
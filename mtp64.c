@@ -0,0 +1,873 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Reader for mTP64 texture packs.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LZ4F_STATIC_LINKING_ONLY 1
+#include <lz4frame.h>
+
+#include "evtrace.h"
+#include "mtp64.h"
+#include "tracebuf.h"
+
+struct mtp64_s
+{
+   const uint8_t *file;
+   size_t file_sz;
+
+   const struct mtp64_header_s *hdr;
+   const struct mtp64_map_s *map;
+   uint32_t n_mappings;
+
+   const uint8_t *dictionary;
+   size_t dictionary_sz;
+
+   /* Unique to each time a pack is opened, as a pack that is closed and
+    * another that is opened may be given the same address. */
+   uint64_t generation;
+};
+
+/* Decompression state kept for each thread that calls mtp64_decode(). */
+struct mtp64_tls_s
+{
+   LZ4F_dctx *dctx;
+   uint8_t *buf;
+   size_t buf_sz;
+
+   /* The last texture decoded by this thread, from the pack with the given
+    * generation, or 0 if none. Duplicate textures are mapped to more than
+    * one CRC, so this is frequently requested again. Packs closed by other
+    * threads are never matched, as their generation is not reused. */
+   uint64_t last_generation;
+   uint64_t last_offset;
+   size_t last_sz;
+};
+
+static pthread_key_t tls_key;
+static pthread_once_t tls_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct mtp64_tls_s *tls;
+
+/* Generation of the last pack opened. */
+static uint64_t pack_generation;
+
+static void write_records(FILE *f, const void *recs, unsigned n,
+                          unsigned thread);
+
+static struct tracebuf_s trace =
+   TRACEBUF_INIT(sizeof(struct mtp64_trace_record_s), write_records);
+static _Thread_local struct tracebuf_thread_s *tls_trace;
+
+#ifdef MTP64_STATS
+/* Log-linear histogram in the style of HdrHistogram. Values below
+ * HIST_SUB_BUCKETS are recorded exactly, and larger values are recorded with
+ * a relative error of at most 1/HIST_SUB_BUCKETS. */
+#define HIST_SUB_BITS      4
+#define HIST_SUB_BUCKETS   (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS       (64 << HIST_SUB_BITS)
+
+/* Latency is timed for one call in every MTP64_STATS_SAMPLE, which must be a
+ * power of two. Reading the clock twice can cost more than a lookup, so
+ * timing every call would slow the reader far more than counting does. */
+#ifndef MTP64_STATS_SAMPLE
+#define MTP64_STATS_SAMPLE 256
+#endif
+
+struct mtp64_hist_s
+{
+   uint64_t count[HIST_BUCKETS];
+   uint64_t total;
+   uint64_t min;
+   uint64_t max;
+   /* Calls made, of which every MTP64_STATS_SAMPLE-th is timed. */
+   uint64_t calls;
+};
+
+/* Lookups are counted by the calls of their histogram, and hits are the
+ * lookups that did not miss, so nothing more is counted for a hit. */
+struct mtp64_stats_s
+{
+   uint64_t misses;
+   uint64_t bytes_read;
+   uint64_t bytes_decoded;
+   uint64_t cache_hits;
+   struct mtp64_hist_s lookup;
+   struct mtp64_hist_s decode;
+   struct mtp64_stats_s *next;
+};
+
+/* Statistics for each thread are never freed, so that a snapshot still
+ * includes threads that have exited. */
+static struct mtp64_stats_s *stats_list;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local struct mtp64_stats_s *tls_stats;
+
+/* Each counter is only written by its own thread, so a relaxed load and store
+ * is sufficient and avoids a locked instruction. */
+#define STAT_ADD(var, n) \
+   __atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (n), \
+                    __ATOMIC_RELAXED)
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define stat_ticks() __rdtsc()
+#else
+#define stat_ticks() tracebuf_now()
+#endif
+
+/* Reference points used to convert ticks to nanoseconds. */
+static uint64_t stats_epoch_ticks;
+static uint64_t stats_epoch_ns;
+
+static struct mtp64_stats_s *stats_get(void)
+{
+   if (tls_stats != NULL)
+      return tls_stats;
+
+   tls_stats = calloc(1, sizeof(*tls_stats));
+
+   if (tls_stats == NULL)
+      return NULL;
+
+   tls_stats->lookup.min = UINT64_MAX;
+   tls_stats->decode.min = UINT64_MAX;
+
+   pthread_mutex_lock(&stats_lock);
+
+   if (stats_epoch_ns == 0)
+   {
+      stats_epoch_ns = tracebuf_now();
+      stats_epoch_ticks = stat_ticks();
+   }
+
+   tls_stats->next = stats_list;
+   stats_list = tls_stats;
+   pthread_mutex_unlock(&stats_lock);
+
+   return tls_stats;
+}
+
+static unsigned hist_bucket(uint64_t v)
+{
+   unsigned shift;
+
+   if (v < HIST_SUB_BUCKETS)
+      return v;
+
+   shift = (63 - __builtin_clzll(v)) - HIST_SUB_BITS;
+   return ((shift + 1) << HIST_SUB_BITS) +
+          ((v >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+static uint64_t hist_bucket_lower(unsigned b)
+{
+   unsigned shift;
+
+   if (b < HIST_SUB_BUCKETS)
+      return b;
+
+   shift = (b >> HIST_SUB_BITS) - 1;
+   return (uint64_t)(HIST_SUB_BUCKETS + (b & (HIST_SUB_BUCKETS - 1))) << shift;
+}
+
+static void hist_record(struct mtp64_hist_s *h, uint64_t v)
+{
+   STAT_ADD(h->count[hist_bucket(v)], 1);
+   STAT_ADD(h->total, v);
+
+   if (v < h->min)
+      __atomic_store_n(&h->min, v, __ATOMIC_RELAXED);
+
+   if (v > h->max)
+      __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/* Returns the start of a call if it is to be timed, and 0 otherwise. */
+static uint64_t hist_start(struct mtp64_hist_s *h)
+{
+   uint64_t calls = h->calls;
+
+   STAT_ADD(h->calls, 1);
+   return (calls & (MTP64_STATS_SAMPLE - 1)) == 0 ? stat_ticks() : 0;
+}
+
+#define STATS_DECL(h)    struct mtp64_stats_s *st = stats_get(); \
+                         uint64_t st_start = st != NULL ? hist_start(&st->h) : 0
+#define STATS_ADD(f, n)  do{if(st != NULL) STAT_ADD(st->f, n);}while(0)
+#define STATS_TIME(h)    do{if(st_start != 0) \
+                            hist_record(&st->h, stat_ticks() - st_start);}while(0)
+#else
+#define STATS_DECL(h)    do{}while(0)
+#define STATS_ADD(f, n)  do{}while(0)
+#define STATS_TIME(h)    do{}while(0)
+#endif
+
+/* Called with the trace's lock held. */
+static void write_records(FILE *f, const void *recs, unsigned n,
+                          unsigned thread)
+{
+   (void)thread;
+   fwrite(recs, sizeof(struct mtp64_trace_record_s), n, f);
+}
+
+static void trace_record(uint32_t crc, uint8_t hit, uint64_t start)
+{
+   struct mtp64_trace_record_s *r;
+   uint64_t now = tracebuf_now();
+   unsigned thread;
+
+   r = tracebuf_append(&trace, &tls_trace, &thread);
+
+   if (r == NULL)
+      return;
+
+   r->timestamp = start - trace.epoch;
+   r->crc = crc;
+   r->latency = now - start > UINT32_MAX ? UINT32_MAX : now - start;
+   r->thread = thread;
+   r->hit = hit;
+   r->unused = 0;
+}
+
+int mtp64_trace_start(const char *filename)
+{
+   struct mtp64_trace_header_s hdr = { MTP64_TRACE_MAGIC,
+             MTP64_TRACE_VERSION, sizeof(struct mtp64_trace_record_s)
+   };
+   FILE *f = fopen(filename, "wb");
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to create trace file %s\n", filename);
+      return -1;
+   }
+
+   fwrite(&hdr, sizeof(hdr), 1, f);
+   tracebuf_start(&trace, f);
+   return 0;
+}
+
+void mtp64_trace_stop(void)
+{
+   FILE *f = tracebuf_stop(&trace);
+
+   if (f != NULL)
+      fclose(f);
+}
+
+static void tls_free(void *p)
+{
+   struct mtp64_tls_s *t = p;
+
+   LZ4F_freeDecompressionContext(t->dctx);
+   free(t->buf);
+   free(t);
+}
+
+static void tls_key_create(void)
+{
+   pthread_key_create(&tls_key, tls_free);
+}
+
+static struct mtp64_tls_s *tls_get(void)
+{
+   if (tls != NULL)
+      return tls;
+
+   pthread_once(&tls_key_once, tls_key_create);
+   tls = calloc(1, sizeof(*tls));
+
+   if (tls == NULL)
+      return NULL;
+
+   if (LZ4F_isError(LZ4F_createDecompressionContext(&tls->dctx,
+                    LZ4F_VERSION)))
+   {
+      free(tls);
+      tls = NULL;
+      return NULL;
+   }
+
+   pthread_setspecific(tls_key, tls);
+   return tls;
+}
+
+static const uint8_t mtp64_magic[10] = MTP64_MAGIC;
+
+static const uint8_t bundle_magic[10] = MTP64_BUNDLE_MAGIC;
+
+/* Maps the whole file into memory. Returns NULL after printing the reason to
+ * stderr on failure. */
+static struct mtp64_s *pack_map(const char *filename)
+{
+   struct mtp64_s *pack;
+   struct stat st;
+   void *file;
+   int fd;
+
+   fd = open(filename, O_RDONLY);
+
+   if (fd < 0)
+   {
+      fprintf(stderr, "Unable to open %s\n", filename);
+      return NULL;
+   }
+
+   if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*pack->hdr) + 4)
+   {
+      fprintf(stderr, "%s is too small to be an mTP64 texture pack\n",
+              filename);
+      close(fd);
+      return NULL;
+   }
+
+   file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+
+   if (file == MAP_FAILED)
+   {
+      fprintf(stderr, "Unable to map %s into memory\n", filename);
+      return NULL;
+   }
+
+   pack = calloc(1, sizeof(*pack));
+
+   if (pack == NULL)
+   {
+      munmap(file, st.st_size);
+      return NULL;
+   }
+
+   pack->file = file;
+   pack->file_sz = st.st_size;
+   pack->generation = __atomic_add_fetch(&pack_generation, 1,
+                                         __ATOMIC_RELAXED);
+   return pack;
+}
+
+/* Validates the mTP64 header at hdr_off and locates its dictionary and map.
+ * Texture offsets in the map are relative to the start of the file. */
+static int pack_init(struct mtp64_s *pack, size_t hdr_off,
+                     const char *filename)
+{
+   size_t map_off;
+
+   if (hdr_off + sizeof(*pack->hdr) + 4 > pack->file_sz)
+   {
+      fprintf(stderr, "%s is truncated\n", filename);
+      return -1;
+   }
+
+   pack->hdr = (const struct mtp64_header_s *)(pack->file + hdr_off);
+
+   if (memcmp(pack->hdr->magic, mtp64_magic, sizeof(mtp64_magic)) != 0 ||
+         pack->hdr->version != 1)
+   {
+      fprintf(stderr, "%s is not a version 1 mTP64 texture pack\n", filename);
+      return -1;
+   }
+
+   pack->dictionary = pack->file + hdr_off + sizeof(*pack->hdr);
+   pack->dictionary_sz = (size_t)pack->hdr->dictionary_size * 1024;
+   pack->n_mappings = pack->hdr->n_mappings;
+
+   /* The map follows the dictionary and four unused bytes. */
+   map_off = hdr_off + sizeof(*pack->hdr) + pack->dictionary_sz + 4;
+
+   if (map_off + (size_t)pack->n_mappings * sizeof(struct mtp64_map_s) >
+         pack->file_sz)
+   {
+      fprintf(stderr, "%s is truncated\n", filename);
+      return -1;
+   }
+
+   pack->map = (const struct mtp64_map_s *)(pack->file + map_off);
+   return 0;
+}
+
+static int is_bundle(const struct mtp64_s *pack)
+{
+   return memcmp(pack->file, bundle_magic, sizeof(bundle_magic)) == 0;
+}
+
+struct mtp64_s *mtp64_open(const char *filename)
+{
+   uint64_t ev_start = evtrace_begin();
+   struct mtp64_s *pack = pack_map(filename);
+
+   if (pack == NULL)
+      return NULL;
+
+   if (is_bundle(pack))
+   {
+      fprintf(stderr, "%s is an mTP64 bundle, so a ROM must be given\n",
+              filename);
+      goto err;
+   }
+
+   if (pack_init(pack, 0, filename) != 0)
+      goto err;
+
+   evtrace_end(EVTRACE_OPEN, 0, ev_start);
+   return pack;
+
+err:
+   mtp64_close(pack);
+   return NULL;
+}
+
+/* Length of a ROM name without trailing spaces and NUL padding. */
+static size_t rom_len(const char *rom, size_t max)
+{
+   size_t len = strnlen(rom, max);
+
+   while (len > 0 && rom[len - 1] == ' ')
+      len--;
+
+   return len;
+}
+
+int mtp64_rom_match(const char *rom_target, const char *rom_header)
+{
+   size_t t_len = rom_len(rom_target, MTP64_ROM_TARGET_LEN);
+   size_t h_len = rom_len(rom_header, MTP64_ROM_TARGET_LEN);
+
+   return t_len == h_len && strncasecmp(rom_target, rom_header, t_len) == 0;
+}
+
+struct mtp64_s *mtp64_open_rom(const char *filename, const char *rom_header)
+{
+   const struct mtp64_bundle_header_s *bhdr;
+   const struct mtp64_bundle_entry_s *entry;
+   uint64_t ev_start = evtrace_begin();
+   struct mtp64_s *pack = pack_map(filename);
+
+   if (pack == NULL)
+      return NULL;
+
+   if (!is_bundle(pack))
+   {
+      if (pack_init(pack, 0, filename) != 0)
+         goto err;
+
+      evtrace_end(EVTRACE_OPEN, 0, ev_start);
+      return pack;
+   }
+
+   bhdr = (const struct mtp64_bundle_header_s *)pack->file;
+   entry = (const struct mtp64_bundle_entry_s *)(bhdr + 1);
+
+   if (bhdr->version != 1)
+   {
+      fprintf(stderr, "%s is not a version 1 mTP64 bundle\n", filename);
+      goto err;
+   }
+
+   if (sizeof(*bhdr) + (size_t)bhdr->n_packs * sizeof(*entry) >
+         pack->file_sz)
+   {
+      fprintf(stderr, "%s is truncated\n", filename);
+      goto err;
+   }
+
+   for (uint32_t i = 0; i < bhdr->n_packs; i++)
+   {
+      if (!mtp64_rom_match(entry[i].rom_target, rom_header))
+         continue;
+
+      if (pack_init(pack, (size_t)entry[i].pack_offset * 8, filename) != 0)
+         goto err;
+
+      evtrace_end(EVTRACE_OPEN, 0, ev_start);
+      return pack;
+   }
+
+   fprintf(stderr, "%s has no texture pack for '%.*s'. It holds packs for:\n",
+           filename, MTP64_ROM_TARGET_LEN, rom_header);
+
+   for (uint32_t i = 0; i < bhdr->n_packs; i++)
+      fprintf(stderr, "  %.*s\n", MTP64_ROM_TARGET_LEN, entry[i].rom_target);
+
+err:
+   mtp64_close(pack);
+   return NULL;
+}
+
+void mtp64_close(struct mtp64_s *pack)
+{
+   if (pack == NULL)
+      return;
+
+   munmap((void *)pack->file, pack->file_sz);
+   free(pack);
+}
+
+const struct mtp64_header_s *mtp64_header(const struct mtp64_s *pack)
+{
+   return pack->hdr;
+}
+
+const uint8_t *mtp64_dictionary(const struct mtp64_s *pack, size_t *sz)
+{
+   *sz = pack->dictionary_sz;
+   return pack->dictionary_sz != 0 ? pack->dictionary : NULL;
+}
+
+uint32_t mtp64_n_mappings(const struct mtp64_s *pack)
+{
+   return pack->n_mappings;
+}
+
+uint32_t mtp64_mapping_crc(const struct mtp64_s *pack, uint32_t i)
+{
+   return pack->map[i].crc;
+}
+
+int mtp64_lookup(const struct mtp64_s *pack, uint32_t crc,
+                 struct mtp64_texture_s *tex)
+{
+   const struct mtp64_texture_header_s *tex_hdr;
+   size_t lo = 0;
+   size_t hi = pack->n_mappings;
+   uint64_t off;
+   uint64_t trace_start;
+   STATS_DECL(lookup);
+
+   trace_start = tracebuf_begin(&trace);
+
+   while (lo < hi)
+   {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (pack->map[mid].crc < crc)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (lo == pack->n_mappings || pack->map[lo].crc != crc)
+      goto miss;
+
+   off = (uint64_t)pack->map[lo].offset * 8;
+
+   if (off + sizeof(*tex_hdr) > pack->file_sz)
+      goto miss;
+
+   tex_hdr = (const struct mtp64_texture_header_s *)(pack->file + off);
+
+   if (off + sizeof(*tex_hdr) + tex_hdr->data_size > pack->file_sz)
+      goto miss;
+
+   tex->data_format = tex_hdr->data_format;
+   tex->tex_width = tex_hdr->tex_width;
+   tex->tex_height = tex_hdr->tex_height;
+   tex->data = pack->file + off + sizeof(*tex_hdr);
+   tex->data_size = tex_hdr->data_size;
+   tex->offset = off;
+
+   STATS_TIME(lookup);
+
+   if (trace_start != 0)
+      trace_record(crc, 1, trace_start);
+
+   return 0;
+
+miss:
+   STATS_ADD(misses, 1);
+   STATS_TIME(lookup);
+
+   if (trace_start != 0)
+      trace_record(crc, 0, trace_start);
+
+   return -1;
+}
+
+size_t mtp64_decoded_size(uint8_t data_format, uint16_t w, uint16_t h)
+{
+   switch (data_format & ~MTP64_FORMAT_LZ4_COMPRESSED)
+   {
+   case MTP64_FORMAT_ETC1:
+      /* Each 4x4 block of pixels is stored in 8 bytes. */
+      return (size_t)((w + 3) / 4) * ((h + 3) / 4) * 8;
+
+   case MTP64_FORMAT_RGBA8888:
+      return (size_t)w * h * 4;
+
+   default:
+      return 0;
+   }
+}
+
+const uint8_t *mtp64_decode(const struct mtp64_s *pack,
+                            const struct mtp64_texture_s *tex,
+                            size_t *decoded_sz)
+{
+   struct mtp64_tls_s *t;
+   const uint8_t *src = tex->data;
+   size_t src_left = tex->data_size;
+   size_t dst_sz;
+   size_t dst_pos = 0;
+   size_t ret;
+   uint64_t ev_start;
+   STATS_DECL(decode);
+
+   STATS_ADD(bytes_read, tex->data_size);
+
+   if ((tex->data_format & MTP64_FORMAT_LZ4_COMPRESSED) == 0)
+   {
+      *decoded_sz = tex->data_size;
+      STATS_ADD(bytes_decoded, tex->data_size);
+      STATS_TIME(decode);
+      return tex->data;
+   }
+
+   t = tls_get();
+
+   if (t == NULL)
+      return NULL;
+
+   if (t->last_generation == pack->generation &&
+         t->last_offset == tex->offset)
+   {
+      *decoded_sz = t->last_sz;
+      STATS_ADD(cache_hits, 1);
+      STATS_TIME(decode);
+      return t->buf;
+   }
+
+   dst_sz = mtp64_decoded_size(tex->data_format, tex->tex_width,
+                               tex->tex_height);
+
+   if (dst_sz == 0)
+      return NULL;
+
+   if (dst_sz > t->buf_sz)
+   {
+      uint8_t *buf = realloc(t->buf, dst_sz);
+
+      if (buf == NULL)
+         return NULL;
+
+      t->buf = buf;
+      t->buf_sz = dst_sz;
+   }
+
+   t->last_generation = 0;
+   ev_start = evtrace_begin();
+   LZ4F_resetDecompressionContext(t->dctx);
+
+   do
+   {
+      size_t dst_chunk = t->buf_sz - dst_pos;
+      size_t src_chunk = src_left;
+
+      ret = LZ4F_decompress_usingDict(t->dctx, t->buf + dst_pos, &dst_chunk,
+                                      src, &src_chunk, pack->dictionary,
+                                      pack->dictionary_sz, NULL);
+
+      if (LZ4F_isError(ret))
+         return NULL;
+
+      src += src_chunk;
+      src_left -= src_chunk;
+      dst_pos += dst_chunk;
+
+      /* Stop if no progress can be made. */
+      if (src_chunk == 0 && dst_chunk == 0)
+         break;
+   }
+   while (ret != 0 && src_left != 0);
+
+   if (ret != 0)
+      return NULL;
+
+   t->last_generation = pack->generation;
+   t->last_offset = tex->offset;
+   t->last_sz = dst_pos;
+   *decoded_sz = dst_pos;
+
+   evtrace_end(EVTRACE_DECODE, tex->offset, ev_start);
+   STATS_ADD(bytes_decoded, dst_pos);
+   STATS_TIME(decode);
+   return t->buf;
+}
+
+#ifdef MTP64_STATS
+static void hist_json(FILE *f, const char *name, const struct mtp64_hist_s *h,
+                      double ns_per_tick)
+{
+   static const struct
+   {
+      const char *name;
+      double q;
+   } pct[] =
+   {
+      { "p50", 0.50 }, { "p90", 0.90 }, { "p99", 0.99 }, { "p999", 0.999 }
+   };
+   uint64_t n = 0;
+   uint64_t cum = 0;
+   unsigned p = 0;
+   unsigned first = 1;
+
+   for (unsigned b = 0; b < HIST_BUCKETS; b++)
+      n += h->count[b];
+
+   fprintf(f, "\"%s\":{\"calls\":%lu,\"count\":%lu", name, h->calls, n);
+
+   if (n == 0)
+   {
+      fputs("}", f);
+      return;
+   }
+
+   fprintf(f, ",\"min\":%.0f,\"max\":%.0f,\"mean\":%.1f",
+           h->min * ns_per_tick, h->max * ns_per_tick,
+           (double)h->total / n * ns_per_tick);
+
+   /* Percentiles are reported as the upper bound of the bucket that they lie
+    * within. */
+   for (unsigned b = 0; b < HIST_BUCKETS && p < sizeof(pct) / sizeof(*pct);
+         b++)
+   {
+      cum += h->count[b];
+
+      while (p < sizeof(pct) / sizeof(*pct) && cum >= pct[p].q * n)
+      {
+         fprintf(f, ",\"%s\":%.0f", pct[p].name,
+                 hist_bucket_lower(b + 1) * ns_per_tick);
+         p++;
+      }
+   }
+
+   fputs(",\"buckets\":[", f);
+
+   for (unsigned b = 0; b < HIST_BUCKETS; b++)
+   {
+      if (h->count[b] == 0)
+         continue;
+
+      fprintf(f, "%s[%.0f,%lu]", first ? "" : ",",
+              hist_bucket_lower(b) * ns_per_tick, h->count[b]);
+      first = 0;
+   }
+
+   fputs("]}", f);
+}
+
+void mtp64_stats_json(FILE *f)
+{
+   struct mtp64_stats_s *sum = calloc(1, sizeof(*sum));
+   double ns_per_tick = 1.0;
+   unsigned threads = 0;
+
+   if (sum == NULL)
+      return;
+
+   sum->lookup.min = UINT64_MAX;
+   sum->decode.min = UINT64_MAX;
+
+   pthread_mutex_lock(&stats_lock);
+
+   for (struct mtp64_stats_s *s = stats_list; s != NULL; s = s->next)
+   {
+#define SUM(x) sum->x += __atomic_load_n(&s->x, __ATOMIC_RELAXED)
+      SUM(misses);
+      SUM(bytes_read);
+      SUM(bytes_decoded);
+      SUM(cache_hits);
+      SUM(lookup.total);
+      SUM(decode.total);
+      SUM(lookup.calls);
+      SUM(decode.calls);
+
+      for (unsigned b = 0; b < HIST_BUCKETS; b++)
+      {
+         SUM(lookup.count[b]);
+         SUM(decode.count[b]);
+      }
+#undef SUM
+
+      if (s->lookup.min < sum->lookup.min)
+         sum->lookup.min = s->lookup.min;
+      if (s->lookup.max > sum->lookup.max)
+         sum->lookup.max = s->lookup.max;
+      if (s->decode.min < sum->decode.min)
+         sum->decode.min = s->decode.min;
+      if (s->decode.max > sum->decode.max)
+         sum->decode.max = s->decode.max;
+
+      threads++;
+   }
+
+   if (stats_epoch_ns != 0)
+   {
+      uint64_t dns = tracebuf_now() - stats_epoch_ns;
+      uint64_t dticks = stat_ticks() - stats_epoch_ticks;
+
+      if (dns != 0 && dticks != 0)
+         ns_per_tick = (double)dns / dticks;
+   }
+
+   pthread_mutex_unlock(&stats_lock);
+
+   fprintf(f, "{\"threads\":%u,\"lookups\":%lu,\"hits\":%lu,\"misses\":%lu,"
+           "\"bytes_read\":%lu,\"bytes_decoded\":%lu,\"cache_hits\":%lu,"
+           "\"sample_interval\":%u,", threads, sum->lookup.calls,
+           sum->lookup.calls - sum->misses, sum->misses, sum->bytes_read,
+           sum->bytes_decoded, sum->cache_hits, MTP64_STATS_SAMPLE);
+   hist_json(f, "lookup_ns", &sum->lookup, ns_per_tick);
+   fputc(',', f);
+   hist_json(f, "decode_ns", &sum->decode, ns_per_tick);
+   fputs("}\n", f);
+
+   free(sum);
+}
+
+void mtp64_stats_reset(void)
+{
+   pthread_mutex_lock(&stats_lock);
+
+   for (struct mtp64_stats_s *s = stats_list; s != NULL; s = s->next)
+   {
+      struct mtp64_stats_s *next = s->next;
+
+      memset(s, 0, sizeof(*s));
+      s->lookup.min = UINT64_MAX;
+      s->decode.min = UINT64_MAX;
+      s->next = next;
+   }
+
+   pthread_mutex_unlock(&stats_lock);
+}
+#else
+void mtp64_stats_json(FILE *f)
+{
+   fputs("{}\n", f);
+}
+
+void mtp64_stats_reset(void)
+{
+}
+#endif
@@ -0,0 +1,225 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Reader for mTP64 texture packs.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MTP64_H
+#define MTP64_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define MTP64_FORMAT_ETC1           0
+#define MTP64_FORMAT_RGBA8888       1
+#define MTP64_FORMAT_LZ4_COMPRESSED 0x80
+
+/* Size of the rom_target field, which may not be NUL terminated. */
+#define MTP64_ROM_TARGET_LEN        20
+
+#define MTP64_MAGIC \
+   { 0xAB, 'm', 'T', 'P', '@', 0xBB, 0x0D, 0x0A, 0x1A, 0x0A }
+
+struct mtp64_header_s
+{
+   uint8_t magic[10];
+   uint8_t version;
+   uint8_t tp_version[3];
+   char rom_target[MTP64_ROM_TARGET_LEN];
+   char pack_name[32];
+   char pack_author[32];
+   uint32_t pack_size;
+   uint32_t n_textures;
+   uint32_t n_mappings;
+   uint32_t first_texture_offset;
+   uint8_t dictionary_size;
+} __attribute__((packed));
+
+/* A header with the magic and versions written by these tools. The sizes and
+ * counts are set once the pack has been written. */
+#define MTP64_HEADER_INIT \
+   { .magic = MTP64_MAGIC, .version = 1, .tp_version = { 0, 1, 0 } }
+
+/* An entry of the map, which is sorted by CRC. The offset of the texture
+ * entry is in bytes, divided by eight. */
+struct mtp64_map_s
+{
+   uint32_t crc;
+   uint32_t offset;
+} __attribute__((packed));
+
+/* The header of each texture entry, which is followed by its data. */
+struct mtp64_texture_header_s
+{
+   uint8_t data_format;
+   uint32_t data_size;
+   uint16_t tex_width;
+   uint16_t tex_height;
+} __attribute__((packed));
+
+/**
+ * An mTP64 bundle holds the texture packs of several ROMs, such as the
+ * regional releases of a game, in one file. Each texture is stored once in a
+ * region shared by every pack. The header is followed by n_packs entries, and
+ * each entry gives the offset of a complete mTP64 header, dictionary and map,
+ * whose texture offsets are relative to the start of the bundle.
+ * See mTP64.md for the full layout.
+ */
+#define MTP64_BUNDLE_MAGIC \
+   { 0xAB, 'm', 'T', 'B', '@', 0xBB, 0x0D, 0x0A, 0x1A, 0x0A }
+
+struct mtp64_bundle_header_s
+{
+   uint8_t magic[10];
+   uint8_t version;
+   uint8_t unused;
+   uint32_t n_packs;
+   /* Size of the bundle in bytes, divided by eight. */
+   uint32_t bundle_size;
+} __attribute__((packed));
+
+struct mtp64_bundle_entry_s
+{
+   char rom_target[MTP64_ROM_TARGET_LEN];
+   /* Offset of the pack's mTP64 header in bytes, divided by eight. */
+   uint32_t pack_offset;
+} __attribute__((packed));
+
+struct mtp64_s;
+
+struct mtp64_texture_s
+{
+   uint8_t data_format;
+   uint16_t tex_width;
+   uint16_t tex_height;
+
+   /* Texture data as stored in the pack. */
+   const uint8_t *data;
+   uint32_t data_size;
+
+   /* Offset of the texture entry within the pack in bytes. */
+   uint64_t offset;
+};
+
+/**
+ * Maps an mTP64 texture pack into memory and validates its header.
+ * Returns NULL on failure, after printing the reason to stderr.
+ */
+struct mtp64_s *mtp64_open(const char *filename);
+void mtp64_close(struct mtp64_s *pack);
+
+/**
+ * Opens the texture pack for the given ROM header. If the file is an mTP64
+ * bundle, the pack whose rom_target matches is chosen, and the ROMs that the
+ * bundle holds packs for are printed to stderr if there is none. Any other
+ * file is opened as with mtp64_open(), without checking its rom_target.
+ * The returned pack is used and closed like any other.
+ */
+struct mtp64_s *mtp64_open_rom(const char *filename, const char *rom_header);
+
+/**
+ * Returns non-zero if a rom_target matches a ROM header. Both are compared
+ * up to MTP64_ROM_TARGET_LEN characters, ignoring case and trailing spaces.
+ */
+int mtp64_rom_match(const char *rom_target, const char *rom_header);
+
+/**
+ * Returns the header of the pack as stored in the file. For a pack within a
+ * bundle, this is the header of the chosen pack.
+ */
+const struct mtp64_header_s *mtp64_header(const struct mtp64_s *pack);
+
+/**
+ * Returns the LZ4 dictionary of the pack and sets sz to its size, or returns
+ * NULL if the pack has no dictionary.
+ */
+const uint8_t *mtp64_dictionary(const struct mtp64_s *pack, size_t *sz);
+
+uint32_t mtp64_n_mappings(const struct mtp64_s *pack);
+uint32_t mtp64_mapping_crc(const struct mtp64_s *pack, uint32_t i);
+
+/**
+ * Looks up the texture mapped to the given CRC with a binary search.
+ * Returns 0 and fills tex when found, and -1 otherwise.
+ */
+int mtp64_lookup(const struct mtp64_s *pack, uint32_t crc,
+                 struct mtp64_texture_s *tex);
+
+/**
+ * Returns the texture data in the format given by
+ * (tex->data_format & ~MTP64_FORMAT_LZ4_COMPRESSED), decompressing it if
+ * required. The returned buffer belongs to the calling thread and is valid
+ * until that thread next calls mtp64_decode() or exits.
+ * Returns NULL on failure.
+ */
+const uint8_t *mtp64_decode(const struct mtp64_s *pack,
+                            const struct mtp64_texture_s *tex,
+                            size_t *decoded_sz);
+
+/**
+ * Size in bytes of a decoded texture of the given format and dimensions.
+ */
+size_t mtp64_decoded_size(uint8_t data_format, uint16_t w, uint16_t h);
+
+/**
+ * Reader statistics. These are only gathered when the reader is compiled with
+ * MTP64_STATS defined; otherwise mtp64_stats_json() writes an empty object.
+ * Counters are kept per thread and summed when a snapshot is taken. Every
+ * call is counted, but only one in every MTP64_STATS_SAMPLE (256 by default)
+ * is timed, so the latency histograms hold a sample of the calls made.
+ */
+void mtp64_stats_json(FILE *f);
+void mtp64_stats_reset(void);
+
+/**
+ * Access trace recording. While a trace is active, every call to
+ * mtp64_lookup() appends a record to the trace file. Records are buffered per
+ * thread and written out when a buffer fills or the trace is stopped.
+ * The trace is replayed with mtp64replay.
+ */
+#define MTP64_TRACE_MAGIC     "mTP64TRC"
+#define MTP64_TRACE_VERSION   1
+
+struct mtp64_trace_header_s
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t record_size;
+};
+
+struct mtp64_trace_record_s
+{
+   /* Nanoseconds since the trace was started. */
+   uint64_t timestamp;
+   uint32_t crc;
+   /* Lookup latency in nanoseconds. */
+   uint32_t latency;
+   /* Index of the thread in the order that threads first recorded. */
+   uint16_t thread;
+   uint8_t hit;
+   uint8_t unused;
+};
+
+/**
+ * Starts recording accesses to the given file. Returns 0 on success.
+ */
+int mtp64_trace_start(const char *filename);
+
+/**
+ * Flushes all buffered records and closes the trace file. Threads must not
+ * call mtp64_lookup() whilst the trace is being stopped.
+ */
+void mtp64_trace_stop(void);
+
+#endif
@@ -0,0 +1,1005 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Compare LZ4 settings for mTP64 texture packs by size and decode speed.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LZ4F_STATIC_LINKING_ONLY 1
+#define LZ4_HC_STATIC_LINKING_ONLY 1
+#include <lz4.h>
+#include <lz4frame.h>
+#include <lz4hc.h>
+
+#include "mtp64.h"
+
+/* Largest dictionary that can be tried, in KiB. */
+#define MAX_DICT_KIB       112
+
+/* Size of each piece of a texture copied into a generated dictionary. */
+#define DICT_PIECE         1024
+
+/* Each texture entry has a nine byte header and is aligned to eight bytes. */
+#define ENTRY_SIZE(sz)     ((9 + (uint64_t)(sz) + 7) & ~(uint64_t)7)
+
+#define MAX_LIST           16
+
+/* Textures to compress, decoded to ETC1 or RGBA8888. */
+struct sample_s
+{
+   uint8_t **data;
+   size_t *size;
+   /* Bytes per ETC1 block or RGBA8888 pixel, which shuffling groups by. */
+   uint8_t *typesize;
+   size_t n;
+   uint64_t raw_bytes;
+
+   /* Dictionaries of each size are taken from the end of this buffer, as
+    * LZ4 finds matches nearest the end of a dictionary first. */
+   uint8_t *dict;
+   size_t dict_sz;
+};
+
+struct config_s
+{
+   unsigned char block;
+   unsigned char decspeed;
+   unsigned char shuffle;
+   int level;
+   unsigned dict_kib;
+
+   /* The compressed sample, kept until it has been decoded. */
+   uint8_t *out;
+   size_t *out_off;
+
+   uint64_t size;
+   uint64_t compress_ns;
+   double decode_mib_s;
+   int pareto;
+   int failed;
+};
+
+struct pool_s
+{
+   const struct sample_s *sample;
+   struct config_s *configs;
+   size_t n;
+   size_t next;
+   pthread_mutex_t lock;
+};
+
+/* A device profile accepts settings that decode at least this fraction as
+ * quickly as the fastest settings that mTP64 supports. */
+static const struct
+{
+   const char *name;
+   double min_speed;
+} profiles[] =
+{
+   { "desktop", 0.25 },
+   { "mobile", 0.50 },
+   { "lowend", 0.80 }
+};
+
+static uint64_t mono_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parses a comma separated list of numbers. Returns the number parsed. */
+static unsigned parse_list(const char *str, int *list)
+{
+   unsigned n = 0;
+
+   while (*str != '\0' && n < MAX_LIST)
+   {
+      char *end;
+
+      list[n++] = strtol(str, &end, 10);
+
+      if (*end != ',')
+         break;
+
+      str = end + 1;
+   }
+
+   return n;
+}
+
+/**
+ * Groups byte j of every element together, so that similar bytes such as
+ * the alpha of each pixel are next to each other. Any trailing bytes that do
+ * not make up a whole element are copied unchanged.
+ */
+static void shuffle(uint8_t *dst, const uint8_t *src, size_t len,
+                    unsigned typesize)
+{
+   size_t n = len / typesize;
+
+   for (unsigned j = 0; j < typesize; j++)
+      for (size_t i = 0; i < n; i++)
+         dst[j * n + i] = src[i * typesize + j];
+
+   memcpy(dst + n * typesize, src + n * typesize, len - n * typesize);
+}
+
+static void unshuffle(uint8_t *dst, const uint8_t *src, size_t len,
+                      unsigned typesize)
+{
+   size_t n = len / typesize;
+
+   for (unsigned j = 0; j < typesize; j++)
+      for (size_t i = 0; i < n; i++)
+         dst[i * typesize + j] = src[j * n + i];
+
+   memcpy(dst + n * typesize, src + n * typesize, len - n * typesize);
+}
+
+/**
+ * Decompresses texture t of a config into dst, which must hold the texture.
+ * tmp must be as large as dst. Returns 0 on success.
+ */
+static int decode_one(const struct config_s *c, const struct sample_s *s,
+                      size_t t, LZ4F_dctx *dctx, uint8_t *dst, uint8_t *tmp)
+{
+   const uint8_t *src = c->out + c->out_off[t];
+   size_t src_sz = c->out_off[t + 1] - c->out_off[t];
+   size_t len = s->size[t];
+   size_t dict_sz = (size_t)c->dict_kib * 1024;
+   const uint8_t *dict = s->dict + s->dict_sz - dict_sz;
+   uint8_t *out = c->shuffle ? tmp : dst;
+
+   if (c->block)
+   {
+      if (LZ4_decompress_safe_usingDict((const char *)src, (char *)out,
+                                        src_sz, len, (const char *)dict,
+                                        dict_sz) != (int)len)
+         return -1;
+   }
+   else
+   {
+      size_t pos = 0, ret;
+
+      LZ4F_resetDecompressionContext(dctx);
+
+      do
+      {
+         size_t dst_chunk = len - pos;
+         size_t src_chunk = src_sz;
+
+         ret = LZ4F_decompress_usingDict(dctx, out + pos, &dst_chunk, src,
+                                         &src_chunk, dict, dict_sz, NULL);
+
+         if (LZ4F_isError(ret))
+            return -1;
+
+         src += src_chunk;
+         src_sz -= src_chunk;
+         pos += dst_chunk;
+
+         if (src_chunk == 0 && dst_chunk == 0)
+            break;
+      }
+      while (ret != 0 && src_sz != 0);
+
+      if (ret != 0 || pos != len)
+         return -1;
+   }
+
+   if (c->shuffle)
+      unshuffle(dst, tmp, len, s->typesize[t]);
+
+   return 0;
+}
+
+/**
+ * Compresses the sample with one config, and checks that every texture
+ * decodes to the original. Returns 0 on success.
+ */
+static int compress_config(struct config_s *c, const struct sample_s *s)
+{
+   size_t dict_sz = (size_t)c->dict_kib * 1024;
+   const uint8_t *dict = s->dict + s->dict_sz - dict_sz;
+   LZ4F_preferences_t prefs = LZ4F_INIT_PREFERENCES;
+   LZ4F_CDict *cdict = NULL;
+   LZ4F_cctx *cctx = NULL;
+   LZ4F_dctx *dctx = NULL;
+   LZ4_stream_t *fast = NULL;
+   LZ4_streamHC_t *hc = NULL;
+   uint8_t *tmp = NULL, *chk = NULL;
+   size_t cap = 0, max_sz = 0, pos = 0;
+   uint64_t start;
+   int ret = -1;
+
+   for (size_t t = 0; t < s->n; t++)
+   {
+      if (s->size[t] > max_sz)
+         max_sz = s->size[t];
+   }
+
+   prefs.compressionLevel = c->level;
+   prefs.favorDecSpeed = c->decspeed;
+
+   for (size_t t = 0; t < s->n; t++)
+      cap += c->block ? (size_t)LZ4_compressBound(s->size[t]) :
+             LZ4F_compressFrameBound(s->size[t], &prefs);
+
+   c->out = malloc(cap + 1);
+   c->out_off = malloc((s->n + 1) * sizeof(*c->out_off));
+   tmp = malloc(max_sz + 1);
+   chk = malloc(max_sz + 1);
+
+   if (c->out == NULL || c->out_off == NULL || tmp == NULL || chk == NULL)
+      goto out;
+
+   if (c->block && c->level < LZ4HC_CLEVEL_MIN)
+      fast = LZ4_createStream();
+   else if (c->block)
+      hc = LZ4_createStreamHC();
+   else if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))
+      goto out;
+
+   if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+      goto out;
+
+   if (!c->block && dict_sz != 0)
+      cdict = LZ4F_createCDict(dict, dict_sz);
+
+   start = mono_ns();
+
+   for (size_t t = 0; t < s->n; t++)
+   {
+      const uint8_t *src = s->data[t];
+      size_t len = s->size[t];
+      size_t bound = c->block ? (size_t)LZ4_compressBound(len) :
+                     LZ4F_compressFrameBound(len, &prefs);
+      size_t out_sz;
+
+      if (c->shuffle)
+      {
+         shuffle(tmp, src, len, s->typesize[t]);
+         src = tmp;
+      }
+
+      if (fast != NULL)
+      {
+         /* Loading a dictionary also resets the stream. */
+         LZ4_loadDict(fast, (const char *)dict, dict_sz);
+         out_sz = LZ4_compress_fast_continue(fast, (const char *)src,
+                                             (char *)c->out + pos, len,
+                                             bound, 1);
+      }
+      else if (hc != NULL)
+      {
+         LZ4_resetStreamHC_fast(hc, c->level);
+         LZ4_loadDictHC(hc, (const char *)dict, dict_sz);
+         LZ4_favorDecompressionSpeed(hc, c->decspeed);
+         out_sz = LZ4_compress_HC_continue(hc, (const char *)src,
+                                           (char *)c->out + pos, len, bound);
+      }
+      else
+      {
+         out_sz = LZ4F_compressFrame_usingCDict(cctx, c->out + pos, bound,
+                                                src, len, cdict, &prefs);
+
+         if (LZ4F_isError(out_sz))
+            out_sz = 0;
+      }
+
+      if (out_sz == 0 && len != 0)
+         goto out;
+
+      c->out_off[t] = pos;
+      pos += out_sz;
+      c->size += ENTRY_SIZE(out_sz);
+   }
+
+   c->compress_ns = mono_ns() - start;
+   c->out_off[s->n] = pos;
+   c->size += dict_sz;
+
+   for (size_t t = 0; t < s->n; t++)
+   {
+      if (decode_one(c, s, t, dctx, chk, tmp) != 0 ||
+            memcmp(chk, s->data[t], s->size[t]) != 0)
+         goto out;
+   }
+
+   ret = 0;
+
+out:
+   LZ4F_freeCDict(cdict);
+   LZ4F_freeCompressionContext(cctx);
+   LZ4F_freeDecompressionContext(dctx);
+   LZ4_freeStream(fast);
+   LZ4_freeStreamHC(hc);
+   free(tmp);
+   free(chk);
+   return ret;
+}
+
+static void *compress_worker(void *arg)
+{
+   struct pool_s *p = arg;
+
+   for (;;)
+   {
+      struct config_s *c;
+
+      pthread_mutex_lock(&p->lock);
+      c = p->next < p->n ? &p->configs[p->next++] : NULL;
+      pthread_mutex_unlock(&p->lock);
+
+      if (c == NULL)
+         break;
+
+      c->failed = compress_config(c, p->sample) != 0;
+   }
+
+   return NULL;
+}
+
+/**
+ * Measures how quickly a config decodes the sample on this thread alone. The
+ * best of five passes is kept.
+ */
+static int measure_decode(struct config_s *c, const struct sample_s *s)
+{
+   LZ4F_dctx *dctx;
+   uint8_t *dst, *tmp;
+   size_t max_sz = 0;
+   uint64_t best = UINT64_MAX;
+
+   for (size_t t = 0; t < s->n; t++)
+   {
+      if (s->size[t] > max_sz)
+         max_sz = s->size[t];
+   }
+
+   dst = malloc(max_sz + 1);
+   tmp = malloc(max_sz + 1);
+
+   if (dst == NULL || tmp == NULL ||
+         LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+   {
+      free(dst);
+      free(tmp);
+      return -1;
+   }
+
+   for (unsigned pass = 0; pass < 5; pass++)
+   {
+      uint64_t start = mono_ns();
+
+      for (size_t t = 0; t < s->n; t++)
+         decode_one(c, s, t, dctx, dst, tmp);
+
+      if (mono_ns() - start < best)
+         best = mono_ns() - start;
+   }
+
+   c->decode_mib_s = s->raw_bytes / (best / 1e9) / (1024 * 1024);
+
+   LZ4F_freeDecompressionContext(dctx);
+   free(dst);
+   free(tmp);
+   return 0;
+}
+
+static int add_texture(struct sample_s *s, const uint8_t *data, size_t sz,
+                       unsigned typesize)
+{
+   s->data[s->n] = malloc(sz + 1);
+
+   if (s->data[s->n] == NULL)
+      return -1;
+
+   memcpy(s->data[s->n], data, sz);
+   s->size[s->n] = sz;
+   s->typesize[s->n] = typesize;
+   s->raw_bytes += sz;
+   s->n++;
+   return 0;
+}
+
+static int alloc_sample(struct sample_s *s, size_t n)
+{
+   s->data = calloc(n + 1, sizeof(*s->data));
+   s->size = calloc(n + 1, sizeof(*s->size));
+   s->typesize = calloc(n + 1, sizeof(*s->typesize));
+
+   return s->data == NULL || s->size == NULL || s->typesize == NULL ? -1 : 0;
+}
+
+static int compare_u64(const void *in1, const void *in2)
+{
+   uint64_t a = *(const uint64_t *)in1;
+   uint64_t b = *(const uint64_t *)in2;
+
+   return (a > b) - (a < b);
+}
+
+/**
+ * Decodes an evenly spaced sample of the distinct textures of a pack. The
+ * pack's dictionary is used to make dictionaries unless one was given.
+ */
+static int load_pack(struct sample_s *s, const char *filename, size_t limit)
+{
+   struct mtp64_s *pack = mtp64_open(filename);
+   uint64_t *keys;
+   uint32_t n;
+   size_t n_unique = 0, n_sample;
+   size_t dict_sz;
+   const uint8_t *dict;
+   int ret = -1;
+
+   if (pack == NULL)
+      return -1;
+
+   n = mtp64_n_mappings(pack);
+   keys = malloc(((size_t)n + 1) * sizeof(*keys));
+
+   if (keys == NULL)
+      goto out;
+
+   /* Several CRCs may map to one texture, so each mapping is keyed by the
+    * offset of its texture in the upper bits and its index in the lower
+    * bits. Once sorted, the first key of each offset is kept. */
+   for (uint32_t i = 0; i < n; i++)
+   {
+      struct mtp64_texture_s tex;
+
+      if (mtp64_lookup(pack, mtp64_mapping_crc(pack, i), &tex) == 0)
+         keys[n_unique++] = (tex.offset << 32) | i;
+   }
+
+   qsort(keys, n_unique, sizeof(*keys), compare_u64);
+
+   {
+      size_t k = 0;
+
+      for (size_t i = 0; i < n_unique; i++)
+      {
+         if (k == 0 || (keys[i] >> 32) != (keys[k - 1] >> 32))
+            keys[k++] = keys[i];
+      }
+
+      n_unique = k;
+   }
+
+   n_sample = limit < n_unique ? limit : n_unique;
+
+   if (alloc_sample(s, n_sample) != 0)
+      goto out;
+
+   for (size_t k = 0; k < n_sample; k++)
+   {
+      struct mtp64_texture_s tex;
+      const uint8_t *data;
+      size_t sz;
+      uint32_t crc = mtp64_mapping_crc(pack,
+                                       (uint32_t)keys[k * n_unique / n_sample]);
+
+      if (mtp64_lookup(pack, crc, &tex) != 0)
+         continue;
+
+      data = mtp64_decode(pack, &tex, &sz);
+
+      if (data == NULL)
+      {
+         fprintf(stderr, "Unable to decode texture %08X\n", crc);
+         goto out;
+      }
+
+      if (add_texture(s, data, sz, (tex.data_format &
+                      ~MTP64_FORMAT_LZ4_COMPRESSED) == MTP64_FORMAT_ETC1 ?
+                      8 : 4) != 0)
+         goto out;
+   }
+
+   dict = mtp64_dictionary(pack, &dict_sz);
+
+   if (s->dict == NULL && dict != NULL)
+   {
+      s->dict = malloc(dict_sz);
+
+      if (s->dict == NULL)
+         goto out;
+
+      memcpy(s->dict, dict, dict_sz);
+      s->dict_sz = dict_sz;
+   }
+
+   ret = 0;
+
+out:
+   free(keys);
+   mtp64_close(pack);
+   return ret;
+}
+
+static uint8_t *read_file(const char *filename, size_t *sz)
+{
+   uint8_t *buf;
+   long len;
+   FILE *f = fopen(filename, "rb");
+
+   if (f == NULL)
+      return NULL;
+
+   fseek(f, 0, SEEK_END);
+   len = ftell(f);
+   rewind(f);
+   buf = len >= 0 ? malloc(len + 1) : NULL;
+
+   if (buf != NULL && fread(buf, 1, len, f) != (size_t)len)
+   {
+      free(buf);
+      buf = NULL;
+   }
+
+   fclose(f);
+   *sz = len;
+   return buf;
+}
+
+/**
+ * Reads an evenly spaced sample of raw textures, such as those dumped by
+ * 'ktx2mtp64 -dump'. Files ending in .ETC1 are treated as ETC1.
+ */
+static int load_files(struct sample_s *s, char **files, size_t n_files,
+                      size_t limit)
+{
+   size_t n_sample = limit < n_files ? limit : n_files;
+
+   if (alloc_sample(s, n_sample) != 0)
+      return -1;
+
+   for (size_t k = 0; k < n_sample; k++)
+   {
+      const char *name = files[k * n_files / n_sample];
+      const char *dot = strrchr(name, '.');
+      size_t sz;
+      uint8_t *data = read_file(name, &sz);
+      int ret;
+
+      if (data == NULL)
+      {
+         fprintf(stderr, "Unable to read %s\n", name);
+         return -1;
+      }
+
+      ret = add_texture(s, data, sz, dot != NULL &&
+                        strcasecmp(dot, ".ETC1") == 0 ? 8 : 4);
+      free(data);
+
+      if (ret != 0)
+         return -1;
+   }
+
+   return 0;
+}
+
+/**
+ * Makes a dictionary from pieces of textures spread across the sample, for
+ * when no trained dictionary is available.
+ */
+static int make_dict(struct sample_s *s)
+{
+   size_t want = (size_t)MAX_DICT_KIB * 1024;
+   size_t pieces = want / DICT_PIECE;
+
+   s->dict = calloc(1, want);
+
+   if (s->dict == NULL)
+      return -1;
+
+   s->dict_sz = want;
+
+   for (size_t p = 0; p < pieces && s->n != 0; p++)
+   {
+      size_t t = p * s->n / pieces;
+      size_t len = s->size[t] < DICT_PIECE ? s->size[t] : DICT_PIECE;
+
+      memcpy(s->dict + p * DICT_PIECE, s->data[t], len);
+   }
+
+   return 0;
+}
+
+/* Marks configs that no other config beats in both size and speed. */
+static void mark_pareto(struct config_s *c, size_t n)
+{
+   for (size_t i = 0; i < n; i++)
+   {
+      c[i].pareto = !c[i].failed;
+
+      for (size_t j = 0; j < n && c[i].pareto; j++)
+      {
+         if (i == j || c[j].failed)
+            continue;
+
+         if (c[j].size <= c[i].size &&
+               c[j].decode_mib_s >= c[i].decode_mib_s &&
+               (c[j].size < c[i].size ||
+                c[j].decode_mib_s > c[i].decode_mib_s))
+            c[i].pareto = 0;
+      }
+   }
+}
+
+static void print_config(FILE *f, const struct config_s *c)
+{
+   fprintf(f, "%s level %d%s, %u KiB dictionary%s: %lu bytes, %.0f MiB/s\n",
+           c->block ? "block" : "frame", c->level,
+           c->decspeed ? " favouring decode speed" : "", c->dict_kib,
+           c->shuffle ? ", shuffled" : "", c->size, c->decode_mib_s);
+}
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: mtp64analyze [OPTION...] PACK\n"
+      "       mtp64analyze [OPTION...] TEXTURE...\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -sample N  \tNumber of textures to analyse (default 2000)\n"
+      "  -levels L  \tLZ4 levels to try (default 1,3,6,9,12)\n"
+      "  -dicts L   \tDictionary sizes in KiB to try (default "
+      "0,4,16,32,64,112)\n"
+      "  -dictionary FILE\n"
+      "             \tTake dictionaries from the end of this file, such as "
+      "one trained by zstd\n"
+      "  -profile P \tDevice profile to recommend settings for: 'desktop', "
+      "'mobile' (default) or 'lowend'\n"
+      "  -dictout FILE\n"
+      "             \tWrite the recommended dictionary to FILE\n"
+      "  -threads N \tNumber of threads to compress with (default: number "
+      "of CPUs)\n"
+      "\n"
+      "Textures are taken from an mTP64 texture pack, or from raw texture "
+      "files such as those written by 'ktx2mtp64 -dump'. Files ending in "
+      ".ETC1 are ETC1, and any others RGBA8888.\n"
+      "Every combination of LZ4 frame or block format, level, favouring "
+      "decode speed at levels of 10 and above, dictionary size and byte "
+      "shuffling is tried. Configurations are compressed in parallel, and "
+      "decoding is then timed on a single thread.\n"
+      "Without '-dictionary', the dictionary of the pack is used, or one is "
+      "made from pieces of the sampled textures. LZ4 only uses the last 64 "
+      "KiB of a dictionary.\n"
+      "\n"
+      "Results are written as CSV to stdout, with the columns:\n"
+      "  codec, level, decspeed, dict_kib, shuffle, size_bytes, ratio, "
+      "compress_ms, decode_mib_s, pareto\n"
+      "The Pareto frontier and the recommended settings are printed to "
+      "stderr. Only the LZ4 frame format without shuffling can be read from "
+      "mTP64 packs, so only those settings are recommended. The profile "
+      "chooses the smallest settings that decode at least 25% (desktop), "
+      "50% (mobile) or 80% (lowend) as quickly as the fastest.\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int main(int argc, char *argv[])
+{
+   struct sample_s sample = { 0 };
+   struct pool_s pool = { .sample = &sample,
+             .lock = PTHREAD_MUTEX_INITIALIZER
+   };
+   struct config_s *configs = NULL, *rec = NULL;
+   int levels[MAX_LIST] = { 1, 3, 6, 9, 12 };
+   int dicts[MAX_LIST] = { 0, 4, 16, 32, 64, 112 };
+   unsigned n_levels = 5, n_dicts = 6;
+   size_t limit = 2000, n_configs = 0;
+   unsigned threads = 0, profile = 1;
+   const char *dictionary = NULL, *dictout = NULL;
+   double fastest = 0;
+   int ret = EXIT_FAILURE;
+   char **arg;
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "A command must be specified.\n"
+              "Try 'mtp64analyze -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-sample") == 0 && arg[1] != NULL)
+         limit = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-levels") == 0 && arg[1] != NULL)
+         n_levels = parse_list(*(++arg), levels);
+      else if (strcmp(*arg, "-dicts") == 0 && arg[1] != NULL)
+         n_dicts = parse_list(*(++arg), dicts);
+      else if (strcmp(*arg, "-dictionary") == 0 && arg[1] != NULL)
+         dictionary = *(++arg);
+      else if (strcmp(*arg, "-dictout") == 0 && arg[1] != NULL)
+         dictout = *(++arg);
+      else if (strcmp(*arg, "-threads") == 0 && arg[1] != NULL)
+         threads = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-profile") == 0 && arg[1] != NULL)
+      {
+         arg++;
+
+         for (profile = 0; profile < sizeof(profiles) / sizeof(*profiles);
+               profile++)
+            if (strcmp(*arg, profiles[profile].name) == 0)
+               break;
+
+         if (profile == sizeof(profiles) / sizeof(*profiles))
+         {
+            fprintf(stderr, "Unknown profile '%s'\n", *arg);
+            return EXIT_FAILURE;
+         }
+      }
+      else if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'mtp64analyze -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (*arg == NULL || limit == 0)
+   {
+      fprintf(stderr, "No texture pack or textures were specified.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (threads == 0)
+   {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? n : 1;
+   }
+
+   if (dictionary != NULL)
+   {
+      sample.dict = read_file(dictionary, &sample.dict_sz);
+
+      if (sample.dict == NULL)
+      {
+         fprintf(stderr, "Unable to read %s\n", dictionary);
+         return EXIT_FAILURE;
+      }
+   }
+
+   /* A single mTP64 pack, or raw textures. */
+   {
+      static const uint8_t magic[10] = MTP64_MAGIC;
+      uint8_t buf[sizeof(magic)] = { 0 };
+      FILE *f = fopen(*arg, "rb");
+      int is_pack = 0;
+
+      if (f != NULL)
+      {
+         is_pack = fread(buf, 1, sizeof(buf), f) == sizeof(buf) &&
+                   memcmp(buf, magic, sizeof(magic)) == 0;
+         fclose(f);
+      }
+
+      if (is_pack && arg[1] == NULL)
+      {
+         if (load_pack(&sample, *arg, limit) != 0)
+            goto out;
+      }
+      else
+      {
+         size_t n_files = 0;
+
+         while (arg[n_files] != NULL)
+            n_files++;
+
+         if (load_files(&sample, arg, n_files, limit) != 0)
+            goto out;
+      }
+   }
+
+   if (sample.dict == NULL && make_dict(&sample) != 0)
+      goto out;
+
+   fprintf(stderr, "Analysing %zu textures of %lu bytes\n", sample.n,
+           sample.raw_bytes);
+
+   configs = calloc(2 * n_levels * 2 * n_dicts * 2 + 1, sizeof(*configs));
+
+   if (configs == NULL)
+      goto out;
+
+   for (unsigned block = 0; block <= 1; block++)
+      for (unsigned l = 0; l < n_levels; l++)
+         for (unsigned decspeed = 0; decspeed <= 1; decspeed++)
+            for (unsigned d = 0; d < n_dicts; d++)
+               for (unsigned shuf = 0; shuf <= 1; shuf++)
+               {
+                  struct config_s *c = &configs[n_configs];
+
+                  /* Only the optimal parser of LZ4HC favours decode speed. */
+                  if (decspeed && levels[l] < LZ4HC_CLEVEL_OPT_MIN)
+                     continue;
+
+                  if (dicts[d] < 0 || dicts[d] > MAX_DICT_KIB ||
+                        (size_t)dicts[d] * 1024 > sample.dict_sz)
+                     continue;
+
+                  c->block = block;
+                  c->level = levels[l];
+                  c->decspeed = decspeed;
+                  c->dict_kib = dicts[d];
+                  c->shuffle = shuf;
+                  n_configs++;
+               }
+
+   /* Configs are compressed in batches of one per thread. Each batch is
+    * decoded on this thread alone once the batch is compressed, so that
+    * timings are not disturbed and only one batch is held in memory. */
+   for (size_t first = 0; first < n_configs; first += threads)
+   {
+      pthread_t *th = calloc(threads, sizeof(*th));
+      unsigned started = 0;
+
+      if (th == NULL)
+         goto out;
+
+      pool.configs = configs + first;
+      pool.n = n_configs - first < threads ? n_configs - first : threads;
+      pool.next = 0;
+
+      while (started < pool.n &&
+             pthread_create(&th[started], NULL, compress_worker, &pool) == 0)
+         started++;
+
+      if (started == 0)
+         compress_worker(&pool);
+
+      for (unsigned i = 0; i < started; i++)
+         pthread_join(th[i], NULL);
+
+      free(th);
+
+      for (size_t i = 0; i < pool.n; i++)
+      {
+         struct config_s *c = &pool.configs[i];
+
+         if (!c->failed && measure_decode(c, &sample) != 0)
+            c->failed = 1;
+
+         if (c->failed)
+            fprintf(stderr, "%s level %d failed\n",
+                    c->block ? "Block" : "Frame", c->level);
+
+         free(c->out);
+         free(c->out_off);
+         c->out = NULL;
+         c->out_off = NULL;
+      }
+
+      fprintf(stderr, "%zu of %zu configurations\r",
+              first + pool.n, n_configs);
+   }
+
+   mark_pareto(configs, n_configs);
+
+   fprintf(stdout, "codec,level,decspeed,dict_kib,shuffle,size_bytes,ratio,"
+           "compress_ms,decode_mib_s,pareto\n");
+
+   for (size_t i = 0; i < n_configs; i++)
+   {
+      const struct config_s *c = &configs[i];
+
+      if (c->failed)
+         continue;
+
+      fprintf(stdout, "%s,%d,%u,%u,%u,%lu,%.3f,%.1f,%.1f,%d\n",
+              c->block ? "block" : "frame", c->level, c->decspeed,
+              c->dict_kib, c->shuffle, c->size,
+              (double)sample.raw_bytes / c->size, c->compress_ns / 1e6,
+              c->decode_mib_s, c->pareto);
+   }
+
+   fprintf(stderr, "\nPareto frontier:\n");
+
+   for (size_t i = 0; i < n_configs; i++)
+   {
+      if (configs[i].pareto)
+      {
+         fputs("  ", stderr);
+         print_config(stderr, &configs[i]);
+      }
+
+      /* Frame format without shuffling is what mTP64 readers support. */
+      if (!configs[i].failed && !configs[i].block && !configs[i].shuffle &&
+            configs[i].decode_mib_s > fastest)
+         fastest = configs[i].decode_mib_s;
+   }
+
+   for (size_t i = 0; i < n_configs; i++)
+   {
+      struct config_s *c = &configs[i];
+
+      if (c->failed || c->block || c->shuffle ||
+            c->decode_mib_s < fastest * profiles[profile].min_speed)
+         continue;
+
+      /* Of settings that give the same size, the fastest to decode is
+       * chosen. */
+      if (rec == NULL || c->size < rec->size ||
+            (c->size == rec->size && c->decode_mib_s > rec->decode_mib_s))
+         rec = c;
+   }
+
+   if (rec == NULL)
+   {
+      fprintf(stderr, "No settings could be recommended.\n");
+      goto out;
+   }
+
+   fprintf(stderr, "Recommended for %s:\n  ", profiles[profile].name);
+   print_config(stderr, rec);
+   fprintf(stderr, "  hts2mtp64 and ktx2mtp64 options: -level %d%s", rec->level,
+           rec->decspeed ? " -decspeed" : "");
+
+   if (rec->dict_kib != 0)
+      fprintf(stderr, " -dictionary %s", dictout != NULL ? dictout : "DICT");
+
+   fputc('\n', stderr);
+
+   if (rec->dict_kib != 0 && dictout != NULL)
+   {
+      size_t dict_sz = (size_t)rec->dict_kib * 1024;
+      FILE *f = fopen(dictout, "wb");
+
+      if (f == NULL || fwrite(sample.dict + sample.dict_sz - dict_sz, 1,
+                              dict_sz, f) != dict_sz)
+      {
+         fprintf(stderr, "Unable to write %s\n", dictout);
+
+         if (f != NULL)
+            fclose(f);
+
+         goto out;
+      }
+
+      fclose(f);
+   }
+
+   ret = EXIT_SUCCESS;
+
+out:
+   for (size_t t = 0; t < sample.n; t++)
+      free(sample.data[t]);
+
+   free(sample.data);
+   free(sample.size);
+   free(sample.typesize);
+   free(sample.dict);
+   free(configs);
+   return ret;
+}
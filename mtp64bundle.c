@@ -0,0 +1,574 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Combine the mTP64 texture packs of several ROMs into one mTP64 bundle.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+
+#include "mtp64.h"
+
+/* Texture offsets are stored divided by eight in 32 bits. */
+#define MAX_BUNDLE_SIZE    ((uint64_t)UINT32_MAX * 8)
+
+#define ALIGN8(x)          (((x) + 7) & ~(uint64_t)7)
+
+/* A pack given on the command line. */
+struct input_s
+{
+   const char *filename;
+   char rom_target[MTP64_ROM_TARGET_LEN];
+   struct mtp64_s *pack;
+   uint64_t file_sz;
+
+   /* Index of the first input with the same dictionary. Compressed textures
+    * may only be shared between packs that decompress with the same
+    * dictionary. */
+   uint32_t dict_id;
+
+   /* Map of the pack within the bundle, and its offset in bytes. */
+   struct mtp64_map_s *map;
+   uint32_t n_mappings;
+   uint32_t n_textures;
+   uint64_t hdr_off;
+};
+
+/* A texture stored in the shared region of the bundle. */
+struct blob_s
+{
+   struct mtp64_texture_s tex;
+   uint32_t dict_id;
+   /* Offset of the texture entry within the bundle, divided by eight. */
+   uint32_t offset;
+};
+
+/* Open addressing hash table of the textures in the shared region. Each slot
+ * holds the index of a blob plus one, so that zero marks an empty slot. */
+struct shared_s
+{
+   uint64_t *hash;
+   uint32_t *blob;
+   size_t cap;
+
+   struct blob_s *blobs;
+   size_t n;
+   size_t blobs_cap;
+};
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: mtp64bundle -out FILE [ROM=]PACK...\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -out       \tSet output mTP64 bundle file\n"
+      "\n"
+      "Each PACK is an mTP64 texture pack, created by ktx2mtp64 or hts2mtp64, "
+      "for the ROM whose header is ROM. If ROM is not given, the rom_target "
+      "stored within the pack is used.\n"
+      "Identical textures are stored once and shared by every pack in the "
+      "bundle. LZ4 compressed textures are only shared between packs that use "
+      "the same dictionary.\n"
+      "\n"
+      "Example:\n"
+      "  mtp64bundle -out mario.mtp64 \"SUPER MARIO 64=usa.mtp64\" \\\n"
+      "     \"SUPERMARIO64=jpn.mtp64\"\n"
+      "  mtp64dump -rom \"SUPERMARIO64\" -list mario.mtp64\n"
+      "\n"
+      "Copyright (c) 2020 Mahyar Koshkouei\n"
+      "https://github.com/deltabeard/texturepack-utils\n\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+static int blob_equal(const struct blob_s *b, const struct mtp64_texture_s *tex,
+                      uint32_t dict_id)
+{
+   if (b->tex.data_format != tex->data_format ||
+         b->tex.tex_width != tex->tex_width ||
+         b->tex.tex_height != tex->tex_height ||
+         b->tex.data_size != tex->data_size)
+      return 0;
+
+   if ((tex->data_format & MTP64_FORMAT_LZ4_COMPRESSED) &&
+         b->dict_id != dict_id)
+      return 0;
+
+   return memcmp(b->tex.data, tex->data, tex->data_size) == 0;
+}
+
+static int shared_grow(struct shared_s *s)
+{
+   size_t cap = s->cap ? s->cap * 2 : 4096;
+   uint64_t *hash = malloc(cap * sizeof(*hash));
+   uint32_t *blob = calloc(cap, sizeof(*blob));
+
+   if (hash == NULL || blob == NULL)
+   {
+      free(hash);
+      free(blob);
+      return -1;
+   }
+
+   for (size_t j = 0; j < s->cap; j++)
+   {
+      size_t i;
+
+      if (s->blob[j] == 0)
+         continue;
+
+      for (i = s->hash[j] & (cap - 1); blob[i] != 0; i = (i + 1) & (cap - 1))
+         ;
+
+      hash[i] = s->hash[j];
+      blob[i] = s->blob[j];
+   }
+
+   free(s->hash);
+   free(s->blob);
+   s->hash = hash;
+   s->blob = blob;
+   s->cap = cap;
+   return 0;
+}
+
+/**
+ * Returns the blob holding a texture identical to tex, adding tex to the end
+ * of the shared region at *end if there is none. Returns NULL on failure.
+ */
+static struct blob_s *shared_add(struct shared_s *s,
+                                 const struct mtp64_texture_s *tex,
+                                 uint32_t dict_id, uint64_t *end)
+{
+   uint64_t seed = (uint64_t)tex->data_format << 32 |
+                   (uint32_t)tex->tex_width << 16 | tex->tex_height;
+   uint64_t hash;
+   struct blob_s *b;
+   size_t i;
+
+   /* Uncompressed textures do not depend upon the dictionary. */
+   if (tex->data_format & MTP64_FORMAT_LZ4_COMPRESSED)
+      seed ^= (uint64_t)dict_id << 40;
+
+   hash = XXH64(tex->data, tex->data_size, seed);
+
+   if ((s->n + 1) * 2 > s->cap && shared_grow(s) != 0)
+      return NULL;
+
+   for (i = hash & (s->cap - 1); s->blob[i] != 0; i = (i + 1) & (s->cap - 1))
+   {
+      b = &s->blobs[s->blob[i] - 1];
+
+      if (s->hash[i] == hash && blob_equal(b, tex, dict_id))
+         return b;
+   }
+
+   if (*end > MAX_BUNDLE_SIZE)
+      return NULL;
+
+   if (s->n == s->blobs_cap)
+   {
+      size_t cap = s->blobs_cap ? s->blobs_cap * 2 : 4096;
+      struct blob_s *blobs = realloc(s->blobs, cap * sizeof(*blobs));
+
+      if (blobs == NULL)
+         return NULL;
+
+      s->blobs = blobs;
+      s->blobs_cap = cap;
+   }
+
+   b = &s->blobs[s->n++];
+   b->tex = *tex;
+   b->dict_id = dict_id;
+   b->offset = *end / 8;
+   *end = ALIGN8(*end + sizeof(struct mtp64_texture_header_s) + tex->data_size);
+
+   s->hash[i] = hash;
+   s->blob[i] = s->n;
+   return b;
+}
+
+/* Parses "ROM=PACK" or "PACK" and opens the pack. */
+static int input_open(struct input_s *in, char *def)
+{
+   const struct mtp64_header_s *hdr;
+   const char *rom = NULL;
+   char *eq = strchr(def, '=');
+   struct stat st;
+
+   in->filename = def;
+
+   if (eq != NULL)
+   {
+      *eq = '\0';
+      rom = def;
+      in->filename = eq + 1;
+   }
+
+   in->pack = mtp64_open(in->filename);
+
+   if (in->pack == NULL)
+      return -1;
+
+   if (stat(in->filename, &st) == 0)
+      in->file_sz = st.st_size;
+
+   hdr = mtp64_header(in->pack);
+   memset(in->rom_target, 0, sizeof(in->rom_target));
+
+   if (rom != NULL)
+   {
+      if (strlen(rom) > MTP64_ROM_TARGET_LEN)
+      {
+         fprintf(stderr, "ROM header '%s' is longer than %d characters\n",
+                 rom, MTP64_ROM_TARGET_LEN);
+         return -1;
+      }
+
+      memcpy(in->rom_target, rom, strlen(rom));
+   }
+   else
+      memcpy(in->rom_target, hdr->rom_target, sizeof(in->rom_target));
+
+   if (in->rom_target[0] == '\0')
+   {
+      fprintf(stderr, "%s has no rom_target, so it must be given as "
+              "ROM=%s\n", in->filename, in->filename);
+      return -1;
+   }
+
+   return 0;
+}
+
+/* Assigns a dictionary to each input, and lays out the header of each pack
+ * after the bundle header and entries. Returns the end of the last pack. */
+static uint64_t layout_packs(struct input_s *in, uint32_t n_in)
+{
+   uint64_t off = ALIGN8(sizeof(struct mtp64_bundle_header_s) +
+                         (uint64_t)n_in * sizeof(struct mtp64_bundle_entry_s));
+
+   for (uint32_t p = 0; p < n_in; p++)
+   {
+      const uint8_t *dict;
+      size_t dict_sz;
+
+      dict = mtp64_dictionary(in[p].pack, &dict_sz);
+      in[p].dict_id = p;
+
+      for (uint32_t q = 0; q < p; q++)
+      {
+         const uint8_t *other;
+         size_t other_sz;
+
+         other = mtp64_dictionary(in[q].pack, &other_sz);
+
+         if (other_sz == dict_sz &&
+               (dict_sz == 0 || memcmp(other, dict, dict_sz) == 0))
+         {
+            in[p].dict_id = in[q].dict_id;
+            break;
+         }
+      }
+
+      in[p].n_mappings = mtp64_n_mappings(in[p].pack);
+      in[p].hdr_off = off;
+      off = ALIGN8(off + sizeof(struct mtp64_header_s) + dict_sz + 4 +
+                   (uint64_t)in[p].n_mappings * sizeof(struct mtp64_map_s));
+   }
+
+   return off;
+}
+
+static int compare_u32(const void *in1, const void *in2)
+{
+   uint32_t a = *(const uint32_t *)in1;
+   uint32_t b = *(const uint32_t *)in2;
+
+   return (a > b) - (a < b);
+}
+
+/* Number of distinct textures that the map of a pack refers to. */
+static uint32_t count_textures(const struct mtp64_map_s *map, uint32_t n)
+{
+   uint32_t *offsets;
+   uint32_t count = 0;
+
+   if (n == 0)
+      return 0;
+
+   offsets = malloc(n * sizeof(*offsets));
+
+   if (offsets == NULL)
+      return 0;
+
+   for (uint32_t i = 0; i < n; i++)
+      offsets[i] = map[i].offset;
+
+   qsort(offsets, n, sizeof(*offsets), compare_u32);
+
+   for (uint32_t i = 0; i < n; i++)
+      count += (i == 0 || offsets[i] != offsets[i - 1]);
+
+   free(offsets);
+   return count;
+}
+
+static void write_padding(FILE *f, uint64_t *pos)
+{
+   static const uint8_t padding[7] = { 0 };
+   uint64_t aligned = ALIGN8(*pos);
+
+   fwrite(padding, 1, aligned - *pos, f);
+   *pos = aligned;
+}
+
+static int write_bundle(const char *out, const struct input_s *in,
+                        uint32_t n_in, const struct shared_s *s,
+                        uint64_t first_texture, uint64_t end)
+{
+   static const uint8_t magic[10] = MTP64_BUNDLE_MAGIC;
+   struct mtp64_bundle_header_s bhdr = { .version = 1 };
+   uint64_t pos = 0;
+   FILE *f = fopen(out, "wb");
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to create %s\n", out);
+      return -1;
+   }
+
+   memcpy(bhdr.magic, magic, sizeof(magic));
+   bhdr.n_packs = n_in;
+   bhdr.bundle_size = end / 8;
+   pos += fwrite(&bhdr, 1, sizeof(bhdr), f);
+
+   for (uint32_t p = 0; p < n_in; p++)
+   {
+      struct mtp64_bundle_entry_s entry;
+
+      memcpy(entry.rom_target, in[p].rom_target, sizeof(entry.rom_target));
+      entry.pack_offset = in[p].hdr_off / 8;
+      pos += fwrite(&entry, 1, sizeof(entry), f);
+   }
+
+   write_padding(f, &pos);
+
+   for (uint32_t p = 0; p < n_in; p++)
+   {
+      struct mtp64_header_s hdr = *mtp64_header(in[p].pack);
+      const uint8_t unused[4] = { 0, 0, 0, 0 };
+      const uint8_t *dict;
+      size_t dict_sz;
+
+      dict = mtp64_dictionary(in[p].pack, &dict_sz);
+
+      memcpy(hdr.rom_target, in[p].rom_target, sizeof(hdr.rom_target));
+      hdr.pack_size = end / 8;
+      hdr.n_textures = in[p].n_textures;
+      hdr.n_mappings = in[p].n_mappings;
+      hdr.first_texture_offset = first_texture;
+
+      pos += fwrite(&hdr, 1, sizeof(hdr), f);
+      if (dict_sz != 0)
+         pos += fwrite(dict, 1, dict_sz, f);
+      pos += fwrite(unused, 1, sizeof(unused), f);
+      pos += fwrite(in[p].map, sizeof(*in[p].map), in[p].n_mappings, f) *
+             sizeof(*in[p].map);
+      write_padding(f, &pos);
+   }
+
+   for (size_t b = 0; b < s->n; b++)
+   {
+      const struct mtp64_texture_s *tex = &s->blobs[b].tex;
+      struct mtp64_texture_header_s tex_hdr;
+
+      tex_hdr.data_format = tex->data_format;
+      tex_hdr.data_size = tex->data_size;
+      tex_hdr.tex_width = tex->tex_width;
+      tex_hdr.tex_height = tex->tex_height;
+
+      pos += fwrite(&tex_hdr, 1, sizeof(tex_hdr), f);
+      pos += fwrite(tex->data, 1, tex->data_size, f);
+      write_padding(f, &pos);
+   }
+
+   if (fclose(f) != 0 || pos != end)
+   {
+      fprintf(stderr, "Unable to write %s\n", out);
+      return -1;
+   }
+
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   struct input_s *in;
+   struct shared_s shared = { 0 };
+   uint32_t n_in = 0;
+   uint64_t first_texture, end;
+   uint64_t inputs_sz = 0, mappings = 0;
+   const char *out = NULL;
+   int ret = EXIT_FAILURE;
+   char **arg;
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "A command must be specified.\n"
+              "Try 'mtp64bundle -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-out") == 0 && arg[1] != NULL)
+         out = *(++arg);
+      else if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'mtp64bundle -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (out == NULL)
+   {
+      fprintf(stderr, "No output file was specified.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (*arg == NULL)
+   {
+      fprintf(stderr, "No texture packs were specified.\n");
+      return EXIT_FAILURE;
+   }
+
+   in = calloc(argc, sizeof(*in));
+
+   if (in == NULL)
+      return EXIT_FAILURE;
+
+   for (; *arg != NULL; arg++, n_in++)
+   {
+      if (input_open(&in[n_in], *arg) != 0)
+      {
+         n_in++;
+         goto out;
+      }
+
+      for (uint32_t q = 0; q < n_in; q++)
+      {
+         if (!mtp64_rom_match(in[q].rom_target, in[n_in].rom_target))
+            continue;
+
+         fprintf(stderr, "%s and %s are both for ROM '%.*s'\n",
+                 in[q].filename, in[n_in].filename, MTP64_ROM_TARGET_LEN,
+                 in[n_in].rom_target);
+         n_in++;
+         goto out;
+      }
+   }
+
+   first_texture = layout_packs(in, n_in);
+   end = first_texture;
+
+   /* Add the textures of each pack to the shared region, and map the pack's
+    * CRCs to their offsets within it. */
+   for (uint32_t p = 0; p < n_in; p++)
+   {
+      in[p].map = malloc((size_t)in[p].n_mappings * sizeof(*in[p].map));
+
+      if (in[p].map == NULL && in[p].n_mappings != 0)
+         goto out;
+
+      for (uint32_t i = 0; i < in[p].n_mappings; i++)
+      {
+         struct mtp64_texture_s tex;
+         struct blob_s *b;
+         uint32_t crc = mtp64_mapping_crc(in[p].pack, i);
+
+         if (mtp64_lookup(in[p].pack, crc, &tex) != 0)
+         {
+            fprintf(stderr, "%s: texture for CRC %08X is corrupt\n",
+                    in[p].filename, crc);
+            goto out;
+         }
+
+         b = shared_add(&shared, &tex, in[p].dict_id, &end);
+
+         if (b == NULL)
+         {
+            fprintf(stderr, "Unable to add texture %08X of %s: the bundle "
+                    "would be larger than 32 GiB, or memory is exhausted\n",
+                    crc, in[p].filename);
+            goto out;
+         }
+
+         in[p].map[i].crc = crc;
+         in[p].map[i].offset = b->offset;
+      }
+
+      in[p].n_textures = count_textures(in[p].map, in[p].n_mappings);
+      inputs_sz += in[p].file_sz;
+      mappings += in[p].n_mappings;
+   }
+
+   if (end > MAX_BUNDLE_SIZE)
+   {
+      fprintf(stderr, "The bundle would be larger than 32 GiB\n");
+      goto out;
+   }
+
+   if (write_bundle(out, in, n_in, &shared, first_texture, end) != 0)
+      goto out;
+
+   for (uint32_t p = 0; p < n_in; p++)
+   {
+      fprintf(stdout, "  %-20.*s %u CRC entries, %u textures (%s)\n",
+              MTP64_ROM_TARGET_LEN, in[p].rom_target, in[p].n_mappings,
+              in[p].n_textures, in[p].filename);
+   }
+
+   fprintf(stdout, "Wrote %u packs with %lu CRC entries and %zu shared "
+           "textures to %s\n"
+           "Bundle is %lu bytes, packs were %lu bytes\n",
+           n_in, mappings, shared.n, out, end, inputs_sz);
+   ret = EXIT_SUCCESS;
+
+out:
+   for (uint32_t p = 0; p < n_in; p++)
+   {
+      mtp64_close(in[p].pack);
+      free(in[p].map);
+   }
+
+   free(in);
+   free(shared.hash);
+   free(shared.blob);
+   free(shared.blobs);
+   return ret;
+}
@@ -0,0 +1,194 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Dump the textures within an mTP64 texture pack to the current folder.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evtrace.h"
+#include "mtp64.h"
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: mtp64dump [OPTION...] FILE\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -list      \tList the textures within the pack instead of dumping "
+      "them\n"
+      "  -stats     \tPrint reader statistics as JSON to stderr on exit\n"
+      "  -record    \tRecord a trace of texture accesses to the given file\n"
+      "  -rom NAME  \tDump the pack for ROM NAME within an mTP64 bundle\n"
+      "  -trace FILE\n"
+      "             \tWrite the time taken to open the pack and to decode and "
+      "write each texture to FILE, as a Chrome trace\n"
+      "\n"
+      "Textures are dumped to the current folder in the same format as "
+      "'ktx2mtp64 -dump'.\n"
+      "Reader statistics are only available when the reader was compiled "
+      "with MTP64_STATS defined.\n"
+      "A recorded trace may be replayed against any pack with "
+      "'mtp64replay'.\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int main(int argc, char *argv[])
+{
+   struct mtp64_s *pack;
+   uint32_t n;
+   uint32_t failed = 0;
+   char **arg;
+   struct
+   {
+      unsigned char list;
+      unsigned char stats;
+      unsigned char show_help;
+      const char *record;
+      const char *rom;
+      const char *trace;
+   } options = { 0 };
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "A command must be specified.\n"
+              "Try 'mtp64dump -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-list") == 0)
+         options.list = 1;
+      else if (strcmp(*arg, "-stats") == 0)
+         options.stats = 1;
+      else if (strcmp(*arg, "-help") == 0)
+         options.show_help = 1;
+      else if (strcmp(*arg, "-record") == 0 && arg[1] != NULL)
+         options.record = *(++arg);
+      else if (strcmp(*arg, "-rom") == 0 && arg[1] != NULL)
+         options.rom = *(++arg);
+      else if (strcmp(*arg, "-trace") == 0 && arg[1] != NULL)
+         options.trace = *(++arg);
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'mtp64dump -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (options.show_help)
+   {
+      print_help();
+      return EXIT_SUCCESS;
+   }
+
+   if (*arg == NULL || arg[1] != NULL)
+   {
+      fprintf(stderr, "A single mTP64 file must be specified.\n"
+              "Try 'mtp64dump -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (options.trace != NULL && evtrace_start(options.trace) != 0)
+      return EXIT_FAILURE;
+
+   if (options.rom != NULL)
+      pack = mtp64_open_rom(*arg, options.rom);
+   else
+      pack = mtp64_open(*arg);
+
+   if (pack == NULL)
+      return EXIT_FAILURE;
+
+   if (options.record != NULL && mtp64_trace_start(options.record) != 0)
+   {
+      mtp64_close(pack);
+      return EXIT_FAILURE;
+   }
+
+   n = mtp64_n_mappings(pack);
+
+   for (uint32_t i = 0; i < n; i++)
+   {
+      struct mtp64_texture_s tex;
+      uint32_t crc = mtp64_mapping_crc(pack, i);
+      const uint8_t *data;
+      size_t data_sz;
+      uint8_t fmt;
+      char dump_name[8 + 1 + 4 + 1];
+      uint64_t ev_start;
+      FILE *f;
+
+      if (mtp64_lookup(pack, crc, &tex) != 0)
+      {
+         fprintf(stderr, "CRC %08X has an invalid texture offset\n", crc);
+         failed++;
+         continue;
+      }
+
+      fmt = tex.data_format & ~MTP64_FORMAT_LZ4_COMPRESSED;
+
+      if (options.list)
+      {
+         fprintf(stdout, "%08X %s %4u x %4u %10u%s\n", crc,
+                 fmt == MTP64_FORMAT_ETC1 ? "ETC1" : "RGB8",
+                 tex.tex_width, tex.tex_height, tex.data_size,
+                 tex.data_format & MTP64_FORMAT_LZ4_COMPRESSED ? " LZ4" : "");
+         continue;
+      }
+
+      data = mtp64_decode(pack, &tex, &data_sz);
+
+      if (data == NULL)
+      {
+         fprintf(stderr, "Unable to decode texture for CRC %08X\n", crc);
+         failed++;
+         continue;
+      }
+
+      snprintf(dump_name, sizeof(dump_name), "%08X.%s", crc,
+               fmt == MTP64_FORMAT_ETC1 ? "ETC1" : "RGB8");
+      ev_start = evtrace_begin();
+      f = fopen(dump_name, "wb");
+
+      if (f == NULL)
+      {
+         fprintf(stderr, "Unable to create output file %s\n", dump_name);
+         failed++;
+         continue;
+      }
+
+      fwrite(data, 1, data_sz, f);
+      fclose(f);
+      evtrace_end(EVTRACE_WRITE, crc, ev_start);
+   }
+
+   if (!options.list)
+      fprintf(stdout, "%u of %u textures dumped.\n", n - failed, n);
+
+   if (options.record != NULL)
+      mtp64_trace_stop();
+
+   if (options.stats)
+      mtp64_stats_json(stderr);
+
+   mtp64_close(pack);
+   return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,358 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Replay a recorded texture access trace against an mTP64 texture pack.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mtp64.h"
+
+struct replay_s
+{
+   struct mtp64_s *pack;
+   const struct mtp64_trace_record_s *rec;
+   size_t n_rec;
+
+   /* Latency of each replayed access in nanoseconds. */
+   uint64_t *latency;
+
+   unsigned n_workers;
+   unsigned char timing;
+   unsigned char lookup_only;
+   uint64_t start;
+};
+
+struct worker_s
+{
+   struct replay_s *r;
+   unsigned id;
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t failures;
+   uint64_t bytes;
+};
+
+static uint64_t mono_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *in1, const void *in2)
+{
+   const uint64_t *a = in1;
+   const uint64_t *b = in2;
+
+   return (*a > *b) - (*a < *b);
+}
+
+/* Each worker replays the accesses of the recorded threads that map to it,
+ * in their recorded order. */
+static void *replay_worker(void *arg)
+{
+   struct worker_s *w = arg;
+   struct replay_s *r = w->r;
+
+   for (size_t i = 0; i < r->n_rec; i++)
+   {
+      const struct mtp64_trace_record_s *rec = &r->rec[i];
+      struct mtp64_texture_s tex;
+      uint64_t t0;
+
+      if (rec->thread % r->n_workers != w->id)
+         continue;
+
+      if (r->timing)
+      {
+         uint64_t due = r->start + rec->timestamp;
+         uint64_t now = mono_ns();
+
+         if (due > now)
+         {
+            struct timespec ts = {
+               .tv_sec = (due - now) / 1000000000,
+               .tv_nsec = (due - now) % 1000000000
+            };
+            nanosleep(&ts, NULL);
+         }
+      }
+
+      t0 = mono_ns();
+
+      if (mtp64_lookup(r->pack, rec->crc, &tex) != 0)
+         w->misses++;
+      else
+      {
+         w->hits++;
+
+         if (!r->lookup_only)
+         {
+            size_t sz;
+
+            if (mtp64_decode(r->pack, &tex, &sz) == NULL)
+               w->failures++;
+            else
+               w->bytes += sz;
+         }
+      }
+
+      r->latency[i] = mono_ns() - t0;
+   }
+
+   return NULL;
+}
+
+/* Either evicts the pack from the page cache, or reads all of it so that it
+ * is resident, before the pack is mapped. */
+static int prepare_cache(const char *filename, int cold)
+{
+   int fd = open(filename, O_RDONLY);
+
+   if (fd < 0)
+   {
+      fprintf(stderr, "Unable to open %s\n", filename);
+      return -1;
+   }
+
+   if (cold)
+   {
+      if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+         fprintf(stderr, "Unable to drop %s from the page cache\n", filename);
+   }
+   else
+   {
+      static uint8_t buf[1 << 16];
+
+      while (read(fd, buf, sizeof(buf)) > 0)
+         ;
+   }
+
+   close(fd);
+   return 0;
+}
+
+static struct mtp64_trace_record_s *load_trace(const char *filename,
+      size_t *n_rec)
+{
+   struct mtp64_trace_header_s hdr;
+   struct mtp64_trace_record_s *rec;
+   long sz;
+   FILE *f = fopen(filename, "rb");
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to open trace %s\n", filename);
+      return NULL;
+   }
+
+   if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+         memcmp(hdr.magic, MTP64_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+         hdr.version != MTP64_TRACE_VERSION ||
+         hdr.record_size != sizeof(*rec))
+   {
+      fprintf(stderr, "%s is not a compatible mTP64 trace\n", filename);
+      fclose(f);
+      return NULL;
+   }
+
+   fseek(f, 0, SEEK_END);
+   sz = ftell(f) - (long)sizeof(hdr);
+   fseek(f, sizeof(hdr), SEEK_SET);
+
+   *n_rec = sz / sizeof(*rec);
+   rec = malloc(*n_rec * sizeof(*rec) + 1);
+
+   if (rec == NULL || fread(rec, sizeof(*rec), *n_rec, f) != *n_rec)
+   {
+      fprintf(stderr, "Unable to read trace %s\n", filename);
+      free(rec);
+      fclose(f);
+      return NULL;
+   }
+
+   fclose(f);
+   return rec;
+}
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: mtp64replay [OPTION...] TRACE FILE\n"
+      "Replays a texture access trace recorded with 'mtp64dump -record' "
+      "against the mTP64 texture pack FILE.\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -timing    \tReplay accesses at their originally recorded times\n"
+      "  -cold      \tDrop the pack from the page cache before replaying\n"
+      "  -lookup    \tOnly look up textures without decoding them\n"
+      "  -threads N \tNumber of threads to replay with (default 1)\n"
+      "  -rom NAME  \tReplay against the pack for ROM NAME within an mTP64 "
+      "bundle\n"
+      "\n"
+      "Accesses recorded by each thread are replayed in order on thread "
+      "(recorded thread modulo N). Without '-timing', accesses are replayed "
+      "as fast as possible. Without '-cold', the pack is read into the page "
+      "cache before replaying.\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int main(int argc, char *argv[])
+{
+   struct replay_s r = { .n_workers = 1 };
+   struct worker_s *workers;
+   pthread_t *threads;
+   uint64_t *sorted;
+   uint64_t hits = 0, misses = 0, failures = 0, bytes = 0;
+   uint64_t elapsed;
+   unsigned char cold = 0;
+   const char *rom = NULL;
+   char **arg;
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "A command must be specified.\n"
+              "Try 'mtp64replay -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (arg = argv + 1; *arg != NULL && **arg == '-'; arg++)
+   {
+      if (strcmp(*arg, "-timing") == 0)
+         r.timing = 1;
+      else if (strcmp(*arg, "-cold") == 0)
+         cold = 1;
+      else if (strcmp(*arg, "-lookup") == 0)
+         r.lookup_only = 1;
+      else if (strcmp(*arg, "-threads") == 0 && arg[1] != NULL)
+         r.n_workers = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-rom") == 0 && arg[1] != NULL)
+         rom = *(++arg);
+      else if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'mtp64replay -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (arg[0] == NULL || arg[1] == NULL || arg[2] != NULL)
+   {
+      fprintf(stderr, "A trace and an mTP64 file must be specified.\n"
+              "Try 'mtp64replay -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (r.n_workers == 0)
+   {
+      fprintf(stderr, "At least one thread is required.\n");
+      return EXIT_FAILURE;
+   }
+
+   r.rec = load_trace(arg[0], &r.n_rec);
+
+   if (r.rec == NULL)
+      return EXIT_FAILURE;
+
+   if (prepare_cache(arg[1], cold) != 0)
+      return EXIT_FAILURE;
+
+   if (rom != NULL)
+      r.pack = mtp64_open_rom(arg[1], rom);
+   else
+      r.pack = mtp64_open(arg[1]);
+
+   if (r.pack == NULL)
+      return EXIT_FAILURE;
+
+   r.latency = calloc(r.n_rec + 1, sizeof(*r.latency));
+   sorted = malloc((r.n_rec + 1) * sizeof(*sorted));
+   workers = calloc(r.n_workers, sizeof(*workers));
+   threads = calloc(r.n_workers, sizeof(*threads));
+
+   if (r.latency == NULL || sorted == NULL || workers == NULL ||
+         threads == NULL)
+   {
+      fprintf(stderr, "Unable to allocate memory.\n");
+      return EXIT_FAILURE;
+   }
+
+   r.start = mono_ns();
+
+   for (unsigned i = 0; i < r.n_workers; i++)
+   {
+      workers[i].r = &r;
+      workers[i].id = i;
+
+      if (pthread_create(&threads[i], NULL, replay_worker, &workers[i]) != 0)
+      {
+         fprintf(stderr, "Unable to create thread.\n");
+         return EXIT_FAILURE;
+      }
+   }
+
+   for (unsigned i = 0; i < r.n_workers; i++)
+   {
+      pthread_join(threads[i], NULL);
+      hits += workers[i].hits;
+      misses += workers[i].misses;
+      failures += workers[i].failures;
+      bytes += workers[i].bytes;
+   }
+
+   elapsed = mono_ns() - r.start;
+
+   memcpy(sorted, r.latency, r.n_rec * sizeof(*sorted));
+   qsort(sorted, r.n_rec, sizeof(*sorted), compare_u64);
+
+   fprintf(stdout, "Replayed %lu accesses on %u threads in %.3f s\n"
+           "Hits: %lu, misses: %lu, decode failures: %lu\n",
+           r.n_rec, r.n_workers, elapsed / 1e9, hits, misses, failures);
+
+   if (r.n_rec != 0)
+   {
+      fprintf(stdout, "Latency (ns): p50 %lu, p99 %lu, p999 %lu, max %lu\n",
+              sorted[(size_t)(r.n_rec * 0.5)],
+              sorted[(size_t)(r.n_rec * 0.99)],
+              sorted[(size_t)(r.n_rec * 0.999)],
+              sorted[r.n_rec - 1]);
+      fprintf(stdout, "Throughput: %.0f accesses/s, %.2f MiB/s decoded\n",
+              r.n_rec / (elapsed / 1e9),
+              bytes / (1024.0 * 1024.0) / (elapsed / 1e9));
+   }
+
+   mtp64_close(r.pack);
+   free(sorted);
+   free(r.latency);
+   free(workers);
+   free(threads);
+   free((void *)r.rec);
+   return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
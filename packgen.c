@@ -0,0 +1,967 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Generate synthetic texture packs for scale and performance testing.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <lz4frame.h>
+#include <lz4hc.h>
+
+#include "etc1.h"
+#include "hts.h"
+#include "mtp64.h"
+
+#define GL_RGBA               0x1908
+#define GL_RGB                0x1907
+#define GL_UNSIGNED_BYTE      0x1401
+#define GL_RGBA8              0x8058
+#define GL_ETC1_RGB8_OES      0x8D64
+
+/* Size of the KTX header and key value data written before each texture. */
+#define KTX_HDR_SZ            96
+
+/* Unique CRCs become hard to find as the count approaches 2^32. */
+#define MAX_COUNT             (1u << 30)
+
+/* Maximum number of entries in a weighted list given on the command line. */
+#define MAX_WEIGHTS           16
+
+enum content_e
+{
+   CONTENT_NOISE = 0,
+   CONTENT_GRADIENT,
+   CONTENT_FLAT,
+   CONTENT_MAX
+};
+
+enum crcdist_e
+{
+   CRCDIST_UNIFORM = 0,
+   CRCDIST_SEQUENTIAL,
+   CRCDIST_CLUSTERED
+};
+
+/* Items chosen at random in proportion to their weights. */
+struct weights_s
+{
+   unsigned n;
+   unsigned total;
+   unsigned weight[MAX_WEIGHTS];
+   uint16_t w[MAX_WEIGHTS];
+   uint16_t h[MAX_WEIGHTS];
+};
+
+struct options_s
+{
+   uint64_t seed;
+   uint32_t count;
+   unsigned dups;
+   unsigned etc1;
+   int level;
+   unsigned char gz;
+   unsigned char gzall;
+   unsigned char nolz4;
+   enum crcdist_e crcdist;
+   struct weights_s sizes;
+   struct weights_s content;
+
+   const char *ktx_dir;
+   const char *hts_out;
+   const char *htc_out;
+   const char *mtp64_out;
+};
+
+/* A generated texture, held by every output as it is written. */
+struct texture_s
+{
+   uint16_t w, h;
+   unsigned etc1;
+
+   uint8_t *rgba;
+   size_t rgba_sz;
+
+   /* ETC1 data, when etc1 is set. */
+   uint8_t *etc1_data;
+   size_t etc1_sz;
+};
+
+uint64_t now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * SplitMix64. Each texture is generated from its own state, derived from the
+ * seed and its index, so that a texture is the same whichever outputs are
+ * written.
+ */
+static uint64_t rng_next(uint64_t *s)
+{
+   uint64_t z = (*s += 0x9E3779B97F4A7C15);
+
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+   return z ^ (z >> 31);
+}
+
+/* Returns a value in the range [0, n). */
+static uint32_t rng_below(uint64_t *s, uint32_t n)
+{
+   return ((rng_next(s) >> 32) * n) >> 32;
+}
+
+static unsigned weights_pick(const struct weights_s *wt, uint64_t *s)
+{
+   uint32_t r = rng_below(s, wt->total);
+
+   for (unsigned i = 0; i < wt->n; i++)
+   {
+      if (r < wt->weight[i])
+         return i;
+
+      r -= wt->weight[i];
+   }
+
+   return wt->n - 1;
+}
+
+/**
+ * Parses a list such as "32x32:60,64x64:40" when sizes is set, or
+ * "noise:20,gradient:80" otherwise. Returns -1 on error.
+ */
+static int parse_weights(struct weights_s *wt, const char *str, int sizes)
+{
+   static const char *const content_names[CONTENT_MAX] =
+   {
+      "noise", "gradient", "flat"
+   };
+   char *list = strdup(str);
+   char *save = NULL;
+   int ret = -1;
+
+   memset(wt, 0, sizeof(*wt));
+
+   if (list == NULL)
+      return -1;
+
+   for (char *item = strtok_r(list, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save))
+   {
+      char *colon = strchr(item, ':');
+      unsigned weight = 1;
+
+      if (wt->n == MAX_WEIGHTS)
+         goto out;
+
+      if (colon != NULL)
+      {
+         *colon = '\0';
+         weight = strtoul(colon + 1, NULL, 10);
+      }
+
+      if (sizes)
+      {
+         unsigned w, h;
+
+         if (sscanf(item, "%ux%u", &w, &h) != 2 || w == 0 || h == 0 ||
+               w > UINT16_MAX || h > UINT16_MAX)
+            goto out;
+
+         wt->w[wt->n] = w;
+         wt->h[wt->n] = h;
+      }
+      else
+      {
+         unsigned c;
+
+         for (c = 0; c < CONTENT_MAX; c++)
+            if (strcmp(item, content_names[c]) == 0)
+               break;
+
+         if (c == CONTENT_MAX)
+            goto out;
+
+         /* Content is stored in place of the width. */
+         wt->w[wt->n] = c;
+      }
+
+      wt->weight[wt->n++] = weight;
+      wt->total += weight;
+   }
+
+   if (wt->n != 0 && wt->total != 0)
+      ret = 0;
+
+out:
+   free(list);
+   return ret;
+}
+
+/**
+ * Generates the CRC of each mapping. CRCs are unique, as mTP64 maps textures
+ * by CRC. Returns NULL if memory could not be allocated.
+ */
+static uint32_t *make_crcs(const struct options_s *opts)
+{
+   uint64_t s = opts->seed ^ 0x43524353;
+   uint32_t *crcs = malloc((size_t)opts->count * sizeof(*crcs));
+   uint32_t *set;
+   size_t cap = 1024;
+   uint32_t base = 0, run = 0, seq = opts->seed * 0x10000;
+
+   while (cap < (size_t)opts->count * 2)
+      cap <<= 1;
+
+   /* Zero marks an empty slot, so zero is never generated. UINT32_MAX is
+    * avoided as ktx2mtp64 rejects it. */
+   set = calloc(cap, sizeof(*set));
+
+   if (crcs == NULL || set == NULL)
+   {
+      free(crcs);
+      free(set);
+      return NULL;
+   }
+
+   for (uint32_t i = 0; i < opts->count; )
+   {
+      uint32_t crc;
+      size_t slot;
+
+      switch (opts->crcdist)
+      {
+      case CRCDIST_SEQUENTIAL:
+         crc = seq++;
+         break;
+
+      case CRCDIST_CLUSTERED:
+         /* Runs of up to 64 CRCs close to each other. */
+         if (run == 0)
+         {
+            base = rng_next(&s);
+            run = 1 + rng_below(&s, 64);
+         }
+
+         crc = base + rng_below(&s, 1024);
+         run--;
+         break;
+
+      default:
+         crc = rng_next(&s);
+         break;
+      }
+
+      if (crc == 0 || crc == UINT32_MAX)
+         continue;
+
+      for (slot = ((crc * 0x9E3779B97F4A7C15) >> 32) & (cap - 1);
+            set[slot] != 0;
+            slot = (slot + 1) & (cap - 1))
+         if (set[slot] == crc)
+            break;
+
+      if (set[slot] == crc)
+         continue;
+
+      set[slot] = crc;
+      crcs[i++] = crc;
+   }
+
+   free(set);
+   return crcs;
+}
+
+/**
+ * Chooses the texture of each mapping. A mapping is a duplicate of an earlier
+ * texture with a probability of opts->dups percent. Returns the number of
+ * distinct textures.
+ */
+static uint32_t make_mappings(const struct options_s *opts, uint32_t *tex_id)
+{
+   uint64_t s = opts->seed ^ 0x44555053;
+   uint32_t n_textures = 0;
+
+   for (uint32_t i = 0; i < opts->count; i++)
+   {
+      if (n_textures != 0 && rng_below(&s, 100) < opts->dups)
+         tex_id[i] = rng_below(&s, n_textures);
+      else
+         tex_id[i] = n_textures++;
+   }
+
+   return n_textures;
+}
+
+static int reserve(uint8_t **buf, size_t *buf_sz, size_t len)
+{
+   uint8_t *p;
+
+   if (len <= *buf_sz)
+      return 0;
+
+   p = realloc(*buf, len);
+
+   if (p == NULL)
+      return -1;
+
+   *buf = p;
+   *buf_sz = len;
+   return 0;
+}
+
+/* Generates texture number id. Returns -1 if memory could not be allocated. */
+static int make_texture(const struct options_s *opts, uint32_t id,
+                        struct texture_s *t)
+{
+   uint64_t s = opts->seed ^ ((uint64_t)id * 0xD1B54A32D192ED03);
+   unsigned size = weights_pick(&opts->sizes, &s);
+   enum content_e content = opts->content.w[weights_pick(&opts->content, &s)];
+   uint8_t c0[4], c1[4];
+   size_t n_px;
+
+   t->w = opts->sizes.w[size];
+   t->h = opts->sizes.h[size];
+   t->etc1 = rng_below(&s, 100) < opts->etc1;
+   n_px = (size_t)t->w * t->h;
+
+   if (reserve(&t->rgba, &t->rgba_sz, n_px * 4) != 0)
+      return -1;
+
+   for (unsigned c = 0; c < 4; c++)
+   {
+      c0[c] = rng_next(&s);
+      c1[c] = rng_next(&s);
+   }
+
+   switch (content)
+   {
+   case CONTENT_NOISE:
+      for (size_t i = 0; i < n_px * 4; i += 8)
+      {
+         uint64_t r = rng_next(&s);
+         memcpy(t->rgba + i, &r, n_px * 4 - i < 8 ? n_px * 4 - i : 8);
+      }
+      break;
+
+   case CONTENT_GRADIENT:
+      /* A linear blend between two colours, diagonally across the texture. */
+      for (size_t y = 0; y < t->h; y++)
+      {
+         for (size_t x = 0; x < t->w; x++)
+         {
+            unsigned f = (x + y) * 255 / (t->w + t->h - 1);
+            uint8_t *px = t->rgba + (y * t->w + x) * 4;
+
+            for (unsigned c = 0; c < 4; c++)
+               px[c] = (c0[c] * (255 - f) + c1[c] * f) / 255;
+         }
+      }
+      break;
+
+   default:
+      for (size_t i = 0; i < n_px; i++)
+         memcpy(t->rgba + i * 4, c0, 4);
+      break;
+   }
+
+   if (!t->etc1)
+      return 0;
+
+   /* ETC1 has no alpha, so the image is made opaque for every output. */
+   for (size_t i = 0; i < n_px; i++)
+      t->rgba[i * 4 + 3] = 0xFF;
+
+   if (reserve(&t->etc1_data, &t->etc1_sz,
+               etc1_image_size(t->w, t->h)) != 0)
+      return -1;
+
+   etc1_encode_image(t->etc1_data, t->rgba, t->w, t->h);
+   return 0;
+}
+
+/**
+ * Writes a KTX 1 header for an ETC1 or uncompressed RGBA8 texture, as read by
+ * ktx2mtp64.
+ */
+static void make_ktx_header(uint8_t *ktx, const struct texture_s *t,
+                            size_t data_sz)
+{
+   static const uint8_t identifier[12] =
+   {
+      0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A
+   };
+   static const char orientation[24] = "KTXorientation\0S=r,T=d";
+   const uint32_t fields[13] =
+   {
+      0x04030201,                            /* endianness */
+      t->etc1 ? 0 : GL_UNSIGNED_BYTE,        /* glType */
+      1,                                     /* glTypeSize */
+      t->etc1 ? 0 : GL_RGBA,                 /* glFormat */
+      t->etc1 ? GL_ETC1_RGB8_OES : GL_RGBA8, /* glInternalFormat */
+      t->etc1 ? GL_RGB : GL_RGBA,            /* glBaseInternalFormat */
+      t->w, t->h,
+      0,                                     /* pixelDepth */
+      0,                                     /* numberOfArrayElements */
+      1,                                     /* numberOfFaces */
+      1,                                     /* numberOfMipmapLevels */
+      4 + sizeof(orientation)
+   };
+   const uint32_t kv_sz = sizeof(orientation) - 1;
+   const uint32_t image_sz = data_sz;
+
+   memcpy(ktx, identifier, sizeof(identifier));
+   memcpy(ktx + 12, fields, sizeof(fields));
+   memcpy(ktx + 64, &kv_sz, 4);
+   memcpy(ktx + 68, orientation, sizeof(orientation));
+   memcpy(ktx + 92, &image_sz, 4);
+}
+
+static int write_ktx(const char *dir, uint32_t crc, const struct texture_s *t)
+{
+   uint8_t hdr[KTX_HDR_SZ];
+   const uint8_t *data = t->etc1 ? t->etc1_data : t->rgba;
+   size_t data_sz = t->etc1 ? etc1_image_size(t->w, t->h) :
+                    (size_t)t->w * t->h * 4;
+   char name[4096];
+   FILE *f;
+   int ret = 0;
+
+   snprintf(name, sizeof(name), "%s/%08X.ktx", dir, crc);
+   f = fopen(name, "wb");
+
+   if (f == NULL)
+   {
+      fprintf(stderr, "Unable to create %s\n", name);
+      return -1;
+   }
+
+   make_ktx_header(hdr, t, data_sz);
+
+   if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr) ||
+         fwrite(data, 1, data_sz, f) != data_sz)
+      ret = -1;
+
+   if (fclose(f) != 0 || ret != 0)
+   {
+      fprintf(stderr, "Unable to write %s\n", name);
+      return -1;
+   }
+
+   return 0;
+}
+
+/**
+ * Makes the header and data of a HTS record, compressing the texture with
+ * zlib if requested. As GLideNHQ does, textures that zlib does not make
+ * smaller are stored uncompressed unless -gzall is given. HTS and HTC packs
+ * only hold RGBA8888 textures.
+ */
+static int make_record(const struct options_s *opts, const struct texture_s *t,
+                       uint8_t *hdr, uint8_t **data, size_t *data_sz,
+                       uint8_t **zbuf, size_t *zbuf_sz)
+{
+   size_t rgba_len = (size_t)t->w * t->h * 4;
+   int32_t w = t->w, h = t->h, sz;
+   uint32_t fmt = GL_RGBA8;
+   uint16_t texfmt = GL_RGBA, pixtype = GL_UNSIGNED_BYTE;
+
+   *data = t->rgba;
+   *data_sz = rgba_len;
+
+   if (opts->gz || opts->gzall)
+   {
+      uLongf z_len = compressBound(rgba_len);
+
+      if (reserve(zbuf, zbuf_sz, z_len) != 0)
+         return -1;
+
+      if (compress2(*zbuf, &z_len, t->rgba, rgba_len,
+                    Z_DEFAULT_COMPRESSION) != Z_OK)
+         return -1;
+
+      if (z_len < rgba_len || opts->gzall)
+      {
+         *data = *zbuf;
+         *data_sz = z_len;
+         fmt |= GL_TEXFMT_GZ;
+      }
+   }
+
+   sz = *data_sz;
+   memcpy(hdr + 0, &w, 4);
+   memcpy(hdr + 4, &h, 4);
+   memcpy(hdr + 8, &fmt, 4);
+   memcpy(hdr + 12, &texfmt, 2);
+   memcpy(hdr + 14, &pixtype, 2);
+   hdr[16] = 1;
+   memcpy(hdr + 17, &sz, 4);
+   return 0;
+}
+
+/**
+ * Compresses a texture for an mTP64 pack with LZ4, unless disabled, and
+ * writes its entry. Returns the offset of the entry divided by eight.
+ */
+static int write_mtp64_texture(const struct options_s *opts, FILE *f,
+                               const struct texture_s *t, uint8_t **lz4buf,
+                               size_t *lz4buf_sz, uint32_t *offset)
+{
+   static const uint8_t padding[7] = { 0 };
+   struct mtp64_texture_header_s tex_hdr;
+   const uint8_t *data = t->etc1 ? t->etc1_data : t->rgba;
+   size_t data_sz = t->etc1 ? etc1_image_size(t->w, t->h) :
+                    (size_t)t->w * t->h * 4;
+   long pos = ftell(f);
+
+   if (pos < 0 || (uint64_t)pos / 8 > UINT32_MAX)
+   {
+      fprintf(stderr, "The mTP64 pack would be larger than 32 GiB\n");
+      return -1;
+   }
+
+   *offset = pos / 8;
+   tex_hdr.data_format = t->etc1 ? MTP64_FORMAT_ETC1 : MTP64_FORMAT_RGBA8888;
+
+   if (!opts->nolz4)
+   {
+      LZ4F_preferences_t lz4pref = LZ4F_INIT_PREFERENCES;
+      size_t bound;
+
+      lz4pref.compressionLevel = opts->level;
+      bound = LZ4F_compressFrameBound(data_sz, &lz4pref);
+
+      if (reserve(lz4buf, lz4buf_sz, bound) != 0)
+         return -1;
+
+      data_sz = LZ4F_compressFrame(*lz4buf, bound, data, data_sz, &lz4pref);
+
+      if (LZ4F_isError(data_sz))
+      {
+         fprintf(stderr, "Error compressing texture with LZ4: %s\n",
+                 LZ4F_getErrorName(data_sz));
+         return -1;
+      }
+
+      data = *lz4buf;
+      tex_hdr.data_format |= MTP64_FORMAT_LZ4_COMPRESSED;
+   }
+
+   tex_hdr.data_size = data_sz;
+   tex_hdr.tex_width = t->w;
+   tex_hdr.tex_height = t->h;
+
+   fwrite(&tex_hdr, 1, sizeof(tex_hdr), f);
+   fwrite(data, 1, data_sz, f);
+
+   if ((sizeof(tex_hdr) + data_sz) % 8 != 0)
+      fwrite(padding, 1, 8 - (sizeof(tex_hdr) + data_sz) % 8, f);
+
+   return 0;
+}
+
+static int compare_map(const void *in1, const void *in2)
+{
+   const struct mtp64_map_s *a = in1;
+   const struct mtp64_map_s *b = in2;
+
+   return (a->crc > b->crc) - (a->crc < b->crc);
+}
+
+/**
+ * Writes the header and CRC sorted map of an mTP64 pack, once the offset of
+ * every texture is known.
+ */
+static int finish_mtp64(FILE *f, const uint32_t *crcs, const uint32_t *tex_id,
+                        const uint32_t *offsets, uint32_t count,
+                        uint32_t n_textures, uint64_t first_texture)
+{
+   struct mtp64_header_s hdr = MTP64_HEADER_INIT;
+   const uint8_t unused[4] = { 0, 0, 0, 0 };
+   struct mtp64_map_s *map = malloc((size_t)count * sizeof(*map) + 1);
+   long end = ftell(f);
+
+   if (map == NULL)
+      return -1;
+
+   for (uint32_t i = 0; i < count; i++)
+   {
+      map[i].crc = crcs[i];
+      map[i].offset = offsets[tex_id[i]];
+   }
+
+   qsort(map, count, sizeof(*map), compare_map);
+
+   memcpy(hdr.pack_name, "packgen", sizeof("packgen"));
+   hdr.pack_size = (end + 7) / 8;
+   hdr.n_textures = n_textures;
+   hdr.n_mappings = count;
+   hdr.first_texture_offset = first_texture;
+
+   fseek(f, 0, SEEK_SET);
+   fwrite(&hdr, 1, sizeof(hdr), f);
+   fwrite(unused, 1, sizeof(unused), f);
+   fwrite(map, sizeof(*map), count, f);
+   free(map);
+   return 0;
+}
+
+void print_help(void)
+{
+   const char *const help_str =
+      "Usage: packgen [OPTION...]\n"
+      "Available options:\n"
+      "  -help      \tPrints this help text\n"
+      "  -seed N    \tSeed of the generator (default 1)\n"
+      "  -count N   \tNumber of CRC mappings (default 1000)\n"
+      "  -sizes L   \tTexture dimensions and their weights (default "
+      "'32x32:40,64x64:30,128x64:20,256x256:10')\n"
+      "  -content L \tContent and its weight, of 'noise', 'gradient' and "
+      "'flat' (default 'noise:20,gradient:60,flat:20')\n"
+      "  -dups P    \tPercentage of mappings that duplicate an earlier "
+      "texture (default 10)\n"
+      "  -crcs D    \tCRC distribution: 'uniform' (default), 'sequential' or "
+      "'clustered'\n"
+      "  -etc1 P    \tPercentage of textures that are ETC1 in KTX and mTP64 "
+      "output (default 0)\n"
+      "  -gz        \tCompress HTS and HTC textures with zlib\n"
+      "  -gzall     \tCompress every HTS and HTC texture with zlib, even if "
+      "it grows\n"
+      "  -level N   \tLZ4 compression level of mTP64 textures (default 9)\n"
+      "  -nolz4     \tStore mTP64 textures without LZ4 compression\n"
+      "  -ktx DIR   \tWrite a KTX file for each mapping to DIR\n"
+      "  -hts FILE  \tWrite a HTS pack\n"
+      "  -htc FILE  \tWrite a gzip compressed HTC pack\n"
+      "  -mtp64 FILE\tWrite an mTP64 pack\n"
+      "\n"
+      "Every output holds the same textures, generated from the seed, so the "
+      "same options always give the same files.\n"
+      "Weighted lists are comma separated, such as '32x32:3,64x64:1'. A "
+      "missing weight is 1.\n"
+      "Clustered CRCs come in runs of up to 64 values within 1024 of each "
+      "other. ETC1 textures are opaque; HTS and HTC packs store them as "
+      "RGBA8888.\n"
+      "With '-gz', textures that zlib does not make smaller are stored "
+      "uncompressed, as GLideNHQ does. '-gzall' compresses them anyway, "
+      "making packs with the zlib streams larger than their textures that "
+      "readers must also accept.\n"
+      "\n"
+      "Example:\n"
+      "  packgen -seed 7 -count 1000000 -dups 25 -hts big.hts "
+      "-mtp64 big.mtp64\n";
+
+   fprintf(stdout, "%s", help_str);
+}
+
+int main(int argc, char *argv[])
+{
+   struct options_s opts =
+   {
+      .seed = 1, .count = 1000, .dups = 10, .level = LZ4HC_CLEVEL_DEFAULT
+   };
+   struct texture_s tex = { 0 };
+   uint32_t *crcs = NULL, *tex_id = NULL, *mtp64_off = NULL;
+   uint64_t *hts_off = NULL;
+   uint8_t *zbuf = NULL, *lz4buf = NULL;
+   size_t zbuf_sz = 0, lz4buf_sz = 0;
+   uint32_t n_textures, next_tex = 0;
+   uint64_t mtp64_first = 0, start_time;
+   FILE *f_hts = NULL, *f_mtp64 = NULL;
+   gzFile gz_htc = NULL;
+   int ret = EXIT_FAILURE;
+   const char *sizes = "32x32:40,64x64:30,128x64:20,256x256:10";
+   const char *content = "noise:20,gradient:60,flat:20";
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "A command must be specified.\n"
+              "Try 'packgen -help' for more information.\n");
+      return EXIT_FAILURE;
+   }
+
+   for (char **arg = argv + 1; *arg != NULL; arg++)
+   {
+      if (strcmp(*arg, "-help") == 0)
+      {
+         print_help();
+         return EXIT_SUCCESS;
+      }
+      else if (strcmp(*arg, "-gz") == 0)
+         opts.gz = 1;
+      else if (strcmp(*arg, "-gzall") == 0)
+         opts.gzall = 1;
+      else if (strcmp(*arg, "-nolz4") == 0)
+         opts.nolz4 = 1;
+      else if (arg[1] == NULL)
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'packgen -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+      else if (strcmp(*arg, "-seed") == 0)
+         opts.seed = strtoull(*(++arg), NULL, 0);
+      else if (strcmp(*arg, "-count") == 0)
+         opts.count = strtoul(*(++arg), NULL, 0);
+      else if (strcmp(*arg, "-sizes") == 0)
+         sizes = *(++arg);
+      else if (strcmp(*arg, "-content") == 0)
+         content = *(++arg);
+      else if (strcmp(*arg, "-dups") == 0)
+         opts.dups = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-etc1") == 0)
+         opts.etc1 = strtoul(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-level") == 0)
+         opts.level = strtol(*(++arg), NULL, 10);
+      else if (strcmp(*arg, "-crcs") == 0)
+      {
+         arg++;
+
+         if (strcmp(*arg, "uniform") == 0)
+            opts.crcdist = CRCDIST_UNIFORM;
+         else if (strcmp(*arg, "sequential") == 0)
+            opts.crcdist = CRCDIST_SEQUENTIAL;
+         else if (strcmp(*arg, "clustered") == 0)
+            opts.crcdist = CRCDIST_CLUSTERED;
+         else
+         {
+            fprintf(stderr, "Unknown CRC distribution '%s'\n", *arg);
+            return EXIT_FAILURE;
+         }
+      }
+      else if (strcmp(*arg, "-ktx") == 0)
+         opts.ktx_dir = *(++arg);
+      else if (strcmp(*arg, "-hts") == 0)
+         opts.hts_out = *(++arg);
+      else if (strcmp(*arg, "-htc") == 0)
+         opts.htc_out = *(++arg);
+      else if (strcmp(*arg, "-mtp64") == 0)
+         opts.mtp64_out = *(++arg);
+      else
+      {
+         fprintf(stderr, "Unrecognised option '%s'\n"
+                 "Try 'packgen -help' for more information.\n", *arg);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (parse_weights(&opts.sizes, sizes, 1) != 0)
+   {
+      fprintf(stderr, "Invalid list of sizes '%s'\n", sizes);
+      return EXIT_FAILURE;
+   }
+
+   if (parse_weights(&opts.content, content, 0) != 0)
+   {
+      fprintf(stderr, "Invalid list of content '%s'\n", content);
+      return EXIT_FAILURE;
+   }
+
+   if (opts.ktx_dir == NULL && opts.hts_out == NULL && opts.htc_out == NULL &&
+         opts.mtp64_out == NULL)
+   {
+      fprintf(stderr, "No output was specified.\n");
+      return EXIT_FAILURE;
+   }
+
+   if (opts.count == 0 || opts.count > MAX_COUNT || opts.dups > 100 ||
+         opts.etc1 > 100)
+   {
+      fprintf(stderr, "Count must be between 1 and %u, and percentages no "
+              "more than 100.\n", MAX_COUNT);
+      return EXIT_FAILURE;
+   }
+
+   start_time = now_ms();
+   crcs = make_crcs(&opts);
+   tex_id = malloc((size_t)opts.count * sizeof(*tex_id));
+
+   if (crcs == NULL || tex_id == NULL)
+      goto out;
+
+   n_textures = make_mappings(&opts, tex_id);
+
+   if (opts.ktx_dir != NULL && mkdir(opts.ktx_dir, 0755) != 0 &&
+         errno != EEXIST)
+   {
+      fprintf(stderr, "Unable to create %s\n", opts.ktx_dir);
+      goto out;
+   }
+
+   if (opts.hts_out != NULL)
+   {
+      const int32_t config = 0;
+      const int64_t keymap_off = 0;
+
+      f_hts = fopen(opts.hts_out, "wb");
+      hts_off = malloc((size_t)n_textures * sizeof(*hts_off));
+
+      if (f_hts == NULL || hts_off == NULL)
+      {
+         fprintf(stderr, "Unable to create %s\n", opts.hts_out);
+         goto out;
+      }
+
+      /* The key map offset is written once the records are. */
+      fwrite(&config, 1, sizeof(config), f_hts);
+      fwrite(&keymap_off, 1, sizeof(keymap_off), f_hts);
+   }
+
+   if (opts.htc_out != NULL)
+   {
+      const int32_t config = 0;
+
+      gz_htc = gzopen(opts.htc_out, "wb");
+
+      if (gz_htc == NULL)
+      {
+         fprintf(stderr, "Unable to create %s\n", opts.htc_out);
+         goto out;
+      }
+
+      gzbuffer(gz_htc, 1024 * 1024);
+      gzwrite(gz_htc, &config, sizeof(config));
+   }
+
+   if (opts.mtp64_out != NULL)
+   {
+      f_mtp64 = fopen(opts.mtp64_out, "wb");
+      mtp64_off = malloc((size_t)n_textures * sizeof(*mtp64_off));
+
+      if (f_mtp64 == NULL || mtp64_off == NULL)
+      {
+         fprintf(stderr, "Unable to create %s\n", opts.mtp64_out);
+         goto out;
+      }
+
+      /* Textures follow the header, four unused bytes and the map. */
+      mtp64_first = sizeof(struct mtp64_header_s) + 4 +
+                    (uint64_t)opts.count * sizeof(struct mtp64_map_s);
+      mtp64_first = (mtp64_first + 7) & ~(uint64_t)7;
+      fseek(f_mtp64, mtp64_first, SEEK_SET);
+   }
+
+   /* Mappings are visited in order, and a texture is generated when the
+    * first mapping to it is reached. A duplicate is generated again, which is
+    * cheaper than keeping every texture. */
+   for (uint32_t i = 0; i < opts.count; i++)
+   {
+      int is_new = tex_id[i] == next_tex;
+      uint8_t hdr[HTS_RECORD_HDR_SZ];
+      uint8_t *data;
+      size_t data_sz;
+
+      /* HTS and mTP64 packs store each texture once. */
+      if (!is_new && opts.ktx_dir == NULL && gz_htc == NULL)
+         continue;
+
+      if (make_texture(&opts, tex_id[i], &tex) != 0)
+         goto out;
+
+      if (is_new)
+         next_tex++;
+
+      if (opts.ktx_dir != NULL && write_ktx(opts.ktx_dir, crcs[i], &tex) != 0)
+         goto out;
+
+      if ((f_hts != NULL && is_new) || gz_htc != NULL)
+      {
+         if (make_record(&opts, &tex, hdr, &data, &data_sz, &zbuf,
+                         &zbuf_sz) != 0)
+            goto out;
+      }
+
+      if (f_hts != NULL && is_new)
+      {
+         hts_off[tex_id[i]] = ftell(f_hts);
+         fwrite(hdr, 1, sizeof(hdr), f_hts);
+         fwrite(data, 1, data_sz, f_hts);
+      }
+
+      if (gz_htc != NULL)
+      {
+         uint64_t key = crcs[i];
+
+         gzwrite(gz_htc, &key, sizeof(key));
+         gzwrite(gz_htc, hdr, sizeof(hdr));
+         gzwrite(gz_htc, data, data_sz);
+      }
+
+      if (f_mtp64 != NULL && is_new &&
+            write_mtp64_texture(&opts, f_mtp64, &tex, &lz4buf, &lz4buf_sz,
+                                &mtp64_off[tex_id[i]]) != 0)
+         goto out;
+
+      if (i % 4096 == 0)
+      {
+         fprintf(stdout, "%8u\r", i);
+         fflush(stdout);
+      }
+   }
+
+   if (f_hts != NULL)
+   {
+      int64_t keymap_off = ftell(f_hts) - 12;
+
+      for (uint32_t i = 0; i < opts.count; i++)
+      {
+         uint64_t entry[2] = { hts_off[tex_id[i]], crcs[i] };
+         fwrite(entry, 1, sizeof(entry), f_hts);
+      }
+
+      fseek(f_hts, 4, SEEK_SET);
+      fwrite(&keymap_off, 1, sizeof(keymap_off), f_hts);
+   }
+
+   if (f_mtp64 != NULL && finish_mtp64(f_mtp64, crcs, tex_id, mtp64_off,
+                                       opts.count, n_textures,
+                                       mtp64_first) != 0)
+      goto out;
+
+   fprintf(stdout, "Generated %u textures for %u CRCs with seed %lu in "
+           "%lu ms\n", n_textures, opts.count, opts.seed,
+           now_ms() - start_time);
+   ret = EXIT_SUCCESS;
+
+out:
+   if (f_hts != NULL && fclose(f_hts) != 0)
+      ret = EXIT_FAILURE;
+
+   if (gz_htc != NULL && gzclose(gz_htc) != Z_OK)
+      ret = EXIT_FAILURE;
+
+   if (f_mtp64 != NULL && fclose(f_mtp64) != 0)
+      ret = EXIT_FAILURE;
+
+   free(crcs);
+   free(tex_id);
+   free(hts_off);
+   free(mtp64_off);
+   free(tex.rgba);
+   free(tex.etc1_data);
+   free(zbuf);
+   free(lz4buf);
+   return ret;
+}
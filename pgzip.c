@@ -0,0 +1,1389 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Parallel inflate of a single gzip stream.
+ *
+ * Based on the approach of pugz and rapidgzip: the compressed file is split
+ * into chunks, and a thread searches each chunk but the first for the first
+ * bit offset at which a deflate block can be decoded. It decodes from there
+ * with its own inflater, which writes 16-bit symbols so that bytes copied
+ * from the unknown 32 KiB before the chunk are kept as markers. Once the last
+ * 32 KiB of output holds no markers, the rest of the chunk is inflated by
+ * zlib with that output as its window. Every chunk stops at the first block
+ * boundary at or past the start of the next chunk.
+ *
+ * The reader takes the chunks in order. A chunk is only used if it started at
+ * the boundary where the previous chunk stopped, in which case its markers
+ * are replaced with bytes of the previous output. Otherwise the reader
+ * inflates it again with zlib, so a wrong guess only costs time.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "pgzip.h"
+
+#define WINSIZE      32768
+#define MAX_BITS     15
+#define LUT_BITS     10
+
+/* Symbols from this value refer to a byte of the window before a chunk. */
+#define MARKER       256
+
+/* Free output space kept whilst inflating with zlib. */
+#define OUT_STEP     (256 * 1024)
+
+enum run_e
+{
+   RUN_ERROR = -1,
+   /* The limit or the end of the last block was reached. */
+   RUN_STOP,
+   /* The window is known, so zlib may continue from here. */
+   RUN_CLEAN
+};
+
+struct huff_s
+{
+   uint16_t count[MAX_BITS + 1];
+   uint16_t symbol[288];
+   /* Symbol << 4 | length of each code of up to LUT_BITS bits, indexed by
+    * the next LUT_BITS bits of input. Zero if the code is longer. */
+   uint16_t lut[1 << LUT_BITS];
+};
+
+struct bits_s
+{
+   const uint8_t *data;
+   size_t size;
+   /* Next byte to be loaded into buf. */
+   size_t pos;
+   uint64_t buf;
+   unsigned n;
+};
+
+struct chunk_s
+{
+   /* Compressed bytes in which the chunk looks for its first block. */
+   size_t begin;
+   size_t end;
+
+   /* Bit offset of the first block, or of the LEN field if it is stored. */
+   uint64_t start_bit;
+   /* Bit offset of the block at which decoding stopped, or of the end of the
+    * last block. */
+   uint64_t stop_bit;
+   unsigned char stored;
+   unsigned char final;
+   unsigned char failed;
+   unsigned char done;
+
+   /* Output decoded before the window was known. */
+   uint16_t *sym;
+   size_t n_sym;
+   size_t sym_cap;
+
+   /* Output inflated by zlib after the window was known. */
+   uint8_t *out;
+   size_t n_out;
+   size_t out_cap;
+   uint32_t out_crc;
+};
+
+struct dec_s
+{
+   struct bits_s b;
+   struct huff_s lit;
+   struct huff_s dist;
+   struct chunk_s *c;
+   /* Output position just after the last marker. */
+   size_t clean;
+};
+
+struct pgz_s
+{
+   const uint8_t *map;
+   size_t map_sz;
+
+   struct chunk_s *chunks;
+   size_t n_chunks;
+
+   pthread_t *threads;
+   unsigned n_threads;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   /* Next chunk to be taken by a thread. */
+   size_t next_chunk;
+   int stop;
+
+   /* Next chunk to be read, and whether the one before it is still being
+    * read from its first or second output. */
+   size_t cur;
+   int loaded;
+   int seg;
+   const uint8_t *rd;
+   size_t rd_left;
+
+   /* Bit offset at which the next chunk must start. */
+   uint64_t next_bit;
+   int final;
+
+   /* The last win_len bytes of output end at window[WINSIZE - 1]. */
+   uint8_t window[WINSIZE];
+   size_t win_len;
+   uint32_t crc;
+   uint64_t total;
+   uint64_t pos;
+
+   /* Members after the first are inflated by zlib as they are read. */
+   z_stream tail;
+   int tail_active;
+
+   int eof;
+   const char *err;
+   size_t n_read;
+   size_t n_serial;
+};
+
+static const uint16_t len_base[29] = {
+   3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+   35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+   0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+   3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+   1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+   257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+   16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+   0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+   7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static inline uint64_t bits_tell(const struct bits_s *b)
+{
+   return (uint64_t)b->pos * 8 - b->n;
+}
+
+/* Buffers at least 56 bits. Zeros are read past the end of the data. */
+static inline void bits_refill(struct bits_s *b)
+{
+   if (b->pos + 8 <= b->size)
+   {
+      uint64_t v;
+
+      memcpy(&v, b->data + b->pos, 8);
+      b->buf |= v << b->n;
+      b->pos += (63 - b->n) >> 3;
+      b->n |= 56;
+      return;
+   }
+
+   while (b->n < 56)
+   {
+      uint64_t byte = b->pos < b->size ? b->data[b->pos] : 0;
+
+      b->buf |= byte << b->n;
+      b->pos++;
+      b->n += 8;
+   }
+}
+
+static inline unsigned bits_get(struct bits_s *b, unsigned n)
+{
+   unsigned v = b->buf & ((1ull << n) - 1);
+
+   b->buf >>= n;
+   b->n -= n;
+   return v;
+}
+
+static void bits_seek(struct bits_s *b, uint64_t bit)
+{
+   b->pos = bit >> 3;
+   b->buf = 0;
+   b->n = 0;
+   bits_refill(b);
+   bits_get(b, bit & 7);
+}
+
+/* Returns -1 if the lengths are over-subscribed, or the number of codes left
+ * unused. */
+static int huff_build(struct huff_s *h, const uint8_t *len, unsigned n)
+{
+   uint16_t offs[MAX_BITS + 1];
+   unsigned code = 0, idx = 0;
+   int left = 1;
+
+   memset(h->count, 0, sizeof(h->count));
+
+   for (unsigned i = 0; i < n; i++)
+      h->count[len[i]]++;
+
+   for (unsigned l = 1; l <= MAX_BITS; l++)
+   {
+      left <<= 1;
+      left -= h->count[l];
+
+      if (left < 0)
+         return -1;
+   }
+
+   offs[1] = 0;
+
+   for (unsigned l = 1; l < MAX_BITS; l++)
+      offs[l + 1] = offs[l] + h->count[l];
+
+   for (unsigned i = 0; i < n; i++)
+   {
+      if (len[i] != 0)
+         h->symbol[offs[len[i]]++] = i;
+   }
+
+   memset(h->lut, 0, sizeof(h->lut));
+
+   for (unsigned l = 1; l <= LUT_BITS; l++)
+   {
+      for (unsigned k = 0; k < h->count[l]; k++, code++, idx++)
+      {
+         unsigned rev = 0;
+
+         /* Codes are packed starting from their most significant bit. */
+         for (unsigned b = 0; b < l; b++)
+            rev |= ((code >> b) & 1) << (l - 1 - b);
+
+         for (unsigned j = rev; j < (1u << LUT_BITS); j += 1u << l)
+            h->lut[j] = h->symbol[idx] << 4 | l;
+      }
+
+      code <<= 1;
+   }
+
+   return left;
+}
+
+/* Returns non-zero if the code has a single symbol of length 1, which zlib
+ * allows although the code is incomplete. */
+static int huff_single(const struct huff_s *h)
+{
+   if (h->count[1] != 1)
+      return 0;
+
+   for (unsigned l = 2; l <= MAX_BITS; l++)
+   {
+      if (h->count[l] != 0)
+         return 0;
+   }
+
+   return 1;
+}
+
+static int huff_decode_slow(struct bits_s *b, const struct huff_s *h)
+{
+   int code = 0, first = 0, index = 0;
+
+   for (unsigned len = 1; len <= MAX_BITS; len++)
+   {
+      int count = h->count[len];
+
+      code |= bits_get(b, 1);
+
+      if (code - count < first)
+         return h->symbol[index + (code - first)];
+
+      index += count;
+      first += count;
+      first <<= 1;
+      code <<= 1;
+   }
+
+   return -1;
+}
+
+static inline int huff_decode(struct bits_s *b, const struct huff_s *h)
+{
+   unsigned e;
+
+   bits_refill(b);
+   e = h->lut[b->buf & ((1u << LUT_BITS) - 1)];
+
+   if (e == 0)
+      return huff_decode_slow(b, h);
+
+   bits_get(b, e & 15);
+   return e >> 4;
+}
+
+static int reserve_sym(struct chunk_s *c, size_t len)
+{
+   if (c->sym_cap - c->n_sym >= len)
+      return 0;
+
+   size_t cap = c->sym_cap ? c->sym_cap : 1 << 20;
+   uint16_t *sym;
+
+   while (cap - c->n_sym < len)
+      cap <<= 1;
+
+   sym = realloc(c->sym, cap * sizeof(*sym));
+
+   if (sym == NULL)
+      return -1;
+
+   c->sym = sym;
+   c->sym_cap = cap;
+   return 0;
+}
+
+static int reserve_out(struct chunk_s *c, size_t len)
+{
+   if (c->out_cap - c->n_out >= len)
+      return 0;
+
+   size_t cap = c->out_cap ? c->out_cap : 1 << 20;
+   uint8_t *out;
+
+   while (cap - c->n_out < len)
+      cap <<= 1;
+
+   out = realloc(c->out, cap);
+
+   if (out == NULL)
+      return -1;
+
+   c->out = out;
+   c->out_cap = cap;
+   return 0;
+}
+
+static void build_fixed(struct dec_s *d)
+{
+   uint8_t lengths[288];
+
+   memset(lengths, 8, 144);
+   memset(lengths + 144, 9, 112);
+   memset(lengths + 256, 7, 24);
+   memset(lengths + 280, 8, 8);
+   huff_build(&d->lit, lengths, 288);
+
+   memset(lengths, 5, 30);
+   huff_build(&d->dist, lengths, 30);
+}
+
+/* Reads the code lengths of a dynamic block, applying the same checks as
+ * zlib so that a block zlib would reject is never taken as a start. */
+static int read_dynamic(struct dec_s *d)
+{
+   static const uint8_t order[19] = {
+      16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+   };
+   struct huff_s lc;
+   uint8_t lengths[286 + 30];
+   unsigned nlen, ndist, ncode, i = 0;
+   int left;
+
+   bits_refill(&d->b);
+   nlen = bits_get(&d->b, 5) + 257;
+   ndist = bits_get(&d->b, 5) + 1;
+   ncode = bits_get(&d->b, 4) + 4;
+
+   if (nlen > 286 || ndist > 30)
+      return -1;
+
+   memset(lengths, 0, 19);
+
+   for (unsigned k = 0; k < ncode; k++)
+   {
+      bits_refill(&d->b);
+      lengths[order[k]] = bits_get(&d->b, 3);
+   }
+
+   if (huff_build(&lc, lengths, 19) != 0)
+      return -1;
+
+   while (i < nlen + ndist)
+   {
+      int sym = huff_decode(&d->b, &lc);
+      unsigned rep, val = 0;
+
+      if (sym < 0)
+         return -1;
+
+      if (sym < 16)
+      {
+         lengths[i++] = sym;
+         continue;
+      }
+
+      if (sym == 16)
+      {
+         if (i == 0)
+            return -1;
+
+         val = lengths[i - 1];
+         rep = 3 + bits_get(&d->b, 2);
+      }
+      else if (sym == 17)
+         rep = 3 + bits_get(&d->b, 3);
+      else
+         rep = 11 + bits_get(&d->b, 7);
+
+      if (i + rep > nlen + ndist)
+         return -1;
+
+      while (rep--)
+         lengths[i++] = val;
+   }
+
+   if (lengths[256] == 0)
+      return -1;
+
+   left = huff_build(&d->lit, lengths, nlen);
+
+   if (left < 0 || (left > 0 && !huff_single(&d->lit)))
+      return -1;
+
+   left = huff_build(&d->dist, lengths + nlen, ndist);
+
+   if (left < 0 || (left > 0 && d->dist.count[0] != ndist &&
+                    !huff_single(&d->dist)))
+      return -1;
+
+   return 0;
+}
+
+static int decode_codes(struct dec_s *d)
+{
+   struct chunk_s *c = d->c;
+
+   for (;;)
+   {
+      int sym;
+      unsigned len, dist;
+      uint16_t *out;
+
+      /* Zeros read past the end of the data would otherwise decode for
+       * ever. */
+      if (d->b.pos > d->b.size + 8 || reserve_sym(c, 258) != 0)
+         return -1;
+
+      sym = huff_decode(&d->b, &d->lit);
+
+      if (sym < 256)
+      {
+         if (sym < 0)
+            return -1;
+
+         c->sym[c->n_sym++] = sym;
+         continue;
+      }
+
+      if (sym == 256)
+         return 0;
+
+      sym -= 257;
+
+      if (sym >= 29)
+         return -1;
+
+      len = len_base[sym] + bits_get(&d->b, len_extra[sym]);
+      sym = huff_decode(&d->b, &d->dist);
+
+      if (sym < 0 || sym >= 30)
+         return -1;
+
+      dist = dist_base[sym] + bits_get(&d->b, dist_extra[sym]);
+
+      if (dist > c->n_sym + WINSIZE)
+         return -1;
+
+      out = c->sym + c->n_sym;
+
+      if (dist <= c->n_sym && c->n_sym - dist >= d->clean)
+      {
+         /* No marker can be copied. */
+         for (unsigned j = 0; j < len; j++)
+            out[j] = out[(ptrdiff_t)j - dist];
+      }
+      else
+      {
+         for (unsigned j = 0; j < len; j++)
+         {
+            uint16_t v;
+
+            if (j < dist && dist - j > c->n_sym)
+               v = MARKER + WINSIZE - (dist - j - c->n_sym);
+            else
+               v = out[(ptrdiff_t)j - dist];
+
+            out[j] = v;
+
+            if (v >= MARKER)
+               d->clean = c->n_sym + j + 1;
+         }
+      }
+
+      c->n_sym += len;
+   }
+}
+
+/* Copies the stored block whose LEN field is at byte at. */
+static int decode_stored(struct dec_s *d, size_t at)
+{
+   struct chunk_s *c = d->c;
+   const uint8_t *p = d->b.data + at;
+   unsigned len;
+
+   if (at + 4 > d->b.size)
+      return -1;
+
+   len = p[0] | p[1] << 8;
+
+   if ((len ^ 0xFFFF) != (unsigned)(p[2] | p[3] << 8) ||
+         at + 4 + len > d->b.size || reserve_sym(c, len) != 0)
+      return -1;
+
+   for (unsigned j = 0; j < len; j++)
+      c->sym[c->n_sym + j] = p[4 + j];
+
+   c->n_sym += len;
+   bits_seek(&d->b, (uint64_t)(at + 4 + len) * 8);
+   return 0;
+}
+
+/* Decodes blocks until the limit, the end of the last block, or a block
+ * boundary where the window is known. Counts the blocks completed. */
+static enum run_e run_sym(struct dec_s *d, uint64_t limit, unsigned *blocks)
+{
+   struct chunk_s *c = d->c;
+
+   for (;;)
+   {
+      uint64_t bit = bits_tell(&d->b);
+      unsigned hdr;
+      int ret;
+
+      if (bit >= limit)
+      {
+         c->stop_bit = bit;
+         return RUN_STOP;
+      }
+
+      if (c->n_sym - d->clean >= WINSIZE)
+         return RUN_CLEAN;
+
+      bits_refill(&d->b);
+      hdr = bits_get(&d->b, 3);
+
+      switch (hdr >> 1)
+      {
+         case 0:
+            ret = decode_stored(d, (bits_tell(&d->b) + 7) / 8);
+            break;
+
+         case 1:
+            build_fixed(d);
+            ret = decode_codes(d);
+            break;
+
+         case 2:
+            ret = read_dynamic(d);
+
+            if (ret == 0)
+               ret = decode_codes(d);
+
+            break;
+
+         default:
+            ret = -1;
+            break;
+      }
+
+      if (ret != 0)
+         return RUN_ERROR;
+
+      (*blocks)++;
+
+      if (hdr & 1)
+      {
+         c->final = 1;
+         c->stop_bit = bits_tell(&d->b);
+         return RUN_STOP;
+      }
+   }
+}
+
+/* Inflates from bit with zlib until the first block boundary at or past
+ * limit, or the end of the last block. */
+static int run_zlib(const struct pgz_s *p, struct chunk_s *c, uint64_t bit,
+                    const uint8_t *dict, size_t dict_len, uint64_t limit,
+                    const char **msg)
+{
+   z_stream strm = { 0 };
+   const uint8_t *end = p->map + p->map_sz;
+   size_t in = bit >> 3;
+   int ret = Z_OK;
+
+   *msg = "out of memory";
+
+   if (inflateInit2(&strm, -15) != Z_OK)
+      return -1;
+
+   if (bit & 7)
+   {
+      inflatePrime(&strm, 8 - (bit & 7), p->map[in] >> (bit & 7));
+      in++;
+   }
+
+   if (dict_len != 0)
+      inflateSetDictionary(&strm, dict, dict_len);
+
+   strm.next_in = (Bytef *)p->map + in;
+
+   for (;;)
+   {
+      size_t before;
+
+      if (strm.avail_in == 0)
+      {
+         size_t left = end - strm.next_in;
+
+         strm.avail_in = left > UINT_MAX ? UINT_MAX : left;
+      }
+
+      if (reserve_out(c, OUT_STEP) != 0)
+         break;
+
+      before = c->out_cap - c->n_out;
+
+      if (before > UINT_MAX)
+         before = UINT_MAX;
+
+      strm.next_out = c->out + c->n_out;
+      strm.avail_out = before;
+      ret = inflate(&strm, Z_BLOCK);
+      c->out_crc = crc32(c->out_crc, c->out + c->n_out,
+                         before - strm.avail_out);
+      c->n_out += before - strm.avail_out;
+
+      if (ret == Z_STREAM_END)
+      {
+         c->final = 1;
+         c->stop_bit = (uint64_t)(strm.next_in - p->map) * 8 -
+                       (strm.data_type & 7);
+         inflateEnd(&strm);
+         return 0;
+      }
+
+      if (ret == Z_BUF_ERROR && strm.next_in == end)
+      {
+         *msg = "unexpected end of file";
+         break;
+      }
+
+      if (ret != Z_OK && ret != Z_BUF_ERROR)
+      {
+         *msg = strm.msg != NULL ? strm.msg : "invalid deflate data";
+         break;
+      }
+
+      if (strm.data_type & 128)
+      {
+         uint64_t pos = (uint64_t)(strm.next_in - p->map) * 8 -
+                        (strm.data_type & 7);
+
+         /* Z_BLOCK also stops after the last block, before its end is
+          * reported. */
+         if (pos >= limit || (strm.data_type & 64))
+         {
+            c->final = (strm.data_type & 64) != 0;
+            c->stop_bit = pos;
+            inflateEnd(&strm);
+            return 0;
+         }
+      }
+   }
+
+   inflateEnd(&strm);
+   return -1;
+}
+
+/* Returns non-zero if a dynamic block header with a complete code length
+ * code starts at bit. */
+static int dynamic_plausible(const struct pgz_s *p, uint64_t bit)
+{
+   struct bits_s b = { .data = p->map, .size = p->map_sz };
+   unsigned hdr, ncode, kraft = 0;
+
+   bits_seek(&b, bit);
+   hdr = bits_get(&b, 3);
+
+   /* Not the last block, and dynamic. */
+   if (hdr != 4 || bits_get(&b, 5) > 29 || bits_get(&b, 5) > 29)
+      return 0;
+
+   ncode = bits_get(&b, 4) + 4;
+
+   for (unsigned k = 0; k < ncode; k++)
+   {
+      unsigned l;
+
+      bits_refill(&b);
+      l = bits_get(&b, 3);
+
+      if (l != 0)
+         kraft += 128 >> l;
+   }
+
+   return kraft == 128;
+}
+
+/* Returns non-zero if a stored block with its LEN field at byte at may start
+ * in the previous byte, whose unused bits zlib leaves as zero. */
+static int stored_plausible(const struct pgz_s *p, size_t at)
+{
+   const uint8_t *s = p->map + at;
+
+   if (at + 4 > p->map_sz || (s[-1] & 0xE0) != 0)
+      return 0;
+
+   return (s[0] ^ s[2]) == 0xFF && (s[1] ^ s[3]) == 0xFF;
+}
+
+/* Decodes a chunk from the candidate start. Returns -1 if the start is
+ * rejected, which is when decoding fails before a second block is read. */
+static int try_start(const struct pgz_s *p, struct chunk_s *c,
+                     struct dec_s *d, uint64_t bit, int stored,
+                     uint64_t limit)
+{
+   enum run_e ret;
+   unsigned blocks = 0;
+   const char *msg;
+
+   c->n_sym = 0;
+   c->final = 0;
+   d->clean = 0;
+   d->b.data = p->map;
+   d->b.size = p->map_sz;
+
+   if (stored)
+   {
+      ret = decode_stored(d, bit >> 3) == 0 ? RUN_STOP : RUN_ERROR;
+
+      if (ret == RUN_STOP)
+      {
+         blocks = 1;
+         ret = run_sym(d, limit, &blocks);
+      }
+   }
+   else
+   {
+      bits_seek(&d->b, bit);
+      ret = run_sym(d, limit, &blocks);
+   }
+
+   if (ret == RUN_ERROR && blocks < 2)
+      return -1;
+
+   c->start_bit = bit;
+   c->stored = stored;
+
+   if (ret == RUN_ERROR)
+      c->failed = 1;
+   else if (ret == RUN_CLEAN)
+   {
+      uint8_t dict[WINSIZE];
+      const uint16_t *last = c->sym + c->n_sym - WINSIZE;
+
+      for (size_t j = 0; j < WINSIZE; j++)
+         dict[j] = last[j];
+
+      if (run_zlib(p, c, bits_tell(&d->b), dict, WINSIZE, limit, &msg) != 0)
+         c->failed = 1;
+   }
+
+   return 0;
+}
+
+static void decode_chunk(const struct pgz_s *p, size_t i)
+{
+   struct chunk_s *c = &p->chunks[i];
+   uint64_t limit = i + 1 < p->n_chunks ?
+                    (uint64_t)p->chunks[i + 1].begin * 8 : UINT64_MAX;
+   struct dec_s *d;
+   const char *msg;
+
+   if (i == 0)
+   {
+      c->start_bit = (uint64_t)c->begin * 8;
+
+      if (run_zlib(p, c, c->start_bit, NULL, 0, limit, &msg) != 0)
+         c->failed = 1;
+
+      return;
+   }
+
+   d = malloc(sizeof(*d));
+
+   if (d == NULL)
+   {
+      c->failed = 1;
+      return;
+   }
+
+   d->c = c;
+
+   for (uint64_t bit = (uint64_t)c->begin * 8; bit < (uint64_t)c->end * 8;
+         bit++)
+   {
+      if ((bit & 7) == 0 && stored_plausible(p, (bit >> 3) + 1) &&
+            try_start(p, c, d, bit + 8, 1, limit) == 0)
+         break;
+
+      if (dynamic_plausible(p, bit) &&
+            try_start(p, c, d, bit, 0, limit) == 0)
+         break;
+
+      if (bit + 1 == (uint64_t)c->end * 8)
+         c->failed = 1;
+   }
+
+   free(d);
+}
+
+static void *pgz_worker(void *arg)
+{
+   struct pgz_s *p = arg;
+
+   for (;;)
+   {
+      size_t i;
+
+      pthread_mutex_lock(&p->lock);
+
+      /* Stay a bounded number of chunks ahead of the reader. */
+      while (!p->stop && p->next_chunk < p->n_chunks &&
+             p->next_chunk >= p->cur + 2 * p->n_threads)
+         pthread_cond_wait(&p->cond, &p->lock);
+
+      if (p->stop || p->next_chunk == p->n_chunks)
+      {
+         pthread_mutex_unlock(&p->lock);
+         return NULL;
+      }
+
+      i = p->next_chunk++;
+      pthread_mutex_unlock(&p->lock);
+
+      decode_chunk(p, i);
+
+      pthread_mutex_lock(&p->lock);
+      p->chunks[i].done = 1;
+      pthread_cond_broadcast(&p->cond);
+      pthread_mutex_unlock(&p->lock);
+   }
+}
+
+static void release_chunk(struct chunk_s *c)
+{
+   free(c->sym);
+   free(c->out);
+   c->sym = NULL;
+   c->out = NULL;
+   c->n_sym = c->sym_cap = 0;
+   c->n_out = c->out_cap = 0;
+}
+
+static void push_window(struct pgz_s *p, const uint8_t *data, size_t len)
+{
+   if (len >= WINSIZE)
+      memcpy(p->window, data + len - WINSIZE, WINSIZE);
+   else
+   {
+      memmove(p->window, p->window + len, WINSIZE - len);
+      memcpy(p->window + WINSIZE - len, data, len);
+   }
+
+   p->win_len = p->win_len + len > WINSIZE ? WINSIZE : p->win_len + len;
+}
+
+/* Returns non-zero if the chunk started where the previous one stopped. */
+static int starts_at(const struct pgz_s *p, const struct chunk_s *c,
+                     uint64_t bit)
+{
+   if (c->failed)
+      return 0;
+
+   if (!c->stored)
+      return c->start_bit == bit;
+
+   if ((bit >> 3) + 1 >= p->map_sz)
+      return 0;
+
+   /* The header of a stored block is padded to the next byte. */
+   return ((p->map[bit >> 3] | p->map[(bit >> 3) + 1] << 8) >> (bit & 7) &
+           7) == 0 && ((bit + 3 + 7) & ~(uint64_t)7) == c->start_bit;
+}
+
+static int load_chunk(struct pgz_s *p)
+{
+   struct chunk_s *c = &p->chunks[p->cur];
+   uint64_t limit = p->cur + 1 < p->n_chunks ?
+                    (uint64_t)p->chunks[p->cur + 1].begin * 8 : UINT64_MAX;
+   const char *msg;
+   uint8_t *bytes;
+
+   pthread_mutex_lock(&p->lock);
+
+   while (!c->done)
+      pthread_cond_wait(&p->cond, &p->lock);
+
+   p->cur++;
+   pthread_cond_broadcast(&p->cond);
+   pthread_mutex_unlock(&p->lock);
+
+   p->loaded = 1;
+   p->seg = 0;
+   p->rd_left = 0;
+
+   /* The previous chunk stopped beyond all of this one. */
+   if (p->next_bit >= limit)
+   {
+      release_chunk(c);
+      return 0;
+   }
+
+   p->n_read++;
+
+   if (!starts_at(p, c, p->next_bit))
+   {
+      release_chunk(c);
+      c->final = 0;
+      c->out_crc = 0;
+      p->n_serial++;
+
+      if (run_zlib(p, c, p->next_bit, p->window + WINSIZE - p->win_len,
+                   p->win_len, limit, &msg) != 0)
+      {
+         p->err = msg;
+         return -1;
+      }
+   }
+
+   /* Replace markers with the window, writing bytes over the symbols. */
+   bytes = (uint8_t *)c->sym;
+
+   for (size_t j = 0; j < c->n_sym; j++)
+   {
+      unsigned v = c->sym[j];
+
+      if (v >= MARKER)
+      {
+         v -= MARKER;
+
+         if (v < WINSIZE - p->win_len)
+         {
+            p->err = "invalid distance too far back";
+            return -1;
+         }
+
+         v = p->window[v];
+      }
+
+      bytes[j] = v;
+   }
+
+   if (c->n_sym != 0)
+   {
+      p->crc = crc32(p->crc, bytes, c->n_sym);
+      push_window(p, bytes, c->n_sym);
+   }
+
+   if (c->n_out != 0)
+   {
+      p->crc = crc32_combine(p->crc, c->out_crc, c->n_out);
+      push_window(p, c->out, c->n_out);
+   }
+
+   p->total += c->n_sym + c->n_out;
+
+   p->next_bit = c->stop_bit;
+   p->final = c->final;
+   p->rd = bytes;
+   p->rd_left = c->n_sym;
+   return 0;
+}
+
+/* Checks the trailer of the first member, and starts inflating any members
+ * that follow it. */
+static int finish_member(struct pgz_s *p)
+{
+   size_t t = (p->next_bit + 7) / 8;
+   const uint8_t *s = p->map + t;
+
+   p->final = 0;
+
+   pthread_mutex_lock(&p->lock);
+   p->stop = 1;
+   pthread_cond_broadcast(&p->cond);
+   pthread_mutex_unlock(&p->lock);
+
+   if (t + 8 > p->map_sz)
+   {
+      p->err = "unexpected end of file";
+      return -1;
+   }
+
+   if ((uint32_t)(s[0] | s[1] << 8 | s[2] << 16 | (uint32_t)s[3] << 24) !=
+         p->crc)
+   {
+      p->err = "incorrect data check";
+      return -1;
+   }
+
+   if ((uint32_t)(s[4] | s[5] << 8 | s[6] << 16 | (uint32_t)s[7] << 24) !=
+         (uint32_t)p->total)
+   {
+      p->err = "incorrect length check";
+      return -1;
+   }
+
+   /* Like gzread, ignore anything after the last member. */
+   if (t + 10 <= p->map_sz && s[8] == 0x1F && s[9] == 0x8B)
+   {
+      if (inflateInit2(&p->tail, 15 + 16) != Z_OK)
+      {
+         p->err = "out of memory";
+         return -1;
+      }
+
+      p->tail.next_in = (Bytef *)s + 8;
+      p->tail_active = 1;
+   }
+   else
+      p->eof = 1;
+
+   return 0;
+}
+
+static int next_segment(struct pgz_s *p)
+{
+   if (p->loaded && p->seg == 0)
+   {
+      struct chunk_s *c = &p->chunks[p->cur - 1];
+
+      p->seg = 1;
+      p->rd = c->out;
+      p->rd_left = c->n_out;
+      return 0;
+   }
+
+   if (p->loaded)
+   {
+      release_chunk(&p->chunks[p->cur - 1]);
+      p->loaded = 0;
+   }
+
+   if (p->final)
+      return finish_member(p);
+
+   if (p->cur == p->n_chunks)
+   {
+      p->err = "unexpected end of file";
+      return -1;
+   }
+
+   return load_chunk(p);
+}
+
+/* Inflates members after the first straight into dst. */
+static long read_tail(struct pgz_s *p, uint8_t *dst, size_t len)
+{
+   const uint8_t *end = p->map + p->map_sz;
+   uint8_t discard[4096];
+   size_t before;
+   int ret;
+
+   if (p->tail.avail_in == 0)
+   {
+      size_t left = end - p->tail.next_in;
+
+      p->tail.avail_in = left > UINT_MAX ? UINT_MAX : left;
+   }
+
+   if (dst == NULL)
+   {
+      dst = discard;
+      len = len > sizeof(discard) ? sizeof(discard) : len;
+   }
+
+   before = len > UINT_MAX ? UINT_MAX : len;
+   p->tail.next_out = dst;
+   p->tail.avail_out = before;
+   ret = inflate(&p->tail, Z_NO_FLUSH);
+
+   if (ret == Z_STREAM_END)
+   {
+      if (end - p->tail.next_in >= 2 && p->tail.next_in[0] == 0x1F &&
+            p->tail.next_in[1] == 0x8B)
+         inflateReset(&p->tail);
+      else
+         p->eof = 1;
+   }
+   else if (ret == Z_BUF_ERROR && p->tail.next_in == end)
+   {
+      p->err = "unexpected end of file";
+      return -1;
+   }
+   else if (ret != Z_OK && ret != Z_BUF_ERROR)
+   {
+      p->err = p->tail.msg != NULL ? p->tail.msg : "invalid deflate data";
+      return -1;
+   }
+
+   return before - p->tail.avail_out;
+}
+
+/* Reads len bytes into dst, or skips them if dst is NULL. */
+static long read_or_skip(struct pgz_s *p, uint8_t *dst, size_t len)
+{
+   size_t done = 0;
+
+   while (done < len)
+   {
+      if (p->rd_left != 0)
+      {
+         size_t n = len - done < p->rd_left ? len - done : p->rd_left;
+
+         if (dst != NULL)
+            memcpy(dst + done, p->rd, n);
+
+         p->rd += n;
+         p->rd_left -= n;
+         done += n;
+         continue;
+      }
+
+      if (p->err != NULL)
+         return -1;
+
+      if (p->eof)
+         break;
+
+      if (p->tail_active)
+      {
+         long got = read_tail(p, dst != NULL ? dst + done : NULL,
+                              len - done);
+
+         if (got < 0)
+            return -1;
+
+         done += got;
+         continue;
+      }
+
+      if (next_segment(p) != 0)
+         return -1;
+   }
+
+   p->pos += done;
+   return done;
+}
+
+long pgz_read(struct pgz_s *p, void *buf, size_t len)
+{
+   return read_or_skip(p, buf, len);
+}
+
+long pgz_skip(struct pgz_s *p, size_t len)
+{
+   return read_or_skip(p, NULL, len);
+}
+
+uint64_t pgz_tell(const struct pgz_s *p)
+{
+   return p->pos;
+}
+
+uint64_t pgz_offset(const struct pgz_s *p)
+{
+   if (p->tail_active)
+      return p->tail.next_in - p->map;
+
+   return p->next_bit / 8;
+}
+
+const char *pgz_error(const struct pgz_s *p)
+{
+   return p->err;
+}
+
+void pgz_stats(const struct pgz_s *p, size_t *n_chunks, size_t *n_serial)
+{
+   *n_chunks = p->n_read;
+   *n_serial = p->n_serial;
+}
+
+/* Returns the offset of the deflate data, or 0 if there is no gzip header. */
+static size_t gzip_header(const uint8_t *d, size_t sz)
+{
+   size_t pos = 10;
+   uint8_t flg;
+
+   if (sz < 18 || d[0] != 0x1F || d[1] != 0x8B || d[2] != 8)
+      return 0;
+
+   flg = d[3];
+
+   if (flg & 4)
+      pos += 2 + (d[pos] | d[pos + 1] << 8);
+
+   for (uint8_t f = 8; f <= 16; f <<= 1)
+   {
+      /* File name and comment. */
+      if (flg & f)
+      {
+         while (pos < sz && d[pos] != 0)
+            pos++;
+
+         pos++;
+      }
+   }
+
+   if (flg & 2)
+      pos += 2;
+
+   return pos < sz ? pos : 0;
+}
+
+struct pgz_s *pgz_open(const char *filename, unsigned n_threads)
+{
+   struct pgz_s *p;
+   struct stat st;
+   size_t data;
+   void *map;
+   int fd = open(filename, O_RDONLY);
+
+   if (fd < 0)
+      return NULL;
+
+   if (fstat(fd, &st) != 0 || st.st_size == 0)
+   {
+      close(fd);
+      return NULL;
+   }
+
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+      return NULL;
+
+   data = gzip_header(map, st.st_size);
+   p = calloc(1, sizeof(*p));
+
+   if (data == 0 || p == NULL)
+   {
+      free(p);
+      munmap(map, st.st_size);
+      return NULL;
+   }
+
+   p->map = map;
+   p->map_sz = st.st_size;
+   p->n_chunks = (p->map_sz - data + PGZ_CHUNK_SZ - 1) / PGZ_CHUNK_SZ;
+   p->n_threads = n_threads == 0 ? 1 : n_threads;
+
+   if (p->n_threads > p->n_chunks)
+      p->n_threads = p->n_chunks;
+
+   p->chunks = calloc(p->n_chunks, sizeof(*p->chunks));
+   p->threads = calloc(p->n_threads, sizeof(*p->threads));
+
+   if (p->chunks == NULL || p->threads == NULL)
+      goto err;
+
+   for (size_t i = 0; i < p->n_chunks; i++)
+   {
+      p->chunks[i].begin = data + i * PGZ_CHUNK_SZ;
+      p->chunks[i].end = i + 1 < p->n_chunks ?
+                         p->chunks[i].begin + PGZ_CHUNK_SZ : p->map_sz;
+   }
+
+   p->next_bit = (uint64_t)data * 8;
+   p->crc = crc32(0, NULL, 0);
+   pthread_mutex_init(&p->lock, NULL);
+   pthread_cond_init(&p->cond, NULL);
+
+   for (unsigned t = 0; t < p->n_threads; t++)
+   {
+      if (pthread_create(&p->threads[t], NULL, pgz_worker, p) != 0)
+      {
+         p->n_threads = t;
+         break;
+      }
+   }
+
+   if (p->n_threads != 0)
+      return p;
+
+   pthread_mutex_destroy(&p->lock);
+   pthread_cond_destroy(&p->cond);
+
+err:
+   free(p->chunks);
+   free(p->threads);
+   munmap(map, p->map_sz);
+   free(p);
+   return NULL;
+}
+
+void pgz_close(struct pgz_s *p)
+{
+   if (p == NULL)
+      return;
+
+   pthread_mutex_lock(&p->lock);
+   p->stop = 1;
+   pthread_cond_broadcast(&p->cond);
+   pthread_mutex_unlock(&p->lock);
+
+   for (unsigned t = 0; t < p->n_threads; t++)
+      pthread_join(p->threads[t], NULL);
+
+   for (size_t i = 0; i < p->n_chunks; i++)
+      release_chunk(&p->chunks[i]);
+
+   if (p->tail_active)
+      inflateEnd(&p->tail);
+
+   pthread_mutex_destroy(&p->lock);
+   pthread_cond_destroy(&p->cond);
+   munmap((void *)p->map, p->map_sz);
+   free(p->chunks);
+   free(p->threads);
+   free(p);
+}
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Parallel inflate of a single gzip stream.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PGZIP_H
+#define PGZIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compressed bytes given to each thread at a time. */
+#define PGZ_CHUNK_SZ    (4 * 1024 * 1024)
+
+struct pgz_s;
+
+/**
+ * Maps a gzip file into memory and starts n_threads threads that inflate it
+ * ahead of the reader, one chunk of compressed data each. Every chunk but the
+ * first starts at the first position that looks like the start of a deflate
+ * block, and back references to the unknown data before it are kept as
+ * markers until the previous chunk is complete. Returns NULL if the file is
+ * not gzip compressed or cannot be mapped.
+ */
+struct pgz_s *pgz_open(const char *filename, unsigned n_threads);
+
+/**
+ * Reads the next len bytes of uncompressed data in order. Returns the number
+ * of bytes read, which is less than len at the end of the stream, or -1 if
+ * the stream is corrupt. Must only be called from one thread.
+ */
+long pgz_read(struct pgz_s *p, void *buf, size_t len);
+
+/* Skips len bytes of uncompressed data, as pgz_read would read them. */
+long pgz_skip(struct pgz_s *p, size_t len);
+
+/* Position of the next byte pgz_read returns within the uncompressed data. */
+uint64_t pgz_tell(const struct pgz_s *p);
+
+/* Compressed bytes that have been inflated and read so far. */
+uint64_t pgz_offset(const struct pgz_s *p);
+
+/* Returns why the stream is corrupt, or NULL if no error has occurred. */
+const char *pgz_error(const struct pgz_s *p);
+
+/**
+ * Number of chunks read, and how many of those had to be inflated again by
+ * the reader because their speculative start was wrong.
+ */
+void pgz_stats(const struct pgz_s *p, size_t *n_chunks, size_t *n_serial);
+
+void pgz_close(struct pgz_s *p);
+
+#endif
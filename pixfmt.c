@@ -0,0 +1,547 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Conversion of texture pack pixel formats to 8-bit RGBA.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pixfmt.h"
+
+/* OpenGL enumerants used by GLideNHQ texture packs. */
+#define GL_RGB                        0x1907
+#define GL_RGBA                       0x1908
+#define GL_UNSIGNED_BYTE              0x1401
+#define GL_UNSIGNED_SHORT_4_4_4_4     0x8033
+#define GL_UNSIGNED_SHORT_5_5_5_1     0x8034
+#define GL_UNSIGNED_SHORT_5_6_5       0x8363
+#define GL_RGBA4                      0x8056
+#define GL_RGB5_A1                    0x8057
+#define GL_RGBA8                      0x8058
+#define GL_RGB565                     0x8D62
+
+/* Flags stored in the upper bits of the internal format. */
+#define GL_TEXFMT_FLAGS               0xFF000000
+
+enum pixfmt_e pixfmt_from_gl(uint32_t internal_fmt, uint16_t texfmt,
+                             uint16_t pixtype)
+{
+   /* The type describes the layout of the stored pixels, so it takes
+    * precedence over the internal format, which is only what the texture is
+    * uploaded as. */
+   switch (pixtype)
+   {
+   case GL_UNSIGNED_SHORT_5_6_5:
+      return PIXFMT_RGB565;
+
+   case GL_UNSIGNED_SHORT_5_5_5_1:
+      return PIXFMT_RGBA5551;
+
+   case GL_UNSIGNED_SHORT_4_4_4_4:
+      return PIXFMT_RGBA4444;
+
+   case GL_UNSIGNED_BYTE:
+      if (texfmt == GL_RGBA)
+         return PIXFMT_RGBA8888;
+
+      return PIXFMT_UNKNOWN;
+   }
+
+   switch (internal_fmt & ~GL_TEXFMT_FLAGS)
+   {
+   case GL_RGBA8:
+      return PIXFMT_RGBA8888;
+
+   case GL_RGB:
+   case GL_RGB565:
+      return PIXFMT_RGB565;
+
+   case GL_RGB5_A1:
+      return PIXFMT_RGBA5551;
+
+   case GL_RGBA4:
+      return PIXFMT_RGBA4444;
+   }
+
+   return PIXFMT_UNKNOWN;
+}
+
+unsigned pixfmt_bpp(enum pixfmt_e fmt)
+{
+   switch (fmt)
+   {
+   case PIXFMT_RGBA8888:
+      return 4;
+
+   case PIXFMT_RGB565:
+   case PIXFMT_RGBA5551:
+   case PIXFMT_RGBA4444:
+      return 2;
+
+   default:
+      return 0;
+   }
+}
+
+const char *pixfmt_name(enum pixfmt_e fmt)
+{
+   switch (fmt)
+   {
+   case PIXFMT_RGBA8888:
+      return "RGBA8888";
+
+   case PIXFMT_RGB565:
+      return "RGB565";
+
+   case PIXFMT_RGBA5551:
+      return "RGBA5551";
+
+   case PIXFMT_RGBA4444:
+      return "RGBA4444";
+
+   default:
+      return "unknown";
+   }
+}
+
+/**
+ * Each 16-bit kernel converts pixels from index i to n, where i is the number
+ * of pixels already converted by the vector loop. Channels are widened by
+ * replicating their most significant bits into the new low bits, so that the
+ * maximum value of each channel maps to 0xFF.
+ */
+static void rgb565_to_rgba8(uint8_t *dst, const uint8_t *src, size_t i,
+                            size_t n)
+{
+   for (; i < n; i++)
+   {
+      uint16_t px;
+      unsigned r, g, b;
+
+      memcpy(&px, src + i * 2, 2);
+      r = px >> 11;
+      g = (px >> 5) & 0x3F;
+      b = px & 0x1F;
+
+      dst[i * 4 + 0] = (r << 3) | (r >> 2);
+      dst[i * 4 + 1] = (g << 2) | (g >> 4);
+      dst[i * 4 + 2] = (b << 3) | (b >> 2);
+      dst[i * 4 + 3] = 0xFF;
+   }
+}
+
+static void rgba5551_to_rgba8(uint8_t *dst, const uint8_t *src, size_t i,
+                              size_t n)
+{
+   for (; i < n; i++)
+   {
+      uint16_t px;
+      unsigned r, g, b;
+
+      memcpy(&px, src + i * 2, 2);
+      r = px >> 11;
+      g = (px >> 6) & 0x1F;
+      b = (px >> 1) & 0x1F;
+
+      dst[i * 4 + 0] = (r << 3) | (r >> 2);
+      dst[i * 4 + 1] = (g << 3) | (g >> 2);
+      dst[i * 4 + 2] = (b << 3) | (b >> 2);
+      dst[i * 4 + 3] = (px & 1) ? 0xFF : 0x00;
+   }
+}
+
+static void rgba4444_to_rgba8(uint8_t *dst, const uint8_t *src, size_t i,
+                              size_t n)
+{
+   for (; i < n; i++)
+   {
+      uint16_t px;
+
+      memcpy(&px, src + i * 2, 2);
+      dst[i * 4 + 0] = ((px >> 12) & 0xF) * 0x11;
+      dst[i * 4 + 1] = ((px >> 8) & 0xF) * 0x11;
+      dst[i * 4 + 2] = ((px >> 4) & 0xF) * 0x11;
+      dst[i * 4 + 3] = (px & 0xF) * 0x11;
+   }
+}
+
+#ifdef __SSE2__
+/**
+ * Interleaves eight 16-bit lanes of each 8-bit channel into eight RGBA pixels
+ * and stores them to dst.
+ */
+static inline void store_rgba8_sse2(uint8_t *dst, __m128i r, __m128i g,
+                                    __m128i b, __m128i a)
+{
+   __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+   __m128i ba = _mm_or_si128(b, _mm_slli_epi16(a, 8));
+
+   _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(rg, ba));
+   _mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(rg, ba));
+}
+
+static size_t rgb565_to_rgba8_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+   const __m128i mask5 = _mm_set1_epi16(0x1F);
+   const __m128i mask6 = _mm_set1_epi16(0x3F);
+   const __m128i alpha = _mm_set1_epi16(0xFF);
+   size_t i;
+
+   for (i = 0; i + 8 <= n; i += 8)
+   {
+      __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 2));
+      __m128i r = _mm_srli_epi16(px, 11);
+      __m128i g = _mm_and_si128(_mm_srli_epi16(px, 5), mask6);
+      __m128i b = _mm_and_si128(px, mask5);
+
+      r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+      g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+      b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+      store_rgba8_sse2(dst + i * 4, r, g, b, alpha);
+   }
+
+   return i;
+}
+
+static size_t rgba5551_to_rgba8_sse2(uint8_t *dst, const uint8_t *src,
+                                     size_t n)
+{
+   const __m128i mask5 = _mm_set1_epi16(0x1F);
+   const __m128i one = _mm_set1_epi16(1);
+   size_t i;
+
+   for (i = 0; i + 8 <= n; i += 8)
+   {
+      __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 2));
+      __m128i r = _mm_srli_epi16(px, 11);
+      __m128i g = _mm_and_si128(_mm_srli_epi16(px, 6), mask5);
+      __m128i b = _mm_and_si128(_mm_srli_epi16(px, 1), mask5);
+      /* 0xFFFF where the alpha bit is set, of which only the low byte is
+       * kept by the shift in store_rgba8_sse2(). */
+      __m128i a = _mm_cmpeq_epi16(_mm_and_si128(px, one), one);
+
+      r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+      g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+      b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+      store_rgba8_sse2(dst + i * 4, r, g, b, a);
+   }
+
+   return i;
+}
+
+static size_t rgba4444_to_rgba8_sse2(uint8_t *dst, const uint8_t *src,
+                                     size_t n)
+{
+   const __m128i mask4 = _mm_set1_epi16(0xF);
+   size_t i;
+
+   for (i = 0; i + 8 <= n; i += 8)
+   {
+      __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 2));
+      __m128i r = _mm_srli_epi16(px, 12);
+      __m128i g = _mm_and_si128(_mm_srli_epi16(px, 8), mask4);
+      __m128i b = _mm_and_si128(_mm_srli_epi16(px, 4), mask4);
+      __m128i a = _mm_and_si128(px, mask4);
+
+      r = _mm_or_si128(_mm_slli_epi16(r, 4), r);
+      g = _mm_or_si128(_mm_slli_epi16(g, 4), g);
+      b = _mm_or_si128(_mm_slli_epi16(b, 4), b);
+      a = _mm_or_si128(_mm_slli_epi16(a, 4), a);
+      store_rgba8_sse2(dst + i * 4, r, g, b, a);
+   }
+
+   return i;
+}
+#endif
+
+void pixfmt_to_rgba8(enum pixfmt_e fmt, uint8_t *dst, const uint8_t *src,
+                     size_t n)
+{
+   size_t i = 0;
+
+   switch (fmt)
+   {
+   case PIXFMT_RGBA8888:
+      memcpy(dst, src, n * 4);
+      break;
+
+   case PIXFMT_RGB565:
+#ifdef __SSE2__
+      i = rgb565_to_rgba8_sse2(dst, src, n);
+#endif
+      rgb565_to_rgba8(dst, src, i, n);
+      break;
+
+   case PIXFMT_RGBA5551:
+#ifdef __SSE2__
+      i = rgba5551_to_rgba8_sse2(dst, src, n);
+#endif
+      rgba5551_to_rgba8(dst, src, i, n);
+      break;
+
+   case PIXFMT_RGBA4444:
+#ifdef __SSE2__
+      i = rgba4444_to_rgba8_sse2(dst, src, n);
+#endif
+      rgba4444_to_rgba8(dst, src, i, n);
+      break;
+
+   default:
+      break;
+   }
+}
+
+/**
+ * Swizzles between the supported orders are one of four operations on each
+ * pixel loaded as a little endian 32-bit word.
+ */
+enum swizzle_op_e
+{
+   SWIZZLE_SWAP02,
+   SWIZZLE_ROTL8,
+   SWIZZLE_ROTR8,
+   SWIZZLE_BSWAP
+};
+
+static inline uint32_t swizzle_u32(uint32_t x, enum swizzle_op_e op)
+{
+   switch (op)
+   {
+   case SWIZZLE_SWAP02:
+      return (x & 0xFF00FF00) | ((x >> 16) & 0xFF) | ((x & 0xFF) << 16);
+
+   case SWIZZLE_ROTL8:
+      return (x << 8) | (x >> 24);
+
+   case SWIZZLE_ROTR8:
+      return (x >> 8) | (x << 24);
+
+   default:
+      return __builtin_bswap32(x);
+   }
+}
+
+#ifdef __SSE2__
+static inline __m128i swizzle_sse2(__m128i x, enum swizzle_op_e op)
+{
+   const __m128i mask0 = _mm_set1_epi32(0xFF);
+   const __m128i mask2 = _mm_set1_epi32(0xFF0000);
+
+   switch (op)
+   {
+   case SWIZZLE_SWAP02:
+      return _mm_or_si128(
+                _mm_andnot_si128(_mm_or_si128(mask0, mask2), x),
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 16), mask0),
+                             _mm_and_si128(_mm_slli_epi32(x, 16), mask2)));
+
+   case SWIZZLE_ROTL8:
+      return _mm_or_si128(_mm_slli_epi32(x, 8), _mm_srli_epi32(x, 24));
+
+   case SWIZZLE_ROTR8:
+      return _mm_or_si128(_mm_srli_epi32(x, 8), _mm_slli_epi32(x, 24));
+
+   default:
+      x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+      return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+   }
+}
+#endif
+
+/* Always inlined so that each operation gets a loop of its own. */
+static inline __attribute__((always_inline)) void swizzle(uint8_t *dst,
+      const uint8_t *src, size_t n, enum swizzle_op_e op)
+{
+   size_t i = 0;
+
+#ifdef __SSE2__
+   for (; i + 4 <= n; i += 4)
+   {
+      __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 4));
+      _mm_storeu_si128((__m128i *)(dst + i * 4), swizzle_sse2(px, op));
+   }
+#endif
+
+   for (; i < n; i++)
+   {
+      uint32_t px;
+
+      memcpy(&px, src + i * 4, 4);
+      px = swizzle_u32(px, op);
+      memcpy(dst + i * 4, &px, 4);
+   }
+}
+
+void pixfmt_swizzle(uint8_t *dst, const uint8_t *src, size_t n,
+                    enum pixfmt_order_e from, enum pixfmt_order_e to)
+{
+   if (from == to)
+   {
+      memmove(dst, src, n * 4);
+      return;
+   }
+
+   if (to == PIXFMT_ORDER_ARGB)
+   {
+      if (from == PIXFMT_ORDER_RGBA)
+         swizzle(dst, src, n, SWIZZLE_ROTL8);
+      else
+         swizzle(dst, src, n, SWIZZLE_BSWAP);
+   }
+   else if (from == PIXFMT_ORDER_ARGB)
+   {
+      if (to == PIXFMT_ORDER_RGBA)
+         swizzle(dst, src, n, SWIZZLE_ROTR8);
+      else
+         swizzle(dst, src, n, SWIZZLE_BSWAP);
+   }
+   else
+      swizzle(dst, src, n, SWIZZLE_SWAP02);
+}
+
+/**
+ * Each alpha kernel converts pixels from index i to n. Colours are multiplied
+ * by alpha / 255 and rounded to nearest, so that opaque pixels are unchanged.
+ */
+static void premultiply(uint8_t *dst, const uint8_t *src, size_t i, size_t n)
+{
+   for (; i < n; i++)
+   {
+      unsigned a = src[i * 4 + 3];
+
+      for (unsigned c = 0; c < 3; c++)
+      {
+         unsigned t = src[i * 4 + c] * a + 128;
+         dst[i * 4 + c] = (t + (t >> 8)) >> 8;
+      }
+
+      dst[i * 4 + 3] = a;
+   }
+}
+
+static void unpremultiply(uint8_t *dst, const uint8_t *src, size_t i,
+                          size_t n)
+{
+   for (; i < n; i++)
+   {
+      unsigned a = src[i * 4 + 3];
+
+      for (unsigned c = 0; c < 3; c++)
+      {
+         unsigned v = a ? (src[i * 4 + c] * 255 + a / 2) / a : 0;
+         dst[i * 4 + c] = v > 255 ? 255 : v;
+      }
+
+      dst[i * 4 + 3] = a;
+   }
+}
+
+#ifdef __SSE2__
+static size_t premultiply_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i round = _mm_set1_epi16(128);
+   /* Alpha is multiplied by 255 to leave it unchanged. */
+   const __m128i colour = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+   const __m128i opaque = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+   size_t i;
+
+   for (i = 0; i + 4 <= n; i += 4)
+   {
+      __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 4));
+      __m128i half[2] = {
+         _mm_unpacklo_epi8(px, zero), _mm_unpackhi_epi8(px, zero)
+      };
+
+      for (unsigned h = 0; h < 2; h++)
+      {
+         __m128i a = _mm_shufflehi_epi16(
+                        _mm_shufflelo_epi16(half[h], 0xFF), 0xFF);
+         __m128i t;
+
+         a = _mm_or_si128(_mm_and_si128(a, colour), opaque);
+         t = _mm_add_epi16(_mm_mullo_epi16(half[h], a), round);
+         half[h] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+      }
+
+      _mm_storeu_si128((__m128i *)(dst + i * 4),
+                       _mm_packus_epi16(half[0], half[1]));
+   }
+
+   return i;
+}
+
+static size_t unpremultiply_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128 max = _mm_set1_ps(255.0f);
+   const __m128 half = _mm_set1_ps(0.5f);
+   const __m128 colour = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+   size_t i;
+
+   for (i = 0; i + 4 <= n; i += 4)
+   {
+      __m128i px = _mm_loadu_si128((const __m128i *)(src + i * 4));
+      __m128i lo = _mm_unpacklo_epi8(px, zero);
+      __m128i hi = _mm_unpackhi_epi8(px, zero);
+      __m128i p[4] = {
+         _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+         _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)
+      };
+
+      for (unsigned j = 0; j < 4; j++)
+      {
+         __m128 f = _mm_cvtepi32_ps(p[j]);
+         __m128 a = _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 3, 3, 3));
+         __m128 c = _mm_add_ps(_mm_div_ps(_mm_mul_ps(f, max), a), half);
+
+         /* Colours of transparent pixels divide by zero, and are masked. */
+         c = _mm_and_ps(_mm_min_ps(c, max),
+                        _mm_cmpneq_ps(a, _mm_setzero_ps()));
+         c = _mm_or_ps(_mm_and_ps(c, colour), _mm_andnot_ps(colour, f));
+         p[j] = _mm_cvttps_epi32(c);
+      }
+
+      _mm_storeu_si128((__m128i *)(dst + i * 4),
+                       _mm_packus_epi16(_mm_packs_epi32(p[0], p[1]),
+                                        _mm_packs_epi32(p[2], p[3])));
+   }
+
+   return i;
+}
+#endif
+
+void pixfmt_premultiply(uint8_t *dst, const uint8_t *src, size_t n)
+{
+   size_t i = 0;
+
+#ifdef __SSE2__
+   i = premultiply_sse2(dst, src, n);
+#endif
+   premultiply(dst, src, i, n);
+}
+
+void pixfmt_unpremultiply(uint8_t *dst, const uint8_t *src, size_t n)
+{
+   size_t i = 0;
+
+#ifdef __SSE2__
+   i = unpremultiply_sse2(dst, src, n);
+#endif
+   unpremultiply(dst, src, i, n);
+}
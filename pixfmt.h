@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Conversion of texture pack pixel formats to 8-bit RGBA.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PIXFMT_H
+#define PIXFMT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pixel formats of uncompressed textures in GLideNHQ texture packs. */
+enum pixfmt_e
+{
+   PIXFMT_UNKNOWN = 0,
+
+   /* R, G, B and A bytes in that order. */
+   PIXFMT_RGBA8888,
+
+   /* 16-bit pixels with red in the most significant bits. */
+   PIXFMT_RGB565,
+   PIXFMT_RGBA5551,
+   PIXFMT_RGBA4444
+};
+
+/**
+ * Decodes the pixel format of a texture from the OpenGL internal format,
+ * format and type stored in its record header. The compression flag of the
+ * internal format is ignored.
+ */
+enum pixfmt_e pixfmt_from_gl(uint32_t internal_fmt, uint16_t texfmt,
+                             uint16_t pixtype);
+
+/**
+ * Returns the number of bytes per pixel, or 0 for an unknown format.
+ */
+unsigned pixfmt_bpp(enum pixfmt_e fmt);
+
+const char *pixfmt_name(enum pixfmt_e fmt);
+
+/**
+ * Expands n pixels of src to 8-bit RGBA in dst, which must hold n * 4 bytes.
+ * src and dst must not overlap.
+ */
+void pixfmt_to_rgba8(enum pixfmt_e fmt, uint8_t *dst, const uint8_t *src,
+                     size_t n);
+
+/* Orders of 8-bit channels within a pixel, named in memory order. */
+enum pixfmt_order_e
+{
+   PIXFMT_ORDER_RGBA = 0,
+   PIXFMT_ORDER_BGRA,
+   PIXFMT_ORDER_ARGB
+};
+
+/**
+ * Reorders the channels of n 8-bit pixels. dst may be the same as src.
+ */
+void pixfmt_swizzle(uint8_t *dst, const uint8_t *src, size_t n,
+                    enum pixfmt_order_e from, enum pixfmt_order_e to);
+
+/**
+ * Multiplies the colour channels of n RGBA or BGRA pixels by their alpha, or
+ * divides them by it. Colours of fully transparent pixels become zero when
+ * unpremultiplied. dst may be the same as src.
+ */
+void pixfmt_premultiply(uint8_t *dst, const uint8_t *src, size_t n);
+void pixfmt_unpremultiply(uint8_t *dst, const uint8_t *src, size_t n);
+
+#endif
@@ -0,0 +1,511 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Streaming tar archive writer shared by several threads.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tar.h"
+
+#define TAR_BLOCK       512
+
+/* Members are written once a writer has buffered this many bytes. */
+#define TAR_BUF_SIZE    (8 * 1024 * 1024)
+
+struct ustar_header_s
+{
+   char name[100];
+   char mode[8];
+   char uid[8];
+   char gid[8];
+   char size[12];
+   char mtime[12];
+   char chksum[8];
+   char typeflag;
+   char linkname[100];
+   char magic[6];
+   char version[2];
+   char uname[32];
+   char gname[32];
+   char devmajor[8];
+   char devminor[8];
+   char prefix[155];
+   char pad[12];
+};
+
+struct tar_entry_s
+{
+   uint64_t key;
+   uint64_t offset;
+   uint64_t size;
+   char name[32];
+};
+
+/* A hard link waiting to be written when the archive is closed. */
+struct tar_link_s
+{
+   uint64_t key;
+   char name[32];
+   char target[32];
+};
+
+struct tar_s
+{
+   int fd;
+   uint64_t pos;
+   long mtime;
+   int failed;
+
+   struct tar_entry_s *entries;
+   size_t n_entries;
+   size_t alloc_entries;
+
+   struct tar_link_s *links;
+   size_t n_links;
+   size_t alloc_links;
+
+   pthread_mutex_t lock;
+};
+
+struct tar_writer_s
+{
+   struct tar_s *tar;
+   uint8_t *buf;
+   size_t len;
+
+   /* Entries within buf, with offsets relative to the start of buf. */
+   struct tar_entry_s *entries;
+   size_t n_entries;
+   size_t alloc_entries;
+};
+
+struct tar_s *tar_create(const char *filename)
+{
+   struct tar_s *tar = calloc(1, sizeof(*tar));
+
+   if (tar == NULL)
+      return NULL;
+
+   tar->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+   if (tar->fd < 0)
+   {
+      fprintf(stderr, "Unable to create %s\n", filename);
+      free(tar);
+      return NULL;
+   }
+
+   tar->mtime = time(NULL);
+   pthread_mutex_init(&tar->lock, NULL);
+   return tar;
+}
+
+/* Fills in the header of a regular file, or of a hard link to target. */
+static void fill_header(struct ustar_header_s *h, const char *name,
+                        const char *target, uint64_t size, long mtime)
+{
+   unsigned sum = 0;
+
+   memset(h, 0, sizeof(*h));
+   strncpy(h->name, name, sizeof(h->name) - 1);
+   memcpy(h->mode, "0000644", 8);
+   memcpy(h->uid, "0000000", 8);
+   memcpy(h->gid, "0000000", 8);
+   snprintf(h->size, sizeof(h->size), "%011lo", (unsigned long)size);
+   snprintf(h->mtime, sizeof(h->mtime), "%011lo", (unsigned long)mtime);
+   h->typeflag = '0';
+
+   if (target != NULL)
+   {
+      h->typeflag = '1';
+      strncpy(h->linkname, target, sizeof(h->linkname) - 1);
+   }
+   memcpy(h->magic, "ustar", 6);
+   memcpy(h->version, "00", 2);
+
+   /* The checksum is calculated with the checksum field set to spaces. */
+   memset(h->chksum, ' ', sizeof(h->chksum));
+
+   for (size_t i = 0; i < sizeof(*h); i++)
+      sum += ((const unsigned char *)h)[i];
+
+   snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+}
+
+static int write_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+   const uint8_t *p = buf;
+
+   while (len > 0)
+   {
+      ssize_t r = pwrite(fd, p, len, offset);
+
+      if (r <= 0)
+         return -1;
+
+      p += r;
+      len -= r;
+      offset += r;
+   }
+
+   return 0;
+}
+
+/* Records entries with offsets relative to base. Must be called with the
+ * lock held. */
+static int add_entries(struct tar_s *tar, const struct tar_entry_s *entries,
+                       size_t n, uint64_t base)
+{
+   if (tar->n_entries + n > tar->alloc_entries)
+   {
+      size_t alloc = (tar->n_entries + n) * 2;
+      struct tar_entry_s *e = realloc(tar->entries, alloc * sizeof(*e));
+
+      if (e == NULL)
+      {
+         tar->failed = 1;
+         return -1;
+      }
+
+      tar->entries = e;
+      tar->alloc_entries = alloc;
+   }
+
+   for (size_t i = 0; i < n; i++)
+   {
+      tar->entries[tar->n_entries] = entries[i];
+      tar->entries[tar->n_entries].offset += base;
+      tar->n_entries++;
+   }
+
+   return 0;
+}
+
+/* Reserves space in the archive for len bytes, and records the entries
+ * that they hold. Returns the offset of the reserved space. */
+static int reserve(struct tar_s *tar, size_t len,
+                   const struct tar_entry_s *entries, size_t n,
+                   uint64_t *offset)
+{
+   int ret;
+
+   pthread_mutex_lock(&tar->lock);
+   *offset = tar->pos;
+   tar->pos += len;
+   ret = add_entries(tar, entries, n, *offset);
+   pthread_mutex_unlock(&tar->lock);
+   return ret;
+}
+
+static int writer_flush(struct tar_writer_s *w)
+{
+   uint64_t offset;
+
+   if (w->len == 0)
+      return 0;
+
+   if (reserve(w->tar, w->len, w->entries, w->n_entries, &offset) != 0 ||
+         write_all(w->tar->fd, w->buf, w->len, offset) != 0)
+   {
+      __atomic_store_n(&w->tar->failed, 1, __ATOMIC_RELAXED);
+      return -1;
+   }
+
+   w->len = 0;
+   w->n_entries = 0;
+   return 0;
+}
+
+struct tar_writer_s *tar_writer_open(struct tar_s *tar)
+{
+   struct tar_writer_s *w = calloc(1, sizeof(*w));
+
+   if (w == NULL)
+      return NULL;
+
+   w->tar = tar;
+   w->buf = malloc(TAR_BUF_SIZE);
+
+   if (w->buf == NULL)
+   {
+      free(w);
+      return NULL;
+   }
+
+   return w;
+}
+
+int tar_writer_close(struct tar_writer_s *w)
+{
+   int ret;
+
+   if (w == NULL)
+      return 0;
+
+   ret = writer_flush(w);
+   free(w->buf);
+   free(w->entries);
+   free(w);
+   return ret;
+}
+
+int tar_add(struct tar_writer_s *w, const char *name, uint64_t key,
+            const void *hdr, size_t hdr_len, const void *data,
+            size_t data_len)
+{
+   size_t size = hdr_len + data_len;
+   size_t padded = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+   size_t total = sizeof(struct ustar_header_s) + padded;
+   struct tar_entry_s *e;
+   uint8_t *p;
+
+   if (w->len + total > TAR_BUF_SIZE && writer_flush(w) != 0)
+      return -1;
+
+   if (w->n_entries == w->alloc_entries)
+   {
+      size_t alloc = w->alloc_entries ? w->alloc_entries * 2 : 256;
+      struct tar_entry_s *entries = realloc(w->entries,
+                                            alloc * sizeof(*entries));
+
+      if (entries == NULL)
+         return -1;
+
+      w->entries = entries;
+      w->alloc_entries = alloc;
+   }
+
+   e = &w->entries[w->n_entries];
+   e->key = key;
+   e->offset = w->len + sizeof(struct ustar_header_s);
+   e->size = size;
+   strncpy(e->name, name, sizeof(e->name) - 1);
+   e->name[sizeof(e->name) - 1] = '\0';
+
+   /* Members larger than the buffer are written on their own. */
+   if (total > TAR_BUF_SIZE)
+   {
+      struct ustar_header_s h;
+      uint64_t offset;
+      int ret = 0;
+
+      fill_header(&h, name, NULL, size, w->tar->mtime);
+      p = calloc(1, total);
+
+      if (p == NULL)
+         return -1;
+
+      memcpy(p, &h, sizeof(h));
+      memcpy(p + sizeof(h), hdr, hdr_len);
+      memcpy(p + sizeof(h) + hdr_len, data, data_len);
+      e->offset = sizeof(h);
+
+      if (reserve(w->tar, total, e, 1, &offset) != 0 ||
+            write_all(w->tar->fd, p, total, offset) != 0)
+      {
+         __atomic_store_n(&w->tar->failed, 1, __ATOMIC_RELAXED);
+         ret = -1;
+      }
+
+      free(p);
+      return ret;
+   }
+
+   p = w->buf + w->len;
+   fill_header((struct ustar_header_s *)p, name, NULL, size, w->tar->mtime);
+   p += sizeof(struct ustar_header_s);
+   memcpy(p, hdr, hdr_len);
+   memcpy(p + hdr_len, data, data_len);
+   memset(p + size, 0, padded - size);
+
+   w->len += total;
+   w->n_entries++;
+   return 0;
+}
+
+int tar_add_link(struct tar_s *tar, const char *name, uint64_t key,
+                 const char *target)
+{
+   struct tar_link_s *l;
+   int ret = 0;
+
+   pthread_mutex_lock(&tar->lock);
+
+   if (tar->n_links == tar->alloc_links)
+   {
+      size_t alloc = tar->alloc_links ? tar->alloc_links * 2 : 256;
+
+      l = realloc(tar->links, alloc * sizeof(*l));
+
+      if (l == NULL)
+      {
+         ret = -1;
+         goto out;
+      }
+
+      tar->links = l;
+      tar->alloc_links = alloc;
+   }
+
+   l = &tar->links[tar->n_links++];
+   l->key = key;
+   snprintf(l->name, sizeof(l->name), "%s", name);
+   snprintf(l->target, sizeof(l->target), "%s", target);
+
+out:
+   pthread_mutex_unlock(&tar->lock);
+   return ret;
+}
+
+static int compare_entry_name(const void *in1, const void *in2)
+{
+   const struct tar_entry_s *a = in1;
+   const struct tar_entry_s *b = in2;
+
+   return strcmp(a->name, b->name);
+}
+
+/**
+ * Writes the header of each hard link, and adds an entry for it with the
+ * data offset and size of its target.
+ */
+static int write_links(struct tar_s *tar)
+{
+   struct ustar_header_s *h;
+   struct tar_entry_s *sorted;
+   size_t len = tar->n_links * sizeof(*h);
+   size_t n_sorted = tar->n_entries;
+   uint64_t offset;
+   int ret = -1;
+
+   if (tar->n_links == 0)
+      return 0;
+
+   h = malloc(len);
+   sorted = malloc(n_sorted * sizeof(*sorted) + 1);
+
+   if (h == NULL || sorted == NULL)
+      goto out;
+
+   memcpy(sorted, tar->entries, n_sorted * sizeof(*sorted));
+   qsort(sorted, n_sorted, sizeof(*sorted), compare_entry_name);
+
+   for (size_t i = 0; i < tar->n_links; i++)
+   {
+      const struct tar_link_s *l = &tar->links[i];
+      struct tar_entry_s key = { 0 }, e;
+      const struct tar_entry_s *target;
+
+      snprintf(key.name, sizeof(key.name), "%s", l->target);
+      target = bsearch(&key, sorted, n_sorted, sizeof(*sorted),
+                       compare_entry_name);
+
+      if (target == NULL)
+      {
+         fprintf(stderr, "Target %s of link %s is not in the archive\n",
+                 l->target, l->name);
+         goto out;
+      }
+
+      fill_header(&h[i], l->name, l->target, 0, tar->mtime);
+
+      /* Links have no data of their own, so they are indexed with the
+       * data of their target. */
+      e = *target;
+      e.key = l->key;
+      memcpy(e.name, l->name, sizeof(e.name));
+
+      if (add_entries(tar, &e, 1, 0) != 0)
+         goto out;
+   }
+
+   if (reserve(tar, len, NULL, 0, &offset) != 0 ||
+         write_all(tar->fd, h, len, offset) != 0)
+      goto out;
+
+   ret = 0;
+
+out:
+   free(h);
+   free(sorted);
+   return ret;
+}
+
+int tar_close(struct tar_s *tar, uint64_t *archive_size)
+{
+   struct tar_writer_s *w = tar_writer_open(tar);
+   char *index = NULL;
+   size_t index_len = 0;
+   FILE *f;
+   uint8_t end[TAR_BLOCK * 2] = { 0 };
+   int ret = -1;
+
+   if (w == NULL)
+      goto out;
+
+   if (write_links(tar) != 0)
+   {
+      tar_writer_close(w);
+      goto out;
+   }
+
+   f = open_memstream(&index, &index_len);
+
+   if (f == NULL)
+   {
+      tar_writer_close(w);
+      goto out;
+   }
+
+   for (size_t i = 0; i < tar->n_entries; i++)
+   {
+      const struct tar_entry_s *e = &tar->entries[i];
+
+      fprintf(f, "%016lX %lu %lu %s\n", e->key, e->offset, e->size,
+              e->name);
+   }
+
+   fclose(f);
+
+   if (tar_add(w, TAR_INDEX_NAME, 0, index, index_len, NULL, 0) != 0 ||
+         tar_writer_close(w) != 0 ||
+         write_all(tar->fd, end, sizeof(end), tar->pos) != 0)
+      goto out;
+
+   tar->pos += sizeof(end);
+   ret = tar->failed ? -1 : 0;
+
+out:
+   if (archive_size != NULL)
+      *archive_size = tar->pos;
+
+   if (close(tar->fd) != 0)
+      ret = -1;
+
+   pthread_mutex_destroy(&tar->lock);
+   free(index);
+   free(tar->entries);
+   free(tar->links);
+   free(tar);
+   return ret;
+}
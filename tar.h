@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Streaming tar archive writer shared by several threads.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TAR_H
+#define TAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Name of the member that indexes every other member of the archive. */
+#define TAR_INDEX_NAME  "index.txt"
+
+struct tar_s;
+struct tar_writer_s;
+
+/**
+ * Creates a ustar archive. Members are added through writers, of which each
+ * thread has its own. Members are gathered in a large buffer by each writer,
+ * and space for the whole buffer is reserved in the archive under a lock
+ * before it is written, so threads only contend once per buffer.
+ */
+struct tar_s *tar_create(const char *filename);
+
+/**
+ * Appends the hard links, the index member and the end of archive marker,
+ * and closes the archive. Every writer must have been closed. The index
+ * member lists the key, data offset, data size and name of each member, one
+ * per line, so that members may be read without scanning the archive. Hard
+ * links are listed with the offset and size of the data of their target.
+ * Returns 0 on success, or -1 if any write to the archive failed.
+ */
+int tar_close(struct tar_s *tar, uint64_t *archive_size);
+
+struct tar_writer_s *tar_writer_open(struct tar_s *tar);
+
+/**
+ * Writes out any buffered members. Returns -1 if a write failed.
+ */
+int tar_writer_close(struct tar_writer_s *w);
+
+/**
+ * Adds a member whose data is hdr followed by data. Either may be empty.
+ * Returns -1 on failure.
+ */
+int tar_add(struct tar_writer_s *w, const char *name, uint64_t key,
+            const void *hdr, size_t hdr_len, const void *data,
+            size_t data_len);
+
+/**
+ * Adds a hard link to a member that has been, or will be, added by any
+ * writer. Links are written when the archive is closed, so that they follow
+ * their targets. Returns -1 on failure.
+ */
+int tar_add_link(struct tar_s *tar, const char *name, uint64_t key,
+                 const char *target);
+
+#endif
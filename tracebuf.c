@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Trace files written by several threads through per-thread buffers.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "tracebuf.h"
+
+struct tracebuf_thread_s
+{
+   unsigned n;
+   unsigned thread;
+   struct tracebuf_thread_s *next;
+   /* TRACEBUF_RECORDS records of rec_sz bytes, aligned for any field. */
+   uint64_t rec[];
+};
+
+uint64_t tracebuf_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t tracebuf_begin(struct tracebuf_s *t)
+{
+   if (!__atomic_load_n(&t->active, __ATOMIC_RELAXED))
+      return 0;
+
+   return tracebuf_now();
+}
+
+/* Must be called with the trace's lock held. */
+static void flush(struct tracebuf_s *t, struct tracebuf_thread_s *b)
+{
+   if (t->file != NULL && b->n != 0)
+      t->write(t->file, b->rec, b->n, b->thread);
+
+   b->n = 0;
+}
+
+void tracebuf_start(struct tracebuf_s *t, FILE *f)
+{
+   pthread_mutex_lock(&t->lock);
+
+   for (struct tracebuf_thread_s *b = t->list; b != NULL; b = b->next)
+      b->n = 0;
+
+   t->file = f;
+   t->epoch = tracebuf_now();
+   pthread_mutex_unlock(&t->lock);
+
+   __atomic_store_n(&t->active, 1, __ATOMIC_RELEASE);
+}
+
+FILE *tracebuf_stop(struct tracebuf_s *t)
+{
+   FILE *f;
+
+   __atomic_store_n(&t->active, 0, __ATOMIC_RELEASE);
+
+   pthread_mutex_lock(&t->lock);
+
+   for (struct tracebuf_thread_s *b = t->list; b != NULL; b = b->next)
+      flush(t, b);
+
+   f = t->file;
+   t->file = NULL;
+   pthread_mutex_unlock(&t->lock);
+
+   return f;
+}
+
+void *tracebuf_append(struct tracebuf_s *t, struct tracebuf_thread_s **tls,
+                      unsigned *thread)
+{
+   struct tracebuf_thread_s *b = *tls;
+
+   if (b == NULL)
+   {
+      b = calloc(1, sizeof(*b) + TRACEBUF_RECORDS * t->rec_sz);
+
+      if (b == NULL)
+         return NULL;
+
+      pthread_mutex_lock(&t->lock);
+      b->thread = t->threads++;
+      b->next = t->list;
+      t->list = b;
+      pthread_mutex_unlock(&t->lock);
+      *tls = b;
+   }
+   else if (b->n == TRACEBUF_RECORDS)
+   {
+      pthread_mutex_lock(&t->lock);
+      flush(t, b);
+      pthread_mutex_unlock(&t->lock);
+   }
+
+   *thread = b->thread;
+   return (uint8_t *)b->rec + (size_t)b->n++ * t->rec_sz;
+}
@@ -0,0 +1,88 @@
+/**
+ * Copyright (c) 2020 Mahyar Koshkouei
+ * Trace files written by several threads through per-thread buffers.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TRACEBUF_H
+#define TRACEBUF_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Number of records buffered by each thread before writing to the trace. */
+#define TRACEBUF_RECORDS   4096
+
+struct tracebuf_thread_s;
+
+/**
+ * A trace of fixed size records. Each thread appends records to its own
+ * buffer, which is passed to the write function under the trace's lock when
+ * it fills or the trace is stopped, so threads only contend once per buffer.
+ * Buffers are kept for the lifetime of the process and reused by later
+ * traces.
+ */
+struct tracebuf_s
+{
+   size_t rec_sz;
+
+   /* Writes n records buffered by the given thread to f. */
+   void (*write)(FILE *f, const void *recs, unsigned n, unsigned thread);
+
+   /* Non-zero whilst a trace is being written. */
+   int active;
+   FILE *file;
+   uint64_t epoch;
+   unsigned threads;
+   struct tracebuf_thread_s *list;
+   pthread_mutex_t lock;
+};
+
+#define TRACEBUF_INIT(rec_sz, write) \
+   { (rec_sz), (write), 0, NULL, 0, 0, NULL, PTHREAD_MUTEX_INITIALIZER }
+
+/* Returns the time in nanoseconds of the clock that traces are timed by. */
+uint64_t tracebuf_now(void);
+
+/**
+ * Returns the current time if the trace is active, and 0 otherwise. Records
+ * are only appended for work that began whilst the trace was active.
+ */
+uint64_t tracebuf_begin(struct tracebuf_s *t);
+
+/**
+ * Starts writing records to f, which already holds any header of the trace.
+ * Records buffered for an earlier trace are discarded.
+ */
+void tracebuf_start(struct tracebuf_s *t, FILE *f);
+
+/**
+ * Writes every buffered record and stops the trace. Returns the trace file,
+ * which the caller completes and closes, or NULL if no trace was active.
+ * Threads must not append records whilst the trace is being stopped.
+ */
+FILE *tracebuf_stop(struct tracebuf_s *t);
+
+/**
+ * Returns space for a record in the calling thread's buffer, which is kept in
+ * tls and created on first use, and sets thread to the index of the thread in
+ * the order that threads first appended. Returns NULL if no buffer could be
+ * allocated. Must only be called from the thread that owns tls.
+ */
+void *tracebuf_append(struct tracebuf_s *t, struct tracebuf_thread_s **tls,
+                      unsigned *thread);
+
+#endif